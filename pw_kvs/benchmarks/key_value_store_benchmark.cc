@@ -0,0 +1,521 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Benchmarks for KeyValueStore operations. These use the unit test framework,
+// but are built as a separate executable rather than run with the tests, since
+// they only report their results; timings are not checked.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "pw_kvs/flash_partition_with_stats.h"
+#include "pw_kvs/in_memory_fake_flash.h"
+#include "pw_kvs/key_value_store.h"
+#include "pw_kvs/write_back_key_value_store.h"
+#include "pw_log/log.h"
+
+namespace pw::kvs {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr EntryFormat kFormat{.magic = 0x5ca1ab1e, .checksum = nullptr};
+
+// Large enough for 4096 small entries plus room for garbage collection.
+constexpr size_t kSectorSize = 4 * 1024;
+constexpr size_t kSectorCount = 48;
+
+FakeFlashBuffer<kSectorSize, kSectorCount> benchmark_flash(16);
+FlashPartitionWithStatsBuffer<kSectorCount> benchmark_partition(
+    &benchmark_flash);
+
+// Large enough for a checkpoint of 2048 entries.
+constexpr size_t kCheckpointSectorSize = 48 * 1024;
+
+FakeFlashBuffer<kCheckpointSectorSize, 2> checkpoint_flash(16);
+FlashPartition checkpoint_partition(&checkpoint_flash);
+
+struct Key {
+  explicit Key(unsigned index) {
+    std::snprintf(buffer, sizeof(buffer), "key_%u", index);
+  }
+
+  const char* c_str() const { return buffer; }
+
+  char buffer[16];
+};
+
+unsigned long NanosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+      .count();
+}
+
+// Fills a KVS with kEntries keys, then times Put, Init, and Get. If
+// kHashIndexSlots is 0, the KVS finds keys by scanning its KeyDescriptors.
+template <size_t kEntries, size_t kHashIndexSlots>
+void RunLookupBenchmark() {
+  static KeyValueStoreBuffer<kEntries, kSectorCount, 1, 1, kHashIndexSlots> kvs(
+      &benchmark_partition, kFormat);
+
+  ASSERT_EQ(Status::OK, benchmark_partition.Erase());
+  ASSERT_EQ(Status::OK, kvs.Init());
+
+  Clock::time_point start = Clock::now();
+  for (unsigned i = 0; i < kEntries; ++i) {
+    ASSERT_EQ(Status::OK, kvs.Put(Key(i).c_str(), i));
+  }
+  const unsigned long put_ns = NanosecondsSince(start);
+
+  start = Clock::now();
+  ASSERT_EQ(Status::OK, kvs.Init());
+  const unsigned long init_ns = NanosecondsSince(start);
+
+  start = Clock::now();
+  for (unsigned i = 0; i < kEntries; ++i) {
+    unsigned value;
+    ASSERT_EQ(Status::OK, kvs.Get(Key(i).c_str(), &value));
+    ASSERT_EQ(i, value);
+  }
+  const unsigned long get_ns = NanosecondsSince(start);
+
+  PW_LOG_INFO("%4zu entries, %s: Put %6lu ns, Get %6lu ns, Init %8lu us",
+              kEntries,
+              kHashIndexSlots == 0u ? "scan " : "index",
+              put_ns / kEntries,
+              get_ns / kEntries,
+              init_ns / 1000);
+}
+
+TEST(KeyValueStoreBenchmark, Lookup_64Entries) {
+  RunLookupBenchmark<64, 0>();
+  RunLookupBenchmark<64, 128>();
+}
+
+TEST(KeyValueStoreBenchmark, Lookup_512Entries) {
+  RunLookupBenchmark<512, 0>();
+  RunLookupBenchmark<512, 1024>();
+}
+
+TEST(KeyValueStoreBenchmark, Lookup_4096Entries) {
+  RunLookupBenchmark<4096, 0>();
+  RunLookupBenchmark<4096, 8192>();
+}
+
+// Fills a KVS with kEntries keys, then times Init with a full scan of the
+// partition and Init from a checkpoint followed by a few more writes. Flash
+// reads are counted for each Init.
+template <size_t kEntries>
+void RunInitBenchmark() {
+  static KeyValueStoreBuffer<kEntries, kSectorCount, 1, 1, 2 * kEntries> kvs(
+      &benchmark_partition, kFormat);
+
+  ASSERT_EQ(Status::OK, benchmark_partition.Erase());
+  ASSERT_EQ(Status::OK, checkpoint_partition.Erase());
+  kvs.set_checkpoint_partition(&checkpoint_partition);
+  ASSERT_EQ(Status::OK, kvs.Init());
+
+  for (unsigned i = 0; i < kEntries; ++i) {
+    ASSERT_EQ(Status::OK, kvs.Put(Key(i).c_str(), i));
+  }
+
+  // Without a checkpoint, Init reads every entry.
+  benchmark_partition.ResetCounters();
+  Clock::time_point start = Clock::now();
+  ASSERT_EQ(Status::OK, kvs.Init());
+  const unsigned long scan_ns = NanosecondsSince(start);
+  const size_t scan_reads = benchmark_partition.read_count();
+  const size_t scan_read_bytes = benchmark_partition.read_bytes();
+
+  ASSERT_EQ(Status::OK, kvs.Checkpoint());
+  for (unsigned i = 0; i < 16u; ++i) {
+    ASSERT_EQ(Status::OK, kvs.Put(Key(i).c_str(), i + 1));
+  }
+
+  benchmark_partition.ResetCounters();
+  start = Clock::now();
+  ASSERT_EQ(Status::OK, kvs.Init());
+  const unsigned long checkpoint_ns = NanosecondsSince(start);
+  const size_t checkpoint_reads = benchmark_partition.read_count();
+
+  unsigned value;
+  ASSERT_EQ(Status::OK, kvs.Get(Key(0).c_str(), &value));
+  ASSERT_EQ(1u, value);
+
+  kvs.set_checkpoint_partition(nullptr);
+
+  PW_LOG_INFO("%4zu entries: Init %8lu us, %5zu reads (%6zu B) full scan; "
+              "%8lu us, %5zu reads from checkpoint",
+              kEntries,
+              scan_ns / 1000,
+              scan_reads,
+              scan_read_bytes,
+              checkpoint_ns / 1000,
+              checkpoint_reads);
+}
+
+TEST(KeyValueStoreBenchmark, Init_64Entries) { RunInitBenchmark<64>(); }
+
+TEST(KeyValueStoreBenchmark, Init_512Entries) { RunInitBenchmark<512>(); }
+
+TEST(KeyValueStoreBenchmark, Init_2048Entries) { RunInitBenchmark<2048>(); }
+
+// Simulated flash timing, typical of a NOR flash with 4 KB sectors.
+constexpr uint32_t kEraseUsPerSector = 45'000;
+constexpr uint32_t kWriteUs = 100;
+
+// Rewrites a set of keys, doing work_us of other work after each write. Garbage
+// collection either blocks on each erase, or runs in steps that let the erase
+// continue in the background during the other work. Returns the simulated time
+// spent waiting for flash.
+uint32_t RunGarbageCollectionWorkload(bool background_erase, uint32_t work_us) {
+  static FakeFlashBuffer<kSectorSize, 8> flash(16);
+  static FlashPartition partition(&flash);
+  static KeyValueStoreBuffer<64, 8> kvs(&partition, kFormat);
+
+  constexpr unsigned kWrites = 2000;
+
+  flash.SetLatency(0, 0);
+  EXPECT_EQ(Status::OK, partition.Erase());
+  EXPECT_EQ(Status::OK, kvs.Init());
+  flash.SetLatency(kEraseUsPerSector, kWriteUs);
+  const uint32_t start_us = flash.elapsed_us();
+
+  std::array<std::byte, 96> value = {};
+  for (unsigned i = 0; i < kWrites; ++i) {
+    value[0] = std::byte(i);
+    EXPECT_EQ(Status::OK, kvs.Put(Key(i % 16).c_str(), value));
+
+    const bool collect =
+        kvs.garbage_collection_in_progress() ||
+        kvs.GetStorageStats().reclaimable_bytes > kSectorSize;
+    if (collect && background_erase) {
+      const Status status = kvs.GarbageCollectStep(kSectorSize);
+      EXPECT_TRUE(status.ok() || status == Status::UNAVAILABLE);
+    } else if (collect) {
+      EXPECT_EQ(Status::OK, kvs.GarbageCollectPartial());
+    }
+    flash.AdvanceTime(work_us);
+  }
+  EXPECT_EQ(Status::OK, partition.WaitForErase());
+
+  const uint32_t total_us = flash.elapsed_us() - start_us;
+  flash.SetLatency(0, 0);
+  return total_us - kWrites * work_us;
+}
+
+TEST(KeyValueStoreBenchmark, GarbageCollection_BackgroundErase) {
+  for (uint32_t work_us : {0u, 5000u, 20000u}) {
+    const uint32_t blocking_us = RunGarbageCollectionWorkload(false, work_us);
+    const uint32_t background_us = RunGarbageCollectionWorkload(true, work_us);
+    PW_LOG_INFO("%5u us work per write: waited for flash %8u us with "
+                "blocking erase, %8u us with background erase",
+                unsigned(work_us),
+                unsigned(blocking_us),
+                unsigned(background_us));
+  }
+}
+
+// Counts sector erases and bytes written.
+class CountingPartition final : public FlashPartition {
+ public:
+  using FlashPartition::FlashPartition;
+
+  using FlashPartition::Erase;
+  using FlashPartition::Write;
+
+  Status Erase(Address address, size_t num_sectors) override {
+    erase_count_ += num_sectors;
+    return FlashPartition::Erase(address, num_sectors);
+  }
+
+  Status StartErase(Address address, size_t num_sectors) override {
+    erase_count_ += num_sectors;
+    return FlashPartition::StartErase(address, num_sectors);
+  }
+
+  StatusWithSize Write(Address address, span<const std::byte> data) override {
+    bytes_written_ += data.size();
+    return FlashPartition::Write(address, data);
+  }
+
+  size_t erase_count() const { return erase_count_; }
+  size_t bytes_written() const { return bytes_written_; }
+
+ private:
+  size_t erase_count_ = 0;
+  size_t bytes_written_ = 0;
+};
+
+// Updates a counter once per millisecond and a few settings occasionally, and
+// counts sector erases. With max_delay_ms of 0, the updates are written to the
+// KVS directly; otherwise, they are buffered by a WriteBackKeyValueStore.
+size_t RunCounterWorkload(uint32_t max_delay_ms, unsigned updates) {
+  static FakeFlashBuffer<kSectorSize, 4> flash(16);
+  CountingPartition partition(&flash);
+  KeyValueStoreBuffer<16, 4> kvs(&partition, kFormat);
+  WriteBackKeyValueStoreBuffer<4, 32> write_back(kvs, max_delay_ms);
+
+  EXPECT_EQ(Status::OK, partition.Erase());
+  EXPECT_EQ(Status::OK, kvs.Init());
+  const size_t initial_erases = partition.erase_count();
+
+  for (unsigned i = 0; i < updates; ++i) {
+    const Key setting(i % 3);
+    const char* key = (i % 100 == 0) ? setting.c_str() : "counter";
+    if (max_delay_ms == 0u) {
+      EXPECT_EQ(Status::OK, kvs.Put(key, i));
+    } else {
+      EXPECT_EQ(Status::OK, write_back.Put(key, i));
+      EXPECT_EQ(Status::OK, write_back.Tick(1));
+    }
+  }
+  EXPECT_EQ(Status::OK, write_back.Flush());
+
+  return partition.erase_count() - initial_erases;
+}
+
+TEST(KeyValueStoreBenchmark, WriteBack_ErasesPerMillionUpdates) {
+  constexpr unsigned kUpdates = 100'000;
+  constexpr unsigned kScale = 1'000'000 / kUpdates;
+
+  const size_t direct = RunCounterWorkload(0, kUpdates) * kScale;
+  for (uint32_t max_delay_ms : {10u, 100u, 1000u}) {
+    const size_t buffered = RunCounterWorkload(max_delay_ms, kUpdates) * kScale;
+    PW_LOG_INFO("Erases per million updates: %6zu direct, %6zu buffered with "
+                "%4u ms max delay",
+                direct,
+                buffered,
+                unsigned(max_delay_ms));
+  }
+}
+
+// Adds 16-byte records to a log, which starts over once it holds 1 KB, and
+// returns the bytes written to flash per record. Each record is added by
+// rewriting the log with Put, or with Append.
+size_t RunLogWorkload(bool append, unsigned updates) {
+  static FakeFlashBuffer<kSectorSize, 4> flash(16);
+  CountingPartition partition(&flash);
+  KeyValueStoreBuffer<16, 4> kvs(&partition, kFormat);
+
+  EXPECT_EQ(Status::OK, partition.Erase());
+  EXPECT_EQ(Status::OK, kvs.Init());
+  const size_t initial_bytes = partition.bytes_written();
+
+  std::array<std::byte, 1024> log;
+  size_t log_size = 0;
+
+  for (unsigned i = 0; i < updates; ++i) {
+    std::array<std::byte, 16> record;
+    record.fill(std::byte(i));
+
+    if (log_size == log.size()) {
+      log_size = 0;
+    }
+    std::copy(record.begin(), record.end(), &log[log_size]);
+    log_size += record.size();
+
+    if (append && log_size != record.size()) {
+      EXPECT_EQ(Status::OK, kvs.Append("log", record));
+    } else {
+      EXPECT_EQ(Status::OK, kvs.Put("log", span(log).first(log_size)));
+    }
+  }
+
+  return (partition.bytes_written() - initial_bytes) / updates;
+}
+
+TEST(KeyValueStoreBenchmark, Append_BytesWrittenPerUpdate) {
+  constexpr unsigned kUpdates = 10'000;
+
+  PW_LOG_INFO("Log of up to 1 KB: %5zu B written per record with Put, %5zu B "
+              "with Append",
+              RunLogWorkload(false, kUpdates),
+              RunLogWorkload(true, kUpdates));
+}
+
+// Simulated operation latencies, in microseconds.
+template <size_t kMaxSamples>
+class Latencies {
+ public:
+  void Add(uint32_t us) {
+    if (count_ < kMaxSamples) {
+      samples_[count_++] = us;
+    }
+  }
+
+  size_t count() const { return count_; }
+
+  uint32_t Percentile(unsigned percent) {
+    if (count_ == 0u) {
+      return 0;
+    }
+    std::sort(samples_.begin(), samples_.begin() + count_);
+    return samples_[(count_ - 1) * percent / 100];
+  }
+
+ private:
+  std::array<uint32_t, kMaxSamples> samples_;
+  size_t count_ = 0;
+};
+
+constexpr size_t kLatencySectorCount = 8;
+constexpr size_t kLatencyMaxEntries = 4096;
+constexpr unsigned kLatencyOperations = 10'000;
+
+// Each entry has a 16-byte header, a key of up to 8 characters, and a 32-byte
+// value, aligned to 16 bytes.
+constexpr size_t kLatencyValueSize = 32;
+constexpr size_t kLatencyEntrySize = 64;
+
+// Fills the KVS to fill_percent of the space available for entries, then runs
+// a random mix of Gets, Puts, and Deletes. The latencies are simulated from
+// the flash timing, so they do not depend on the host and can be compared
+// between revisions. Results are printed to stdout as one JSON object per line,
+// which is longer than a log message may be.
+template <size_t kSectorSize, size_t kRedundancy>
+void RunLatencyBenchmark(uint32_t erase_us_per_sector, unsigned fill_percent) {
+  static FakeFlashBuffer<kSectorSize, kLatencySectorCount> flash(16);
+  static CountingPartition partition(&flash);
+  static KeyValueStoreBuffer<kLatencyMaxEntries,
+                             kLatencySectorCount,
+                             kRedundancy,
+                             1,
+                             2 * kLatencyMaxEntries>
+      kvs(&partition, kFormat);
+
+  // Typical of a SPI NOR flash: a page program takes about 0.7 ms per 256
+  // bytes, and reads transfer about 12 MB/s.
+  flash.SetTiming({.erase_us_per_sector = erase_us_per_sector,
+                   .write_us = 10,
+                   .write_ns_per_byte = 2700,
+                   .read_us = 1,
+                   .read_ns_per_byte = 80});
+
+  ASSERT_EQ(Status::OK, partition.Erase());
+  ASSERT_EQ(Status::OK, kvs.Init());
+
+  // One sector is always kept empty for garbage collection.
+  const size_t keys = fill_percent * (kLatencySectorCount - 1) * kSectorSize /
+                      (100 * kLatencyEntrySize * kRedundancy);
+  ASSERT_LE(keys, kLatencyMaxEntries);
+
+  std::array<std::byte, kLatencyValueSize> value = {};
+  for (unsigned i = 0; i < keys; ++i) {
+    ASSERT_EQ(Status::OK, kvs.Put(Key(i).c_str(), value));
+  }
+
+  Latencies<kLatencyOperations> put;
+  Latencies<kLatencyOperations> get;
+  Latencies<kLatencyOperations> del;
+  Latencies<kLatencyOperations> gc_pause;
+  std::array<bool, kLatencyMaxEntries> deleted = {};
+
+  const size_t initial_bytes = partition.bytes_written();
+  size_t user_bytes = 0;
+  uint32_t random = 1;
+
+  for (unsigned i = 0; i < kLatencyOperations; ++i) {
+    random = random * 1664525u + 1013904223u;
+    const unsigned index = (random >> 8) % keys;
+    const unsigned operation = (random >> 24) % 10;
+    const Key key(index);
+
+    const uint64_t start_ns = flash.elapsed_ns();
+    const size_t start_erases = partition.erase_count();
+
+    // Half of the operations are Gets, and most of the rest are Puts. Deleted
+    // keys are added back by the next operation on them.
+    Latencies<kLatencyOperations>* latencies;
+    if (operation < 5u) {
+      std::array<std::byte, kLatencyValueSize> read_value;
+      const StatusWithSize result = kvs.Get(key.c_str(), read_value);
+      ASSERT_EQ(deleted[index] ? Status::NOT_FOUND : Status::OK,
+                result.status());
+      latencies = &get;
+    } else if (operation < 9u || deleted[index]) {
+      value[0] = std::byte(i);
+      ASSERT_EQ(Status::OK, kvs.Put(key.c_str(), value));
+      user_bytes += std::strlen(key.c_str()) + value.size();
+      deleted[index] = false;
+      latencies = &put;
+    } else {
+      ASSERT_EQ(Status::OK, kvs.Delete(key.c_str()));
+      user_bytes += std::strlen(key.c_str());
+      deleted[index] = true;
+      latencies = &del;
+    }
+
+    const uint32_t us = (flash.elapsed_ns() - start_ns) / 1000;
+    latencies->Add(us);
+    if (partition.erase_count() != start_erases) {
+      gc_pause.Add(us);
+    }
+  }
+
+  const double write_amplification =
+      double(partition.bytes_written() - initial_bytes) / user_bytes;
+
+  const uint64_t mount_start_ns = flash.elapsed_ns();
+  ASSERT_EQ(Status::OK, kvs.Init());
+  const uint32_t mount_us = (flash.elapsed_ns() - mount_start_ns) / 1000;
+
+  std::printf(
+      "{\"benchmark\":\"kvs_latency\",\"sector_bytes\":%zu,"
+      "\"redundancy\":%zu,\"fill_percent\":%u,\"keys\":%zu,"
+      "\"put_p50_us\":%u,\"put_p99_us\":%u,"
+      "\"get_p50_us\":%u,\"get_p99_us\":%u,"
+      "\"delete_p50_us\":%u,\"delete_p99_us\":%u,"
+      "\"gc_pauses\":%zu,\"gc_pause_p50_us\":%u,\"gc_pause_max_us\":%u,"
+      "\"write_amplification\":%.2f,\"mount_us\":%u}\n",
+      kSectorSize,
+      kRedundancy,
+      fill_percent,
+      keys,
+      unsigned(put.Percentile(50)),
+      unsigned(put.Percentile(99)),
+      unsigned(get.Percentile(50)),
+      unsigned(get.Percentile(99)),
+      unsigned(del.Percentile(50)),
+      unsigned(del.Percentile(99)),
+      gc_pause.count(),
+      unsigned(gc_pause.Percentile(50)),
+      unsigned(gc_pause.Percentile(100)),
+      write_amplification,
+      unsigned(mount_us));
+
+  flash.SetLatency(0, 0);
+}
+
+TEST(KeyValueStoreBenchmark, Latency_4KSectors) {
+  for (unsigned fill_percent : {25u, 50u, 75u}) {
+    RunLatencyBenchmark<4 * 1024, 1>(45'000, fill_percent);
+    RunLatencyBenchmark<4 * 1024, 2>(45'000, fill_percent);
+  }
+}
+
+TEST(KeyValueStoreBenchmark, Latency_32KSectors) {
+  for (unsigned fill_percent : {25u, 50u, 75u}) {
+    RunLatencyBenchmark<32 * 1024, 1>(120'000, fill_percent);
+    RunLatencyBenchmark<32 * 1024, 2>(120'000, fill_percent);
+  }
+}
+
+}  // namespace
+}  // namespace pw::kvs
@@ -0,0 +1,118 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace pw::kvs {
+namespace {
+
+using std::byte;
+
+constexpr uint8_t kRepeatFlag = 0x80;
+constexpr size_t kMaxLiteralBytes = 0x80;
+constexpr size_t kMinRepeatBytes = 3;
+constexpr size_t kMaxRepeatBytes = 0x7F + kMinRepeatBytes;
+
+// True if a run of repeated bytes long enough to encode starts at position.
+bool RepeatStartsAt(span<const byte> data, size_t position) {
+  return position + kMinRepeatBytes <= data.size() &&
+         data[position] == data[position + 1] &&
+         data[position] == data[position + 2];
+}
+
+}  // namespace
+
+StatusWithSize RunLengthEncoding::Compress(span<const byte> data,
+                                           span<byte> output) const {
+  size_t in = 0;
+  size_t out = 0;
+
+  while (in < data.size()) {
+    if (RepeatStartsAt(data, in)) {
+      size_t count = kMinRepeatBytes;
+      while (in + count < data.size() && count < kMaxRepeatBytes &&
+             data[in + count] == data[in]) {
+        count += 1;
+      }
+
+      if (out + 2 > output.size()) {
+        return StatusWithSize::RESOURCE_EXHAUSTED;
+      }
+      output[out++] = byte(kRepeatFlag | (count - kMinRepeatBytes));
+      output[out++] = data[in];
+      in += count;
+      continue;
+    }
+
+    // Collect literal bytes until a run of repeated bytes starts.
+    size_t count = 1;
+    while (in + count < data.size() && count < kMaxLiteralBytes &&
+           !RepeatStartsAt(data, in + count)) {
+      count += 1;
+    }
+
+    if (out + 1 + count > output.size()) {
+      return StatusWithSize::RESOURCE_EXHAUSTED;
+    }
+    output[out++] = byte(count - 1);
+    std::memcpy(output.data() + out, data.data() + in, count);
+    out += count;
+    in += count;
+  }
+
+  return StatusWithSize(out);
+}
+
+StatusWithSize RunLengthEncoding::Decompress(span<const byte> data,
+                                             span<byte> output,
+                                             size_t offset_bytes) const {
+  size_t in = 0;
+  size_t out = 0;
+
+  while (in < data.size()) {
+    const uint8_t control = uint8_t(data[in++]);
+    const bool repeat = (control & kRepeatFlag) != 0u;
+    const size_t count = repeat ? (control & ~kRepeatFlag) + kMinRepeatBytes
+                                : control + size_t(1);
+
+    if (in + (repeat ? 1 : count) > data.size()) {
+      return StatusWithSize::DATA_LOSS;
+    }
+
+    // Skip the part of the run that comes before the offset.
+    const size_t skipped = std::min(offset_bytes, count);
+    offset_bytes -= skipped;
+
+    const size_t copied = std::min(count - skipped, output.size() - out);
+    if (repeat) {
+      std::memset(output.data() + out, int(data[in]), copied);
+      in += 1;
+    } else {
+      std::memcpy(output.data() + out, data.data() + in + skipped, copied);
+      in += count;
+    }
+    out += copied;
+
+    if (copied != count - skipped) {
+      return StatusWithSize(Status::RESOURCE_EXHAUSTED, out);
+    }
+  }
+
+  return StatusWithSize(out);
+}
+
+}  // namespace pw::kvs
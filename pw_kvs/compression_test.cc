@@ -0,0 +1,117 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/compression.h"
+
+#include <array>
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+namespace pw::kvs {
+namespace {
+
+using std::byte;
+
+// A sparse value: a few fields separated by long runs of zeros.
+constexpr auto kSparse = [] {
+  std::array<byte, 200> data{};
+  data[0] = byte{0x12};
+  data[1] = byte{0x34};
+  data[100] = byte{0x56};
+  data[199] = byte{0x78};
+  return data;
+}();
+
+constexpr std::array<byte, 6> kNoRuns = {
+    byte{1}, byte{2}, byte{3}, byte{4}, byte{5}, byte{6}};
+
+TEST(RunLengthEncoding, CompressAndDecompress) {
+  RunLengthEncodingBuffer<64> rle;
+  const CompressionAlgorithm& algo = rle;
+
+  std::array<byte, 64> compressed;
+  StatusWithSize result = algo.Compress(kSparse, compressed);
+  ASSERT_EQ(Status::OK, result.status());
+  EXPECT_LT(result.size(), 16u);
+
+  std::array<byte, kSparse.size()> decompressed;
+  result =
+      algo.Decompress(span(compressed).first(result.size()), decompressed);
+  ASSERT_EQ(Status::OK, result.status());
+  ASSERT_EQ(kSparse.size(), result.size());
+  EXPECT_EQ(0,
+            std::memcmp(kSparse.data(), decompressed.data(), kSparse.size()));
+}
+
+TEST(RunLengthEncoding, Compress_NoRuns_AddsOneByte) {
+  RunLengthEncodingBuffer<0> rle;
+
+  std::array<byte, 16> compressed;
+  StatusWithSize result = rle.Compress(kNoRuns, compressed);
+  ASSERT_EQ(Status::OK, result.status());
+  EXPECT_EQ(kNoRuns.size() + 1, result.size());
+
+  std::array<byte, kNoRuns.size()> decompressed;
+  result =
+      rle.Decompress(span(compressed).first(result.size()), decompressed);
+  ASSERT_EQ(Status::OK, result.status());
+  EXPECT_EQ(0,
+            std::memcmp(kNoRuns.data(), decompressed.data(), kNoRuns.size()));
+}
+
+TEST(RunLengthEncoding, Compress_OutputTooSmall) {
+  RunLengthEncodingBuffer<0> rle;
+
+  std::array<byte, 4> compressed;
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED,
+            rle.Compress(kNoRuns, compressed).status());
+}
+
+TEST(RunLengthEncoding, Decompress_WithOffset) {
+  RunLengthEncodingBuffer<0> rle;
+
+  std::array<byte, 64> compressed;
+  const StatusWithSize compressed_size = rle.Compress(kSparse, compressed);
+  ASSERT_EQ(Status::OK, compressed_size.status());
+  const auto data = span(compressed).first(compressed_size.size());
+
+  std::array<byte, 8> decompressed;
+  StatusWithSize result = rle.Decompress(data, decompressed, 96);
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED, result.status());
+  EXPECT_EQ(decompressed.size(), result.size());
+  EXPECT_EQ(0, std::memcmp(&kSparse[96], decompressed.data(), result.size()));
+
+  result = rle.Decompress(data, decompressed, 196);
+  EXPECT_EQ(Status::OK, result.status());
+  EXPECT_EQ(4u, result.size());
+  EXPECT_EQ(byte{0x78}, decompressed[3]);
+}
+
+TEST(RunLengthEncoding, Decompress_Truncated_DataLoss) {
+  RunLengthEncodingBuffer<0> rle;
+
+  std::array<byte, 16> compressed;
+  const StatusWithSize compressed_size = rle.Compress(kNoRuns, compressed);
+  ASSERT_EQ(Status::OK, compressed_size.status());
+
+  std::array<byte, kNoRuns.size()> decompressed;
+  EXPECT_EQ(Status::DATA_LOSS,
+            rle.Decompress(span(compressed).first(compressed_size.size() - 1),
+                           decompressed)
+                .status());
+}
+
+}  // namespace
+}  // namespace pw::kvs
@@ -25,6 +25,32 @@ namespace pw::kvs::internal {
 using std::byte;
 using std::string_view;
 
+namespace {
+
+// Reads an entry's key and value for Entry::Copy, adding them to the entry's
+// checksum as they are read.
+class ChecksummedInput final : public pw::Input {
+ public:
+  ChecksummedInput(const Entry& entry,
+                   FlashPartition& partition,
+                   Entry::Address address)
+      : entry_(entry), flash_(partition, address) {}
+
+ private:
+  StatusWithSize DoRead(span<byte> data) override {
+    const StatusWithSize result = flash_.Read(data);
+    if (result.ok()) {
+      entry_.UpdateChecksum(data.first(result.size()));
+    }
+    return result;
+  }
+
+  const Entry& entry_;
+  FlashPartition::Input flash_;
+};
+
+}  // namespace
+
 Status Entry::Read(FlashPartition& partition,
                    Address address,
                    const internal::EntryFormats& formats,
@@ -35,9 +61,6 @@ Status Entry::Read(FlashPartition& partition,
   if (partition.AppearsErased(as_bytes(span(&header.magic, 1)))) {
     return Status::NOT_FOUND;
   }
-  if (header.key_length_bytes > kMaxKeyLength) {
-    return Status::DATA_LOSS;
-  }
 
   const EntryFormat* format = formats.Find(header.magic);
   if (format == nullptr) {
@@ -47,7 +70,26 @@ Status Entry::Read(FlashPartition& partition,
     return Status::DATA_LOSS;
   }
 
+  // Only formats with a compression algorithm write compressed entries.
+  // Appended entries start with an AppendHeader and are never tombstones.
+  const uint8_t flags = header.key_length_bytes & kAppendedFlags;
+  if (flags == kCompressedFlag && format->compression == nullptr) {
+    return Status::DATA_LOSS;
+  }
+  if (flags == kAppendedFlags &&
+      (header.value_size_bytes < sizeof(AppendHeader) ||
+       header.value_size_bytes == kDeletedValueLength)) {
+    return Status::DATA_LOSS;
+  }
+
   *entry = Entry(&partition, address, *format, header);
+
+  // The expiry time follows the value.
+  if (format->expiry) {
+    TRY(partition.Read(address + entry->content_size() - kExpirySize,
+                       sizeof(entry->expiry_),
+                       &entry->expiry_));
+  }
   return Status::OK;
 }
 
@@ -69,7 +111,10 @@ Entry::Entry(FlashPartition& partition,
              string_view key,
              span<const byte> value,
              uint16_t value_size_bytes,
-             uint32_t transaction_id)
+             uint32_t transaction_id,
+             bool batched,
+             bool compressed,
+             uint32_t expiry_time)
     : Entry(&partition,
             address,
             format,
@@ -77,9 +122,12 @@ Entry::Entry(FlashPartition& partition,
              .checksum = 0,
              .alignment_units =
                  alignment_bytes_to_units(partition.alignment_bytes()),
-             .key_length_bytes = static_cast<uint8_t>(key.size()),
+             .key_length_bytes = static_cast<uint8_t>(
+                 key.size() | (batched ? kBatchFlag : 0u) |
+                 (compressed ? kCompressedFlag : 0u)),
              .value_size_bytes = value_size_bytes,
-             .transaction_id = transaction_id}) {
+             .transaction_id = transaction_id},
+            expiry_time) {
   if (checksum_algo_ != nullptr) {
     span<const byte> checksum = CalculateChecksum(key, value);
     std::memcpy(&header_.checksum,
@@ -89,11 +137,19 @@ Entry::Entry(FlashPartition& partition,
 }
 
 StatusWithSize Entry::Write(string_view key, span<const byte> value) const {
+  FlashPartition::Output flash(partition(), address_);
+  return AlignedWrite<64>(flash,
+                          alignment_bytes(),
+                          {as_bytes(span(&header_, 1)),
+                           as_bytes(span(key)),
+                           value,
+                           expiry_bytes()});
+}
+
+StatusWithSize Entry::WriteHeader(span<const byte> first_bytes) const {
   FlashPartition::Output flash(partition(), address_);
   return AlignedWrite<64>(
-      flash,
-      alignment_bytes(),
-      {as_bytes(span(&header_, 1)), as_bytes(span(key)), value});
+      flash, alignment_bytes(), {as_bytes(span(&header_, 1)), first_bytes});
 }
 
 Status Entry::Update(const EntryFormat& new_format,
@@ -108,26 +164,61 @@ Status Entry::Update(const EntryFormat& new_format,
   // when moving an entry. However, to support alignments greater than the
   // header size, we first read the entire value to calculate the new checksum,
   // then write the full entry in WriteFrom.
-  return CalculateChecksumFromFlash();
+  return CalculateChecksumFromFlash(span<byte>());
+}
+
+Status Entry::ClearBatchFlag(span<byte> buffer) {
+  // Check the entry against its checksum before replacing it, so that a corrupt
+  // entry does not get a valid checksum. A corrupt entry keeps its checksum.
+  const Status status = VerifyChecksumInFlash(buffer);
+  header_.key_length_bytes &= ~kBatchFlag;
+  TRY(status);
+  return CalculateChecksumFromFlash(buffer);
 }
 
-StatusWithSize Entry::Copy(Address new_address) const {
+StatusWithSize Entry::Copy(Address new_address, span<byte> buffer) const {
   PW_LOG_DEBUG("Copying entry from 0x%x to 0x%x as ID %" PRIu32,
                unsigned(address()),
                unsigned(new_address),
                transaction_id());
 
+  std::array<byte, 4 * kMinAlignmentBytes> default_buffer;
+  if (buffer.size() <= default_buffer.size() ||
+      buffer.size() < alignment_bytes()) {
+    buffer = default_buffer;
+  }
+
   FlashPartition::Output output(partition(), new_address);
-  AlignedWriterBuffer<4 * kMinAlignmentBytes> writer(alignment_bytes(), output);
+  AlignedWriter writer(buffer, alignment_bytes(), output);
 
   // Use this object's header rather than the header in flash of flash, since
   // this Entry may have been updated.
   TRY_WITH_SIZE(writer.Write(&header_, sizeof(header_)));
 
-  // Write only the key and value from the original entry.
-  FlashPartition::Input input(partition(), address() + sizeof(EntryHeader));
-  TRY_WITH_SIZE(writer.Write(input, key_length() + value_size()));
-  return writer.Flush();
+  // Write only the key, value, and expiry time from the original entry. They
+  // are read once, and checked against the checksum as they are copied.
+  StartChecksum();
+  ChecksummedInput input(
+      *this, partition(), address() + sizeof(EntryHeader));
+  TRY_WITH_SIZE(
+      writer.Write(input, content_size() - sizeof(EntryHeader)));
+
+  const StatusWithSize result = writer.Flush();
+  TRY_WITH_SIZE(result);
+
+  const Status checksum = FinishAndVerifyChecksum();
+  if (!checksum.ok()) {
+    PW_LOG_ERROR("Entry at 0x%x failed its checksum while being copied",
+                 unsigned(address()));
+  }
+  return StatusWithSize(checksum, result.size());
+}
+
+Status Entry::ReadAppendHeader(AppendHeader* header) const {
+  if (!appended()) {
+    return Status::FAILED_PRECONDITION;
+  }
+  return partition().Read(value_address(), sizeof(*header), header).status();
 }
 
 StatusWithSize Entry::ReadValue(span<byte> buffer, size_t offset_bytes) const {
@@ -138,9 +229,8 @@ StatusWithSize Entry::ReadValue(span<byte> buffer, size_t offset_bytes) const {
   const size_t remaining_bytes = value_size() - offset_bytes;
   const size_t read_size = std::min(buffer.size(), remaining_bytes);
 
-  StatusWithSize result = partition().Read(
-      address_ + sizeof(EntryHeader) + key_length() + offset_bytes,
-      buffer.subspan(0, read_size));
+  StatusWithSize result = partition().Read(value_address() + offset_bytes,
+                                           buffer.subspan(0, read_size));
   TRY_WITH_SIZE(result);
 
   if (read_size != remaining_bytes) {
@@ -157,21 +247,61 @@ Status Entry::VerifyChecksum(string_view key, span<const byte> value) const {
   return checksum_algo_->Verify(checksum_bytes());
 }
 
-Status Entry::VerifyChecksumInFlash() const {
-  // Read the entire entry piece-by-piece into a small buffer. If the entry is
-  // 32 B or less, only one read is required.
-  union {
-    EntryHeader header_to_verify;
-    byte buffer[sizeof(EntryHeader) * 2];
-  };
+void Entry::StartChecksum() const {
+  if (checksum_algo_ == nullptr) {
+    return;
+  }
+
+  checksum_algo_->Reset();
+
+  EntryHeader header_for_checksum = header_;
+  header_for_checksum.checksum = 0;
+  checksum_algo_->Update(&header_for_checksum, sizeof(header_for_checksum));
+}
+
+void Entry::FinishChecksum() {
+  header_.checksum = 0;
+
+  if (checksum_algo_ == nullptr) {
+    return;
+  }
+
+  AddPaddingBytesToChecksum();
+
+  span checksum = checksum_algo_->Finish();
+  std::memcpy(&header_.checksum,
+              checksum.data(),
+              std::min(checksum.size(), sizeof(header_.checksum)));
+}
+
+Status Entry::FinishAndVerifyChecksum() const {
+  if (checksum_algo_ == nullptr) {
+    return header_.checksum == 0 ? Status::OK : Status::DATA_LOSS;
+  }
+
+  AddPaddingBytesToChecksum();
+  checksum_algo_->Finish();
+  return checksum_algo_->Verify(checksum_bytes());
+}
+
+Status Entry::VerifyChecksumInFlash(span<byte> buffer) const {
+  // Read the entire entry piece-by-piece into a buffer. If the entry fits in
+  // the buffer, only one read is required.
+  std::array<byte, sizeof(EntryHeader) * 2> default_buffer;
+  if (buffer.size() <= default_buffer.size()) {
+    buffer = default_buffer;
+  }
 
   size_t bytes_to_read = size();
-  size_t read_size = std::min(sizeof(buffer), bytes_to_read);
+  size_t read_size = std::min(buffer.size(), bytes_to_read);
 
   Address read_address = address_;
 
   // Read the first chunk, which includes the header, and compare the checksum.
-  TRY(partition().Read(read_address, read_size, buffer));
+  TRY(partition().Read(read_address, buffer.first(read_size)));
+
+  EntryHeader header_to_verify;
+  std::memcpy(&header_to_verify, buffer.data(), sizeof(header_to_verify));
 
   if (header_to_verify.checksum != header_.checksum) {
     PW_LOG_ERROR("Expected checksum %08" PRIx32 ", found %08" PRIx32,
@@ -186,12 +316,13 @@ Status Entry::VerifyChecksumInFlash() const {
 
   // The checksum is calculated as if the header's checksum field were 0.
   header_to_verify.checksum = 0;
+  std::memcpy(buffer.data(), &header_to_verify, sizeof(header_to_verify));
 
   checksum_algo_->Reset();
 
   while (true) {
     // Add the chunk in the buffer to the checksum.
-    checksum_algo_->Update(buffer, read_size);
+    checksum_algo_->Update(buffer.first(read_size));
 
     bytes_to_read -= read_size;
     if (bytes_to_read == 0u) {
@@ -200,8 +331,8 @@ Status Entry::VerifyChecksumInFlash() const {
 
     // Read the next chunk into the buffer.
     read_address += read_size;
-    read_size = std::min(sizeof(buffer), bytes_to_read);
-    TRY(partition().Read(read_address, read_size, buffer));
+    read_size = std::min(buffer.size(), bytes_to_read);
+    TRY(partition().Read(read_address, buffer.first(read_size)));
   }
 
   checksum_algo_->Finish();
@@ -218,21 +349,23 @@ void Entry::DebugLog() const {
   PW_LOG_DEBUG("   Value length = 0x%zx", size_t(value_size()));
   PW_LOG_DEBUG("   Entry size   = 0x%zx", size_t(size()));
   PW_LOG_DEBUG("   Alignment    = 0x%zx", size_t(alignment_bytes()));
+  if (has_expiry_) {
+    PW_LOG_DEBUG("   Expiry       = %zu", size_t(expiry_));
+  }
 }
 
 span<const byte> Entry::CalculateChecksum(const string_view key,
                                           span<const byte> value) const {
-  checksum_algo_->Reset();
-
-  {
-    EntryHeader header_for_checksum = header_;
-    header_for_checksum.checksum = 0;
+  StartChecksum();
+  checksum_algo_->Update(as_bytes(span(key)));
+  checksum_algo_->Update(value);
+  checksum_algo_->Update(expiry_bytes());
 
-    checksum_algo_->Update(&header_for_checksum, sizeof(header_for_checksum));
-    checksum_algo_->Update(as_bytes(span(key)));
-    checksum_algo_->Update(value);
-  }
+  AddPaddingBytesToChecksum();
+  return checksum_algo_->Finish();
+}
 
+void Entry::AddPaddingBytesToChecksum() const {
   // Update the checksum with 0s to pad the entry to its alignment boundary.
   constexpr byte padding[kMinAlignmentBytes - 1] = {};
   size_t padding_to_add = Padding(content_size(), alignment_bytes());
@@ -242,11 +375,9 @@ span<const byte> Entry::CalculateChecksum(const string_view key,
     checksum_algo_->Update(padding, chunk_size);
     padding_to_add -= chunk_size;
   }
-
-  return checksum_algo_->Finish();
 }
 
-Status Entry::CalculateChecksumFromFlash() {
+Status Entry::CalculateChecksumFromFlash(span<byte> buffer) {
   header_.checksum = 0;
 
   if (checksum_algo_ == nullptr) {
@@ -259,15 +390,21 @@ Status Entry::CalculateChecksumFromFlash() {
   Address address = address_ + sizeof(EntryHeader);
   const Address end = address_ + content_size();
 
-  std::array<std::byte, 2 * kMinAlignmentBytes> buffer;
+  std::array<byte, 2 * kMinAlignmentBytes> default_buffer;
+  if (buffer.size() <= default_buffer.size()) {
+    buffer = default_buffer;
+  }
+
   while (address < end) {
     const size_t read_size = std::min(size_t(end - address), buffer.size());
-    TRY(partition_->Read(address, span(buffer).first(read_size)));
+    TRY(partition_->Read(address, buffer.first(read_size)));
 
     checksum_algo_->Update(buffer.data(), read_size);
     address += read_size;
   }
 
+  AddPaddingBytesToChecksum();
+
   span checksum = checksum_algo_->Finish();
   std::memcpy(&header_.checksum,
               checksum.data(),
@@ -275,4 +412,53 @@ Status Entry::CalculateChecksumFromFlash() {
   return Status::OK;
 }
 
+EntryWriter::EntryWriter(FlashPartition& partition)
+    : partition_(partition),
+      entry_(nullptr),
+      first_unit_{},
+      first_unit_size_(0),
+      flash_address_(0),
+      flash_(this),
+      writer_(Entry::alignment_bytes(partition), flash_) {}
+
+void EntryWriter::Start(Entry& entry) {
+  entry_ = &entry;
+  first_unit_size_ = 0;
+  flash_address_ = entry.address() + Entry::alignment_bytes(partition_);
+  entry.StartChecksum();
+}
+
+Status EntryWriter::Write(span<const byte> data) {
+  entry_->UpdateChecksum(data);
+
+  // Fill the alignment unit shared with the header first.
+  const size_t first_unit_capacity =
+      Entry::alignment_bytes(partition_) - sizeof(EntryHeader);
+  const size_t to_buffer =
+      std::min(first_unit_capacity - first_unit_size_, data.size());
+
+  std::memcpy(&first_unit_[first_unit_size_], data.data(), to_buffer);
+  first_unit_size_ += to_buffer;
+
+  if (to_buffer == data.size()) {
+    return Status::OK;
+  }
+  return writer_.Write(data.subspan(to_buffer)).status();
+}
+
+Status EntryWriter::Finish() {
+  TRY(writer_.Flush());
+  entry_->FinishChecksum();
+  return entry_->WriteHeader(span(first_unit_).first(first_unit_size_))
+      .status();
+}
+
+void EntryWriter::Abandon() { writer_.Flush(); }
+
+StatusWithSize EntryWriter::WriteToFlash(span<const byte> data) {
+  const StatusWithSize result = partition_.Write(flash_address_, data);
+  flash_address_ += data.size();
+  return result;
+}
+
 }  // namespace pw::kvs::internal
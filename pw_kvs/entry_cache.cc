@@ -14,6 +14,7 @@
 
 #include "pw_kvs/internal/entry_cache.h"
 
+#include <algorithm>
 #include <cinttypes>
 
 #include "pw_kvs/flash_memory.h"
@@ -41,28 +42,37 @@ void EntryMetadata::Reset(const KeyDescriptor& descriptor, Address address) {
   addresses_ = addresses_.first(1);
 }
 
+void EntryMetadata::RemoveAddress(Address address) {
+  const auto found = std::find(addresses_.begin(), addresses_.end(), address);
+  if (found == addresses_.end()) {
+    return;
+  }
+
+  std::copy(found + 1, addresses_.end(), found);
+  addresses_.back() = kNoAddress;
+  addresses_ = addresses_.first(addresses_.size() - 1);
+}
+
+void EntryCache::Reset() {
+  descriptors_.clear();
+  std::fill(hash_index_.begin(), hash_index_.end(), kEmptySlot);
+  key_cache_.Reset();
+}
+
 Status EntryCache::Find(FlashPartition& partition,
                         string_view key,
                         EntryMetadata* metadata) const {
   const uint32_t hash = internal::Hash(key);
-  Entry::KeyBuffer key_buffer;
 
-  for (size_t i = 0; i < descriptors_.size(); ++i) {
-    if (descriptors_[i].key_hash == hash) {
-      TRY(Entry::ReadKey(
-          partition, *first_address(i), key.size(), key_buffer.data()));
-
-      if (key == string_view(key_buffer.data(), key.size())) {
-        PW_LOG_DEBUG("Found match for key hash 0x%08" PRIx32, hash);
-        *metadata = EntryMetadata(descriptors_[i], addresses(i));
-        return Status::OK;
-      } else {
-        PW_LOG_WARN("Found key hash collision for 0x%08" PRIx32, hash);
-        return Status::ALREADY_EXISTS;
-      }
-    }
+  Status status;
+  const int index = FindKeyIndex(partition, hash, key, &status);
+  if (index == -1) {
+    return status;
   }
-  return Status::NOT_FOUND;
+
+  PW_LOG_DEBUG("Found match for key hash 0x%08" PRIx32, hash);
+  *metadata = EntryMetadata(descriptors_[index], addresses(index));
+  return Status::OK;
 }
 
 Status EntryCache::FindExisting(FlashPartition& partition,
@@ -79,31 +89,63 @@ Status EntryCache::FindExisting(FlashPartition& partition,
   return status;
 }
 
+Status EntryCache::FindByHash(uint32_t key_hash,
+                              EntryMetadata* metadata) const {
+  const int index = FindIndex(key_hash);
+
+  if (index == -1) {
+    return Status::NOT_FOUND;
+  }
+
+  *metadata = EntryMetadata(descriptors_[index], addresses(index));
+  return Status::OK;
+}
+
 EntryMetadata EntryCache::AddNew(const KeyDescriptor& descriptor,
                                  Address entry_address) {
   // TODO(hepler): DCHECK(!full());
   Address* first_address = ResetAddresses(descriptors_.size(), entry_address);
   descriptors_.push_back(descriptor);
+  AddToHashIndex(descriptors_.size() - 1);
+
+  // The key is not known yet, so mark its prefix as unknown.
+  if (!key_prefixes_.empty()) {
+    key_prefixes_[descriptors_.size() - 1].fill('\0');
+  }
   return EntryMetadata(descriptors_.back(), span(first_address, 1));
 }
 
-// TODO: This method is the trigger of the O(valid_entries * all_entries) time
-// complexity for reading. At some cost to memory, this could be optimized by
-// using a hash table instead of scanning, but in practice this should be fine
-// for a small number of keys
+// Without a hash index, this method is the trigger of the
+// O(valid_entries * all_entries) time complexity for reading. This is fine for
+// a small number of keys; KVSs with many keys should provide a hash index.
 Status EntryCache::AddNewOrUpdateExisting(const KeyDescriptor& descriptor,
                                           Address address,
-                                          size_t sector_size_bytes) {
+                                          size_t sector_size_bytes,
+                                          string_view key,
+                                          FlashPartition* partition) {
   // With the new key descriptor, either add it to the descriptor table or
   // overwrite an existing entry with an older version of the key.
-  const int index = FindIndex(descriptor.key_hash);
+  int index;
+  if (chain_collisions_ && partition != nullptr && !key.empty()) {
+    Status status;
+    index = FindKeyIndex(
+        *partition, descriptor.key_hash, key, &status, &descriptor);
+    if (index == -1 && status != Status::NOT_FOUND) {
+      return status;
+    }
+  } else {
+    index = FindIndex(descriptor.key_hash);
+  }
 
   // Write a new entry if there is room.
   if (index == -1) {
     if (full()) {
       return Status::RESOURCE_EXHAUSTED;
     }
-    AddNew(descriptor, address);
+    EntryMetadata metadata = AddNew(descriptor, address);
+    if (!key.empty()) {
+      SetKeyPrefix(metadata, key);
+    }
     return Status::OK;
   }
 
@@ -142,6 +184,65 @@ Status EntryCache::AddNewOrUpdateExisting(const KeyDescriptor& descriptor,
   return Status::OK;
 }
 
+void EntryCache::RemoveAddressesInSector(Address sector_address,
+                                         size_t sector_size_bytes) {
+  for (size_t i = 0; i < descriptors_.size(); ++i) {
+    Address* const first = first_address(i);
+
+    // Keep the remaining addresses at the front of the descriptor's list.
+    size_t kept = 0;
+    for (Address address : addresses(i)) {
+      if (address - sector_address >= sector_size_bytes) {
+        first[kept++] = address;
+      }
+    }
+    for (size_t j = kept; j < redundancy_; ++j) {
+      first[j] = kNoAddress;
+    }
+  }
+}
+
+void EntryCache::SetKeyPrefix(const EntryMetadata& metadata,
+                              string_view key) const {
+  if (key_prefixes_.empty()) {
+    return;
+  }
+
+  KeyPrefix& prefix = key_prefixes_[index_of(metadata)];
+  prefix.fill('\0');
+  std::copy_n(key.begin(), std::min(key.size(), prefix.size()), prefix.begin());
+}
+
+EntryCache::PrefixMatch EntryCache::MatchPrefix(const EntryMetadata& metadata,
+                                                string_view prefix) const {
+  if (prefix.empty()) {
+    return PrefixMatch::kYes;
+  }
+
+  if (key_prefixes_.empty()) {
+    return PrefixMatch::kMaybe;
+  }
+
+  const KeyPrefix& key_prefix = key_prefixes_[index_of(metadata)];
+  if (key_prefix[0] == '\0') {
+    return PrefixMatch::kMaybe;
+  }
+
+  const size_t compared = std::min(prefix.size(), key_prefix.size());
+  if (!std::equal(
+          prefix.begin(), prefix.begin() + compared, key_prefix.begin())) {
+    return PrefixMatch::kNo;
+  }
+
+  // The key prefix is padded with '\0', so a match is only certain if the
+  // whole prefix was compared and it does not contain '\0'.
+  if (prefix.size() <= key_prefix.size() &&
+      prefix.find('\0') == string_view::npos) {
+    return PrefixMatch::kYes;
+  }
+  return PrefixMatch::kMaybe;
+}
+
 size_t EntryCache::present_entries() const {
   size_t present_entries = 0;
 
@@ -154,13 +255,104 @@ size_t EntryCache::present_entries() const {
   return present_entries;
 }
 
-int EntryCache::FindIndex(uint32_t key_hash) const {
-  for (size_t i = 0; i < descriptors_.size(); ++i) {
-    if (descriptors_[i].key_hash == key_hash) {
-      return i;
+int EntryCache::FindKeyIndex(FlashPartition& partition,
+                             uint32_t key_hash,
+                             string_view key,
+                             Status* status,
+                             const KeyDescriptor* loading) const {
+  *status = Status::NOT_FOUND;
+  int without_address = -1;
+  int same_transaction = -1;
+  bool ambiguous = false;
+
+  const int index = FindIndex(key_hash, [&](size_t candidate) {
+    if (*first_address(candidate) == kNoAddress) {
+      if (loading != nullptr) {
+        const uint32_t id = descriptors_[candidate].transaction_id;
+        if (loading->transaction_id == id) {
+          ambiguous = same_transaction != -1;
+          same_transaction = int(candidate);
+        } else if (loading->transaction_id > id && without_address == -1) {
+          without_address = int(candidate);
+        }
+      }
+      return false;  // The key cannot be read, so keep looking.
+    }
+    *status = CompareKey(partition, candidate, key);
+    if (*status != Status::NOT_FOUND) {
+      return true;  // The key matched, or it could not be read.
+    }
+    if (!chain_collisions_) {
+      PW_LOG_WARN("Found key hash collision for 0x%08" PRIx32, key_hash);
+      *status = Status::ALREADY_EXISTS;
+      return true;
+    }
+    return false;  // Keep looking through the keys with the same hash.
+  });
+
+  if (index == -1 && *status == Status::NOT_FOUND) {
+    // Entries written by one batch share a transaction ID, so keys with the
+    // same hash in one batch cannot be told apart by their descriptors.
+    if (ambiguous) {
+      PW_LOG_ERROR("Unable to match key 0x%08" PRIx32
+                   " with transaction ID %" PRIu32 " to its descriptor",
+                   key_hash,
+                   loading->transaction_id);
+      *status = Status::DATA_LOSS;
+      return -1;
+    }
+    const int match =
+        same_transaction != -1 ? same_transaction : without_address;
+    if (match != -1) {
+      *status = Status::OK;
+      return match;
     }
   }
-  return -1;
+  return status->ok() ? index : -1;
+}
+
+Status EntryCache::CompareKey(FlashPartition& partition,
+                              size_t descriptor_index,
+                              string_view key) const {
+  // Confirm the match with the cached key if possible; otherwise, read the key
+  // from flash and cache it.
+  const string_view cached_key = key_cache_.Find(descriptor_index);
+  if (!cached_key.empty()) {
+    return cached_key == key ? Status::OK : Status::NOT_FOUND;
+  }
+
+  const Address address = *first_address(descriptor_index);
+
+  // Chained keys with the same hash could also share a prefix, so the whole
+  // key is compared, including its length.
+  if (chain_collisions_) {
+    EntryHeader header;
+    TRY(partition.Read(address, sizeof(header), &header));
+    if ((header.key_length_bytes & Entry::kMaxKeyLength) != key.size()) {
+      return Status::NOT_FOUND;
+    }
+  }
+
+  Entry::KeyBuffer key_buffer;
+  TRY(Entry::ReadKey(partition, address, key.size(), key_buffer.data()));
+  if (string_view(key_buffer.data(), key.size()) != key) {
+    return Status::NOT_FOUND;
+  }
+
+  key_cache_.Add(descriptor_index, key);
+  return Status::OK;
+}
+
+void EntryCache::AddToHashIndex(size_t descriptor_index) {
+  if (hash_index_.empty()) {
+    return;
+  }
+
+  size_t slot = descriptors_[descriptor_index].key_hash % hash_index_.size();
+  while (hash_index_[slot] != kEmptySlot) {
+    slot = (slot + 1) % hash_index_.size();
+  }
+  hash_index_[slot] = descriptor_index;
 }
 
 void EntryCache::AddAddressIfRoom(size_t descriptor_index, Address address) {
@@ -43,7 +43,9 @@ constexpr char kTheKey[] = "The Key";
 
 constexpr KeyDescriptor kDescriptor = {.key_hash = Hash(kTheKey),
                                        .transaction_id = 123,
-                                       .state = EntryState::kValid};
+                                       .state = EntryState::kValid,
+                                       .verified = false,
+                                       .entry_size = 32};
 
 TEST_F(EmptyEntryCache, AddNew) {
   EntryMetadata metadata = entries_.AddNew(kDescriptor, 5);
@@ -66,13 +68,35 @@ TEST_F(EmptyEntryCache, EntryMetadata_AddNewAddress) {
   EXPECT_EQ(999u, metadata.addresses()[1]);
 }
 
+TEST_F(EmptyEntryCache, EntryMetadata_RemoveAddress) {
+  EntryMetadata metadata = entries_.AddNew(kDescriptor, 100);
+  metadata.AddNewAddress(200);
+  metadata.AddNewAddress(300);
+
+  metadata.RemoveAddress(100);
+
+  ASSERT_EQ(2u, metadata.addresses().size());
+  EXPECT_EQ(200u, metadata.addresses()[0]);
+  EXPECT_EQ(300u, metadata.addresses()[1]);
+
+  metadata.RemoveAddress(123);
+  EXPECT_EQ(2u, metadata.addresses().size());
+
+  // The freed slot can hold a new address.
+  metadata.AddNewAddress(400);
+  EXPECT_EQ(400u, entries_.begin()->addresses()[2]);
+}
+
 TEST_F(EmptyEntryCache, EntryMetadata_Reset) {
   EntryMetadata metadata = entries_.AddNew(kDescriptor, 100);
   metadata.AddNewAddress(999);
 
-  metadata.Reset(
-      {.key_hash = 987, .transaction_id = 5, .state = EntryState::kDeleted},
-      8888);
+  metadata.Reset({.key_hash = 987,
+                  .transaction_id = 5,
+                  .state = EntryState::kDeleted,
+                  .verified = false,
+                  .entry_size = 32},
+                 8888);
 
   EXPECT_EQ(987u, metadata.hash());
   EXPECT_EQ(5u, metadata.transaction_id());
@@ -99,7 +123,8 @@ TEST_F(EmptyEntryCache, AddNewOrUpdateExisting_NewEntry_Full) {
   for (uint32_t i = 0; i < kMaxEntries; ++i) {
     ASSERT_EQ(  // Fill up the cache
         Status::OK,
-        entries_.AddNewOrUpdateExisting({i, i, EntryState::kValid}, i, 1));
+        entries_.AddNewOrUpdateExisting(
+            {i, i, EntryState::kValid, false, 1}, i, 1));
   }
   ASSERT_EQ(kMaxEntries, entries_.total_entries());
   ASSERT_TRUE(entries_.full());
@@ -166,6 +191,41 @@ TEST_F(EmptyEntryCache, AddNewOrUpdateExisting_AddDuplicateEntryInSameSector) {
   }
 }
 
+TEST_F(EmptyEntryCache, RemoveAddressesInSector) {
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(kDescriptor, 1000, 1000));
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(kDescriptor, 2500, 1000));
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(kDescriptor, 3000, 1000));
+
+  entries_.RemoveAddressesInSector(2000, 1000);
+
+  for (const EntryMetadata& entry : entries_) {
+    ASSERT_EQ(2u, entry.addresses().size());
+    EXPECT_EQ(1000u, entry.addresses()[0]);
+    EXPECT_EQ(3000u, entry.addresses()[1]);
+  }
+
+  entries_.RemoveAddressesInSector(0, 4000);
+
+  for (const EntryMetadata& entry : entries_) {
+    EXPECT_TRUE(entry.addresses().empty());
+  }
+}
+
+TEST_F(EmptyEntryCache, FindByHash) {
+  entries_.AddNew(kDescriptor, 1000);
+
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::OK, entries_.FindByHash(kDescriptor.key_hash, &metadata));
+  EXPECT_EQ(kDescriptor.transaction_id, metadata.transaction_id());
+  EXPECT_EQ(1000u, metadata.first_address());
+
+  EXPECT_EQ(Status::NOT_FOUND,
+            entries_.FindByHash(kDescriptor.key_hash + 1, &metadata));
+}
+
 constexpr auto kTheEntry = AsBytes(uint32_t(12345),  // magic
                                    uint32_t(0),      // checksum
                                    uint8_t(0),       // alignment (16 B)
@@ -208,11 +268,15 @@ class InitializedEntryCache : public EmptyEntryCache {
     entries_.AddNew(kDescriptor, 0);
     entries_.AddNew({.key_hash = Hash(kCollision1),
                      .transaction_id = 125,
-                     .state = EntryState::kDeleted},
+                     .state = EntryState::kDeleted,
+                     .verified = false,
+                     .entry_size = kCollisionEntry.size() + kPadding2.size()},
                     kTheEntry.size() + kPadding1.size());
     entries_.AddNew({.key_hash = Hash("delorted"),
                      .transaction_id = 256,
-                     .state = EntryState::kDeleted},
+                     .state = EntryState::kDeleted,
+                     .verified = false,
+                     .entry_size = kDeletedEntry.size()},
                     kTheEntry.size() + kPadding1.size() +
                         kCollisionEntry.size() + kPadding2.size());
   }
@@ -284,5 +348,309 @@ TEST_F(InitializedEntryCache, FindExisting_Collision) {
             entries_.FindExisting(partition_, kCollision2, &metadata));
 }
 
+class InitializedIndexedEntryCache : public ::testing::Test {
+ protected:
+  static constexpr size_t kMaxEntries = 32;
+  static constexpr size_t kRedundancy = 1;
+
+  InitializedIndexedEntryCache()
+      : entries_(descriptors_, addresses_, kRedundancy, hash_index_),
+        flash_(AsBytes(kTheEntry, kPadding1, kCollisionEntry, kPadding2)),
+        partition_(&flash_) {
+    entries_.Reset();
+    entries_.AddNew(kDescriptor, 0);
+    entries_.AddNew({.key_hash = Hash(kCollision1),
+                     .transaction_id = 125,
+                     .state = EntryState::kValid,
+                     .verified = false,
+                     .entry_size = kCollisionEntry.size() + kPadding2.size()},
+                    kTheEntry.size() + kPadding1.size());
+  }
+
+  Vector<KeyDescriptor, kMaxEntries> descriptors_;
+  EntryCache::AddressList<kMaxEntries, kRedundancy> addresses_;
+  EntryCache::HashIndex<2 * kMaxEntries> hash_index_;
+
+  EntryCache entries_;
+
+  FakeFlashBuffer<64, 128> flash_;
+  FlashPartition partition_;
+};
+
+TEST_F(InitializedIndexedEntryCache, Find_PresentEntry) {
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::OK, entries_.Find(partition_, kTheKey, &metadata));
+  EXPECT_EQ(Hash(kTheKey), metadata.hash());
+  EXPECT_EQ(0u, metadata.first_address());
+}
+
+TEST_F(InitializedIndexedEntryCache, Find_MissingEntry) {
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::NOT_FOUND, entries_.Find(partition_, "3.141", &metadata));
+}
+
+TEST_F(InitializedIndexedEntryCache, Find_Collision) {
+  EntryMetadata metadata;
+  EXPECT_EQ(Status::ALREADY_EXISTS,
+            entries_.Find(partition_, kCollision2, &metadata));
+}
+
+TEST_F(InitializedIndexedEntryCache, Reset_ClearsIndex) {
+  entries_.Reset();
+
+  EntryMetadata metadata;
+  EXPECT_EQ(Status::NOT_FOUND, entries_.Find(partition_, kTheKey, &metadata));
+}
+
+TEST_F(InitializedIndexedEntryCache, AddNewOrUpdateExisting_FillWithSameSlot) {
+  entries_.Reset();
+
+  // Every hash maps to slot 0, so each insertion probes past all of the others.
+  for (uint32_t i = 0; i < kMaxEntries; ++i) {
+    const uint32_t hash = i * hash_index_.size();
+    ASSERT_EQ(Status::OK,
+              entries_.AddNewOrUpdateExisting(
+                  {hash, 1, EntryState::kValid, false, 64}, 64 * i, 64));
+  }
+  ASSERT_TRUE(entries_.full());
+
+  // Updating an existing descriptor finds it through the index.
+  const uint32_t last_hash = (kMaxEntries - 1) * hash_index_.size();
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(
+                {last_hash, 2, EntryState::kValid, false, 64}, 4096, 64));
+  EXPECT_EQ(kMaxEntries, entries_.total_entries());
+
+  for (const EntryMetadata& entry : entries_) {
+    if (entry.hash() == last_hash) {
+      EXPECT_EQ(2u, entry.transaction_id());
+      EXPECT_EQ(4096u, entry.first_address());
+    }
+  }
+}
+
+class KeyCachedEntryCache : public InitializedIndexedEntryCache {
+ protected:
+  KeyCachedEntryCache()
+      : cached_entries_(
+            descriptors_, addresses_, kRedundancy, hash_index_, key_slots_) {
+    cached_entries_.Reset();
+    cached_entries_.AddNew(kDescriptor, 0);
+  }
+
+  std::array<KeyCache::Slot, 2> key_slots_;
+  EntryCache cached_entries_;
+};
+
+TEST_F(KeyCachedEntryCache, Find_SecondLookupDoesNotReadFlash) {
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::OK, cached_entries_.Find(partition_, kTheKey, &metadata));
+  EXPECT_EQ(0u, cached_entries_.key_cache_stats().hits);
+  EXPECT_EQ(1u, cached_entries_.key_cache_stats().misses);
+
+  flash_.InjectReadError(FlashError::Unconditional(Status::INTERNAL));
+
+  ASSERT_EQ(Status::OK, cached_entries_.Find(partition_, kTheKey, &metadata));
+  EXPECT_EQ(Hash(kTheKey), metadata.hash());
+  EXPECT_EQ(1u, cached_entries_.key_cache_stats().hits);
+  EXPECT_EQ(1u, cached_entries_.key_cache_stats().misses);
+}
+
+TEST_F(KeyCachedEntryCache, CachedKey) {
+  EntryMetadata metadata = *cached_entries_.begin();
+  EXPECT_TRUE(cached_entries_.CachedKey(metadata).empty());
+
+  cached_entries_.CacheKey(metadata, kTheKey);
+  EXPECT_EQ(std::string_view(kTheKey), cached_entries_.CachedKey(metadata));
+}
+
+TEST_F(KeyCachedEntryCache, Reset_DiscardsCachedKeys) {
+  cached_entries_.CacheKey(*cached_entries_.begin(), kTheKey);
+  cached_entries_.Reset();
+  EntryMetadata metadata = cached_entries_.AddNew(kDescriptor, 0);
+
+  EXPECT_TRUE(cached_entries_.CachedKey(metadata).empty());
+}
+
+constexpr auto kCollisionEntry2 =
+    AsBytes(uint32_t(12345),                   // magic
+            uint32_t(0),                       // checksum
+            uint8_t(0),                        // alignment (16 B)
+            uint8_t(sizeof(kCollision2) - 1),  // key length
+            uint16_t(0),                       // value size
+            uint32_t(124),                     // transaction ID
+            ByteStr(kCollision2));
+constexpr std::array<byte, 16 - kCollisionEntry2.size() % 16> kPadding3{};
+
+class ChainedEntryCache : public ::testing::Test {
+ protected:
+  static constexpr size_t kMaxEntries = 32;
+  static constexpr size_t kRedundancy = 1;
+  static constexpr EntryCache::Address kCollision1Address =
+      kTheEntry.size() + kPadding1.size();
+  static constexpr EntryCache::Address kCollision2Address =
+      kCollision1Address + kCollisionEntry.size() + kPadding2.size();
+
+  ChainedEntryCache()
+      : entries_(descriptors_,
+                 addresses_,
+                 kRedundancy,
+                 hash_index_,
+                 {},
+                 {},
+                 /*chain_collisions=*/true),
+        flash_(AsBytes(kTheEntry,
+                       kPadding1,
+                       kCollisionEntry,
+                       kPadding2,
+                       kCollisionEntry2,
+                       kPadding3)),
+        partition_(&flash_) {
+    entries_.Reset();
+    entries_.AddNew(kDescriptor, 0);
+    entries_.AddNew({.key_hash = Hash(kCollision1),
+                     .transaction_id = 123,
+                     .state = EntryState::kValid,
+                     .verified = false,
+                     .entry_size = kCollisionEntry.size() + kPadding2.size()},
+                    kCollision1Address);
+  }
+
+  Vector<KeyDescriptor, kMaxEntries> descriptors_;
+  EntryCache::AddressList<kMaxEntries, kRedundancy> addresses_;
+  EntryCache::HashIndex<2 * kMaxEntries> hash_index_;
+
+  EntryCache entries_;
+
+  FakeFlashBuffer<64, 128> flash_;
+  FlashPartition partition_;
+};
+
+TEST_F(ChainedEntryCache, Find_Collision_NotFound) {
+  EntryMetadata metadata;
+  EXPECT_EQ(Status::NOT_FOUND,
+            entries_.Find(partition_, kCollision2, &metadata));
+  ASSERT_EQ(Status::OK, entries_.Find(partition_, kCollision1, &metadata));
+  EXPECT_EQ(kCollision1Address, metadata.first_address());
+}
+
+TEST_F(ChainedEntryCache, CollidingKeysCoexist) {
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(
+                {.key_hash = Hash(kCollision2),
+                 .transaction_id = 124,
+                 .state = EntryState::kValid,
+                 .verified = false,
+                 .entry_size = kCollisionEntry2.size() + kPadding3.size()},
+                kCollision2Address,
+                2048,
+                kCollision2,
+                &partition_));
+  EXPECT_EQ(3u, entries_.total_entries());
+
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::OK, entries_.Find(partition_, kCollision1, &metadata));
+  EXPECT_EQ(kCollision1Address, metadata.first_address());
+  EXPECT_EQ(123u, metadata.transaction_id());
+
+  ASSERT_EQ(Status::OK, entries_.Find(partition_, kCollision2, &metadata));
+  EXPECT_EQ(kCollision2Address, metadata.first_address());
+  EXPECT_EQ(124u, metadata.transaction_id());
+}
+
+TEST_F(ChainedEntryCache, AddNewOrUpdateExisting_UpdatesMatchingKey) {
+  ASSERT_EQ(Status::OK,
+            entries_.AddNewOrUpdateExisting(
+                {.key_hash = Hash(kCollision1),
+                 .transaction_id = 200,
+                 .state = EntryState::kDeleted,
+                 .verified = false,
+                 .entry_size = kCollisionEntry.size() + kPadding2.size()},
+                kCollision1Address,
+                2048,
+                kCollision1,
+                &partition_));
+  EXPECT_EQ(2u, entries_.total_entries());
+
+  EntryMetadata metadata;
+  ASSERT_EQ(Status::OK, entries_.Find(partition_, kCollision1, &metadata));
+  EXPECT_EQ(200u, metadata.transaction_id());
+  EXPECT_EQ(EntryState::kDeleted, metadata.state());
+}
+
+class PrefixedEntryCache : public EmptyEntryCache {
+ protected:
+  PrefixedEntryCache()
+      : prefixed_entries_(
+            descriptors_, addresses_, kRedundancy, {}, {}, key_prefixes_) {}
+
+  std::array<EntryCache::KeyPrefix, kMaxEntries> key_prefixes_;
+  EntryCache prefixed_entries_;
+};
+
+TEST_F(PrefixedEntryCache, MatchPrefix_UnknownKey_Maybe) {
+  EntryMetadata metadata = prefixed_entries_.AddNew(kDescriptor, 0);
+
+  EXPECT_EQ(EntryCache::PrefixMatch::kMaybe,
+            prefixed_entries_.MatchPrefix(metadata, "The"));
+  EXPECT_EQ(EntryCache::PrefixMatch::kYes,
+            prefixed_entries_.MatchPrefix(metadata, ""));
+}
+
+TEST_F(PrefixedEntryCache, MatchPrefix_KnownKey) {
+  EntryMetadata metadata = prefixed_entries_.AddNew(kDescriptor, 0);
+  prefixed_entries_.SetKeyPrefix(metadata, kTheKey);
+
+  EXPECT_EQ(EntryCache::PrefixMatch::kYes,
+            prefixed_entries_.MatchPrefix(metadata, "The "));
+  EXPECT_EQ(EntryCache::PrefixMatch::kNo,
+            prefixed_entries_.MatchPrefix(metadata, "Tha"));
+  // Only four characters are kept, so longer prefixes must be checked in flash.
+  EXPECT_EQ(EntryCache::PrefixMatch::kMaybe,
+            prefixed_entries_.MatchPrefix(metadata, "The Key"));
+  EXPECT_EQ(EntryCache::PrefixMatch::kNo,
+            prefixed_entries_.MatchPrefix(metadata, "Thy Lock"));
+}
+
+TEST_F(PrefixedEntryCache, MatchPrefix_ShortKey) {
+  EntryMetadata metadata = prefixed_entries_.AddNew(kDescriptor, 0);
+  prefixed_entries_.SetKeyPrefix(metadata, "ab");
+
+  EXPECT_EQ(EntryCache::PrefixMatch::kYes,
+            prefixed_entries_.MatchPrefix(metadata, "ab"));
+  EXPECT_EQ(EntryCache::PrefixMatch::kNo,
+            prefixed_entries_.MatchPrefix(metadata, "abc"));
+}
+
+TEST_F(PrefixedEntryCache, AddNewOrUpdateExisting_RecordsKeyPrefix) {
+  ASSERT_EQ(Status::OK,
+            prefixed_entries_.AddNewOrUpdateExisting(
+                kDescriptor, 0, 2048, kTheKey));
+  EntryMetadata metadata = *prefixed_entries_.begin();
+
+  EXPECT_EQ(EntryCache::PrefixMatch::kYes,
+            prefixed_entries_.MatchPrefix(metadata, "The"));
+  EXPECT_EQ(EntryCache::PrefixMatch::kNo,
+            prefixed_entries_.MatchPrefix(metadata, "Key"));
+}
+
+TEST(KeyCache, Add_EvictsLeastRecentlyUsed) {
+  std::array<KeyCache::Slot, 2> slots;
+  KeyCache cache(slots);
+  cache.Reset();
+
+  cache.Add(0, "zero");
+  cache.Add(1, "one");
+  EXPECT_EQ("zero", cache.Find(0));  // 1 is now the least recently used.
+
+  cache.Add(2, "two");
+  EXPECT_EQ("zero", cache.Find(0));
+  EXPECT_TRUE(cache.Find(1).empty());
+  EXPECT_EQ("two", cache.Find(2));
+
+  EXPECT_EQ(3u, cache.stats().hits);
+  EXPECT_EQ(1u, cache.stats().misses);
+}
+
 }  // namespace
 }  // namespace pw::kvs::internal
@@ -21,6 +21,7 @@
 #include "pw_kvs/checksum.h"
 #include "pw_kvs/crc16_checksum.h"
 #include "pw_kvs/flash_memory.h"
+#include "pw_kvs/flash_partition_with_stats.h"
 #include "pw_kvs/format.h"
 #include "pw_kvs/in_memory_fake_flash.h"
 #include "pw_kvs_private/byte_utils.h"
@@ -374,6 +375,29 @@ TEST_F(EntryInFlash, Copy_ReadError) {
   EXPECT_EQ(0u, result.size());
 }
 
+TEST_F(EntryInFlash, Copy_ReadsKeyAndValueOnce) {
+  FlashPartitionWithStatsBuffer<4> partition(&flash_);
+  Entry entry;
+  ASSERT_EQ(Status::OK, Entry::Read(partition, 0, kFormats, &entry));
+  partition.ResetCounters();
+
+  auto result = entry.Copy(kEntry1.size());
+  EXPECT_EQ(Status::OK, result.status());
+  EXPECT_EQ(kKey1.size() + kValue1.size(), partition.read_bytes());
+}
+
+TEST_F(EntryInFlash, Copy_CorruptValue_CopiesAndReportsDataLoss) {
+  flash_.buffer()[sizeof(EntryHeader) + kKey1.size()] = byte{'v'};
+
+  auto result = entry_.Copy(kEntry1.size());
+  EXPECT_EQ(Status::DATA_LOSS, result.status());
+  EXPECT_EQ(kEntry1.size(), result.size());
+  EXPECT_EQ(0,
+            std::memcmp(&flash_.buffer()[kEntry1.size()],
+                        flash_.buffer().data(),
+                        kEntry1.size()));
+}
+
 constexpr uint32_t ByteSum(span<const byte> bytes, uint32_t value = 0) {
   for (byte b : bytes) {
     value += unsigned(b);
@@ -459,5 +483,89 @@ TEST_F(EntryInFlash, UpdateAndCopy_WriteError) {
   EXPECT_EQ(kEntry1.size(), result.size());
 }
 
+TEST(Entry, LargeBuffer_VerifiesAndCopiesInOneRead) {
+  FakeFlashBuffer<1024, 4> flash(16);
+  FlashPartitionWithStatsBuffer<4> partition(&flash);
+
+  std::array<byte, 200> value;
+  value.fill(byte{0x5A});
+  Entry entry =
+      Entry::Valid(partition, 0, kFormatWithChecksum, "key", value, 1);
+  ASSERT_EQ(Status::OK, entry.Write("key", value).status());
+
+  // Without a buffer, the entry is read 32 B at a time.
+  partition.ResetCounters();
+  ASSERT_EQ(Status::OK, entry.VerifyChecksumInFlash());
+  EXPECT_EQ(AlignUp(entry.size(), 32) / 32, partition.read_count());
+
+  std::array<byte, 256> buffer;
+  partition.ResetCounters();
+  ASSERT_EQ(Status::OK, entry.VerifyChecksumInFlash(buffer));
+  EXPECT_EQ(1u, partition.read_count());
+
+  partition.ResetCounters();
+  auto result = entry.Copy(512, buffer);
+  ASSERT_EQ(Status::OK, result.status());
+  EXPECT_EQ(entry.size(), result.size());
+  EXPECT_EQ(1u, partition.read_count());
+
+  Entry copy = entry;
+  copy.set_address(512);
+  EXPECT_EQ(Status::OK, copy.VerifyChecksumInFlash(buffer));
+}
+
+TEST(Entry, Expiring_ExpiryTimeFollowsValue) {
+  FakeFlashBuffer<1024, 4> flash;
+  FlashPartition partition(&flash, 0, flash.sector_count(), 16);
+
+  constexpr EntryFormat kExpiringFormat{
+      .magic = 0x3d2c1b0a, .checksum = &checksum, .expiry = true};
+  constexpr EntryFormat kFormatList[] = {kFormatWithChecksum, kExpiringFormat};
+  const EntryFormats formats(kFormatList);
+
+  Entry entry = Entry::Expiring(
+      partition, 0, kExpiringFormat, "key45", kValue1, kTransactionId1, 1000);
+  EXPECT_EQ(32u, entry.size());  // 16 B header, 5 B key, 6 B value, 4 B expiry
+  auto result = entry.Write("key45", kValue1);
+  ASSERT_EQ(Status::OK, result.status());
+  EXPECT_EQ(32u, result.size());
+
+  uint32_t expiry_time = 0;
+  std::memcpy(&expiry_time,
+              &flash.buffer()[sizeof(EntryHeader) + 5 + kValue1.size()],
+              sizeof(expiry_time));
+  EXPECT_EQ(1000u, expiry_time);
+
+  Entry read;
+  ASSERT_EQ(Status::OK, Entry::Read(partition, 0, formats, &read));
+  EXPECT_TRUE(read.has_expiry());
+  EXPECT_EQ(1000u, read.expiry_time());
+  EXPECT_EQ(kValue1.size(), read.value_size());
+  EXPECT_EQ(Status::OK, read.VerifyChecksumInFlash());
+  EXPECT_FALSE(read.expired(999));
+  EXPECT_TRUE(read.expired(1000));
+
+  // The expiry time is copied and checked with the rest of the entry.
+  ASSERT_EQ(Status::OK, read.Copy(64).status());
+  ASSERT_EQ(Status::OK, Entry::Read(partition, 64, formats, &read));
+  EXPECT_EQ(1000u, read.expiry_time());
+  EXPECT_EQ(Status::OK, read.VerifyChecksumInFlash());
+
+  flash.buffer()[sizeof(EntryHeader) + 5 + kValue1.size()] = byte{0};
+  ASSERT_EQ(Status::OK, Entry::Read(partition, 0, formats, &read));
+  EXPECT_EQ(Status::DATA_LOSS, read.VerifyChecksumInFlash());
+}
+
+TEST(Entry, Expiring_OtherFormatsNeverExpire) {
+  FakeFlashBuffer<1024, 4> flash;
+  FlashPartition partition(&flash, 0, flash.sector_count(), 16);
+
+  Entry entry = Entry::Valid(
+      partition, 0, kFormatWithChecksum, "key45", kValue1, kTransactionId1);
+  EXPECT_FALSE(entry.has_expiry());
+  EXPECT_EQ(Entry::kNoExpiry, entry.expiry_time());
+  EXPECT_FALSE(entry.expired(Entry::kNoExpiry));
+}
+
 }  // namespace
 }  // namespace pw::kvs::internal
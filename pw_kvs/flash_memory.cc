@@ -26,6 +26,14 @@ namespace pw::kvs {
 
 using std::byte;
 
+Status FlashMemory::WaitForErase() {
+  Status status = PollErase();
+  while (status == Status::UNAVAILABLE) {
+    status = PollErase();
+  }
+  return status;
+}
+
 StatusWithSize FlashPartition::Output::DoWrite(span<const byte> data) {
   TRY_WITH_SIZE(flash_.Write(address_, data));
   address_ += data.size();
@@ -47,6 +55,15 @@ Status FlashPartition::Erase(Address address, size_t num_sectors) {
   return flash_.Erase(PartitionToFlashAddress(address), num_sectors);
 }
 
+Status FlashPartition::StartErase(Address address, size_t num_sectors) {
+  if (permission_ == PartitionPermission::kReadOnly) {
+    return Status::PERMISSION_DENIED;
+  }
+
+  TRY(CheckBounds(address, num_sectors * sector_size_bytes()));
+  return flash_.StartErase(PartitionToFlashAddress(address), num_sectors);
+}
+
 StatusWithSize FlashPartition::Read(Address address, span<byte> output) {
   TRY_WITH_SIZE(CheckBounds(address, output.size()));
   return flash_.Read(PartitionToFlashAddress(address), output);
@@ -67,6 +67,17 @@ Status FlashPartitionWithStats::SaveStorageStats(const KeyValueStore& kvs,
 }
 
 Status FlashPartitionWithStats::Erase(Address address, size_t num_sectors) {
+  CountErase(address, num_sectors);
+  return FlashPartition::Erase(address, num_sectors);
+}
+
+Status FlashPartitionWithStats::StartErase(Address address,
+                                           size_t num_sectors) {
+  CountErase(address, num_sectors);
+  return FlashPartition::StartErase(address, num_sectors);
+}
+
+void FlashPartitionWithStats::CountErase(Address address, size_t num_sectors) {
   size_t base_index = address / FlashPartition::sector_size_bytes();
   if (base_index < sector_counters_.size()) {
     num_sectors = std::min(num_sectors, (sector_counters_.size() - base_index));
@@ -74,8 +85,13 @@ Status FlashPartitionWithStats::Erase(Address address, size_t num_sectors) {
       sector_counters_[base_index + i]++;
     }
   }
+}
 
-  return FlashPartition::Erase(address, num_sectors);
+StatusWithSize FlashPartitionWithStats::Read(Address address,
+                                             span<std::byte> output) {
+  read_count_ += 1;
+  read_bytes_ += output.size();
+  return FlashPartition::Read(address, output);
 }
 
 }  // namespace pw::kvs
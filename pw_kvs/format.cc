@@ -25,4 +25,22 @@ const EntryFormat* EntryFormats::Find(const uint32_t magic) const {
   return nullptr;
 }
 
+const EntryFormat* EntryFormats::Expiring() const {
+  for (const EntryFormat& format : formats_) {
+    if (format.expiry) {
+      return &format;
+    }
+  }
+  return nullptr;
+}
+
+bool EntryFormats::HasCompression() const {
+  for (const EntryFormat& format : formats_) {
+    if (format.compression != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
 }  // namespace pw::kvs::internal
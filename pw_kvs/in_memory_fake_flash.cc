@@ -54,6 +54,57 @@ Status FlashError::Check(FlashMemory::Address start_address, size_t size) {
 }
 
 Status InMemoryFakeFlash::Erase(Address address, size_t num_sectors) {
+  if (Status status = CheckEraseArguments(address, num_sectors); !status.ok()) {
+    return status;
+  }
+
+  elapsed_ns_ += EraseNs(num_sectors);
+  std::memset(
+      &buffer_[address], int(kErasedValue), sector_size_bytes() * num_sectors);
+  return Status::OK;
+}
+
+Status InMemoryFakeFlash::StartErase(Address address, size_t num_sectors) {
+  if (Status status = CheckEraseArguments(address, num_sectors); !status.ok()) {
+    return status;
+  }
+
+  erase_pending_ = true;
+  erase_address_ = address;
+  erase_sectors_ = num_sectors;
+  erase_end_ns_ = elapsed_ns_ + EraseNs(num_sectors);
+  return Status::OK;
+}
+
+Status InMemoryFakeFlash::PollErase() {
+  if (!erase_pending_) {
+    return Status::OK;
+  }
+  if (elapsed_ns_ < erase_end_ns_) {
+    return Status::UNAVAILABLE;
+  }
+
+  erase_pending_ = false;
+  std::memset(&buffer_[erase_address_],
+              int(kErasedValue),
+              sector_size_bytes() * erase_sectors_);
+  return Status::OK;
+}
+
+Status InMemoryFakeFlash::WaitForErase() {
+  if (erase_pending_) {
+    elapsed_ns_ = std::max(elapsed_ns_, erase_end_ns_);
+  }
+  return PollErase();
+}
+
+Status InMemoryFakeFlash::CheckEraseArguments(Address address,
+                                              size_t num_sectors) const {
+  if (erase_pending_) {
+    PW_LOG_ERROR("Attempted to erase while another erase is in progress");
+    return Status::FAILED_PRECONDITION;
+  }
+
   if (address % sector_size_bytes() != 0) {
     PW_LOG_ERROR(
         "Attempted to erase sector at non-sector aligned boundary; address %zx",
@@ -70,19 +121,37 @@ Status InMemoryFakeFlash::Erase(Address address, size_t num_sectors) {
     return Status::OUT_OF_RANGE;
   }
 
-  std::memset(
-      &buffer_[address], int(kErasedValue), sector_size_bytes() * num_sectors);
   return Status::OK;
 }
 
+bool InMemoryFakeFlash::Erasing(Address address, size_t size) const {
+  if (!erase_pending_) {
+    return false;
+  }
+  const Address erase_end =
+      erase_address_ + erase_sectors_ * sector_size_bytes();
+  return address < erase_end && address + size > erase_address_;
+}
+
 StatusWithSize InMemoryFakeFlash::Read(Address address,
                                        span<std::byte> output) {
   if (address + output.size() >= sector_count() * size_bytes()) {
     return StatusWithSize::OUT_OF_RANGE;
   }
 
+  if (Erasing(address, output.size())) {
+    PW_LOG_ERROR("Read from sector being erased; address %zx", size_t(address));
+    return StatusWithSize::FAILED_PRECONDITION;
+  }
+
   // Check for injected read errors
   Status status = FlashError::Check(read_errors_, address, output.size());
+  // Only advance the time if reads are timed, so that concurrent readers
+  // sharing a lock do not race on elapsed_ns_ when timing is not simulated.
+  if (timing_.read_us != 0u || timing_.read_ns_per_byte != 0u) {
+    elapsed_ns_ += uint64_t(timing_.read_us) * 1000 +
+                   uint64_t(timing_.read_ns_per_byte) * output.size();
+  }
   std::memcpy(output.data(), &buffer_[address], output.size());
   return StatusWithSize(status, output.size());
 }
@@ -114,6 +183,11 @@ StatusWithSize InMemoryFakeFlash::Write(Address address,
     return StatusWithSize::OUT_OF_RANGE;
   }
 
+  if (Erasing(address, data.size())) {
+    PW_LOG_ERROR("Write to sector being erased; address %zx", size_t(address));
+    return StatusWithSize::FAILED_PRECONDITION;
+  }
+
   // Check in erased state
   for (unsigned i = 0; i < data.size(); i++) {
     if (buffer_[address + i] != kErasedValue) {
@@ -125,6 +199,8 @@ StatusWithSize InMemoryFakeFlash::Write(Address address,
 
   // Check for any injected write errors
   Status status = FlashError::Check(write_errors_, address, data.size());
+  elapsed_ns_ += uint64_t(timing_.write_us) * 1000 +
+                 uint64_t(timing_.write_ns_per_byte) * data.size();
   std::memcpy(&buffer_[address], data.data(), data.size());
   return StatusWithSize(status, data.size());
 }
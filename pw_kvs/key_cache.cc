@@ -0,0 +1,72 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/internal/key_cache.h"
+
+#include <algorithm>
+
+namespace pw::kvs::internal {
+
+void KeyCache::Reset() {
+  for (Slot& slot : slots_) {
+    slot.descriptor_index = kEmpty;
+  }
+}
+
+std::string_view KeyCache::Find(size_t descriptor_index) {
+  // A disabled cache is not updated, so lookups may run concurrently.
+  if (!enabled()) {
+    return std::string_view();
+  }
+
+  for (Slot& slot : slots_) {
+    if (slot.descriptor_index == descriptor_index) {
+      slot.last_used = ++clock_;
+      stats_.hits += 1;
+      return std::string_view(slot.key, slot.key_length);
+    }
+  }
+
+  stats_.misses += 1;
+  return std::string_view();
+}
+
+void KeyCache::Add(size_t descriptor_index, std::string_view key) {
+  if (!enabled() || key.size() > sizeof(Slot::key)) {
+    return;
+  }
+
+  // Replace an existing copy of this key, an empty slot, or the least recently
+  // used key, in that order of preference.
+  Slot* victim = &slots_[0];
+  for (Slot& slot : slots_) {
+    if (slot.descriptor_index == descriptor_index) {
+      victim = &slot;
+      break;
+    }
+    if (victim->descriptor_index == kEmpty) {
+      continue;
+    }
+    if (slot.descriptor_index == kEmpty || slot.last_used < victim->last_used) {
+      victim = &slot;
+    }
+  }
+
+  victim->descriptor_index = descriptor_index;
+  victim->key_length = key.size();
+  victim->last_used = ++clock_;
+  std::copy(key.begin(), key.end(), victim->key);
+}
+
+}  // namespace pw::kvs::internal
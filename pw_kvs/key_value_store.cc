@@ -17,6 +17,7 @@
 #include <algorithm>
 #include <cinttypes>
 #include <cstring>
+#include <limits>
 #include <type_traits>
 
 #define PW_LOG_USE_ULTRA_SHORT_NAMES 1
@@ -33,6 +34,137 @@ constexpr bool InvalidKey(std::string_view key) {
   return key.empty() || (key.size() > internal::Entry::kMaxKeyLength);
 }
 
+constexpr FlashPartition::Address kNoAddress = FlashPartition::Address(-1);
+constexpr uint32_t kNoTransactionId = uint32_t(-1);
+
+// True if reading a copy of an entry failed in a way that another copy might
+// not, as opposed to failing because of the request itself, such as with a
+// buffer that is too small or an offset past the end of the value.
+bool TryOtherCopies(Status status) {
+  return !status.ok() && status != Status::RESOURCE_EXHAUSTED &&
+         status != Status::OUT_OF_RANGE && status != Status::INVALID_ARGUMENT &&
+         status != Status::UNIMPLEMENTED;
+}
+
+// Checks whether a write was interrupted after writing part of an entry at this
+// address, but before writing the entry's header. Entries whose headers are
+// written last write the alignment unit after the header first, so only that
+// unit is checked.
+bool InterruptedWriteAt(FlashPartition& partition,
+                        FlashPartition::Address address,
+                        FlashPartition::Address end) {
+  std::array<byte, 4 * internal::Entry::kMinAlignmentBytes> buffer;
+
+  const size_t alignment = internal::Entry::alignment_bytes(partition);
+  const FlashPartition::Address next_unit = address + alignment;
+  if (next_unit >= end) {
+    return false;
+  }
+
+  const size_t read_size = std::min(alignment, buffer.size());
+  if (!partition.Read(next_unit, span(buffer).first(read_size)).ok()) {
+    return false;
+  }
+  return !partition.AppearsErased(span(buffer).first(read_size));
+}
+
+// Output that copies data into a buffer. Reports RESOURCE_EXHAUSTED if the
+// buffer fills before all of the data is copied.
+class BufferOutput final : public Output {
+ public:
+  constexpr BufferOutput(span<byte> buffer) : buffer_(buffer), size_(0) {}
+
+  // The number of bytes copied into the buffer.
+  size_t size() const { return size_; }
+
+ private:
+  StatusWithSize DoWrite(span<const byte> data) override {
+    const size_t copy_size = std::min(data.size(), buffer_.size() - size_);
+    std::memcpy(buffer_.data() + size_, data.data(), copy_size);
+    size_ += copy_size;
+    return StatusWithSize(
+        copy_size == data.size() ? Status::OK : Status::RESOURCE_EXHAUSTED,
+        copy_size);
+  }
+
+  span<byte> buffer_;
+  size_t size_;
+};
+
+// Output that writes an entry's key or value with an EntryWriter.
+class EntryWriterOutput final : public Output {
+ public:
+  constexpr EntryWriterOutput(internal::EntryWriter& writer)
+      : writer_(writer) {}
+
+ private:
+  StatusWithSize DoWrite(span<const byte> data) override {
+    return StatusWithSize(writer_.Write(data), data.size());
+  }
+
+  internal::EntryWriter& writer_;
+};
+
+// Records in the checkpoint partition are entries whose transaction IDs are
+// sequence numbers. A checkpoint is followed by a record for each sector that
+// was erased after it was written. Each sector of the checkpoint partition
+// starts with a checkpoint.
+constexpr std::string_view kCheckpointKey = "checkpoint";
+constexpr std::string_view kSectorErasedKey = "sector_erased";
+
+// A checkpoint's value is a CheckpointHeader, then a CheckpointSector for each
+// sector, then a CheckpointDescriptor for each KeyDescriptor. Each
+// CheckpointDescriptor is followed by redundancy() addresses.
+struct CheckpointHeader {
+  uint32_t transaction_id;
+  uint16_t sector_size_bytes;
+  uint16_t sector_count;
+  uint16_t descriptor_count;
+  uint8_t redundancy;
+  uint8_t reserved;
+};
+
+struct CheckpointSector {
+  uint16_t written_bytes;
+  uint16_t reserved;
+  uint32_t newest_transaction_id;
+
+  // Transaction ID of the sector's first entry, which is used to detect sectors
+  // that were erased other than by the KVS.
+  uint32_t first_transaction_id;
+};
+
+struct CheckpointDescriptor {
+  uint32_t key_hash;
+  uint32_t transaction_id;
+  uint8_t state;
+  uint8_t address_count;
+  uint16_t entry_size;
+};
+
+static_assert(sizeof(CheckpointHeader) == 12u);
+static_assert(sizeof(CheckpointSector) == 12u);
+static_assert(sizeof(CheckpointDescriptor) == 12u);
+
+constexpr size_t CheckpointSize(size_t sectors,
+                                size_t descriptors,
+                                size_t redundancy) {
+  return sizeof(CheckpointHeader) + sectors * sizeof(CheckpointSector) +
+         descriptors * (sizeof(CheckpointDescriptor) +
+                        redundancy * sizeof(FlashPartition::Address));
+}
+
+// Reads the next part of a checkpoint's value.
+template <typename T>
+Status ReadCheckpointValue(const internal::Entry& checkpoint,
+                           size_t* offset,
+                           T* value) {
+  const StatusWithSize result =
+      checkpoint.ReadValue(as_writable_bytes(span(value, 1)), *offset);
+  *offset += sizeof(T);
+  return result.size() == sizeof(T) ? Status::OK : Status::DATA_LOSS;
+}
+
 }  // namespace
 
 KeyValueStore::KeyValueStore(FlashPartition* partition,
@@ -42,22 +174,60 @@ KeyValueStore::KeyValueStore(FlashPartition* partition,
                              Vector<SectorDescriptor>& sector_descriptor_list,
                              const SectorDescriptor** temp_sectors_to_skip,
                              Vector<KeyDescriptor>& key_descriptor_list,
-                             Address* addresses)
+                             Address* addresses,
+                             span<internal::EntryCache::IndexSlot> hash_index,
+                             span<internal::KeyCache::Slot> key_cache_slots,
+                             span<internal::EntryCache::KeyPrefix> key_prefixes)
     : partition_(*partition),
       formats_(formats),
-      sectors_(sector_descriptor_list, *partition, temp_sectors_to_skip),
-      entry_cache_(key_descriptor_list, addresses, redundancy),
+      sectors_(sector_descriptor_list,
+               *partition,
+               temp_sectors_to_skip,
+               options.gc_policy),
+      entry_cache_(key_descriptor_list,
+                   addresses,
+                   redundancy,
+                   hash_index,
+                   key_cache_slots,
+                   key_prefixes,
+                   options.chain_hash_collisions),
       options_(options),
       initialized_(false),
       error_detected_(false),
-      last_transaction_id_(0) {}
+      last_transaction_id_(0),
+      gc_sector_(nullptr),
+      gc_next_entry_(0),
+      gc_writable_bytes_(0),
+      erasing_sector_(nullptr),
+      verify_next_entry_(0),
+      repair_next_entry_(0),
+      repair_status_(Status::OK),
+      repair_failed_(false),
+      erase_epoch_(0),
+      stream_open_(false),
+      scratch_buffer_(),
+      current_time_(0),
+      checkpoint_partition_(nullptr),
+      checkpoint_address_(0),
+      checkpoint_sequence_(0),
+      checkpoint_transaction_id_(0),
+      has_checkpoint_(false) {}
 
 Status KeyValueStore::Init() {
+  if (stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  // Init reads every sector, so wait for an erase in progress. The sectors are
+  // rescanned, so the result of the erase does not matter.
+  if (erasing_sector_ != nullptr) {
+    partition_.WaitForErase();
+    erasing_sector_ = nullptr;
+  }
+
   initialized_ = false;
-  error_detected_ = false;
-  last_transaction_id_ = 0;
-  sectors_.Reset();
-  entry_cache_.Reset();
+  checkpoint_transaction_id_ = 0;
+  ResetInMemoryState();
 
   INF("Initializing key value store");
   if (partition_.sector_count() > sectors_.max_size()) {
@@ -79,15 +249,123 @@ Status KeyValueStore::Init() {
     return Status::FAILED_PRECONDITION;
   }
 
-  DBG("First pass: Read all entries from all sectors");
-  Address sector_address = 0;
+  if (formats_.primary().expiry) {
+    ERR("KVS init failed: the primary entry format must not store expiry "
+        "times");
+    return Status::FAILED_PRECONDITION;
+  }
+
+  if (checkpoint_partition_ != nullptr &&
+      (checkpoint_partition_->sector_count() < 2u ||
+       Entry::alignment_bytes(*checkpoint_partition_) >
+           internal::EntryWriter::kMaxAlignmentBytes)) {
+    ERR("KVS init failed: the checkpoint partition must have at least 2 "
+        "sectors and an alignment of at most %zu B",
+        internal::EntryWriter::kMaxAlignmentBytes);
+    return Status::FAILED_PRECONDITION;
+  }
 
   size_t total_corrupt_bytes = 0;
   int corrupt_entries = 0;
+  Status load_status = Status::NOT_FOUND;
+
+  if (checkpoint_partition_ != nullptr) {
+    load_status = LoadCheckpoint(&total_corrupt_bytes, &corrupt_entries);
+
+    if (!load_status.ok()) {
+      // A checkpoint that does not match the entries in flash must not be
+      // used, even if a later checkpoint happens to match.
+      if (has_checkpoint_) {
+        WRN("KVS init: unable to use checkpoint (%s); reading all entries",
+            load_status.str());
+        if (!InvalidateCheckpoints().ok()) {
+          ERR("KVS init failed: unable to erase the checkpoint partition");
+          return Status::UNKNOWN;
+        }
+      }
+
+      ResetInMemoryState();
+      total_corrupt_bytes = 0;
+      corrupt_entries = 0;
+    }
+  }
+
+  if (!load_status.ok()) {
+    TRY(LoadEntries(&total_corrupt_bytes, &corrupt_entries));
+  }
+
   bool empty_sector_found = false;
+  for (const SectorDescriptor& sector : sectors_) {
+    if (sector.Empty(sector_size_bytes)) {
+      empty_sector_found = true;
+    }
+  }
+
+  if (error_detected_ && options_.recovery == ErrorRecovery::kLazy) {
+    INF("KVS init: Corruption detected; MaintenanceStep will repair it");
+  } else if (error_detected_) {
+    Status recovery_status = RepairCorruption();
+    if (recovery_status.ok()) {
+      INF("KVS init: Corruption detected and fully repaired");
+    } else {
+      ERR("KVS init: Corruption detected and unable repair");
+    }
+  }
+
+  if (!empty_sector_found) {
+    // TODO: Record/report the error condition and recovery result.
+    Status gc_result = GarbageCollectPartial();
+
+    if (!gc_result.ok()) {
+      ERR("KVS init failed: Unable to maintain required free sector");
+      return Status::INTERNAL;
+    }
+  }
+
+  initialized_ = true;
+
+  INF("KeyValueStore init complete: active keys %zu, deleted keys %zu, sectors "
+      "%zu, logical sector size %zu bytes",
+      size(),
+      (entry_cache_.total_entries() - size()),
+      sectors_.size(),
+      partition_.sector_size_bytes());
+
+  if (total_corrupt_bytes > 0) {
+    WRN("Found %zu corrupt bytes and %d corrupt entries during init process; "
+        "some keys may be missing",
+        total_corrupt_bytes,
+        corrupt_entries);
+    return Status::DATA_LOSS;
+  }
+
+  return Status::OK;
+}
+
+void KeyValueStore::ResetInMemoryState() {
+  error_detected_ = false;
+  last_transaction_id_ = 0;
+  gc_sector_ = nullptr;
+  verify_next_entry_ = 0;
+  repair_next_entry_ = 0;
+  repair_status_ = Status::OK;
+  repair_failed_ = false;
+  sectors_.Reset();
+  entry_cache_.Reset();
+}
+
+// Reads the entries in each sector, starting after the sector's written bytes.
+// Normally, every sector is empty when this is called, so all entries are read.
+Status KeyValueStore::LoadEntries(size_t* total_corrupt_bytes,
+                                  int* corrupt_entries) {
+  const size_t sector_size_bytes = partition_.sector_size_bytes();
+
+  DBG("Reading entries from all sectors");
+  Address sector_address = 0;
 
   for (SectorDescriptor& sector : sectors_) {
-    Address entry_address = sector_address;
+    Address entry_address =
+        sector_address + sector_size_bytes - sector.writable_bytes();
 
     size_t sector_corrupt_bytes = 0;
 
@@ -105,8 +383,15 @@ Status KeyValueStore::Init() {
       Address next_entry_address;
       Status status = LoadEntry(entry_address, &next_entry_address);
       if (status == Status::NOT_FOUND) {
-        DBG("Hit un-written data in sector; moving to the next sector");
-        break;
+        if (!InterruptedWriteAt(partition_,
+                                entry_address,
+                                sector_address + sector_size_bytes)) {
+          DBG("Hit un-written data in sector; moving to the next sector");
+          break;
+        }
+        // A ValueWriter was interrupted before writing the entry's header, so
+        // the space after it is not erased. Treat it as a corrupt entry.
+        status = Status::DATA_LOSS;
       }
       if (status == Status::DATA_LOSS) {
         // The entry could not be read, indicating data corruption within the
@@ -116,7 +401,7 @@ Status KeyValueStore::Init() {
             size_t(entry_address));
 
         error_detected_ = true;
-        corrupt_entries++;
+        *corrupt_entries += 1;
 
         status = ScanForEntry(sector,
                               entry_address + Entry::kMinAlignmentBytes,
@@ -162,26 +447,27 @@ Status KeyValueStore::Init() {
           sector_corrupt_bytes);
     }
 
-    if (sector.Empty(sector_size_bytes)) {
-      empty_sector_found = true;
-    }
     sector_address += sector_size_bytes;
-    total_corrupt_bytes += sector_corrupt_bytes;
+    *total_corrupt_bytes += sector_corrupt_bytes;
   }
 
   DBG("Second pass: Count valid bytes in each sector");
   Address newest_key = 0;
 
-  // For every valid entry, count the valid bytes in that sector. Track which
+  // For every valid entry, count the valid bytes in that sector. Entry sizes
+  // are kept in the KeyDescriptors, so this does not read flash. Track which
   // entry has the newest transaction ID for initializing last_new_sector_.
   for (const EntryMetadata& metadata : entry_cache_) {
+    if (metadata.addresses().empty()) {
+      // Only possible if a checkpoint's entries were erased without a record.
+      ERR("Key 0x%08" PRIx32 " has no entries", metadata.hash());
+      return Status::DATA_LOSS;
+    }
     if (metadata.addresses().size() < redundancy()) {
       error_detected_ = true;
     }
     for (Address address : metadata.addresses()) {
-      Entry entry;
-      TRY(Entry::Read(partition_, address, formats_, &entry));
-      sectors_.FromAddress(address).AddValidBytes(entry.size());
+      sectors_.FromAddress(address).AddValidBytes(metadata.entry_size());
     }
     if (metadata.IsNewerThan(last_transaction_id_)) {
       last_transaction_id_ = metadata.transaction_id();
@@ -190,43 +476,6 @@ Status KeyValueStore::Init() {
   }
 
   sectors_.set_last_new_sector(newest_key);
-
-  if (error_detected_) {
-    Status recovery_status = Repair();
-    if (recovery_status.ok()) {
-      INF("KVS init: Corruption detected and fully repaired");
-    } else {
-      ERR("KVS init: Corruption detected and unable repair");
-    }
-  }
-
-  if (!empty_sector_found) {
-    // TODO: Record/report the error condition and recovery result.
-    Status gc_result = GarbageCollectPartial();
-
-    if (!gc_result.ok()) {
-      ERR("KVS init failed: Unable to maintain required free sector");
-      return Status::INTERNAL;
-    }
-  }
-
-  initialized_ = true;
-
-  INF("KeyValueStore init complete: active keys %zu, deleted keys %zu, sectors "
-      "%zu, logical sector size %zu bytes",
-      size(),
-      (entry_cache_.total_entries() - size()),
-      sectors_.size(),
-      partition_.sector_size_bytes());
-
-  if (total_corrupt_bytes > 0) {
-    WRN("Found %zu corrupt bytes and %d corrupt entries during init process; "
-        "some keys may be missing",
-        total_corrupt_bytes,
-        corrupt_entries);
-    return Status::DATA_LOSS;
-  }
-
   return Status::OK;
 }
 
@@ -260,18 +509,129 @@ Status KeyValueStore::LoadEntry(Address entry_address,
   Entry entry;
   TRY(Entry::Read(partition_, entry_address, formats_, &entry));
 
+  if (entry.batched()) {
+    return LoadBatch(entry, next_entry_address);
+  }
+  return AddEntryToCache(entry, next_entry_address);
+}
+
+// Loads the entries of a batch written by Commit. The entries are only loaded
+// if they are followed in the same sector by a commit marker with the batch's
+// transaction ID and entry count. Otherwise, the batch was interrupted before
+// it was committed, and its entries are skipped.
+Status KeyValueStore::LoadBatch(const Entry& first_entry,
+                                Address* next_entry_address) {
+  if (first_entry.batch_commit()) {
+    // A commit marker whose entries were skipped or not loaded as a batch.
+    TRY(first_entry.VerifyChecksumInFlash(scratch_buffer_));
+    *next_entry_address = first_entry.next_address();
+    return Status::OK;
+  }
+
+  const uint32_t transaction_id = first_entry.transaction_id();
+  const SectorDescriptor& sector = sectors_.FromAddress(first_entry.address());
+
+  // Find the commit marker by reading the headers that follow the first entry.
+  Entry entry = first_entry;
+  size_t entry_count = 0;
+  bool committed = false;
+  Address batch_end = 0;
+
+  while (true) {
+    entry_count += 1;
+    *next_entry_address = entry.next_address();
+
+    if (!sectors_.AddressInSector(sector, *next_entry_address) ||
+        !Entry::Read(partition_, *next_entry_address, formats_, &entry).ok() ||
+        !entry.batched() || entry.transaction_id() != transaction_id) {
+      break;
+    }
+
+    if (entry.batch_commit()) {
+      uint16_t committed_count;
+      committed = entry.value_size() == sizeof(committed_count) &&
+                  entry.ReadValue(as_writable_bytes(span(&committed_count, 1)))
+                      .ok() &&
+                  committed_count == entry_count &&
+                  entry.VerifyChecksumInFlash(scratch_buffer_).ok();
+      batch_end = entry.next_address();
+      break;
+    }
+  }
+
+  if (!committed) {
+    WRN("Skipping %zu entries from uncommitted batch %u",
+        entry_count,
+        unsigned(transaction_id));
+    // Never reuse the ID of the skipped batch. Another batch with the same ID
+    // could otherwise be written after it in this sector.
+    last_transaction_id_ = std::max(last_transaction_id_, transaction_id);
+    return Status::OK;
+  }
+
+  // The batch was committed, so load each of its entries.
+  Address address = first_entry.address();
+  for (size_t i = 0; i < entry_count; ++i) {
+    TRY(Entry::Read(partition_, address, formats_, &entry));
+    TRY(AddEntryToCache(entry, &address));
+  }
+
+  *next_entry_address = batch_end;
+  return Status::OK;
+}
+
+Status KeyValueStore::AddEntryToCache(const Entry& entry,
+                                      Address* next_entry_address) {
   // Read the key from flash & validate the entry (which reads the value).
   Entry::KeyBuffer key_buffer;
   TRY_ASSIGN(size_t key_length, entry.ReadKey(key_buffer));
   const string_view key(key_buffer.data(), key_length);
 
-  TRY(entry.VerifyChecksumInFlash());
+  TRY(entry.VerifyChecksumInFlash(scratch_buffer_));
 
   // A valid entry was found, so update the next entry address before doing any
   // of the checks that happen in AddNewOrUpdateExisting.
   *next_entry_address = entry.next_address();
-  return entry_cache_.AddNewOrUpdateExisting(
-      entry.descriptor(key), entry.address(), partition_.sector_size_bytes());
+  sectors_.FromAddress(entry.address())
+      .UpdateNewestTransactionId(entry.transaction_id());
+
+  KeyDescriptor descriptor = entry.descriptor(key);
+  descriptor.verified = true;
+
+  // A key whose entry has already expired is loaded as deleted.
+  if (entry.expired(current_time_)) {
+    descriptor.state = EntryState::kDeleted;
+  }
+
+  // An appended entry extends the key's entry that precedes it in the sector,
+  // which was loaded first. The entries are accounted for as one.
+  if (entry.appended()) {
+    internal::AppendHeader header;
+    TRY(entry.ReadAppendHeader(&header));
+
+    EntryMetadata previous;
+    const Status status = entry_cache_.Find(partition_, key, &previous);
+    if (status.ok() &&
+        previous.transaction_id() >= entry.transaction_id()) {
+      return Status::OK;  // A newer entry, or the relocated chain, was loaded.
+    }
+    if (!status.ok() ||
+        previous.transaction_id() != header.previous_transaction_id ||
+        previous.first_address() != header.previous_address) {
+      ERR("Appended entry for key 0x%08" PRIx32 " at address %u does not "
+          "follow the key's entry",
+          descriptor.key_hash,
+          unsigned(entry.address()));
+      return Status::DATA_LOSS;
+    }
+    descriptor.entry_size = previous.entry_size() + entry.size();
+  }
+
+  return entry_cache_.AddNewOrUpdateExisting(descriptor,
+                                             entry.address(),
+                                             partition_.sector_size_bytes(),
+                                             key,
+                                             &partition_);
 }
 
 // Scans flash memory within a sector to find a KVS entry magic.
@@ -307,19 +667,32 @@ StatusWithSize KeyValueStore::Get(string_view key,
   TRY_WITH_SIZE(CheckOperation(key));
 
   EntryMetadata metadata;
-  TRY_WITH_SIZE(entry_cache_.FindExisting(partition_, key, &metadata));
+  TRY_WITH_SIZE(FindExisting(key, &metadata));
 
   return Get(key, metadata, value_buffer, offset_bytes);
 }
 
-Status KeyValueStore::PutBytes(string_view key, span<const byte> value) {
+Status KeyValueStore::PutBytes(string_view key,
+                               span<const byte> value,
+                               uint32_t expiry_time) {
   DBG("Writing key/value; key length=%zu, value length=%zu",
       key.size(),
       value.size());
 
   TRY(CheckOperation(key));
 
-  if (Entry::size(partition_, key, value) > partition_.sector_size_bytes()) {
+  size_t stored_size = value.size();
+  if (expiry_time != Entry::kNoExpiry) {
+    if (!formats_.HasExpiry()) {
+      ERR("Cannot write an entry with an expiry time: no entry format stores "
+          "expiry times");
+      return Status::FAILED_PRECONDITION;
+    }
+    stored_size += Entry::kExpirySize;
+  }
+
+  if (Entry::size(partition_, key, stored_size) >
+      partition_.sector_size_bytes()) {
     DBG("%zu B value with %zu B key cannot fit in one sector",
         value.size(),
         key.size());
@@ -335,11 +708,12 @@ Status KeyValueStore::PutBytes(string_view key, span<const byte> value) {
         metadata.hash(),
         metadata.addresses().size(),
         sectors_.Index(metadata.first_address()));
-    return WriteEntryForExistingKey(metadata, EntryState::kValid, key, value);
+    return WriteEntryForExistingKey(
+        metadata, EntryState::kValid, key, value, expiry_time);
   }
 
   if (status == Status::NOT_FOUND) {
-    return WriteEntryForNewKey(key, value);
+    return WriteEntryForNewKey(key, value, expiry_time);
   }
 
   return status;
@@ -349,7 +723,7 @@ Status KeyValueStore::Delete(string_view key) {
   TRY(CheckOperation(key));
 
   EntryMetadata metadata;
-  TRY(entry_cache_.FindExisting(partition_, key, &metadata));
+  TRY(FindExisting(key, &metadata));
 
   // TODO: figure out logging how to support multiple addresses.
   DBG("Writing tombstone for key 0x%08" PRIx32 " in %zu sectors including %u",
@@ -359,42 +733,201 @@ Status KeyValueStore::Delete(string_view key) {
   return WriteEntryForExistingKey(metadata, EntryState::kDeleted, key, {});
 }
 
-void KeyValueStore::Item::ReadKey() {
+Status KeyValueStore::Append(string_view key, span<const byte> data) {
+  TRY(CheckOperation(key));
+
+  EntryMetadata metadata;
+  const Status status = FindExisting(key, &metadata);
+  if (status == Status::NOT_FOUND) {
+    return PutBytes(key, data);
+  }
+  TRY(status);
+
+  const size_t alignment = Entry::alignment_bytes(partition_);
+  if (alignment > internal::EntryWriter::kMaxAlignmentBytes) {
+    ERR("%zu B alignment is too large for Append", alignment);
+    return Status::UNIMPLEMENTED;
+  }
+
+  TRY_ASSIGN(const size_t old_value_size, ValueSize(metadata));
+  const size_t value_size = old_value_size + data.size();
+  const size_t entry_size = Entry::size(partition_, key, value_size);
+
+  if (entry_size > partition_.sector_size_bytes()) {
+    DBG("%zu B value with %zu B key cannot fit in one sector",
+        value_size,
+        key.size());
+    return Status::INVALID_ARGUMENT;
+  }
+
+  Entry entry;
+  TRY(Entry::Read(partition_, metadata.first_address(), formats_, &entry));
+
+  internal::AppendHeader header{};
+  if (entry.appended()) {
+    TRY(entry.ReadAppendHeader(&header));
+  }
+
+  // Write only the data if it fits after the key's entry. Otherwise, rewrite
+  // the whole value.
+  const size_t appended_size =
+      Entry::size(partition_, key, sizeof(header) + data.size());
+
+  if (redundancy() == 1u && header.chain_length < kMaxAppendedEntries &&
+      appended_size < entry_size &&
+      sectors_.FromAddress(entry.address()).HasSpace(appended_size)) {
+    return WriteAppendedEntry(
+        metadata, key, data, value_size, header.chain_length + 1);
+  }
+  return WriteCombinedEntry(metadata, key, data, value_size);
+}
+
+Status KeyValueStore::WriteBatch::Add(string_view key,
+                                      span<const byte> value,
+                                      EntryState state) {
+  if (InvalidKey(key)) {
+    return Status::INVALID_ARGUMENT;
+  }
+  if (operations_.full()) {
+    return Status::RESOURCE_EXHAUSTED;
+  }
+  operations_.push_back(Operation{key, value, state, false, {}, 0});
+  return Status::OK;
+}
+
+Status KeyValueStore::Commit(WriteBatch& batch) {
+  if (!initialized() || stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+  if (batch.empty()) {
+    return Status::OK;
+  }
+
+  DBG("Committing batch of %zu operations", batch.size());
+
+  size_t batch_size;
+  TRY(PrepareBatch(batch, &batch_size));
+
+  // Reserve space for the entire batch, including its commit marker, in a
+  // single sector for each redundant copy.
+  Address* reserved_addresses = entry_cache_.TempReservedAddressesForWrite();
+
+  for (size_t i = 0; i < redundancy(); i++) {
+    SectorDescriptor* sector;
+    TRY(GetSectorForWrite(&sector, batch_size, span(reserved_addresses, i)));
+
+    DBG("Found space for batch in sector %u", sectors_.Index(sector));
+    reserved_addresses[i] = sectors_.NextWritableAddress(*sector);
+  }
+
+  // All entries in the batch share one transaction ID. As in CreateEntry, the
+  // ID is burned even if the batch is not written successfully.
+  last_transaction_id_ += 1;
+
+  TRY(AppendBatch(batch, reserved_addresses[0]));
+
+  // After the first copy of the batch is committed, update the key descriptors.
+  for (WriteBatch::Operation& op : batch.operations_) {
+    op.metadata = UpdateKeyDescriptor(
+        KeyDescriptor{
+            internal::Hash(op.key),
+            last_transaction_id_,
+            op.state,
+            false,
+            static_cast<uint16_t>(Entry::size(partition_, op.key, op.value))},
+        op.key,
+        op.address,
+        op.new_key ? nullptr : &op.metadata);
+  }
+
+  // Write the additional copies of the batch, if redundancy is greater than 1.
+  for (size_t i = 1; i < redundancy(); ++i) {
+    TRY(AppendBatch(batch, reserved_addresses[i]));
+
+    for (WriteBatch::Operation& op : batch.operations_) {
+      op.metadata.AddNewAddress(op.address);
+    }
+  }
+
+  CheckpointIfDue();
+  return Status::OK;
+}
+
+string_view KeyValueStore::Item::ReadKey() {
+  if (key_length_ != 0u) {
+    return string_view(key_buffer_.data(), key_length_);
+  }
+
   key_buffer_.fill('\0');
 
+  if (string_view key = kvs_.entry_cache_.CachedKey(*iterator_); !key.empty()) {
+    std::copy(key.begin(), key.end(), key_buffer_.begin());
+    key_length_ = key.size();
+    return key;
+  }
+
   Entry entry;
-  // TODO: add support for using one of the redundant entries if reading the
-  // first copy fails.
-  if (Entry::Read(
-          kvs_.partition_, iterator_->first_address(), kvs_.formats_, &entry)
-          .ok()) {
-    entry.ReadKey(key_buffer_);
+  if (kvs_.ReadEntry(*iterator_, entry).ok()) {
+    if (StatusWithSize result = entry.ReadKey(key_buffer_); result.ok()) {
+      key_length_ = result.size();
+      const string_view key(key_buffer_.data(), key_length_);
+      kvs_.entry_cache_.CacheKey(*iterator_, key);
+      kvs_.entry_cache_.SetKeyPrefix(*iterator_, key);
+    }
   }
+  return string_view(key_buffer_.data(), key_length_);
 }
 
 KeyValueStore::iterator& KeyValueStore::iterator::operator++() {
-  // Skip to the next entry that is valid (not deleted).
-  while (++item_.iterator_ != item_.kvs_.entry_cache_.end() &&
-         item_.iterator_->state() != EntryState::kValid) {
-  }
+  ++item_.iterator_;
+  SkipNonMatching();
   return *this;
 }
 
-KeyValueStore::iterator KeyValueStore::begin() const {
-  internal::EntryCache::iterator cache_iterator = entry_cache_.begin();
-  // Skip over any deleted entries at the start of the descriptor list.
-  while (cache_iterator != entry_cache_.end() &&
-         cache_iterator->state() != EntryState::kValid) {
-    ++cache_iterator;
+// Skips to the next entry that is valid (not deleted or expired) and starts
+// with the prefix, if the current entry does not. Only reads keys from flash if
+// the key prefix table cannot rule them out. Expired keys are marked deleted,
+// as they are by lookups.
+void KeyValueStore::iterator::SkipNonMatching() {
+  using PrefixMatch = internal::EntryCache::PrefixMatch;
+  const internal::EntryCache& entry_cache = item_.kvs_.entry_cache_;
+
+  for (; item_.iterator_ != entry_cache.end(); ++item_.iterator_) {
+    item_.key_length_ = 0;
+
+    if (item_.iterator_->state() != EntryState::kValid) {
+      continue;
+    }
+
+    bool matches = false;
+    switch (entry_cache.MatchPrefix(*item_.iterator_, prefix_)) {
+      case PrefixMatch::kYes:
+        matches = true;
+        break;
+      case PrefixMatch::kNo:
+        break;
+      case PrefixMatch::kMaybe:
+        matches = item_.ReadKey().substr(0, prefix_.size()) == prefix_;
+        break;
+    }
+
+    if (matches && !item_.kvs_.MarkDeletedIfExpired(*item_.iterator_)) {
+      return;
+    }
   }
-  return iterator(*this, cache_iterator);
+}
+
+KeyValueStore::iterator KeyValueStore::begin(string_view prefix) const {
+  iterator it(*this, entry_cache_.begin(), prefix);
+  it.SkipNonMatching();
+  return it;
 }
 
 StatusWithSize KeyValueStore::ValueSize(string_view key) const {
   TRY_WITH_SIZE(CheckOperation(key));
 
   EntryMetadata metadata;
-  TRY_WITH_SIZE(entry_cache_.FindExisting(partition_, key, &metadata));
+  TRY_WITH_SIZE(FindExisting(key, &metadata));
 
   return ValueSize(metadata);
 }
@@ -403,14 +936,57 @@ StatusWithSize KeyValueStore::Get(string_view key,
                                   const EntryMetadata& metadata,
                                   span<std::byte> value_buffer,
                                   size_t offset_bytes) const {
+  // Copies are read in order, so the first copy is the only one read unless it
+  // is corrupt. If every copy fails, the first copy's error is reported.
+  StatusWithSize result;
+  for (size_t i = 0; i < metadata.addresses().size(); ++i) {
+    const StatusWithSize copy_result = GetCopy(
+        key, metadata, metadata.addresses()[i], value_buffer, offset_bytes);
+    if (!TryOtherCopies(copy_result.status())) {
+      if (i != 0u) {
+        PreferCopy(metadata, i);
+      }
+      return copy_result;
+    }
+    if (i == 0u) {
+      result = copy_result;
+    }
+  }
+  return result;
+}
+
+StatusWithSize KeyValueStore::GetCopy(string_view key,
+                                      const EntryMetadata& metadata,
+                                      Address address,
+                                      span<std::byte> value_buffer,
+                                      size_t offset_bytes) const {
   Entry entry;
-  // TODO: add support for using one of the redundant entries if reading the
-  // first copy fails.
-  TRY_WITH_SIZE(
-      Entry::Read(partition_, metadata.first_address(), formats_, &entry));
+  TRY_WITH_SIZE(Entry::Read(partition_, address, formats_, &entry));
+
+  if (entry.appended()) {
+    return GetAppended(key, metadata, entry, value_buffer, offset_bytes);
+  }
+
+  if (entry.compressed()) {
+    span<const byte> data;
+    const StatusWithSize value_size =
+        ReadCompressedValue(key, metadata, entry, &data);
+    TRY_WITH_SIZE(value_size);
+
+    if (offset_bytes > value_size.size()) {
+      return StatusWithSize::OUT_OF_RANGE;
+    }
+
+    StatusWithSize result =
+        entry.compression()->Decompress(data, value_buffer, offset_bytes);
+    if (result.ok() && offset_bytes + result.size() != value_size.size()) {
+      return StatusWithSize::DATA_LOSS;
+    }
+    return result;
+  }
 
   StatusWithSize result = entry.ReadValue(value_buffer, offset_bytes);
-  if (result.ok() && options_.verify_on_read && offset_bytes == 0u) {
+  if (result.ok() && VerifyOnRead(metadata) && offset_bytes == 0u) {
     Status verify_result =
         entry.VerifyChecksum(key, value_buffer.first(result.size()));
     if (!verify_result.ok()) {
@@ -418,18 +994,295 @@ StatusWithSize KeyValueStore::Get(string_view key,
       return StatusWithSize(verify_result, 0);
     }
 
+    metadata.set_verified(true);
     return StatusWithSize(verify_result, result.size());
   }
   return result;
 }
 
+Status KeyValueStore::GetView(string_view key,
+                              span<const byte>* value) const {
+  TRY(CheckOperation(key));
+
+  EntryMetadata metadata;
+  TRY(FindExisting(key, &metadata));
+
+  Status result;
+  for (size_t i = 0; i < metadata.addresses().size(); ++i) {
+    const Status copy_result =
+        GetViewOfCopy(key, metadata, metadata.addresses()[i], value);
+    if (!TryOtherCopies(copy_result)) {
+      if (i != 0u) {
+        PreferCopy(metadata, i);
+      }
+      return copy_result;
+    }
+    if (i == 0u) {
+      result = copy_result;
+    }
+  }
+  return result;
+}
+
+Status KeyValueStore::GetViewOfCopy(string_view key,
+                                    const EntryMetadata& metadata,
+                                    Address address,
+                                    span<const byte>* value) const {
+  Entry entry;
+  TRY(Entry::Read(partition_, address, formats_, &entry));
+
+  if (entry.compressed() || entry.appended()) {
+    return Status::UNIMPLEMENTED;
+  }
+
+  const byte* data =
+      partition_.PartitionAddressToMcuAddress(entry.value_address());
+  if (data == nullptr) {
+    return Status::UNIMPLEMENTED;
+  }
+
+  const span<const byte> view(data, entry.value_size());
+  if (VerifyOnRead(metadata)) {
+    TRY(entry.VerifyChecksum(key, view));
+    metadata.set_verified(true);
+  }
+
+  *value = view;
+  return Status::OK;
+}
+
+// Compresses the value into the compression working buffer if the primary
+// entry format has a compression algorithm and the compressed entry is smaller.
+// Returns the value to write, which is the original value if it was not
+// compressed.
+span<const byte> KeyValueStore::CompressValue(string_view key,
+                                              span<const byte> value,
+                                              bool* compressed) const {
+  *compressed = false;
+
+  const CompressionAlgorithm* compression = formats_.primary().compression;
+  if (compression == nullptr) {
+    return value;
+  }
+
+  // The decompressed size is stored before the compressed data.
+  const span<byte> buffer = compression->working_buffer();
+  const uint16_t value_size = value.size();
+  if (buffer.size() <= sizeof(value_size)) {
+    return value;
+  }
+
+  const StatusWithSize result =
+      compression->Compress(value, buffer.subspan(sizeof(value_size)));
+  if (!result.ok()) {
+    return value;  // The compressed value does not fit in the buffer.
+  }
+
+  const span<const byte> compressed_value =
+      buffer.first(sizeof(value_size) + result.size());
+  if (Entry::size(partition_, key, compressed_value) >=
+      Entry::size(partition_, key, value)) {
+    return value;
+  }
+
+  std::memcpy(buffer.data(), &value_size, sizeof(value_size));
+  *compressed = true;
+  return compressed_value;
+}
+
+// Reads a compressed value into the compression working buffer and verifies
+// it. Sets data to the compressed data and returns the decompressed size.
+StatusWithSize KeyValueStore::ReadCompressedValue(
+    string_view key,
+    const EntryMetadata& metadata,
+    const Entry& entry,
+    span<const byte>* data,
+    bool verify) const {
+  uint16_t value_size;
+  const span<byte> buffer = entry.compression()->working_buffer();
+  if (entry.value_size() < sizeof(value_size)) {
+    return StatusWithSize::DATA_LOSS;
+  }
+  if (entry.value_size() > buffer.size()) {
+    ERR("Compressed value for key 0x%08" PRIx32 " does not fit in the "
+        "compression working buffer",
+        metadata.hash());
+    return StatusWithSize::INTERNAL;
+  }
+
+  const span<byte> compressed = buffer.first(entry.value_size());
+  TRY_WITH_SIZE(entry.ReadValue(compressed));
+
+  // The whole value was read, so verify it now, even if reading at an offset.
+  if (verify && VerifyOnRead(metadata)) {
+    TRY_WITH_SIZE(entry.VerifyChecksum(key, compressed));
+    metadata.set_verified(true);
+  }
+
+  std::memcpy(&value_size, compressed.data(), sizeof(value_size));
+  *data = compressed.subspan(sizeof(value_size));
+  return StatusWithSize(value_size);
+}
+
+// Finds the entries in the append chain that ends with the entry, oldest first,
+// and returns how many there are. An entry that is not appended is a chain of
+// one. Each entry's checksum is verified if verify is true.
+StatusWithSize KeyValueStore::FindAppendChain(const Entry& newest,
+                                              AppendChain& chain,
+                                              bool verify) const {
+  const SectorDescriptor& sector = sectors_.FromAddress(newest.address());
+  Entry entry = newest;
+  size_t length = 0;
+
+  while (true) {
+    if (length == chain.size()) {
+      return StatusWithSize::DATA_LOSS;
+    }
+    if (verify) {
+      TRY_WITH_SIZE(entry.VerifyChecksumInFlash(scratch_buffer_));
+    }
+
+    chain[length++] = entry.address();
+    if (!entry.appended()) {
+      break;
+    }
+
+    // Each entry refers to an earlier entry in the same sector.
+    internal::AppendHeader header;
+    TRY_WITH_SIZE(entry.ReadAppendHeader(&header));
+    if (header.previous_address >= entry.address() ||
+        !sectors_.AddressInSector(sector, header.previous_address)) {
+      return StatusWithSize::DATA_LOSS;
+    }
+
+    TRY_WITH_SIZE(
+        Entry::Read(partition_, header.previous_address, formats_, &entry));
+    if (entry.transaction_id() != header.previous_transaction_id) {
+      return StatusWithSize::DATA_LOSS;
+    }
+  }
+
+  std::reverse(chain.begin(), chain.begin() + length);
+  return StatusWithSize(length);
+}
+
+// Writes the value stored in an append chain to the output, starting
+// offset_bytes into the value. The entries are not verified.
+Status KeyValueStore::ReadAppendChain(string_view key,
+                                      const EntryMetadata& metadata,
+                                      span<const Address> chain,
+                                      size_t offset_bytes,
+                                      Output& output) const {
+  std::array<byte, 4 * Entry::kMinAlignmentBytes> buffer;
+
+  for (Address address : chain) {
+    Entry entry;
+    TRY(Entry::Read(partition_, address, formats_, &entry));
+
+    if (entry.compressed()) {
+      span<const byte> data;
+      TRY_ASSIGN(const size_t value_size,
+                 ReadCompressedValue(key, metadata, entry, &data, false));
+
+      for (size_t offset = offset_bytes; offset < value_size;) {
+        const StatusWithSize result =
+            entry.compression()->Decompress(data, buffer, offset);
+        if (!result.ok() && result.status() != Status::RESOURCE_EXHAUSTED) {
+          return result.status();
+        }
+        if (result.size() == 0u) {
+          return Status::DATA_LOSS;
+        }
+        TRY(output.Write(span(buffer).first(result.size())));
+        offset += result.size();
+      }
+
+      offset_bytes -= std::min(offset_bytes, value_size);
+      continue;
+    }
+
+    // An appended entry's data follows its AppendHeader.
+    const size_t start = entry.appended() ? sizeof(internal::AppendHeader) : 0;
+    const size_t size = entry.value_size() - start;
+    if (offset_bytes >= size) {
+      offset_bytes -= size;
+      continue;
+    }
+
+    Address read_address = entry.value_address() + start + offset_bytes;
+    const Address end = entry.value_address() + entry.value_size();
+    offset_bytes = 0;
+
+    while (read_address < end) {
+      const span<byte> chunk =
+          span(buffer).first(std::min(size_t(end - read_address),
+                                      buffer.size()));
+      TRY(partition_.Read(read_address, chunk));
+      TRY(output.Write(chunk));
+      read_address += chunk.size();
+    }
+  }
+
+  return Status::OK;
+}
+
+StatusWithSize KeyValueStore::GetAppended(string_view key,
+                                          const EntryMetadata& metadata,
+                                          const Entry& newest,
+                                          span<byte> value_buffer,
+                                          size_t offset_bytes) const {
+  internal::AppendHeader header;
+  TRY_WITH_SIZE(newest.ReadAppendHeader(&header));
+  if (offset_bytes > header.value_size) {
+    return StatusWithSize::OUT_OF_RANGE;
+  }
+
+  // Verify the whole chain before reading, since reading a compressed entry
+  // does not update the checksum.
+  const bool verify = VerifyOnRead(metadata);
+  AppendChain chain;
+  const StatusWithSize length = FindAppendChain(newest, chain, verify);
+  TRY_WITH_SIZE(length);
+  if (verify) {
+    metadata.set_verified(true);
+  }
+
+  BufferOutput output(value_buffer);
+  const Status status = ReadAppendChain(
+      key, metadata, span(chain).first(length.size()), offset_bytes, output);
+  return StatusWithSize(status, output.size());
+}
+
+bool KeyValueStore::VerifyOnRead(const EntryMetadata& metadata) const {
+  if (!options_.verify_on_read) {
+    return false;
+  }
+
+  // Memory-mapped flash is read directly, so an entry that was verified since
+  // Init reads the same bytes every time and need not be verified again.
+  return !(options_.verify_once_on_read && metadata.verified() &&
+           partition_.PartitionAddressToMcuAddress(metadata.first_address()) !=
+               nullptr);
+}
+
+bool KeyValueStore::ReadsModifyState() const {
+  // Reads may cache keys or key prefixes, mark entries as verified, update the
+  // state of the checksum algorithm, decompress values in the compression
+  // algorithm's working buffer, reorder the copies of a redundant entry, or
+  // mark expired keys deleted.
+  return entry_cache_.key_cache_enabled() ||
+         entry_cache_.key_prefixes_enabled() || redundancy() > 1u ||
+         options_.verify_on_read || formats_.HasCompression() ||
+         formats_.HasExpiry();
+}
+
 Status KeyValueStore::FixedSizeGet(std::string_view key,
                                    void* value,
                                    size_t size_bytes) const {
   TRY(CheckOperation(key));
 
   EntryMetadata metadata;
-  TRY(entry_cache_.FindExisting(partition_, key, &metadata));
+  TRY(FindExisting(key, &metadata));
 
   return FixedSizeGet(key, metadata, value, size_bytes);
 }
@@ -455,19 +1308,88 @@ Status KeyValueStore::FixedSizeGet(std::string_view key,
 
 StatusWithSize KeyValueStore::ValueSize(const EntryMetadata& metadata) const {
   Entry entry;
-  // TODO: add support for using one of the redundant entries if reading the
-  // first copy fails.
-  TRY_WITH_SIZE(
-      Entry::Read(partition_, metadata.first_address(), formats_, &entry));
+  TRY_WITH_SIZE(ReadEntry(metadata, entry));
+
+  // An appended entry records the size of the whole value.
+  if (entry.appended()) {
+    internal::AppendHeader header;
+    TRY_WITH_SIZE(entry.ReadAppendHeader(&header));
+    return StatusWithSize(header.value_size);
+  }
+
+  // A compressed value starts with its decompressed size.
+  if (entry.compressed()) {
+    uint16_t value_size;
+    TRY_WITH_SIZE(partition_.Read(
+        entry.value_address(), sizeof(value_size), &value_size));
+    return StatusWithSize(value_size);
+  }
 
   return StatusWithSize(entry.value_size());
 }
 
+Status KeyValueStore::ReadEntry(const EntryMetadata& metadata,
+                               Entry& entry) const {
+  Status result;
+  for (size_t i = 0; i < metadata.addresses().size(); ++i) {
+    const Status copy_result =
+        Entry::Read(partition_, metadata.addresses()[i], formats_, &entry);
+    if (copy_result.ok()) {
+      if (i != 0u) {
+        PreferCopy(metadata, i);
+      }
+      return Status::OK;
+    }
+    if (i == 0u) {
+      result = copy_result;
+    }
+  }
+  return result;
+}
+
+Status KeyValueStore::FindExisting(string_view key,
+                                   EntryMetadata* metadata) const {
+  TRY(entry_cache_.FindExisting(partition_, key, metadata));
+  return MarkDeletedIfExpired(*metadata) ? Status::NOT_FOUND : Status::OK;
+}
+
+bool KeyValueStore::MarkDeletedIfExpired(const EntryMetadata& metadata) const {
+  if (!formats_.HasExpiry()) {
+    return false;
+  }
+
+  // Expiry times are not kept in memory, so read the entry's header. A key
+  // whose entry has expired is marked deleted, so that it is skipped from then
+  // on without reading flash. Errors are left for the caller's read to report.
+  Entry entry;
+  if (!ReadEntry(metadata, entry).ok() || !entry.expired(current_time_)) {
+    return false;
+  }
+
+  DBG("Entry for key 0x%08" PRIx32 " expired at %u",
+      metadata.hash(),
+      unsigned(entry.expiry_time()));
+  metadata.set_state(EntryState::kDeleted);
+  return true;
+}
+
+void KeyValueStore::PreferCopy(const EntryMetadata& metadata,
+                               size_t index) const {
+  WRN("Key 0x%08" PRIx32 " was read from redundant copy %zu at address %u",
+      metadata.hash(),
+      index,
+      unsigned(metadata.addresses()[index]));
+  std::swap(metadata.addresses()[0], metadata.addresses()[index]);
+
+  // The copies that were read first are corrupt and need repair.
+  error_detected_ = true;
+}
+
 Status KeyValueStore::CheckOperation(string_view key) const {
   if (InvalidKey(key)) {
     return Status::INVALID_ARGUMENT;
   }
-  if (!initialized()) {
+  if (!initialized() || stream_open_) {
     return Status::FAILED_PRECONDITION;
   }
   return Status::OK;
@@ -476,33 +1398,39 @@ Status KeyValueStore::CheckOperation(string_view key) const {
 Status KeyValueStore::WriteEntryForExistingKey(EntryMetadata& metadata,
                                                EntryState new_state,
                                                string_view key,
-                                               span<const byte> value) {
-  // Read the original entry to get the size for sector accounting purposes.
-  Entry entry;
-  // TODO: add support for using one of the redundant entries if reading the
-  // first copy fails.
-  TRY(Entry::Read(partition_, metadata.first_address(), formats_, &entry));
-
-  return WriteEntry(key, value, new_state, &metadata, entry.size());
+                                               span<const byte> value,
+                                               uint32_t expiry_time) {
+  return WriteEntry(key, value, new_state, &metadata, expiry_time);
 }
 
 Status KeyValueStore::WriteEntryForNewKey(string_view key,
-                                          span<const byte> value) {
+                                          span<const byte> value,
+                                          uint32_t expiry_time) {
   if (entry_cache_.full()) {
     WRN("KVS full: trying to store a new entry, but can't. Have %zu entries",
         entry_cache_.total_entries());
     return Status::RESOURCE_EXHAUSTED;
   }
 
-  return WriteEntry(key, value, EntryState::kValid);
+  return WriteEntry(key, value, EntryState::kValid, nullptr, expiry_time);
 }
 
 Status KeyValueStore::WriteEntry(string_view key,
                                  span<const byte> value,
                                  EntryState new_state,
                                  EntryMetadata* prior_metadata,
-                                 size_t prior_size) {
-  const size_t entry_size = Entry::size(partition_, key, value);
+                                 uint32_t expiry_time) {
+  // Entries with an expiry time are written in the expiring format, which is
+  // not compressed.
+  const bool expires = expiry_time != Entry::kNoExpiry;
+
+  bool compressed = false;
+  if (new_state == EntryState::kValid && !expires) {
+    value = CompressValue(key, value, &compressed);
+  }
+
+  const size_t entry_size = Entry::size(
+      partition_, key, value.size() + (expires ? Entry::kExpirySize : 0u));
 
   // List of addresses for sectors with space for this entry.
   Address* reserved_addresses = entry_cache_.TempReservedAddressesForWrite();
@@ -518,13 +1446,14 @@ Status KeyValueStore::WriteEntry(string_view key,
   }
 
   // Write the entry at the first address that was found.
-  Entry entry = CreateEntry(reserved_addresses[0], key, value, new_state);
+  Entry entry = CreateEntry(
+      reserved_addresses[0], key, value, new_state, compressed, expiry_time);
   TRY(AppendEntry(entry, key, value));
 
   // After writing the first entry successfully, update the key descriptors.
   // Once a single new the entry is written, the old entries are invalidated.
-  EntryMetadata new_metadata =
-      UpdateKeyDescriptor(entry, key, prior_metadata, prior_size);
+  EntryMetadata new_metadata = UpdateKeyDescriptor(
+      entry.descriptor(key), key, entry.address(), prior_metadata);
 
   // Write the additional copies of the entry, if redundancy is greater than 1.
   for (size_t i = 1; i < redundancy(); ++i) {
@@ -532,138 +1461,753 @@ Status KeyValueStore::WriteEntry(string_view key,
     TRY(AppendEntry(entry, key, value));
     new_metadata.AddNewAddress(reserved_addresses[i]);
   }
+
+  CheckpointIfDue();
   return Status::OK;
 }
 
 KeyValueStore::EntryMetadata KeyValueStore::UpdateKeyDescriptor(
-    const Entry& entry,
+    const KeyDescriptor& descriptor,
     string_view key,
-    EntryMetadata* prior_metadata,
-    size_t prior_size) {
+    Address address,
+    EntryMetadata* prior_metadata) {
+  EntryMetadata metadata;
+
   // If there is no prior descriptor, create a new one.
   if (prior_metadata == nullptr) {
-    return entry_cache_.AddNew(entry.descriptor(key), entry.address());
-  }
+    metadata = entry_cache_.AddNew(descriptor, address);
+  } else {
+    // Remove valid bytes for the old entry and its copies, which are now stale.
+    // The size is read here rather than when the key was found, since garbage
+    // collection may have replaced an expired entry with a smaller tombstone
+    // in the meantime. The size includes the entry's append chain, if any.
+    for (Address address : prior_metadata->addresses()) {
+      sectors_.FromAddress(address).RemoveValidBytes(
+          prior_metadata->entry_size());
+    }
 
-  // Remove valid bytes for the old entry and its copies, which are now stale.
-  for (Address address : prior_metadata->addresses()) {
-    sectors_.FromAddress(address).RemoveValidBytes(prior_size);
+    prior_metadata->Reset(descriptor, address);
+    metadata = *prior_metadata;
   }
 
-  prior_metadata->Reset(entry.descriptor(key), entry.address());
-  return *prior_metadata;
+  // The new entry was verified in flash when it was written.
+  metadata.set_verified(options_.verify_on_write);
+  entry_cache_.SetKeyPrefix(metadata, key);
+  return metadata;
 }
 
-// Finds a sector to use for writing a new entry to. Does automatic garbage
-// collection if needed and allowed.
-//
-//                 OK: Sector found with needed space.
-// RESOURCE_EXHAUSTED: No sector available with the needed space.
-Status KeyValueStore::GetSectorForWrite(SectorDescriptor** sector,
-                                        size_t entry_size,
-                                        span<const Address> reserved) {
-  Status result = sectors_.FindSpace(sector, entry_size, reserved);
+// Writes an appended entry after the key's entry, in the same sector.
+Status KeyValueStore::WriteAppendedEntry(EntryMetadata& metadata,
+                                         string_view key,
+                                         span<const byte> data,
+                                         size_t value_size,
+                                         uint16_t chain_length) {
+  SectorDescriptor& sector = sectors_.FromAddress(metadata.first_address());
+
+  const internal::AppendHeader header{
+      .previous_address = metadata.first_address(),
+      .previous_transaction_id = metadata.transaction_id(),
+      .value_size = static_cast<uint16_t>(value_size),
+      .chain_length = chain_length,
+  };
 
-  size_t gc_sector_count = 0;
-  bool do_auto_gc = options_.gc_on_write != GargbageCollectOnWrite::kDisabled;
+  last_transaction_id_ += 1;
+  Entry entry = Entry::Appended(partition_,
+                                sectors_.NextWritableAddress(sector),
+                                formats_.primary(),
+                                key,
+                                sizeof(header) + data.size(),
+                                last_transaction_id_);
+
+  // The entry is written in pieces, so claim its space up front.
+  sector.RemoveWritableBytes(entry.size());
+
+  internal::EntryWriter writer(partition_);
+  writer.Start(entry);
+  TRY(writer.Write(as_bytes(span(key))));
+  TRY(writer.Write(as_bytes(span(&header, 1))));
+  TRY(writer.Write(data));
+  TRY(writer.Finish());
 
-  // Do garbage collection as needed, so long as policy allows.
-  while (result == Status::RESOURCE_EXHAUSTED && do_auto_gc) {
-    if (options_.gc_on_write == GargbageCollectOnWrite::kOneSector) {
-      // If GC config option is kOneSector clear the flag to not do any more
-      // GC after this try.
-      do_auto_gc = false;
-    }
-    // Garbage collect and then try again to find the best sector.
-    Status gc_status = GarbageCollectPartial(reserved);
-    if (!gc_status.ok()) {
-      if (gc_status == Status::NOT_FOUND) {
-        // Not enough space, and no reclaimable bytes, this KVS is full!
-        return Status::RESOURCE_EXHAUSTED;
-      }
-      return gc_status;
-    }
+  if (options_.verify_on_write) {
+    TRY(entry.VerifyChecksumInFlash(scratch_buffer_));
+  }
 
-    result = sectors_.FindSpace(sector, entry_size, reserved);
+  // The chain's entries are valid together, so the prior entries' bytes, which
+  // UpdateKeyDescriptor removes, are counted again with the new entry's.
+  KeyDescriptor descriptor = entry.descriptor(key);
+  descriptor.entry_size = metadata.entry_size() + entry.size();
+  sector.AddValidBytes(descriptor.entry_size);
+  sector.UpdateNewestTransactionId(entry.transaction_id());
 
-    gc_sector_count++;
-    // Allow total sectors + 2 number of GC cycles so that once reclaimable
-    // bytes in all the sectors have been reclaimed can try and free up space by
-    // moving entries for keys other than the one being worked on in to sectors
-    // that have copies of the key trying to be written.
-    if (gc_sector_count > (partition_.sector_count() + 2)) {
-      ERR("Did more GC sectors than total sectors!!!!");
-      return Status::RESOURCE_EXHAUSTED;
-    }
-  }
+  const bool prior_verified = metadata.verified();
+  UpdateKeyDescriptor(descriptor, key, entry.address(), &metadata);
+  metadata.set_verified(prior_verified && metadata.verified());
 
-  if (!result.ok()) {
-    WRN("Unable to find sector to write %zu B", entry_size);
-  }
-  return result;
+  CheckpointIfDue();
+  return Status::OK;
 }
 
-Status KeyValueStore::AppendEntry(const Entry& entry,
-                                  string_view key,
-                                  span<const byte> value) {
-  const StatusWithSize result = entry.Write(key, value);
+// Rewrites the key's value followed by data as one entry. The value is copied
+// from flash in pieces, so it need not fit in RAM.
+Status KeyValueStore::WriteCombinedEntry(EntryMetadata& metadata,
+                                         string_view key,
+                                         span<const byte> data,
+                                         size_t value_size) {
+  const size_t entry_size = Entry::size(partition_, key, value_size);
+  Address* reserved_addresses = entry_cache_.TempReservedAddressesForWrite();
 
-  // Remove any bytes that were written, even if the write was not successful.
-  // This is important to retain the writable space invariant on the sectors.
-  SectorDescriptor& sector = sectors_.FromAddress(entry.address());
-  sector.RemoveWritableBytes(result.size());
+  for (size_t i = 0; i < redundancy(); i++) {
+    SectorDescriptor* sector;
+    TRY(GetSectorForWrite(&sector, entry_size, span(reserved_addresses, i)));
+    reserved_addresses[i] = sectors_.NextWritableAddress(*sector);
+  }
 
-  if (!result.ok()) {
-    ERR("Failed to write %zu bytes at %#zx. %zu actually written",
-        entry.size(),
-        size_t(entry.address()),
-        result.size());
-    return result.status();
+  // Finding space may have garbage collected the key's entries, so read them
+  // afterwards. They are verified before they are combined, since the new
+  // entry's checksum is calculated from the bytes that are read.
+  Entry prior;
+  TRY(Entry::Read(partition_, metadata.first_address(), formats_, &prior));
+  AppendChain chain;
+  const StatusWithSize length = FindAppendChain(prior, chain, true);
+  TRY(length);
+
+  SectorDescriptor& sector = sectors_.FromAddress(reserved_addresses[0]);
+  sector.RemoveWritableBytes(entry_size);
+
+  last_transaction_id_ += 1;
+  Entry entry = Entry::Streamed(partition_,
+                                reserved_addresses[0],
+                                formats_.primary(),
+                                key,
+                                value_size,
+                                last_transaction_id_);
+  TRY(WriteChainedValue(
+      entry, key, metadata, span(chain).first(length.size()), data));
+
+  sector.AddValidBytes(entry.size());
+  sector.UpdateNewestTransactionId(entry.transaction_id());
+
+  EntryMetadata new_metadata = UpdateKeyDescriptor(
+      entry.descriptor(key), key, entry.address(), &metadata);
+
+  for (size_t i = 1; i < redundancy(); ++i) {
+    TRY(AppendCopy(entry, reserved_addresses[i]));
+    new_metadata.AddNewAddress(reserved_addresses[i]);
   }
 
+  CheckpointIfDue();
+  return Status::OK;
+}
+
+// Writes the key, the value stored in the append chain, and then data to an
+// entry created with Entry::Streamed. The chain must already be verified, since
+// the checksum algorithm is in use while the entry is written.
+Status KeyValueStore::WriteChainedValue(Entry& entry,
+                                        string_view key,
+                                        const EntryMetadata& metadata,
+                                        span<const Address> chain,
+                                        span<const byte> data) {
+  internal::EntryWriter writer(partition_);
+  EntryWriterOutput output(writer);
+
+  writer.Start(entry);
+  TRY(writer.Write(as_bytes(span(key))));
+  TRY(ReadAppendChain(key, metadata, chain, 0, output));
+  TRY(writer.Write(data));
+  TRY(writer.Finish());
+
   if (options_.verify_on_write) {
-    TRY(entry.VerifyChecksumInFlash());
+    TRY(entry.VerifyChecksumInFlash(scratch_buffer_));
   }
-
-  sector.AddValidBytes(result.size());
   return Status::OK;
 }
 
-Status KeyValueStore::RelocateEntry(const EntryMetadata& metadata,
-                                    KeyValueStore::Address& address,
-                                    span<const Address> reserved_addresses) {
-  Entry entry;
-  TRY(Entry::Read(partition_, address, formats_, &entry));
+// Checks the operations in a batch, finds the existing KeyDescriptors for their
+// keys, and calculates the space needed to write the batch.
+Status KeyValueStore::PrepareBatch(WriteBatch& batch, size_t* batch_size) {
+  const uint16_t entry_count = batch.size();
+  *batch_size = Entry::size(partition_, {}, as_bytes(span(&entry_count, 1)));
+
+  size_t new_keys = 0;
+
+  for (auto op = batch.operations_.begin(); op != batch.operations_.end();
+       ++op) {
+    const uint32_t hash = internal::Hash(op->key);
+    for (auto prior = batch.operations_.begin(); prior != op; ++prior) {
+      if (prior->key == op->key) {
+        DBG("Batch contains two operations for the same key");
+        return Status::INVALID_ARGUMENT;
+      }
+      if (internal::Hash(prior->key) == hash &&
+          !entry_cache_.chain_collisions()) {
+        DBG("Batch contains two operations for the same key hash");
+        return Status::ALREADY_EXISTS;
+      }
+    }
 
-  // Find a new sector for the entry and write it to the new location. For
-  // relocation the find should not not be a sector already containing the key
-  // but can be the always empty sector, since this is part of the GC process
-  // that will result in a new empty sector. Also find a sector that does not
-  // have reclaimable space (mostly for the full GC, where that would result in
-  // an immediate extra relocation).
-  SectorDescriptor* new_sector;
+    *batch_size += Entry::size(partition_, op->key, op->value);
 
-  TRY(sectors_.FindSpaceDuringGarbageCollection(
-      &new_sector, entry.size(), metadata.addresses(), reserved_addresses));
+    Status status = entry_cache_.Find(partition_, op->key, &op->metadata);
 
-  const Address new_address = sectors_.NextWritableAddress(*new_sector);
-  const StatusWithSize result = entry.Copy(new_address);
-  new_sector->RemoveWritableBytes(result.size());
-  TRY(result);
+    if (status.ok()) {
+      if (op->state == EntryState::kDeleted &&
+          op->metadata.state() == EntryState::kDeleted) {
+        return Status::NOT_FOUND;
+      }
 
-  // Entry was written successfully; update descriptor's address and the sector
-  // descriptors to reflect the new entry.
-  sectors_.FromAddress(address).RemoveValidBytes(result.size());
-  new_sector->AddValidBytes(result.size());
-  address = new_address;
+      op->new_key = false;
+    } else if (status == Status::NOT_FOUND &&
+               op->state == EntryState::kValid) {
+      op->new_key = true;
+      new_keys += 1;
+    } else {
+      return status;
+    }
+  }
+
+  if (*batch_size > partition_.sector_size_bytes()) {
+    DBG("%zu B batch cannot fit in one sector", *batch_size);
+    return Status::INVALID_ARGUMENT;
+  }
+
+  if (entry_cache_.total_entries() + new_keys > entry_cache_.max_entries()) {
+    WRN("KVS full: trying to store %zu new entries, but can't. Have %zu "
+        "entries",
+        new_keys,
+        entry_cache_.total_entries());
+    return Status::RESOURCE_EXHAUSTED;
+  }
 
   return Status::OK;
 }
 
-Status KeyValueStore::GarbageCollectFull() {
-  DBG("Garbage Collect all sectors");
+// Writes a batch's entries, followed by its commit marker, starting at the
+// address. Records where each operation's entry was written. If the batch is
+// not fully written, its entries are counted as reclaimable, since Init does
+// not load them.
+Status KeyValueStore::AppendBatch(WriteBatch& batch, Address address) {
+  SectorDescriptor& sector = sectors_.FromAddress(address);
+  size_t valid_bytes = 0;
 
-  SectorDescriptor* sector = sectors_.last_new();
+  for (WriteBatch::Operation& op : batch.operations_) {
+    Entry entry = CreateBatchEntry(address, op.key, op.value, op.state);
+
+    if (Status status = AppendEntry(entry, op.key, op.value); !status.ok()) {
+      sector.RemoveValidBytes(valid_bytes);
+      return status;
+    }
+
+    op.address = address;
+    valid_bytes += entry.size();
+    address = entry.next_address();
+  }
+
+  const uint16_t entry_count = batch.size();
+  const Entry marker = Entry::BatchCommit(partition_,
+                                          address,
+                                          formats_.primary(),
+                                          as_bytes(span(&entry_count, 1)),
+                                          last_transaction_id_);
+
+  if (Status status =
+          AppendEntry(marker, {}, as_bytes(span(&entry_count, 1)));
+      !status.ok()) {
+    sector.RemoveValidBytes(valid_bytes);
+    return status;
+  }
+
+  // No key refers to the commit marker, so its space is reclaimable.
+  sector.RemoveValidBytes(marker.size());
+  return Status::OK;
+}
+
+KeyValueStore::ValueWriter::ValueWriter(KeyValueStore& kvs)
+    : kvs_(kvs),
+      entry_(),
+      key_buffer_{},
+      bytes_remaining_(0),
+      status_(Status::OK),
+      open_(false),
+      writer_(kvs.partition_) {}
+
+Status KeyValueStore::ValueWriter::Open(string_view key, size_t value_size) {
+  TRY(kvs_.CheckOperation(key));
+
+  FlashPartition& partition = kvs_.partition_;
+  const size_t alignment = Entry::alignment_bytes(partition);
+  if (alignment > internal::EntryWriter::kMaxAlignmentBytes) {
+    ERR("%zu B alignment is too large for ValueWriter", alignment);
+    return Status::INTERNAL;
+  }
+
+  const size_t entry_size = Entry::size(partition, key, value_size);
+  if (entry_size > partition.sector_size_bytes()) {
+    DBG("%zu B value with %zu B key cannot fit in one sector",
+        value_size,
+        key.size());
+    return Status::INVALID_ARGUMENT;
+  }
+
+  EntryMetadata metadata;
+  Status status = kvs_.entry_cache_.Find(partition, key, &metadata);
+  if (status == Status::NOT_FOUND) {
+    if (kvs_.entry_cache_.full()) {
+      WRN("KVS full: trying to store a new entry, but can't. Have %zu entries",
+          kvs_.entry_cache_.total_entries());
+      return Status::RESOURCE_EXHAUSTED;
+    }
+  } else if (!status.ok()) {
+    return status;
+  }
+
+  // Find space for every copy of the entry. The redundant copies are written by
+  // Finish; no other operation uses the reserved address list until then.
+  Address* reserved_addresses =
+      kvs_.entry_cache_.TempReservedAddressesForWrite();
+
+  for (size_t i = 0; i < kvs_.redundancy(); i++) {
+    SectorDescriptor* sector;
+    TRY(kvs_.GetSectorForWrite(
+        &sector, entry_size, span(reserved_addresses, i)));
+    reserved_addresses[i] = kvs_.sectors_.NextWritableAddress(*sector);
+  }
+
+  // The first copy is written in pieces, so claim its space up front.
+  kvs_.sectors_.FromAddress(reserved_addresses[0])
+      .RemoveWritableBytes(entry_size);
+
+  kvs_.last_transaction_id_ += 1;
+  entry_ = Entry::Streamed(partition,
+                           reserved_addresses[0],
+                           kvs_.formats_.primary(),
+                           key,
+                           value_size,
+                           kvs_.last_transaction_id_);
+  std::copy(key.begin(), key.end(), key_buffer_.begin());
+
+  bytes_remaining_ = value_size;
+  open_ = true;
+  kvs_.stream_open_ = true;
+
+  writer_.Start(entry_);
+  status_ = writer_.Write(as_bytes(span(key)));
+  if (!status_.ok()) {
+    Close();
+  }
+  return status_;
+}
+
+Status KeyValueStore::ValueWriter::Finish() {
+  if (!open_ || bytes_remaining_ != 0u) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  if (status_.ok()) {
+    status_ = writer_.Finish();
+  }
+  Close();
+  TRY(status_);
+
+  if (kvs_.options_.verify_on_write) {
+    TRY(entry_.VerifyChecksumInFlash(kvs_.scratch_buffer_));
+  }
+
+  SectorDescriptor& sector = kvs_.sectors_.FromAddress(entry_.address());
+  sector.AddValidBytes(entry_.size());
+  sector.UpdateNewestTransactionId(entry_.transaction_id());
+
+  // Replace the key's prior entry, if there is one.
+  const string_view key(key_buffer_.data(), entry_.key_length());
+  EntryMetadata prior_metadata;
+  EntryMetadata* prior = nullptr;
+
+  Status status = kvs_.entry_cache_.Find(kvs_.partition_, key, &prior_metadata);
+  if (status.ok()) {
+    prior = &prior_metadata;
+  } else if (status != Status::NOT_FOUND) {
+    return status;
+  }
+
+  EntryMetadata new_metadata = kvs_.UpdateKeyDescriptor(
+      entry_.descriptor(key), key, entry_.address(), prior);
+
+  // Write the additional copies of the entry from the first copy.
+  const Address* reserved_addresses =
+      kvs_.entry_cache_.TempReservedAddressesForWrite();
+
+  for (size_t i = 1; i < kvs_.redundancy(); ++i) {
+    TRY(kvs_.AppendCopy(entry_, reserved_addresses[i]));
+    new_metadata.AddNewAddress(reserved_addresses[i]);
+  }
+
+  kvs_.CheckpointIfDue();
+  return Status::OK;
+}
+
+StatusWithSize KeyValueStore::ValueWriter::DoWrite(span<const byte> data) {
+  if (!open_) {
+    return StatusWithSize::FAILED_PRECONDITION;
+  }
+  if (data.size() > bytes_remaining_) {
+    return StatusWithSize::OUT_OF_RANGE;
+  }
+  TRY_WITH_SIZE(status_);
+
+  bytes_remaining_ -= data.size();
+  status_ = writer_.Write(data);
+  return StatusWithSize(status_, data.size());
+}
+
+void KeyValueStore::ValueWriter::Close() {
+  if (open_) {
+    // Flush any buffered data so the EntryWriter is empty for the next Open.
+    // If the entry was abandoned, this only writes to its reserved space.
+    writer_.Abandon();
+    open_ = false;
+    kvs_.stream_open_ = false;
+  }
+}
+
+StatusWithSize KeyValueStore::ValueReader::Open(string_view key) {
+  TRY_WITH_SIZE(kvs_.CheckOperation(key));
+
+  EntryMetadata metadata;
+  TRY_WITH_SIZE(kvs_.FindExisting(key, &metadata));
+
+  TRY_WITH_SIZE(kvs_.ReadEntry(metadata, entry_));
+
+  if (entry_.appended()) {
+    return StatusWithSize::UNIMPLEMENTED;
+  }
+
+  offset_ = 0;
+  value_size_ = entry_.value_size();
+  compressed_value_ = {};
+  verify_ = kvs_.VerifyOnRead(metadata);
+
+  // Compressed values are read and verified in full when opened.
+  if (entry_.compressed()) {
+    const StatusWithSize value_size =
+        kvs_.ReadCompressedValue(key, metadata, entry_, &compressed_value_);
+    TRY_WITH_SIZE(value_size);
+    value_size_ = value_size.size();
+    verify_ = false;
+  }
+
+  if (verify_) {
+    entry_.StartChecksum();
+    entry_.UpdateChecksum(as_bytes(span(key)));
+
+    // An empty value is read in its entirety by opening it.
+    if (entry_.value_size() == 0u) {
+      return StatusWithSize(entry_.FinishAndVerifyChecksum(), 0);
+    }
+  }
+
+  open_ = true;
+  kvs_.stream_open_ = true;
+  return StatusWithSize(value_size_);
+}
+
+void KeyValueStore::ValueReader::Close() {
+  if (open_) {
+    open_ = false;
+    kvs_.stream_open_ = false;
+  }
+}
+
+StatusWithSize KeyValueStore::ValueReader::DoRead(span<byte> data) {
+  if (!open_) {
+    return StatusWithSize::FAILED_PRECONDITION;
+  }
+
+  const size_t read_size = std::min(data.size(), bytes_remaining());
+  StatusWithSize result =
+      entry_.compressed()
+          ? entry_.compression()->Decompress(
+                compressed_value_, data.first(read_size), offset_)
+          : entry_.ReadValue(data.first(read_size), offset_);
+
+  // ReadValue reports RESOURCE_EXHAUSTED if the value does not end in the
+  // buffer, which is expected when reading in pieces.
+  if (!result.ok() && result.status() != Status::RESOURCE_EXHAUSTED) {
+    Close();
+    return result;
+  }
+
+  if (verify_) {
+    entry_.UpdateChecksum(data.first(result.size()));
+  }
+  offset_ += result.size();
+
+  if (bytes_remaining() != 0u) {
+    return StatusWithSize(result.size());
+  }
+
+  Close();
+
+  if (verify_) {
+    return StatusWithSize(entry_.FinishAndVerifyChecksum(), result.size());
+  }
+  return StatusWithSize(result.size());
+}
+
+// Finds a sector to use for writing a new entry to. Does automatic garbage
+// collection if needed and allowed.
+//
+//                 OK: Sector found with needed space.
+// RESOURCE_EXHAUSTED: No sector available with the needed space.
+Status KeyValueStore::GetSectorForWrite(SectorDescriptor** sector,
+                                        size_t entry_size,
+                                        span<const Address> reserved) {
+  Status result = sectors_.FindSpace(sector, entry_size, reserved);
+
+  // Entries are written to other sectors while a sector is being erased. Wait
+  // for the erase only if the space is needed.
+  if (result == Status::RESOURCE_EXHAUSTED && erasing_sector_ != nullptr) {
+    TRY(FinishErase());
+    result = sectors_.FindSpace(sector, entry_size, reserved);
+  }
+
+  size_t gc_sector_count = 0;
+  bool do_auto_gc = options_.gc_on_write != GargbageCollectOnWrite::kDisabled;
+
+  // Do garbage collection as needed, so long as policy allows.
+  while (result == Status::RESOURCE_EXHAUSTED && do_auto_gc) {
+    if (options_.gc_on_write == GargbageCollectOnWrite::kOneSector) {
+      // If GC config option is kOneSector clear the flag to not do any more
+      // GC after this try.
+      do_auto_gc = false;
+    }
+    // Garbage collect and then try again to find the best sector.
+    Status gc_status = GarbageCollectPartial(reserved);
+    if (!gc_status.ok()) {
+      if (gc_status == Status::NOT_FOUND) {
+        // Not enough space, and no reclaimable bytes, this KVS is full!
+        return Status::RESOURCE_EXHAUSTED;
+      }
+      return gc_status;
+    }
+
+    result = sectors_.FindSpace(sector, entry_size, reserved);
+
+    gc_sector_count++;
+    // Allow total sectors + 2 number of GC cycles so that once reclaimable
+    // bytes in all the sectors have been reclaimed can try and free up space by
+    // moving entries for keys other than the one being worked on in to sectors
+    // that have copies of the key trying to be written.
+    if (gc_sector_count > (partition_.sector_count() + 2)) {
+      ERR("Did more GC sectors than total sectors!!!!");
+      return Status::RESOURCE_EXHAUSTED;
+    }
+  }
+
+  if (!result.ok()) {
+    WRN("Unable to find sector to write %zu B", entry_size);
+  }
+  return result;
+}
+
+Status KeyValueStore::AppendEntry(const Entry& entry,
+                                  string_view key,
+                                  span<const byte> value) {
+  const StatusWithSize result = entry.Write(key, value);
+
+  // Remove any bytes that were written, even if the write was not successful.
+  // This is important to retain the writable space invariant on the sectors.
+  SectorDescriptor& sector = sectors_.FromAddress(entry.address());
+  sector.RemoveWritableBytes(result.size());
+
+  if (!result.ok()) {
+    ERR("Failed to write %zu bytes at %#zx. %zu actually written",
+        entry.size(),
+        size_t(entry.address()),
+        result.size());
+    return result.status();
+  }
+
+  if (options_.verify_on_write) {
+    TRY(entry.VerifyChecksumInFlash(scratch_buffer_));
+  }
+
+  sector.AddValidBytes(result.size());
+  sector.UpdateNewestTransactionId(entry.transaction_id());
+  return Status::OK;
+}
+
+Status KeyValueStore::RelocateEntry(const EntryMetadata& metadata,
+                                    KeyValueStore::Address& address,
+                                    span<const Address> reserved_addresses) {
+  Entry entry;
+  TRY(Entry::Read(partition_, address, formats_, &entry));
+
+  if (entry.appended()) {
+    return RelocateAppendChain(
+        metadata, entry, address, reserved_addresses);
+  }
+
+  // Only a key's single copy is replaced, so that all of its copies stay the
+  // same size. The tombstone's key is read from the expired entry, so a corrupt
+  // expired entry is relocated as is and left for repair.
+  if (entry.expired(current_time_) && redundancy() == 1u &&
+      entry.VerifyChecksumInFlash(scratch_buffer_).ok()) {
+    return RelocateExpiredEntry(metadata, entry, address, reserved_addresses);
+  }
+
+  // A relocated entry is no longer next to its batch's commit marker, so it is
+  // rewritten as an ordinary entry. A corrupt entry keeps its old checksum, so
+  // that its copy is also found to be corrupt.
+  bool source_corrupt = false;
+  if (entry.batched()) {
+    const Status status = entry.ClearBatchFlag(scratch_buffer_);
+    source_corrupt = status == Status::DATA_LOSS;
+    if (!source_corrupt) {
+      TRY(status);
+    }
+  }
+
+  // Find a new sector for the entry and write it to the new location. For
+  // relocation the find should not not be a sector already containing the key
+  // but can be the always empty sector, since this is part of the GC process
+  // that will result in a new empty sector. Also find a sector that does not
+  // have reclaimable space (mostly for the full GC, where that would result in
+  // an immediate extra relocation).
+  SectorDescriptor* new_sector;
+
+  TRY(sectors_.FindSpaceDuringGarbageCollection(
+      &new_sector, entry.size(), metadata.addresses(), reserved_addresses));
+
+  const Address new_address = sectors_.NextWritableAddress(*new_sector);
+  const StatusWithSize result = entry.Copy(new_address, scratch_buffer_);
+  new_sector->RemoveWritableBytes(result.size());
+
+  // The entry did not match its checksum as it was copied, or before its batch
+  // flag was cleared. The copy is as complete as the original and keeps its
+  // checksum, so relocation continues and the corruption is left for repair,
+  // which restores it from a redundant copy if there is one.
+  if (result.status() == Status::DATA_LOSS && result.size() == entry.size()) {
+    source_corrupt = true;
+  } else {
+    TRY(result);
+  }
+  if (source_corrupt) {
+    WRN("Relocated corrupt copy of key 0x%08" PRIx32 " from address %u",
+        metadata.hash(),
+        unsigned(address));
+    error_detected_ = true;
+  }
+
+  // The source was checked while it was copied (or, for a batched entry, when
+  // its checksum was recalculated), so only the copy is read back.
+  if (options_.verify_on_write && !source_corrupt) {
+    Entry copy = entry;
+    copy.set_address(new_address);
+    TRY(copy.VerifyChecksumInFlash(scratch_buffer_));
+  }
+
+  // Entry was written successfully; update descriptor's address and the sector
+  // descriptors to reflect the new entry.
+  sectors_.FromAddress(address).RemoveValidBytes(result.size());
+  new_sector->AddValidBytes(result.size());
+  new_sector->UpdateNewestTransactionId(entry.transaction_id());
+  address = new_address;
+
+  // Unless the copy was read back, verify it the next time it is read.
+  if (!options_.verify_on_write || source_corrupt) {
+    metadata.set_verified(false);
+  }
+  return Status::OK;
+}
+
+// Replaces an expired entry with a tombstone, so that its value is not copied.
+// The tombstone has a new transaction ID, so it supersedes the expired entry
+// even if the sector is not erased.
+Status KeyValueStore::RelocateExpiredEntry(
+    const EntryMetadata& metadata,
+    const Entry& entry,
+    KeyValueStore::Address& address,
+    span<const Address> reserved_addresses) {
+  Entry::KeyBuffer key_buffer;
+  TRY_ASSIGN(const size_t key_length, entry.ReadKey(key_buffer));
+  const string_view key(key_buffer.data(), key_length);
+
+  SectorDescriptor* new_sector;
+  const size_t tombstone_size = Entry::size(partition_, key, 0u);
+  TRY(sectors_.FindSpaceDuringGarbageCollection(
+      &new_sector, tombstone_size, metadata.addresses(), reserved_addresses));
+
+  const Address new_address = sectors_.NextWritableAddress(*new_sector);
+  const Entry tombstone =
+      CreateEntry(new_address, key, {}, EntryState::kDeleted, false);
+  TRY(AppendEntry(tombstone, key, {}));
+
+  DBG("Replaced expired entry for key 0x%08" PRIx32 " with a tombstone",
+      metadata.hash());
+
+  sectors_.FromAddress(address).RemoveValidBytes(entry.size());
+  EntryMetadata updated = metadata;
+  updated.Reset(tombstone.descriptor(key), new_address);
+  updated.set_verified(options_.verify_on_write);
+  address = new_address;
+  return Status::OK;
+}
+
+// Relocates an append chain by combining its entries into one entry with the
+// chain's transaction ID.
+Status KeyValueStore::RelocateAppendChain(
+    const EntryMetadata& metadata,
+    const Entry& newest,
+    KeyValueStore::Address& address,
+    span<const Address> reserved_addresses) {
+  Entry::KeyBuffer key_buffer;
+  TRY_ASSIGN(const size_t key_length, newest.ReadKey(key_buffer));
+  const string_view key(key_buffer.data(), key_length);
+
+  internal::AppendHeader header;
+  TRY(newest.ReadAppendHeader(&header));
+
+  // The chain is verified before it is combined, since the new entry's
+  // checksum is calculated from the bytes that are read.
+  AppendChain chain;
+  const StatusWithSize length = FindAppendChain(newest, chain, true);
+  TRY(length);
+
+  SectorDescriptor* new_sector;
+  TRY(sectors_.FindSpaceDuringGarbageCollection(
+      &new_sector,
+      Entry::size(partition_, key, header.value_size),
+      metadata.addresses(),
+      reserved_addresses));
+
+  Entry entry = Entry::Streamed(partition_,
+                                sectors_.NextWritableAddress(*new_sector),
+                                formats_.primary(),
+                                key,
+                                header.value_size,
+                                newest.transaction_id());
+  new_sector->RemoveWritableBytes(entry.size());
+  TRY(WriteChainedValue(
+      entry, key, metadata, span(chain).first(length.size()), {}));
+
+  sectors_.FromAddress(address).RemoveValidBytes(metadata.entry_size());
+  new_sector->AddValidBytes(entry.size());
+  new_sector->UpdateNewestTransactionId(entry.transaction_id());
+  metadata.set_entry_size(entry.size());
+  address = entry.address();
+
+  metadata.set_verified(false);
+  return Status::OK;
+}
+
+Status KeyValueStore::GarbageCollectFull() {
+  if (stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+  DBG("Garbage Collect all sectors");
+  TRY(FinishErase());
+
+  SectorDescriptor* sector = sectors_.last_new();
 
   // TODO: look in to making an iterator method for cycling through sectors
   // starting from last_new_sector_.
@@ -673,33 +2217,349 @@ Status KeyValueStore::GarbageCollectFull() {
       sector = sectors_.begin();
     }
 
-    if (sector->RecoverableBytes(partition_.sector_size_bytes()) > 0) {
-      TRY(GarbageCollectSector(*sector, {}));
+    if (sector->RecoverableBytes(partition_.sector_size_bytes()) > 0) {
+      TRY(GarbageCollectSector(*sector, {}));
+    }
+  }
+
+  DBG("Garbage Collect all complete");
+  return Status::OK;
+}
+
+Status KeyValueStore::GarbageCollectPartial(
+    span<const Address> reserved_addresses) {
+  DBG("Garbage Collect a single sector");
+  TRY(FinishErase());
+
+  for (Address address : reserved_addresses) {
+    DBG("   Avoid address %u", unsigned(address));
+  }
+
+  // Step 1: Find the sector to garbage collect
+  SectorDescriptor* sector_to_gc =
+      sectors_.FindSectorToGarbageCollect(reserved_addresses,
+                                          last_transaction_id_);
+
+  if (sector_to_gc == nullptr) {
+    // Nothing to GC.
+    return Status::NOT_FOUND;
+  }
+
+  // Step 2: Garbage collect the selected sector.
+  return GarbageCollectSector(*sector_to_gc, reserved_addresses);
+}
+
+Status KeyValueStore::GarbageCollectStep(size_t max_bytes) {
+  if (stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  // Check on the erase started by the previous step.
+  if (erasing_sector_ != nullptr) {
+    return FinishErase(false);
+  }
+
+  if (gc_sector_ == nullptr) {
+    SectorDescriptor* sector =
+        sectors_.FindSectorToGarbageCollect({}, last_transaction_id_);
+
+    if (sector == nullptr ||
+        sector->RecoverableBytes(partition_.sector_size_bytes()) == 0u) {
+      return Status::NOT_FOUND;
+    }
+
+    StartGarbageCollectStep(*sector);
+  }
+
+  // KeyDescriptors are only appended between steps, so gc_next_entry_ still
+  // refers to the next descriptor to check. Entries written since the
+  // collection started are never in gc_sector_.
+  size_t relocated_bytes = 0;
+
+  while (gc_sector_->valid_bytes() != 0u && relocated_bytes < max_bytes) {
+    if (gc_next_entry_ == entry_cache_.total_entries()) {
+      ERR("  Failed to relocate valid entries from sector being garbage "
+          "collected, %zu valid bytes remain",
+          gc_sector_->valid_bytes());
+      // Keep writing to the sector's free space until it is collected again.
+      gc_sector_->set_writable_bytes(gc_writable_bytes_);
+      gc_sector_ = nullptr;
+      return Status::INTERNAL;
+    }
+
+    const size_t valid_bytes = gc_sector_->valid_bytes();
+    TRY(RelocateKeyAddressesInSector(
+        *gc_sector_, entry_cache_.at(gc_next_entry_), {}));
+
+    gc_next_entry_ += 1;
+    relocated_bytes += valid_bytes - gc_sector_->valid_bytes();
+  }
+
+  // Erase the sector in its own step, since erasing may take as long as
+  // relocating the budgeted bytes. The erase runs in the background if the
+  // flash supports it, and is finished by the next step or write.
+  if (relocated_bytes != 0u || gc_sector_->valid_bytes() != 0u) {
+    return Status::OK;
+  }
+
+  TRY(StartReinitializeSector(*gc_sector_));
+  const Status status = FinishErase(false);
+  return status == Status::UNAVAILABLE ? Status(Status::OK) : status;
+}
+
+void KeyValueStore::StartGarbageCollectStep(SectorDescriptor& sector) {
+  DBG("Start incremental Garbage Collect of sector %u", sectors_.Index(sector));
+
+  // Stop new entries from being written to the sector. Its free space is
+  // reclaimed when it is erased.
+  gc_writable_bytes_ = sector.writable_bytes();
+  sector.set_writable_bytes(0);
+  gc_sector_ = &sector;
+  gc_next_entry_ = 0;
+}
+
+Status KeyValueStore::MaintenanceStep(size_t max_bytes) {
+  if (!initialized()) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  if (error_detected_ && !repair_failed_) {
+    if (stream_open_) {
+      return Status::FAILED_PRECONDITION;
+    }
+    return RepairStep(max_bytes);
+  }
+
+  if (!garbage_collection_in_progress() &&
+      sectors_.EmptySectorCount() > options_.spare_sectors) {
+    return Status::NOT_FOUND;
+  }
+  return GarbageCollectStep(max_bytes);
+}
+
+Status KeyValueStore::VerifyAll(size_t max_bytes) {
+  if (!initialized() || stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  // Like GarbageCollectStep, the position is kept between calls as an index
+  // into the KeyDescriptors, which are only appended between calls.
+  Status status = Status::OK;
+  size_t verified_bytes = 0;
+
+  while (verify_next_entry_ < entry_cache_.total_entries()) {
+    if (verified_bytes >= max_bytes) {
+      return status;
+    }
+
+    const EntryMetadata metadata = entry_cache_.at(verify_next_entry_);
+    verify_next_entry_ += 1;
+
+    for (Address address : metadata.addresses()) {
+      Entry entry;
+      Status entry_status = Entry::Read(partition_, address, formats_, &entry);
+      if (entry_status.ok()) {
+        AppendChain chain;
+        entry_status = FindAppendChain(entry, chain, true).status();
+      }
+
+      if (address == metadata.first_address()) {
+        metadata.set_verified(entry_status.ok());
+      }
+
+      if (!entry_status.ok()) {
+        ERR("Entry for key 0x%08" PRIx32 " at address %u is corrupt",
+            metadata.hash(),
+            unsigned(address));
+        error_detected_ = true;
+        status = entry_status;
+      }
+      verified_bytes += metadata.entry_size();
+    }
+  }
+
+  verify_next_entry_ = 0;
+  return status.ok() ? Status(Status::NOT_FOUND) : status;
+}
+
+Status KeyValueStore::Repair() {
+  if (!initialized() || stream_open_) {
+    return Status::FAILED_PRECONDITION;
+  }
+  return RepairCorruption();
+}
+
+Status KeyValueStore::RepairCorruption() {
+  // A repair in progress in MaintenanceStep starts over.
+  repair_next_entry_ = 0;
+  repair_status_ = Status::OK;
+  repair_failed_ = false;
+
+  if (!error_detected_) {
+    return Status::OK;
+  }
+
+  INF("Starting KVS repair");
+  TRY(FinishErase());
+
+  // Every entry is checked, since reads and VerifyAll stop at the first error
+  // and Init does not verify values.
+  Status status = Status::OK;
+  for (EntryMetadata metadata : entry_cache_) {
+    if (Status entry_status = RepairEntry(metadata); !entry_status.ok()) {
+      if (status.ok()) {
+        status = entry_status;
+      }
+    }
+  }
+
+  for (SectorDescriptor& sector : sectors_) {
+    if (sector.corrupt()) {
+      DBG("Garbage collecting corrupt sector %u", sectors_.Index(sector));
+      if (Status gc_status = GarbageCollectSector(sector, {});
+          !gc_status.ok() && status.ok()) {
+        status = gc_status;
+      }
     }
   }
 
-  DBG("Garbage Collect all complete");
-  return Status::OK;
+  // Corrupt sectors are not written to, so there may be no empty sector.
+  if (sectors_.EmptySectorCount() == 0u) {
+    if (Status gc_status = GarbageCollectPartial({});
+        !gc_status.ok() && status.ok()) {
+      status = gc_status;
+    }
+  }
+
+  if (status.ok()) {
+    error_detected_ = false;
+  }
+  return status;
 }
 
-Status KeyValueStore::GarbageCollectPartial(
-    span<const Address> reserved_addresses) {
-  DBG("Garbage Collect a single sector");
-  for (Address address : reserved_addresses) {
-    DBG("   Avoid address %u", unsigned(address));
+// Does part of the work of RepairCorruption. Entries are repaired first, in
+// order, and then the sectors with corrupt data are garbage collected with
+// GarbageCollectStep. MaintenanceStep keeps the spare sectors afterwards.
+Status KeyValueStore::RepairStep(size_t max_bytes) {
+  if (repair_next_entry_ < entry_cache_.total_entries()) {
+    // Like VerifyAll, the position is an index into the KeyDescriptors, which
+    // are only appended between calls.
+    size_t checked_bytes = 0;
+    while (repair_next_entry_ < entry_cache_.total_entries() &&
+           checked_bytes < max_bytes) {
+      EntryMetadata metadata = entry_cache_.at(repair_next_entry_);
+      repair_next_entry_ += 1;
+
+      if (Status status = RepairEntry(metadata);
+          !status.ok() && repair_status_.ok()) {
+        repair_status_ = status;
+      }
+      checked_bytes += metadata.entry_size() * metadata.addresses().size();
+    }
+    return Status::OK;
   }
 
-  // Step 1: Find the sector to garbage collect
-  SectorDescriptor* sector_to_gc =
-      sectors_.FindSectorToGarbageCollect(reserved_addresses);
+  if (gc_sector_ == nullptr && erasing_sector_ == nullptr) {
+    for (SectorDescriptor& sector : sectors_) {
+      if (sector.corrupt()) {
+        StartGarbageCollectStep(sector);
+        break;
+      }
+    }
+  }
 
-  if (sector_to_gc == nullptr) {
-    // Nothing to GC.
-    return Status::NOT_FOUND;
+  if (garbage_collection_in_progress()) {
+    const Status status = GarbageCollectStep(max_bytes);
+    if (status.ok() || status == Status::UNAVAILABLE) {
+      return status;
+    }
+
+    // A sector that cannot be collected is left unwritable.
+    ERR("Unable to garbage collect corrupt sector during repair");
+    gc_sector_ = nullptr;
+    if (repair_status_.ok()) {
+      repair_status_ = status;
+    }
   }
 
-  // Step 2: Garbage collect the selected sector.
-  return GarbageCollectSector(*sector_to_gc, reserved_addresses);
+  return FinishRepair();
+}
+
+Status KeyValueStore::FinishRepair() {
+  const Status status = repair_status_;
+  repair_next_entry_ = 0;
+  repair_status_ = Status::OK;
+
+  if (status.ok()) {
+    INF("KVS repair complete");
+    error_detected_ = false;
+  } else {
+    ERR("KVS repair failed");
+    repair_failed_ = true;
+  }
+  return status;
+}
+
+// Drops the copies of an entry that fail verification, then copies a good copy
+// until the entry has as many copies as the redundancy. The last copy is kept
+// even if it is corrupt, so that reads report DATA_LOSS rather than NOT_FOUND.
+Status KeyValueStore::RepairEntry(EntryMetadata& metadata) {
+  Entry good_entry;
+  bool found_good_entry = false;
+
+  for (size_t i = 0; i < metadata.addresses().size();) {
+    const Address address = metadata.addresses()[i];
+
+    Entry entry;
+    Status status = Entry::Read(partition_, address, formats_, &entry);
+    if (status.ok()) {
+      AppendChain chain;
+      status = FindAppendChain(entry, chain, true).status();
+    }
+
+    if (status.ok()) {
+      if (!found_good_entry) {
+        good_entry = entry;
+        found_good_entry = true;
+      }
+      i += 1;
+    } else if (metadata.addresses().size() > 1u) {
+      WRN("Dropping corrupt copy of key 0x%08" PRIx32 " at address %u",
+          metadata.hash(),
+          unsigned(address));
+      sectors_.FromAddress(address).RemoveValidBytes(metadata.entry_size());
+      metadata.RemoveAddress(address);
+      metadata.set_verified(false);
+    } else {
+      i += 1;
+    }
+  }
+
+  if (!found_good_entry) {
+    ERR("Unable to repair key 0x%08" PRIx32 ": no valid copy remains",
+        metadata.hash());
+    return Status::DATA_LOSS;
+  }
+
+  // The copy is no longer next to its batch's commit marker.
+  if (good_entry.batched()) {
+    TRY(good_entry.ClearBatchFlag(scratch_buffer_));
+  }
+
+  // The sectors holding the remaining copies are skipped, which also keeps
+  // garbage collection from relocating the copy that is being read.
+  while (metadata.addresses().size() < redundancy()) {
+    SectorDescriptor* sector;
+    TRY(GetSectorForWrite(&sector, good_entry.size(), metadata.addresses()));
+
+    const Address new_address = sectors_.NextWritableAddress(*sector);
+    TRY(AppendCopy(good_entry, new_address));
+    metadata.AddNewAddress(new_address);
+    DBG("Wrote redundant copy of key 0x%08" PRIx32 " to address %u",
+        metadata.hash(),
+        unsigned(new_address));
+  }
+  return Status::OK;
 }
 
 Status KeyValueStore::RelocateKeyAddressesInSector(
@@ -736,18 +2596,524 @@ Status KeyValueStore::GarbageCollectSector(
   }
 
   // Step 2: Reinitialize the sector
-  sector_to_gc.set_writable_bytes(0);
-  TRY(partition_.Erase(sectors_.BaseAddress(sector_to_gc), 1));
-  sector_to_gc.set_writable_bytes(partition_.sector_size_bytes());
+  return ReinitializeSector(sector_to_gc);
+}
+
+// Erases a sector that holds no valid entries so it can be written again.
+Status KeyValueStore::ReinitializeSector(SectorDescriptor& sector) {
+  TRY(StartReinitializeSector(sector));
+  return FinishErase();
+}
+
+// Starts erasing a sector that holds no valid entries. The sector is not
+// writable until FinishErase completes the erase.
+Status KeyValueStore::StartReinitializeSector(SectorDescriptor& sector) {
+  if (has_checkpoint_) {
+    TRY(WriteSectorErasure(sector));
+  }
+
+  sector.set_writable_bytes(0);
+  erase_epoch_ += 1;
+  TRY(partition_.StartErase(sectors_.BaseAddress(sector), 1));
+  erasing_sector_ = &sector;
+
+  // The sector may have been partially collected by GarbageCollectStep.
+  if (&sector == gc_sector_) {
+    gc_sector_ = nullptr;
+  }
+  return Status::OK;
+}
+
+// Completes the erase started by StartReinitializeSector, if there is one. If
+// wait is false and the erase is still in progress, returns UNAVAILABLE.
+Status KeyValueStore::FinishErase(bool wait) {
+  if (erasing_sector_ == nullptr) {
+    return Status::OK;
+  }
+
+  const Status status =
+      wait ? partition_.WaitForErase() : partition_.PollErase();
+  if (status == Status::UNAVAILABLE) {
+    return status;
+  }
+
+  SectorDescriptor& sector = *erasing_sector_;
+  erasing_sector_ = nullptr;
+  TRY(status);
+
+  sector.set_writable_bytes(partition_.sector_size_bytes());
+  sector.ResetNewestTransactionId();
+
+  DBG("  Garbage Collect sector %u complete", sectors_.Index(sector));
+  return Status::OK;
+}
+
+// Writes a copy of an entry that is already in flash to a new address.
+Status KeyValueStore::AppendCopy(const Entry& entry, Address new_address) {
+  const StatusWithSize result = entry.Copy(new_address, scratch_buffer_);
+
+  SectorDescriptor& sector = sectors_.FromAddress(new_address);
+  sector.RemoveWritableBytes(result.size());
+  TRY(result);
+
+  if (options_.verify_on_write) {
+    Entry copy = entry;
+    copy.set_address(new_address);
+    TRY(copy.VerifyChecksumInFlash(scratch_buffer_));
+  }
+
+  sector.AddValidBytes(result.size());
+  sector.UpdateNewestTransactionId(entry.transaction_id());
+  return Status::OK;
+}
+
+Status KeyValueStore::Checkpoint() {
+  if (!initialized() || stream_open_ || checkpoint_partition_ == nullptr ||
+      error_detected_) {
+    return Status::FAILED_PRECONDITION;
+  }
+  return WriteCheckpoint();
+}
+
+Status KeyValueStore::LoadCheckpoint(size_t* total_corrupt_bytes,
+                                     int* corrupt_entries) {
+  Entry checkpoint;
+  Address records_end;
+  TRY(FindCheckpoint(&checkpoint, &records_end));
+
+  uint32_t transaction_id;
+  TRY(ReadCheckpoint(checkpoint, &transaction_id));
+  TRY(ApplySectorErasures(checkpoint.next_address(), records_end));
+  TRY(VerifyCheckpointSectors(checkpoint));
+
+  DBG("Loaded checkpoint %" PRIu32 "; reading the entries written after it",
+      checkpoint.transaction_id());
+
+  TRY(LoadEntries(total_corrupt_bytes, corrupt_entries));
+
+  // Transaction IDs may have been burned after the newest entry was written.
+  last_transaction_id_ = std::max(last_transaction_id_, transaction_id);
+  checkpoint_transaction_id_ = transaction_id;
+  return Status::OK;
+}
+
+// Finds the newest checkpoint, which is in the checkpoint sector whose first
+// record has the highest sequence number. Any sector erasure records after it
+// are applied when it is loaded.
+Status KeyValueStore::FindCheckpoint(Entry* checkpoint, Address* records_end) {
+  has_checkpoint_ = false;
+  checkpoint_address_ = 0;
+  checkpoint_sequence_ = 0;
+
+  const size_t sector_size_bytes = checkpoint_partition_->sector_size_bytes();
+  Address sector_address = 0;
+
+  for (size_t i = 0; i < checkpoint_partition_->sector_count(); ++i) {
+    const Address address = i * sector_size_bytes;
+    Entry record;
+    bool is_checkpoint;
+    if (ReadCheckpointRecord(address, &record, &is_checkpoint).ok() &&
+        is_checkpoint &&
+        (!has_checkpoint_ || record.transaction_id() > checkpoint_sequence_)) {
+      has_checkpoint_ = true;
+      checkpoint_sequence_ = record.transaction_id();
+      sector_address = address;
+    }
+  }
+
+  if (!has_checkpoint_) {
+    return Status::NOT_FOUND;
+  }
+
+  // Read the sector's records until reaching unwritten or invalid data.
+  const Address sector_end = sector_address + sector_size_bytes;
+  Address address = sector_address;
+  Status status;
+
+  while (address < sector_end) {
+    Entry record;
+    bool is_checkpoint;
+    status = ReadCheckpointRecord(address, &record, &is_checkpoint);
+    if (!status.ok()) {
+      break;
+    }
+    if (is_checkpoint) {
+      *checkpoint = record;
+    }
+    checkpoint_sequence_ =
+        std::max(checkpoint_sequence_, record.transaction_id());
+    address = record.next_address();
+  }
+
+  *records_end = address;
+
+  // If a record was not written completely, start a new sector for the next
+  // record rather than writing after it.
+  if ((!status.ok() && status != Status::NOT_FOUND) ||
+      (address < sector_end &&
+       InterruptedWriteAt(*checkpoint_partition_, address, sector_end))) {
+    checkpoint_address_ = sector_end;
+  } else {
+    checkpoint_address_ = address;
+  }
+  return Status::OK;
+}
 
-  DBG("  Garbage Collect sector %u complete", sectors_.Index(sector_to_gc));
+Status KeyValueStore::ReadCheckpointRecord(Address address,
+                                           Entry* entry,
+                                           bool* is_checkpoint) const {
+  TRY(Entry::Read(*checkpoint_partition_, address, formats_, entry));
+
+  Entry::KeyBuffer key_buffer;
+  TRY_ASSIGN(size_t key_length, entry->ReadKey(key_buffer));
+  const string_view key(key_buffer.data(), key_length);
+
+  if (key == kCheckpointKey) {
+    *is_checkpoint = true;
+  } else if (key == kSectorErasedKey) {
+    *is_checkpoint = false;
+  } else {
+    return Status::DATA_LOSS;
+  }
+  return entry->VerifyChecksumInFlash(scratch_buffer_);
+}
+
+// Loads the sector and KeyDescriptor state from a checkpoint.
+Status KeyValueStore::ReadCheckpoint(const Entry& checkpoint,
+                                     uint32_t* transaction_id) {
+  const size_t sector_size_bytes = partition_.sector_size_bytes();
+  size_t offset = 0;
+
+  CheckpointHeader header;
+  TRY(ReadCheckpointValue(checkpoint, &offset, &header));
+
+  if (header.sector_size_bytes != sector_size_bytes ||
+      header.sector_count != sectors_.size() ||
+      header.redundancy != redundancy() ||
+      header.descriptor_count > entry_cache_.max_entries()) {
+    WRN("Checkpoint does not match the KVS's configuration");
+    return Status::FAILED_PRECONDITION;
+  }
+
+  if (checkpoint.value_size() != CheckpointSize(header.sector_count,
+                                                header.descriptor_count,
+                                                header.redundancy)) {
+    return Status::DATA_LOSS;
+  }
+
+  for (SectorDescriptor& sector : sectors_) {
+    CheckpointSector saved;
+    TRY(ReadCheckpointValue(checkpoint, &offset, &saved));
+
+    if (saved.written_bytes > sector_size_bytes) {
+      return Status::DATA_LOSS;
+    }
+    sector.set_writable_bytes(sector_size_bytes - saved.written_bytes);
+    sector.UpdateNewestTransactionId(saved.newest_transaction_id);
+  }
+
+  for (size_t i = 0; i < header.descriptor_count; ++i) {
+    CheckpointDescriptor saved;
+    TRY(ReadCheckpointValue(checkpoint, &offset, &saved));
+
+    if (saved.address_count == 0u || saved.address_count > redundancy() ||
+        saved.state > uint8_t(EntryState::kDeleted)) {
+      return Status::DATA_LOSS;
+    }
+
+    EntryMetadata metadata;
+    for (size_t j = 0; j < redundancy(); ++j) {
+      Address address;
+      TRY(ReadCheckpointValue(checkpoint, &offset, &address));
+
+      if (j >= saved.address_count) {
+        continue;
+      }
+
+      // Addresses must be within the written part of a sector.
+      if (address >= partition_.size_bytes() ||
+          address % sector_size_bytes >=
+              sector_size_bytes - sectors_.FromAddress(address).writable_bytes()) {
+        return Status::DATA_LOSS;
+      }
+
+      if (j == 0u) {
+        metadata = entry_cache_.AddNew(
+            KeyDescriptor{.key_hash = saved.key_hash,
+                          .transaction_id = saved.transaction_id,
+                          .state = EntryState(saved.state),
+                          .verified = false,
+                          .entry_size = saved.entry_size},
+            address);
+      } else {
+        metadata.AddNewAddress(address);
+      }
+    }
+  }
+
+  *transaction_id = header.transaction_id;
+  return Status::OK;
+}
+
+// Empties the sectors that were erased after the checkpoint was written.
+Status KeyValueStore::ApplySectorErasures(Address address,
+                                          Address records_end) {
+  const size_t sector_size_bytes = partition_.sector_size_bytes();
+
+  while (address < records_end) {
+    Entry record;
+    bool is_checkpoint;
+    TRY(ReadCheckpointRecord(address, &record, &is_checkpoint));
+
+    uint16_t index;
+    size_t offset = 0;
+    TRY(ReadCheckpointValue(record, &offset, &index));
+    if (is_checkpoint || index >= sectors_.size()) {
+      return Status::DATA_LOSS;
+    }
+
+    SectorDescriptor& sector = sectors_.FromAddress(index * sector_size_bytes);
+    sector.set_writable_bytes(sector_size_bytes);
+    sector.ResetNewestTransactionId();
+    entry_cache_.RemoveAddressesInSector(sectors_.BaseAddress(sector),
+                                         sector_size_bytes);
+
+    address = record.next_address();
+  }
+  return Status::OK;
+}
+
+// Checks that the sectors with entries in the checkpoint were not erased or
+// rewritten other than by the KVS, by comparing their first entries.
+Status KeyValueStore::VerifyCheckpointSectors(const Entry& checkpoint) const {
+  size_t offset = sizeof(CheckpointHeader);
+
+  for (const SectorDescriptor& sector : sectors_) {
+    CheckpointSector saved;
+    TRY(ReadCheckpointValue(checkpoint, &offset, &saved));
+
+    if (sector.writable_bytes() != partition_.sector_size_bytes() &&
+        FirstTransactionId(sector) != saved.first_transaction_id) {
+      WRN("Sector %u does not match the checkpoint", sectors_.Index(sector));
+      return Status::DATA_LOSS;
+    }
+  }
+  return Status::OK;
+}
+
+uint32_t KeyValueStore::FirstTransactionId(
+    const SectorDescriptor& sector) const {
+  Entry entry;
+  if (!Entry::Read(partition_, sectors_.BaseAddress(sector), formats_, &entry)
+           .ok()) {
+    return kNoTransactionId;
+  }
+  return entry.transaction_id();
+}
+
+void KeyValueStore::CheckpointIfDue() {
+  if (options_.checkpoint_interval == 0u || checkpoint_partition_ == nullptr ||
+      last_transaction_id_ - checkpoint_transaction_id_ <
+          options_.checkpoint_interval) {
+    return;
+  }
+
+  const Status status = Checkpoint();
+  if (!status.ok()) {
+    // The write succeeded, so don't report the error. Wait for another
+    // interval before trying again.
+    WRN("Failed to write checkpoint: %s", status.str());
+    checkpoint_transaction_id_ = last_transaction_id_;
+  }
+}
+
+Status KeyValueStore::WriteCheckpoint() {
+  // The checkpoint records which sectors are writable.
+  TRY(FinishErase());
+
+  const size_t value_size =
+      CheckpointSize(sectors_.size(), entry_cache_.total_entries(), redundancy());
+  const size_t record_size =
+      Entry::size(*checkpoint_partition_, kCheckpointKey, value_size);
+
+  // Values of 0xFFFF bytes are reserved for tombstones.
+  if (value_size >= std::numeric_limits<uint16_t>::max() ||
+      record_size > checkpoint_partition_->sector_size_bytes()) {
+    WRN("A %zu B checkpoint does not fit in the checkpoint partition",
+        record_size);
+    return Status::RESOURCE_EXHAUSTED;
+  }
+
+  if (CheckpointSectorSpace() < record_size) {
+    TRY(StartCheckpointSector());
+  }
+
+  Entry record = Entry::Streamed(*checkpoint_partition_,
+                                 checkpoint_address_,
+                                 formats_.primary(),
+                                 kCheckpointKey,
+                                 value_size,
+                                 ++checkpoint_sequence_);
+
+  internal::EntryWriter writer(*checkpoint_partition_);
+  writer.Start(record);
+
+  Status status = writer.Write(as_bytes(span(kCheckpointKey)));
+  if (status.ok()) {
+    status = WriteCheckpointContents(writer);
+  }
+  TRY(FinishCheckpointRecord(writer, record, status));
+
+  DBG("Wrote checkpoint at transaction %" PRIu32, last_transaction_id_);
+  has_checkpoint_ = true;
+  checkpoint_transaction_id_ = last_transaction_id_;
+  return Status::OK;
+}
+
+Status KeyValueStore::WriteCheckpointContents(
+    internal::EntryWriter& writer) const {
+  const size_t sector_size_bytes = partition_.sector_size_bytes();
+
+  const CheckpointHeader header{
+      .transaction_id = last_transaction_id_,
+      .sector_size_bytes = static_cast<uint16_t>(sector_size_bytes),
+      .sector_count = static_cast<uint16_t>(sectors_.size()),
+      .descriptor_count = static_cast<uint16_t>(entry_cache_.total_entries()),
+      .redundancy = static_cast<uint8_t>(redundancy()),
+      .reserved = 0,
+  };
+  TRY(writer.Write(as_bytes(span(&header, 1))));
+
+  for (const SectorDescriptor& sector : sectors_) {
+    const size_t written_bytes = sector_size_bytes - sector.writable_bytes();
+    const CheckpointSector saved{
+        .written_bytes = static_cast<uint16_t>(written_bytes),
+        .reserved = 0,
+        .newest_transaction_id = sector.newest_transaction_id(),
+        .first_transaction_id =
+            written_bytes == 0u ? kNoTransactionId : FirstTransactionId(sector),
+    };
+    TRY(writer.Write(as_bytes(span(&saved, 1))));
+  }
+
+  for (const EntryMetadata& metadata : entry_cache_) {
+    const CheckpointDescriptor saved{
+        .key_hash = metadata.hash(),
+        .transaction_id = metadata.transaction_id(),
+        .state = static_cast<uint8_t>(metadata.state()),
+        .address_count = static_cast<uint8_t>(metadata.addresses().size()),
+        .entry_size = static_cast<uint16_t>(metadata.entry_size()),
+    };
+    TRY(writer.Write(as_bytes(span(&saved, 1))));
+
+    for (size_t i = 0; i < redundancy(); ++i) {
+      const Address address = i < metadata.addresses().size()
+                                  ? metadata.addresses()[i]
+                                  : kNoAddress;
+      TRY(writer.Write(as_bytes(span(&address, 1))));
+    }
+  }
+  return Status::OK;
+}
+
+// Records that a sector of the KVS's partition is about to be erased, so that
+// the sector is not expected to match the checkpoint.
+Status KeyValueStore::WriteSectorErasure(const SectorDescriptor& sector) {
+  const uint16_t index = sectors_.Index(sector);
+  const size_t record_size =
+      Entry::size(*checkpoint_partition_, kSectorErasedKey, sizeof(index));
+
+  // Start a new checkpoint sector with a checkpoint, if possible. Otherwise,
+  // erase the checkpoints, since they can no longer be used.
+  if (CheckpointSectorSpace() < record_size &&
+      (error_detected_ || stream_open_ || !WriteCheckpoint().ok() ||
+       CheckpointSectorSpace() < record_size)) {
+    WRN("Unable to record sector erasure; erasing checkpoints");
+    return InvalidateCheckpoints();
+  }
+
+  Entry record = Entry::Streamed(*checkpoint_partition_,
+                                 checkpoint_address_,
+                                 formats_.primary(),
+                                 kSectorErasedKey,
+                                 sizeof(index),
+                                 ++checkpoint_sequence_);
+
+  internal::EntryWriter writer(*checkpoint_partition_);
+  writer.Start(record);
+
+  Status status = writer.Write(as_bytes(span(kSectorErasedKey)));
+  if (status.ok()) {
+    status = writer.Write(as_bytes(span(&index, 1)));
+  }
+  status = FinishCheckpointRecord(writer, record, status);
+
+  // If the record could not be written, the checkpoints were erased instead.
+  return has_checkpoint_ ? status : Status(Status::OK);
+}
+
+// Finishes or abandons a record. If the record could not be written, the
+// checkpoints are erased so that they are not used with incomplete records.
+Status KeyValueStore::FinishCheckpointRecord(internal::EntryWriter& writer,
+                                             const Entry& record,
+                                             Status status) {
+  if (status.ok()) {
+    status = writer.Finish();
+  } else {
+    writer.Abandon();
+  }
+  if (status.ok() && options_.verify_on_write) {
+    status = record.VerifyChecksumInFlash(scratch_buffer_);
+  }
+
+  checkpoint_address_ = record.next_address();
+
+  if (!status.ok()) {
+    ERR("Failed to write checkpoint record: %s", status.str());
+    TRY(InvalidateCheckpoints());
+  }
+  return status;
+}
+
+// Returns the space left for records in the current checkpoint sector.
+size_t KeyValueStore::CheckpointSectorSpace() const {
+  if (!has_checkpoint_) {
+    return 0;
+  }
+  return AlignUp(checkpoint_address_,
+                 checkpoint_partition_->sector_size_bytes()) -
+         checkpoint_address_;
+}
+
+// Erases the next checkpoint sector so the next checkpoint can be written to
+// it. The current sector is kept until the new checkpoint is written.
+Status KeyValueStore::StartCheckpointSector() {
+  const size_t sector_size_bytes = checkpoint_partition_->sector_size_bytes();
+
+  size_t index = 0;
+  if (has_checkpoint_) {
+    index = ((checkpoint_address_ - 1) / sector_size_bytes + 1) %
+            checkpoint_partition_->sector_count();
+  }
+
+  TRY(checkpoint_partition_->Erase(index * sector_size_bytes, 1));
+  checkpoint_address_ = index * sector_size_bytes;
+  return Status::OK;
+}
+
+Status KeyValueStore::InvalidateCheckpoints() {
+  TRY(checkpoint_partition_->Erase());
+  has_checkpoint_ = false;
+  checkpoint_address_ = 0;
   return Status::OK;
 }
 
 KeyValueStore::Entry KeyValueStore::CreateEntry(Address address,
                                                 string_view key,
                                                 span<const byte> value,
-                                                EntryState state) {
+                                                EntryState state,
+                                                bool compressed,
+                                                uint32_t expiry_time) {
   // Always bump the transaction ID when creating a new entry.
   //
   // Burning transaction IDs prevents inconsistencies between flash and memory
@@ -766,12 +3132,45 @@ KeyValueStore::Entry KeyValueStore::CreateEntry(Address address,
     return Entry::Tombstone(
         partition_, address, formats_.primary(), key, last_transaction_id_);
   }
+  if (expiry_time != Entry::kNoExpiry) {
+    return Entry::Expiring(partition_,
+                           address,
+                           *formats_.Expiring(),
+                           key,
+                           value,
+                           last_transaction_id_,
+                           expiry_time);
+  }
+  return Entry::Valid(partition_,
+                      address,
+                      formats_.primary(),
+                      key,
+                      value,
+                      last_transaction_id_,
+                      false,
+                      compressed);
+}
+
+KeyValueStore::Entry KeyValueStore::CreateBatchEntry(Address address,
+                                                     string_view key,
+                                                     span<const byte> value,
+                                                     EntryState state) {
+  // Commit reserves one transaction ID for all of the entries in a batch.
+  if (state == EntryState::kDeleted) {
+    return Entry::Tombstone(partition_,
+                            address,
+                            formats_.primary(),
+                            key,
+                            last_transaction_id_,
+                            true);
+  }
   return Entry::Valid(partition_,
                       address,
                       formats_.primary(),
                       key,
                       value,
-                      last_transaction_id_);
+                      last_transaction_id_,
+                      true);
 }
 
 void KeyValueStore::LogDebugInfo() const {
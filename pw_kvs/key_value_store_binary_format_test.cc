@@ -75,13 +75,14 @@ template <uint32_t (*kChecksum)(span<const byte>, uint32_t) = &SimpleChecksum,
 constexpr auto MakeValidEntry(uint32_t magic,
                               uint32_t id,
                               const char (&key)[kKeyLengthWithNull],
-                              const std::array<byte, kValueSize>& value) {
+                              const std::array<byte, kValueSize>& value,
+                              uint8_t key_length_flags = 0) {
   constexpr size_t kKeyLength = kKeyLengthWithNull - 1;
 
   auto data = AsBytes(magic,
                       uint32_t(0),
                       uint8_t(kAlignmentBytes / 16 - 1),
-                      uint8_t(kKeyLength),
+                      uint8_t(kKeyLength | key_length_flags),
                       uint16_t(kValueSize),
                       id,
                       ByteStr(key),
@@ -294,6 +295,85 @@ TEST_F(KvsErrorHandling, Put_WriteFailure_EntryNotAddedButBytesMarkedWritten) {
   EXPECT_EQ(stats.writable_bytes, 512u * 3 - (32 + (32 * kvs_.redundancy())));
 }
 
+constexpr uint8_t kBatch = internal::Entry::kBatchFlag;
+
+// Creates the commit marker for a batch at compile time.
+constexpr auto MakeCommitMarker(uint32_t magic,
+                                uint32_t id,
+                                uint16_t entry_count) {
+  auto data = AsBytes(magic,
+                      uint32_t(0),
+                      uint8_t(0),
+                      kBatch,
+                      uint16_t(sizeof(entry_count)),
+                      id,
+                      entry_count,
+                      EntryPadding<16, 0, sizeof(entry_count)>());
+
+  uint32_t checksum = SimpleChecksum(data, 0);
+  for (size_t i = 0; i < sizeof(checksum); ++i) {
+    data[4 + i] = byte(checksum & 0xff);
+    checksum >>= 8;
+  }
+
+  return data;
+}
+
+constexpr auto kBatchEntry2 =
+    MakeValidEntry(kMagic, 7, "k2", ByteStr("value2"), kBatch);
+constexpr auto kBatchEntry3 =
+    MakeValidEntry(kMagic, 7, "k3y", ByteStr("value3"), kBatch);
+
+TEST_F(KvsErrorHandling, Init_CommittedBatch_LoadsAllEntries) {
+  constexpr auto kCommit = MakeCommitMarker(kMagic, 7, 2);
+  InitFlashTo(AsBytes(kEntry1, kBatchEntry2, kBatchEntry3, kCommit));
+
+  ASSERT_EQ(Status::OK, kvs_.Init());
+  EXPECT_EQ(3u, kvs_.size());
+  EXPECT_EQ(7u, kvs_.transaction_count());
+
+  byte buffer[64];
+  EXPECT_EQ(Status::OK, kvs_.Get("key1", buffer).status());
+  EXPECT_EQ(Status::OK, kvs_.Get("k2", buffer).status());
+  EXPECT_EQ(Status::OK, kvs_.Get("k3y", buffer).status());
+
+  auto stats = kvs_.GetStorageStats();
+  EXPECT_EQ(96u, stats.in_use_bytes);
+  EXPECT_EQ(32u, stats.reclaimable_bytes);  // The commit marker
+}
+
+TEST_F(KvsErrorHandling, Init_UncommittedBatch_IsSkipped) {
+  InitFlashTo(AsBytes(kEntry1, kBatchEntry2, kBatchEntry3));
+
+  ASSERT_EQ(Status::OK, kvs_.Init());
+  EXPECT_EQ(1u, kvs_.size());
+
+  byte buffer[64];
+  EXPECT_EQ(Status::OK, kvs_.Get("key1", buffer).status());
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("k2", buffer).status());
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("k3y", buffer).status());
+
+  // The skipped batch's transaction ID must not be reused.
+  EXPECT_EQ(7u, kvs_.transaction_count());
+
+  auto stats = kvs_.GetStorageStats();
+  EXPECT_EQ(32u, stats.in_use_bytes);
+  EXPECT_EQ(64u, stats.reclaimable_bytes);
+}
+
+TEST_F(KvsErrorHandling, Init_BatchWithWrongEntryCount_IsSkipped) {
+  constexpr auto kCommit = MakeCommitMarker(kMagic, 7, 3);
+  InitFlashTo(AsBytes(kBatchEntry2, kBatchEntry3, kCommit, kEntry1));
+
+  ASSERT_EQ(Status::OK, kvs_.Init());
+  EXPECT_EQ(1u, kvs_.size());
+
+  byte buffer[64];
+  EXPECT_EQ(Status::OK, kvs_.Get("key1", buffer).status());
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("k2", buffer).status());
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("k3y", buffer).status());
+}
+
 constexpr uint32_t kAltMagic = 0xbadD00D;
 
 constexpr uint32_t AltChecksum(span<const byte> data, uint32_t state) {
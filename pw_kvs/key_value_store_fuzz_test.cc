@@ -12,6 +12,8 @@
 // License for the specific language governing permissions and limitations under
 // the License.
 
+#include <cstring>
+
 #include "gtest/gtest.h"
 #include "pw_kvs/crc16_checksum.h"
 #include "pw_kvs/flash_partition_with_stats.h"
@@ -41,34 +43,72 @@ ChecksumCrc16 checksum;
 
 class EmptyInitializedKvs : public ::testing::Test {
  protected:
-  EmptyInitializedKvs()
-      : kvs_(&test_partition, {.magic = 0xBAD'C0D3, .checksum = &checksum}) {
+  EmptyInitializedKvs(
+      GarbageCollectPolicy gc_policy = GarbageCollectPolicy::kGreedy)
+      : kvs_(&test_partition,
+             {.magic = 0xBAD'C0D3, .checksum = &checksum},
+             {.gc_policy = gc_policy}) {
     test_partition.Erase(0, test_partition.sector_count());
     ASSERT_EQ(Status::OK, kvs_.Init());
   }
 
-  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
-};
+  void Test_PutVaryingKeysAndValues(const char* label) {
+    char value[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"  // 52
+        "34567890123";  // 64 (with final \0);
+    static_assert(sizeof(value) == 64);
 
-TEST_F(EmptyInitializedKvs, Put_VaryingKeysAndValues) {
-  char value[] =
-      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"  // 52
-      "34567890123";  // 64 (with final \0);
-  static_assert(sizeof(value) == 64);
+    test_partition.ResetCounters();
+    kvs_.set_sector_erase_counts(test_partition.sector_erase_counters());
 
-  test_partition.ResetCounters();
+    for (int i = 0; i < kFuzzIterations; ++i) {
+      for (unsigned key_size = 1; key_size < sizeof(value); ++key_size) {
+        for (unsigned value_size = 0; value_size < sizeof(value);
+             ++value_size) {
+          ASSERT_EQ(Status::OK,
+                    kvs_.Put(std::string_view(value, key_size),
+                             as_bytes(span(value, value_size))));
+        }
+      }
+    }
 
-  for (int i = 0; i < kFuzzIterations; ++i) {
+    // Each key was last written with the longest value.
+    char read_value[sizeof(value)];
     for (unsigned key_size = 1; key_size < sizeof(value); ++key_size) {
-      for (unsigned value_size = 0; value_size < sizeof(value); ++value_size) {
-        ASSERT_EQ(Status::OK,
-                  kvs_.Put(std::string_view(value, key_size),
-                           as_bytes(span(value, value_size))));
-      }
+      ASSERT_EQ(Status::OK,
+                kvs_.Get(std::string_view(value, key_size),
+                         as_writable_bytes(span(read_value)))
+                    .status());
+      ASSERT_EQ(0, std::memcmp(value, read_value, sizeof(value) - 1));
     }
+
+    test_partition.SaveStorageStats(kvs_, label);
   }
 
-  test_partition.SaveStorageStats(kvs_, "fuzz Put_VaryingKeysAndValues");
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
+};
+
+class CostBenefitKvs : public EmptyInitializedKvs {
+ protected:
+  CostBenefitKvs() : EmptyInitializedKvs(GarbageCollectPolicy::kCostBenefit) {}
+};
+
+class WearLevelingKvs : public EmptyInitializedKvs {
+ protected:
+  WearLevelingKvs()
+      : EmptyInitializedKvs(GarbageCollectPolicy::kWearLeveling) {}
+};
+
+TEST_F(EmptyInitializedKvs, Put_VaryingKeysAndValues) {
+  Test_PutVaryingKeysAndValues("fuzz Put_VaryingKeysAndValues");
+}
+
+TEST_F(CostBenefitKvs, Put_VaryingKeysAndValues) {
+  Test_PutVaryingKeysAndValues("fuzz Put_VaryingKeysAndValues CostBenefit");
+}
+
+TEST_F(WearLevelingKvs, Put_VaryingKeysAndValues) {
+  Test_PutVaryingKeysAndValues("fuzz Put_VaryingKeysAndValues WearLeveling");
 }
 
 }  // namespace
@@ -56,6 +56,7 @@ struct TestParameters {
   size_t partition_start_sector;
   size_t partition_sector_count;
   size_t partition_alignment;
+  GarbageCollectPolicy gc_policy = GarbageCollectPolicy::kGreedy;
 };
 
 enum Options {
@@ -85,7 +86,9 @@ class KvsTester {
                    kParams.partition_start_sector,
                    kParams.partition_sector_count,
                    kParams.partition_alignment),
-        kvs_(&partition_, {.magic = 0xBAD'C0D3, .checksum = nullptr}) {
+        kvs_(&partition_,
+             {.magic = 0xBAD'C0D3, .checksum = nullptr},
+             {.gc_policy = kParams.gc_policy}) {
     EXPECT_EQ(Status::OK, partition_.Erase());
     Status result = kvs_.Init();
     EXPECT_EQ(Status::OK, result);
@@ -113,6 +116,7 @@ class KvsTester {
     };
 
     partition_.ResetCounters();
+    kvs_.set_sector_erase_counts(partition_.sector_erase_counters());
 
     for (int i = 0; i < iterations; ++i) {
       if (options != kNone && random_int() % 10 == 0) {
@@ -163,6 +167,12 @@ class KvsTester {
       label << ((options == kReinitWithFullGC) ? "FullGC" : "");
       label << ((options == kReinitWithPartialGC) ? "PartialGC" : "");
       label << ((kvs_.redundancy() > 1) ? "Redundant" : "");
+      label << ((kParams.gc_policy == GarbageCollectPolicy::kCostBenefit)
+                    ? "CostBenefit"
+                    : "");
+      label << ((kParams.gc_policy == GarbageCollectPolicy::kWearLeveling)
+                    ? "WearLeveling"
+                    : "");
 
       partition_.SaveStorageStats(kvs_, label.data());
     }
@@ -489,6 +499,26 @@ RUN_TESTS_WITH_PARAMETERS(LotsOfSmallSectorsRedundant,
                           .partition_sector_count = 95,
                           .partition_alignment = 32);
 
+RUN_TESTS_WITH_PARAMETERS(LotsOfSmallSectorsCostBenefit,
+                          .sector_size = 160,
+                          .sector_count = 100,
+                          .sector_alignment = 32,
+                          .redundancy = 1,
+                          .partition_start_sector = 5,
+                          .partition_sector_count = 95,
+                          .partition_alignment = 32,
+                          .gc_policy = GarbageCollectPolicy::kCostBenefit);
+
+RUN_TESTS_WITH_PARAMETERS(LotsOfSmallSectorsWearLeveling,
+                          .sector_size = 160,
+                          .sector_count = 100,
+                          .sector_alignment = 32,
+                          .redundancy = 1,
+                          .partition_start_sector = 5,
+                          .partition_sector_count = 95,
+                          .partition_alignment = 32,
+                          .gc_policy = GarbageCollectPolicy::kWearLeveling);
+
 RUN_TESTS_WITH_PARAMETERS(OnlyTwoSectors,
                           .sector_size = 4 * 1024,
                           .sector_count = 20,
@@ -498,5 +528,102 @@ RUN_TESTS_WITH_PARAMETERS(OnlyTwoSectors,
                           .partition_sector_count = 2,
                           .partition_alignment = 64);
 
+// Counts erases regardless of PW_KVS_RECORD_PARTITION_STATS, since the
+// benchmark below needs the counts to measure the garbage collection policies.
+template <size_t kSectors>
+class CountingPartition : public FlashPartitionWithStats {
+ public:
+  CountingPartition(FlashMemory* flash)
+      : FlashPartitionWithStats(sector_counters_,
+                                flash,
+                                0,
+                                flash->sector_count(),
+                                flash->alignment_bytes()) {
+    ResetCounters();
+  }
+
+ private:
+  Vector<size_t, kSectors> sector_counters_;
+};
+
+// Overwrites a few hot keys many times while rarely touching the rest, then
+// logs the write amplification (bytes erased per byte of key and value
+// written) and the spread between the most and least erased sectors.
+void RunGarbageCollectPolicyBenchmark(GarbageCollectPolicy gc_policy,
+                                      const char* name) {
+  constexpr size_t kSectorSize = 512;
+  constexpr size_t kSectors = 32;
+  constexpr unsigned kColdKeys = 96;
+  constexpr unsigned kHotKeys = 8;
+  constexpr int kIterations = 4000;
+
+  static FakeFlashBuffer<kSectorSize, kSectors> flash(16);
+  CountingPartition<kSectors> partition(&flash);
+  KeyValueStoreBuffer<kColdKeys + kHotKeys, kSectors> kvs(
+      &partition,
+      {.magic = 0xBAD'C0D3, .checksum = nullptr},
+      {.gc_policy = gc_policy});
+
+  ASSERT_EQ(Status::OK, partition.Erase());
+  ASSERT_EQ(Status::OK, kvs.Init());
+
+  std::mt19937 random(6006411);
+  std::unordered_map<std::string, uint32_t> map;
+  size_t user_bytes = 0;
+
+  auto put = [&](unsigned key_index) {
+    const std::string key = "key" + std::to_string(key_index);
+    const uint32_t value = random();
+    ASSERT_EQ(Status::OK, kvs.Put(key, value));
+    map[key] = value;
+    user_bytes += key.size() + sizeof(value);
+  };
+
+  for (unsigned i = 0; i < kColdKeys + kHotKeys; ++i) {
+    put(i);
+  }
+
+  partition.ResetCounters();
+  kvs.set_sector_erase_counts(partition.sector_erase_counters());
+  user_bytes = 0;
+
+  for (int i = 0; i < kIterations; ++i) {
+    // 9 out of 10 writes go to the hot keys.
+    if (random() % 10 == 0) {
+      put(random() % kColdKeys);
+    } else {
+      put(kColdKeys + random() % kHotKeys);
+    }
+  }
+
+  for (const auto& [key, value] : map) {
+    uint32_t stored_value;
+    ASSERT_EQ(Status::OK, kvs.Get(key, &stored_value));
+    ASSERT_EQ(value, stored_value);
+  }
+
+  const auto erases = partition.sector_erase_counters();
+  const auto [min, max] = std::minmax_element(erases.begin(), erases.end());
+
+  PW_LOG_INFO(
+      "%-12s: write amplification %u.%02u, %zu erases, spread %zu (%zu-%zu)",
+      name,
+      unsigned(partition.total_erase_count() * kSectorSize / user_bytes),
+      unsigned(partition.total_erase_count() * kSectorSize * 100 / user_bytes %
+               100),
+      partition.total_erase_count(),
+      *max - *min,
+      *min,
+      *max);
+}
+
+TEST(GarbageCollectPolicyBenchmark, HotAndColdKeys) {
+  RunGarbageCollectPolicyBenchmark(GarbageCollectPolicy::kGreedy, "Greedy");
+  RunGarbageCollectPolicyBenchmark(GarbageCollectPolicy::kCostBenefit,
+                                   "CostBenefit");
+  RunGarbageCollectPolicyBenchmark(GarbageCollectPolicy::kWearLeveling,
+                                   "WearLeveling");
+}
+
 }  // namespace
 }  // namespace pw::kvs
@@ -18,18 +18,18 @@
 
 #include "pw_kvs/key_value_store.h"
 
+#include <algorithm>
 #include <array>
 #include <cstdio>
 #include <cstring>
-
-#if DUMP_KVS_STATE_TO_FILE
+#include <string>
 #include <vector>
-#endif  // DUMP_KVS_STATE_TO_FILE
 
 #include "gtest/gtest.h"
 #include "pw_checksum/ccitt_crc16.h"
 #include "pw_kvs/crc16_checksum.h"
 #include "pw_kvs/flash_memory.h"
+#include "pw_kvs/flash_partition_with_stats.h"
 #include "pw_kvs/internal/entry.h"
 #include "pw_kvs_private/byte_utils.h"
 #include "pw_kvs_private/macros.h"
@@ -45,6 +45,7 @@
 namespace pw::kvs {
 namespace {
 
+using internal::Entry;
 using internal::EntryHeader;
 using std::byte;
 
@@ -460,6 +461,201 @@ TEST_F(EmptyInitializedKvs, Collision_WithDeletedKey) {
   EXPECT_EQ(Status::NOT_FOUND, kvs_.Delete(key2));
 }
 
+TEST(InMemoryKvs, Collision_ChainedKeysCoexist) {
+  FakeFlashBuffer<512, 4> flash(8);
+  FlashPartition partition(&flash);
+  ASSERT_EQ(Status::OK, partition.Erase());
+
+  Options options;
+  options.chain_hash_collisions = true;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &partition, format, options);
+  ASSERT_EQ(Status::OK, kvs.Init());
+
+  // Both pairs of keys have the same hash.
+  ASSERT_EQ(Status::OK, kvs.Put("D4", 1));
+  ASSERT_EQ(Status::OK, kvs.Put("dFU6S", 2));
+  ASSERT_EQ(Status::OK, kvs.Put("1U2", 3));
+  ASSERT_EQ(Status::OK, kvs.Delete("1U2"));
+  ASSERT_EQ(Status::OK, kvs.Put("ahj9d", 4));
+  EXPECT_EQ(3u, kvs.size());
+
+  // Keys are found after Init reads them back from flash.
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> new_kvs(
+      &partition, format, options);
+  ASSERT_EQ(Status::OK, new_kvs.Init());
+  EXPECT_EQ(3u, new_kvs.size());
+
+  int value = 0;
+  ASSERT_EQ(Status::OK, new_kvs.Get("D4", &value));
+  EXPECT_EQ(1, value);
+  ASSERT_EQ(Status::OK, new_kvs.Get("dFU6S", &value));
+  EXPECT_EQ(2, value);
+  EXPECT_EQ(Status::NOT_FOUND, new_kvs.Get("1U2", &value));
+  ASSERT_EQ(Status::OK, new_kvs.Get("ahj9d", &value));
+  EXPECT_EQ(4, value);
+
+  // Deleting one key leaves the key it collides with.
+  ASSERT_EQ(Status::OK, new_kvs.Delete("D4"));
+  EXPECT_EQ(Status::NOT_FOUND, new_kvs.Get("D4", &value));
+  ASSERT_EQ(Status::OK, new_kvs.Get("dFU6S", &value));
+  EXPECT_EQ(2, value);
+
+  ASSERT_EQ(Status::OK, new_kvs.GarbageCollectFull());
+  ASSERT_EQ(Status::OK, new_kvs.Get("dFU6S", &value));
+  EXPECT_EQ(2, value);
+  ASSERT_EQ(Status::OK, new_kvs.Get("ahj9d", &value));
+  EXPECT_EQ(4, value);
+}
+
+TEST_F(EmptyInitializedKvs, Commit_AppliesAllOperations) {
+  ASSERT_EQ(Status::OK, kvs_.Put("deleted", 1));
+  ASSERT_EQ(Status::OK, kvs_.Put("updated", 2));
+
+  WriteBatchBuffer<4> batch;
+  ASSERT_EQ(Status::OK, batch.Put("new", 10));
+  ASSERT_EQ(Status::OK, batch.Put("updated", 20));
+  ASSERT_EQ(Status::OK, batch.Delete("deleted"));
+
+  const uint32_t transaction_count = kvs_.transaction_count();
+  ASSERT_EQ(Status::OK, kvs_.Commit(batch));
+  EXPECT_EQ(transaction_count + 1, kvs_.transaction_count());
+
+  for (int i = 0; i < 2; ++i) {
+    int value = 0;
+    EXPECT_EQ(Status::OK, kvs_.Get("new", &value));
+    EXPECT_EQ(10, value);
+    EXPECT_EQ(Status::OK, kvs_.Get("updated", &value));
+    EXPECT_EQ(20, value);
+    EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("deleted", &value));
+    EXPECT_EQ(2u, kvs_.size());
+
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+}
+
+TEST_F(EmptyInitializedKvs, Commit_EntriesSurviveGarbageCollection) {
+  WriteBatchBuffer<2> batch;
+  ASSERT_EQ(Status::OK, batch.Put("key1", 1));
+  ASSERT_EQ(Status::OK, batch.Put("key2", 2));
+  ASSERT_EQ(Status::OK, kvs_.Commit(batch));
+
+  // The commit marker is reclaimable, so the batch's entries are relocated
+  // without it. They must still be loaded by Init.
+  ASSERT_EQ(Status::OK, kvs_.GarbageCollectFull());
+  EXPECT_EQ(0u, kvs_.GetStorageStats().reclaimable_bytes);
+  ASSERT_EQ(Status::OK, kvs_.Init());
+
+  int value = 0;
+  EXPECT_EQ(Status::OK, kvs_.Get("key1", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_EQ(Status::OK, kvs_.Get("key2", &value));
+  EXPECT_EQ(2, value);
+}
+
+TEST_F(EmptyInitializedKvs, Commit_RepeatedKey_IsInvalid) {
+  WriteBatchBuffer<2> batch;
+  ASSERT_EQ(Status::OK, batch.Put("key", 1));
+  ASSERT_EQ(Status::OK, batch.Delete("key"));
+
+  EXPECT_EQ(Status::INVALID_ARGUMENT, kvs_.Commit(batch));
+  EXPECT_TRUE(kvs_.empty());
+}
+
+TEST_F(EmptyInitializedKvs, Commit_DeleteMissingKey_NothingApplied) {
+  WriteBatchBuffer<2> batch;
+  ASSERT_EQ(Status::OK, batch.Put("key", 1));
+  ASSERT_EQ(Status::OK, batch.Delete("missing"));
+
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Commit(batch));
+  EXPECT_TRUE(kvs_.empty());
+  EXPECT_EQ(0u, kvs_.transaction_count());
+}
+
+TEST_F(EmptyInitializedKvs, Commit_LargerThanSector_IsInvalid) {
+  constexpr const char* kKeys[] = {
+      "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7"};
+
+  WriteBatchBuffer<std::size(kKeys)> batch;
+  for (const char* key : kKeys) {
+    ASSERT_EQ(Status::OK, batch.Put(key, buffer));
+  }
+  ASSERT_GE(batch.size() * buffer.size(), test_partition.sector_size_bytes());
+  EXPECT_EQ(Status::INVALID_ARGUMENT, kvs_.Commit(batch));
+}
+
+TEST_F(EmptyInitializedKvs, WriteBatch_Full) {
+  WriteBatchBuffer<1> batch;
+  ASSERT_EQ(Status::OK, batch.Put("key1", 1));
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED, batch.Put("key2", 2));
+  EXPECT_EQ(Status::INVALID_ARGUMENT, batch.Delete(""));
+
+  batch.clear();
+  EXPECT_TRUE(batch.empty());
+  EXPECT_EQ(Status::OK, batch.Put("key2", 2));
+}
+
+TEST_F(EmptyInitializedKvs, GarbageCollectStep_NothingToCollect) {
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.GarbageCollectStep(1));
+
+  ASSERT_EQ(Status::OK, kvs_.Put("key", 1));
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.GarbageCollectStep(1));
+  EXPECT_FALSE(kvs_.garbage_collection_in_progress());
+}
+
+TEST_F(EmptyInitializedKvs, GarbageCollectStep_OneEntryPerStep) {
+  constexpr const char* kKeys[] = {"k0", "k1", "k2", "k3"};
+  for (const char* key : kKeys) {
+    ASSERT_EQ(Status::OK, kvs_.Put(key, 1));
+  }
+  ASSERT_EQ(Status::OK, kvs_.Put(kKeys[0], 2));  // Leave a stale entry.
+
+  // One step per valid entry, then one step to erase the sector.
+  for (size_t i = 0; i < std::size(kKeys); ++i) {
+    ASSERT_EQ(Status::OK, kvs_.GarbageCollectStep(1));
+    EXPECT_TRUE(kvs_.garbage_collection_in_progress());
+  }
+  ASSERT_EQ(Status::OK, kvs_.GarbageCollectStep(1));
+  EXPECT_FALSE(kvs_.garbage_collection_in_progress());
+
+  EXPECT_EQ(0u, kvs_.GetStorageStats().reclaimable_bytes);
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.GarbageCollectStep(1));
+
+  int value = 0;
+  EXPECT_EQ(Status::OK, kvs_.Get(kKeys[0], &value));
+  EXPECT_EQ(2, value);
+}
+
+TEST_F(EmptyInitializedKvs, GarbageCollectStep_InterleavedWithWrites) {
+  ASSERT_EQ(Status::OK, kvs_.Put("k0", 0));
+  ASSERT_EQ(Status::OK, kvs_.Put("k1", 1));
+  ASSERT_EQ(Status::OK, kvs_.Put("k2", 2));
+  ASSERT_EQ(Status::OK, kvs_.Delete("k2"));
+
+  ASSERT_EQ(Status::OK, kvs_.GarbageCollectStep(1));
+  ASSERT_TRUE(kvs_.garbage_collection_in_progress());
+
+  // Writes between steps go to other sectors.
+  ASSERT_EQ(Status::OK, kvs_.Put("k1", 10));
+  ASSERT_EQ(Status::OK, kvs_.Put("k3", 3));
+
+  while (kvs_.garbage_collection_in_progress()) {
+    ASSERT_EQ(Status::OK, kvs_.GarbageCollectStep(1));
+  }
+  EXPECT_EQ(0u, kvs_.GetStorageStats().reclaimable_bytes);
+
+  ASSERT_EQ(Status::OK, kvs_.Init());
+  EXPECT_EQ(3u, kvs_.size());
+
+  int value = 0;
+  EXPECT_EQ(Status::OK, kvs_.Get("k0", &value));
+  EXPECT_EQ(0, value);
+  EXPECT_EQ(Status::OK, kvs_.Get("k1", &value));
+  EXPECT_EQ(10, value);
+  EXPECT_EQ(Status::OK, kvs_.Get("k3", &value));
+  EXPECT_EQ(3, value);
+}
+
 TEST_F(EmptyInitializedKvs, Iteration_Empty_ByReference) {
   for (const KeyValueStore::Item& entry : kvs_) {
     FAIL();  // The KVS is empty; this shouldn't execute.
@@ -538,6 +734,29 @@ TEST_F(EmptyInitializedKvs, Iteration_EmptyAfterDeletion) {
   }
 }
 
+TEST_F(EmptyInitializedKvs, Iteration_Prefix) {
+  ASSERT_EQ(Status::OK, kvs_.Put("net/addr", 1));
+  ASSERT_EQ(Status::OK, kvs_.Put("sys/time", 2));
+  ASSERT_EQ(Status::OK, kvs_.Put("net", 3));
+  ASSERT_EQ(Status::OK, kvs_.Put("net/mask", 4));
+  ASSERT_EQ(Status::OK, kvs_.Put("network", 5));
+  ASSERT_EQ(Status::OK, kvs_.Delete("net/mask"));
+
+  std::vector<std::string> keys;
+  for (auto it = kvs_.begin("net/"); it != kvs_.end("net/"); ++it) {
+    keys.push_back(it->key());
+  }
+  EXPECT_EQ(std::vector<std::string>{"net/addr"}, keys);
+
+  keys.clear();
+  for (auto it = kvs_.begin("net"); it != kvs_.end(); ++it) {
+    keys.push_back(it->key());
+  }
+  EXPECT_EQ(3u, keys.size());
+
+  EXPECT_EQ(kvs_.end(), kvs_.begin("usr/"));
+}
+
 TEST_F(EmptyInitializedKvs, FuzzTest) {
   if (test_partition.sector_size_bytes() < 4 * 1024 ||
       test_partition.sector_count() < 4) {
@@ -731,6 +950,1708 @@ TEST(InMemoryKvs, WriteAndReadOneKey) {
   EXPECT_EQ(kvs.size(), 1u);
 }
 
+TEST(InMemoryKvs, KeyCache_LookupsAndIterationUseCachedKeys) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+
+  constexpr EntryFormat format{.magic = 0xBAD'C0D3, .checksum = nullptr};
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 1, 1, 0, 4> kvs(
+      &flash.partition, format);
+  ASSERT_OK(kvs.Init());
+
+  ASSERT_OK(kvs.Put("Key1", uint8_t(1)));
+  ASSERT_OK(kvs.Put("Key1", uint8_t(2)));  // Finds Key1 and caches it.
+  EXPECT_EQ(0u, kvs.GetKeyCacheStats().hits);
+  EXPECT_EQ(1u, kvs.GetKeyCacheStats().misses);
+
+  uint8_t value;
+  ASSERT_OK(kvs.Get("Key1", &value));
+  EXPECT_EQ(2u, value);
+  EXPECT_EQ(1u, kvs.GetKeyCacheStats().hits);
+
+  for (const auto& item : kvs) {
+    EXPECT_STREQ("Key1", item.key());
+  }
+  EXPECT_EQ(2u, kvs.GetKeyCacheStats().hits);
+  EXPECT_EQ(1u, kvs.GetKeyCacheStats().misses);
+}
+
+TEST(InMemoryKvs, Init_ReadsEachEntryOnce) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartitionWithStatsBuffer<4> partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  constexpr EntryFormat format{.magic = 0xBAD'C0D3, .checksum = nullptr};
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&partition, format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr size_t kEntries = 20;
+  for (size_t i = 0; i < kEntries; ++i) {
+    ASSERT_OK(kvs.Put(i % 2 == 0 ? "even" : "odd", i));
+  }
+
+  // Loading an entry reads its header, its key, and then the whole entry to
+  // verify it. Reaching the end of the written data in each sector takes up to
+  // two more reads. No entry is read again to count valid bytes.
+  partition.ResetCounters();
+  ASSERT_OK(kvs.Init());
+  EXPECT_LE(partition.read_count(), 3 * kEntries + 2 * partition.sector_count());
+
+  const KeyValueStore::StorageStats stats = kvs.GetStorageStats();
+  EXPECT_EQ(2 * internal::Entry::size(partition, "even", sizeof(size_t)),
+            stats.in_use_bytes);
+}
+
+TEST(InMemoryKvs, Iteration_IndexedKeyPrefixes_ReadsOnlyMatchingKeys) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartitionWithStatsBuffer<4> partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 1, 1, 0, 0, true> kvs(
+      &partition, format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr size_t kKeys = 8;
+  for (size_t i = 0; i < kKeys; ++i) {
+    const char net_key[] = {'n', 'e', 't', '/', char('a' + i), '\0'};
+    const char sys_key[] = {'s', 'y', 's', '/', char('a' + i), '\0'};
+    ASSERT_OK(kvs.Put(net_key, i));
+    ASSERT_OK(kvs.Put(sys_key, i));
+  }
+  ASSERT_OK(kvs.Init());
+
+  // Matching keys are read (header and key) when dereferenced. Other keys are
+  // ruled out by their prefixes without reading flash.
+  partition.ResetCounters();
+  size_t count = 0;
+  for (auto it = kvs.begin("net/"); it != kvs.end(); ++it) {
+    EXPECT_EQ(0, std::strncmp("net/", it->key(), 4));
+    count += 1;
+  }
+  EXPECT_EQ(kKeys, count);
+  EXPECT_EQ(2 * kKeys, partition.read_count());
+}
+
+constexpr uint32_t kEraseLatencyUs = 10'000;
+
+// Writes stale entries and runs garbage collection steps until a sector erase
+// is started.
+void StartBackgroundErase(FakeFlashBuffer<512, 4>& flash, KeyValueStore& kvs) {
+  for (size_t i = 0; i < 20; ++i) {
+    ASSERT_OK(kvs.Put("key", i));
+  }
+  flash.SetLatency(kEraseLatencyUs, 0);
+
+  for (int step = 0; step < 20 && !flash.erase_in_progress(); ++step) {
+    ASSERT_OK(kvs.GarbageCollectStep(1024));
+  }
+  ASSERT_TRUE(flash.erase_in_progress());
+  ASSERT_TRUE(kvs.garbage_collection_in_progress());
+}
+
+TEST(InMemoryKvs, MaintenanceStep_KeepsSpareSectorsErased) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  Options options;
+  options.spare_sectors = 1;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &partition, format, options);
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs.MaintenanceStep(512));
+  ASSERT_OK(kvs.Init());
+
+  // Each entry takes a quarter of a sector. Fill the three sectors that are not
+  // kept empty for garbage collection with stale copies of one key.
+  std::array<byte, 100> value = {};
+  for (int i = 0; i < 12; ++i) {
+    value[0] = byte(i);
+    ASSERT_OK(kvs.Put("key", value));
+  }
+  ASSERT_EQ(0u, kvs.GetStorageStats().writable_bytes);
+
+  size_t steps = 0;
+  Status status;
+  while ((status = kvs.MaintenanceStep(512)).ok()) {
+    ASSERT_LT(++steps, 20u);
+  }
+  EXPECT_EQ(Status::NOT_FOUND, status);
+  EXPECT_FALSE(kvs.garbage_collection_in_progress());
+  EXPECT_EQ(512u, kvs.GetStorageStats().writable_bytes);
+
+  // There is still reclaimable space, but enough sectors are erased.
+  EXPECT_NE(0u, kvs.GetStorageStats().reclaimable_bytes);
+  EXPECT_EQ(Status::NOT_FOUND, kvs.MaintenanceStep(512));
+
+  // Writes to the spare sector do not wait for an erase.
+  flash.SetLatency(kEraseLatencyUs, 0);
+  const uint32_t start_us = flash.elapsed_us();
+  for (int i = 0; i < 4; ++i) {
+    value[0] = byte(i);
+    ASSERT_OK(kvs.Put("key", value));
+  }
+  EXPECT_EQ(start_us, flash.elapsed_us());
+
+  std::array<byte, 100> read_value = {};
+  EXPECT_OK(kvs.Get("key", read_value).status());
+  EXPECT_EQ(value, read_value);
+}
+
+TEST(InMemoryKvs, GarbageCollectStep_EraseRunsInBackground) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&partition, format);
+  ASSERT_OK(kvs.Init());
+  StartBackgroundErase(flash, kvs);
+  const uint32_t start_us = flash.elapsed_us();
+
+  // Entries remain readable while the erase is in progress.
+  size_t value = 0;
+  EXPECT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(19u, value);
+
+  EXPECT_EQ(Status::UNAVAILABLE, kvs.GarbageCollectStep(1024));
+  EXPECT_TRUE(flash.erase_in_progress());
+
+  flash.AdvanceTime(kEraseLatencyUs);
+  EXPECT_OK(kvs.GarbageCollectStep(1024));
+  EXPECT_FALSE(flash.erase_in_progress());
+  EXPECT_FALSE(kvs.garbage_collection_in_progress());
+  EXPECT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(19u, value);
+
+  // Only the time advanced by the caller passed; nothing waited on the erase.
+  EXPECT_EQ(start_us + kEraseLatencyUs, flash.elapsed_us());
+}
+
+TEST(InMemoryKvs, Put_DuringErase_WritesToOtherSector) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&partition, format);
+  ASSERT_OK(kvs.Init());
+  StartBackgroundErase(flash, kvs);
+  const uint32_t start_us = flash.elapsed_us();
+
+  ASSERT_OK(kvs.Put("other", 1));
+  EXPECT_TRUE(flash.erase_in_progress());
+  EXPECT_EQ(start_us, flash.elapsed_us());
+
+  // Garbage collection waits for the erase before starting another.
+  ASSERT_OK(kvs.GarbageCollectFull());
+  EXPECT_FALSE(flash.erase_in_progress());
+  EXPECT_FALSE(kvs.garbage_collection_in_progress());
+  EXPECT_LE(start_us + kEraseLatencyUs, flash.elapsed_us());
+
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(2u, kvs.size());
+}
+
+TEST(InMemoryKvs, Put_NeedsSectorBeingErased_WaitsForErase) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&partition, format);
+  ASSERT_OK(kvs.Init());
+  StartBackgroundErase(flash, kvs);
+  const uint32_t start_us = flash.elapsed_us();
+
+  // Fill the remaining space until a write needs the sector being erased.
+  std::array<byte, 100> value = {};
+  for (int i = 0; i < 20 && flash.erase_in_progress(); ++i) {
+    value[0] = byte(i);
+    ASSERT_OK(kvs.Put("fill", value));
+  }
+  EXPECT_FALSE(flash.erase_in_progress());
+  EXPECT_EQ(start_us + kEraseLatencyUs, flash.elapsed_us());
+
+  std::array<byte, 100> read_value = {};
+  EXPECT_OK(kvs.Get("fill", read_value).status());
+  EXPECT_EQ(value, read_value);
+}
+
+TEST(InMemoryKvs, Commit_InterruptedBatch_IsNotApplied) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+
+  constexpr EntryFormat format{.magic = 0xBAD'C0D3, .checksum = nullptr};
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+  ASSERT_OK(kvs.Put("key1", 1));
+
+  WriteBatchBuffer<2> batch;
+  ASSERT_OK(batch.Put("key1", 2));
+  ASSERT_OK(batch.Put("key2", 2));
+
+  // Fail the write of each entry in the batch in turn. The commit marker is
+  // never written, so the batch is not applied, even after reinitializing.
+  for (size_t failed_write = 0; failed_write < 2u; ++failed_write) {
+    flash.memory.InjectWriteError(
+        FlashError::Unconditional(Status::UNAVAILABLE, 1, failed_write));
+    EXPECT_EQ(Status::UNAVAILABLE, kvs.Commit(batch));
+
+    for (int i = 0; i < 2; ++i) {
+      int value = 0;
+      EXPECT_OK(kvs.Get("key1", &value));
+      EXPECT_EQ(1, value);
+      EXPECT_EQ(Status::NOT_FOUND, kvs.Get("key2", &value));
+
+      ASSERT_OK(kvs.Init());
+    }
+  }
+
+  ASSERT_OK(kvs.Commit(batch));
+  int value = 0;
+  EXPECT_OK(kvs.Get("key2", &value));
+  EXPECT_EQ(2, value);
+}
+
+namespace {
+
+// Writes a value to a ValueWriter in chunks of up to chunk_size bytes.
+Status StreamValue(KeyValueStore::ValueWriter& writer,
+                   span<const byte> value,
+                   size_t chunk_size) {
+  while (!value.empty()) {
+    const size_t size = std::min(chunk_size, value.size());
+    if (StatusWithSize result = writer.Write(value.first(size)); !result.ok()) {
+      return result.status();
+    }
+    value = value.subspan(size);
+  }
+  return writer.Finish();
+}
+
+template <size_t kSize>
+std::array<byte, kSize> MakeStreamValue() {
+  std::array<byte, kSize> value;
+  for (size_t i = 0; i < value.size(); ++i) {
+    value[i] = byte(i * 7);
+  }
+  return value;
+}
+
+}  // namespace
+
+TEST_F(EmptyInitializedKvs, ValueWriter_WritesValueInPieces) {
+  const auto value = MakeStreamValue<1000>();
+
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("blob", value.size()));
+  EXPECT_TRUE(writer.is_open());
+  EXPECT_EQ(value.size(), writer.bytes_remaining());
+  ASSERT_OK(StreamValue(writer, value, 37));
+  EXPECT_FALSE(writer.is_open());
+
+  for (int i = 0; i < 2; ++i) {
+    std::array<byte, 1000> read_value = {};
+    StatusWithSize result = kvs_.Get("blob", read_value);
+    ASSERT_OK(result.status());
+    EXPECT_EQ(value.size(), result.size());
+    EXPECT_EQ(0, std::memcmp(value.data(), read_value.data(), value.size()));
+
+    ASSERT_OK(kvs_.Init());
+  }
+}
+
+TEST_F(EmptyInitializedKvs, ValueWriter_ValueInFirstAlignmentUnit) {
+  const auto value = MakeStreamValue<3>();
+
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("k", value.size()));
+  ASSERT_OK(StreamValue(writer, value, 1));
+
+  std::array<byte, 3> read_value = {};
+  ASSERT_OK(kvs_.Get("k", read_value).status());
+  EXPECT_EQ(value, read_value);
+}
+
+TEST_F(EmptyInitializedKvs, ValueWriter_ReplacesExistingValue) {
+  ASSERT_OK(kvs_.Put("key", uint32_t(1)));
+
+  const uint32_t new_value = 2;
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("key", sizeof(new_value)));
+  ASSERT_OK(StreamValue(writer, as_bytes(span(&new_value, 1)), 1));
+
+  uint32_t value = 0;
+  EXPECT_OK(kvs_.Get("key", &value));
+  EXPECT_EQ(2u, value);
+  EXPECT_EQ(1u, kvs_.size());
+}
+
+TEST_F(EmptyInitializedKvs, ValueWriter_IncompleteValue) {
+  const auto value = MakeStreamValue<10>();
+
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("blob", value.size()));
+  ASSERT_OK(writer.Write(span(value).first(4)).status());
+
+  EXPECT_EQ(Status::FAILED_PRECONDITION, writer.Finish());
+  EXPECT_EQ(Status::OUT_OF_RANGE, writer.Write(span(value).first(7)).status());
+
+  ASSERT_OK(writer.Write(span(value).subspan(4)).status());
+  EXPECT_OK(writer.Finish());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, writer.Finish());
+}
+
+TEST_F(EmptyInitializedKvs, ValueWriter_OtherOperationsWaitForStream) {
+  const auto value = MakeStreamValue<10>();
+
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("blob", value.size()));
+
+  KeyValueStore::ValueWriter other_writer(kvs_);
+  EXPECT_EQ(Status::FAILED_PRECONDITION, other_writer.Open("key", 1));
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Put("key", 1));
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Get("key", buffer).status());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.GarbageCollectFull());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Init());
+
+  ASSERT_OK(StreamValue(writer, value, value.size()));
+  EXPECT_OK(kvs_.Put("key", 1));
+}
+
+TEST_F(EmptyInitializedKvs, ValueWriter_Abandoned_IsSkippedByInit) {
+  const auto value = MakeStreamValue<200>();
+  {
+    KeyValueStore::ValueWriter writer(kvs_);
+    ASSERT_OK(writer.Open("blob", value.size()));
+    ASSERT_OK(writer.Write(span(value).first(100)).status());
+  }
+
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("blob", buffer).status());
+  ASSERT_OK(kvs_.Put("key", 1));
+
+  // The entry's header was never written, but the data after it was. Init must
+  // not treat that space as writable.
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.Init());
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("blob", buffer).status());
+
+  int read_value = 0;
+  EXPECT_OK(kvs_.Get("key", &read_value));
+  EXPECT_EQ(1, read_value);
+
+  ASSERT_OK(kvs_.Put("key", 2));
+  EXPECT_OK(kvs_.Get("key", &read_value));
+  EXPECT_EQ(2, read_value);
+}
+
+TEST(InMemoryKvs, ValueWriter_WritesRedundantCopies) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+
+  const auto value = MakeStreamValue<100>();
+  KeyValueStore::ValueWriter writer(kvs);
+  ASSERT_OK(writer.Open("blob", value.size()));
+  ASSERT_OK(StreamValue(writer, value, 30));
+
+  const size_t entry_size = AlignUp(sizeof(EntryHeader) + 4 + 100, 16);
+  EXPECT_EQ(2 * entry_size, kvs.GetStorageStats().in_use_bytes);
+
+  ASSERT_OK(kvs.Init());
+  std::array<byte, 100> read_value = {};
+  ASSERT_OK(kvs.Get("blob", read_value).status());
+  EXPECT_EQ(value, read_value);
+}
+
+TEST(InMemoryKvs, ValueWriter_LargeAlignment) {
+  // With 64-byte alignment, the start of the key and value share an alignment
+  // unit with the header and are written last.
+  Flash flash(64);
+  ASSERT_OK(flash.partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+
+  const auto small_value = MakeStreamValue<3>();
+  const auto large_value = MakeStreamValue<200>();
+
+  KeyValueStore::ValueWriter writer(kvs);
+  ASSERT_OK(writer.Open("small", small_value.size()));
+  ASSERT_OK(StreamValue(writer, small_value, 2));
+  ASSERT_OK(writer.Open("large", large_value.size()));
+  ASSERT_OK(StreamValue(writer, large_value, 17));
+
+  ASSERT_OK(kvs.Init());
+
+  std::array<byte, 3> small_read = {};
+  ASSERT_OK(kvs.Get("small", small_read).status());
+  EXPECT_EQ(small_value, small_read);
+
+  std::array<byte, 200> large_read = {};
+  ASSERT_OK(kvs.Get("large", large_read).status());
+  EXPECT_EQ(large_value, large_read);
+}
+
+TEST_F(EmptyInitializedKvs, ValueReader_ReadsValueInPieces) {
+  const auto value = MakeStreamValue<300>();
+  ASSERT_OK(kvs_.Put("blob", value));
+
+  KeyValueStore::ValueReader reader(kvs_);
+  StatusWithSize result = reader.Open("blob");
+  ASSERT_OK(result.status());
+  EXPECT_EQ(value.size(), result.size());
+
+  std::array<byte, 300> read_value = {};
+  size_t offset = 0;
+  while (reader.is_open()) {
+    result = reader.Read(span(read_value).subspan(offset).first(
+        std::min<size_t>(23, read_value.size() - offset)));
+    ASSERT_OK(result.status());
+    offset += result.size();
+  }
+
+  EXPECT_EQ(value.size(), offset);
+  EXPECT_EQ(value, read_value);
+  EXPECT_EQ(Status::FAILED_PRECONDITION, reader.Read(read_value).status());
+  EXPECT_OK(kvs_.Put("key", 1));
+}
+
+TEST_F(EmptyInitializedKvs, ValueReader_CorruptValue_FailsAtEndOfStream) {
+  const auto value = MakeStreamValue<64>();
+  ASSERT_OK(kvs_.Put("blob", value));
+
+  // Corrupt the last byte of the value in flash.
+  span<byte> flash = test_flash.buffer();
+  auto position =
+      std::search(flash.begin(), flash.end(), value.begin(), value.end());
+  ASSERT_NE(flash.end(), position);
+  position[value.size() - 1] = ~position[value.size() - 1];
+
+  KeyValueStore::ValueReader reader(kvs_);
+  ASSERT_OK(reader.Open("blob").status());
+
+  std::array<byte, 32> chunk;
+  EXPECT_OK(reader.Read(chunk).status());
+
+  StatusWithSize result = reader.Read(chunk);
+  EXPECT_EQ(Status::DATA_LOSS, result.status());
+  EXPECT_EQ(chunk.size(), result.size());
+  EXPECT_FALSE(reader.is_open());
+}
+
+TEST_F(EmptyInitializedKvs, ValueReader_Close) {
+  ASSERT_OK(kvs_.Put("blob", MakeStreamValue<64>()));
+
+  KeyValueStore::ValueReader reader(kvs_);
+  ASSERT_OK(reader.Open("blob").status());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Put("key", 1));
+
+  reader.Close();
+  EXPECT_FALSE(reader.is_open());
+  EXPECT_OK(kvs_.Put("key", 1));
+}
+
+namespace {
+
+// Fake flash that reports its buffer as memory-mapped.
+class MemoryMappedFakeFlash : public FakeFlashBuffer<512, 4> {
+ public:
+  MemoryMappedFakeFlash() : FakeFlashBuffer<512, 4>(16) {}
+
+  std::byte* FlashAddressToMcuAddress(Address address) const override {
+    return buffer().data() + address;
+  }
+};
+
+// Flips the bits of the first byte of the value in flash.
+template <typename T>
+void CorruptValue(span<byte> flash, const T& value) {
+  const auto bytes = as_bytes(span(&value, 1));
+  auto position =
+      std::search(flash.begin(), flash.end(), bytes.begin(), bytes.end());
+  ASSERT_NE(flash.end(), position);
+  *position = ~*position;
+}
+
+constexpr Options kVerifyOnceOptions = [] {
+  Options options;
+  options.verify_once_on_read = true;
+  return options;
+}();
+
+class MemoryMappedKvs : public ::testing::Test {
+ protected:
+  MemoryMappedKvs()
+      : partition_(&flash_), kvs_(&partition_, format, kVerifyOnceOptions) {
+    partition_.Erase();
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+
+  MemoryMappedFakeFlash flash_;
+  FlashPartition partition_;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
+};
+
+}  // namespace
+
+TEST_F(MemoryMappedKvs, Get_VerifiedEntry_IsNotVerifiedAgain) {
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs_.Put("key", kValue));
+
+  // The entry was verified when it was written, so corruption afterwards is
+  // not detected when reading it.
+  CorruptValue(flash_.buffer(), kValue);
+  uint32_t value = 0;
+  EXPECT_OK(kvs_.Get("key", &value));
+  EXPECT_NE(kValue, value);
+}
+
+TEST(InMemoryKvs, VerifyOnceOnRead_NotMemoryMapped_VerifiesEveryRead) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &partition, format, kVerifyOnceOptions);
+  ASSERT_OK(kvs.Init());
+
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", kValue));
+
+  CorruptValue(flash.buffer(), kValue);
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Get("key", &value));
+}
+
+TEST_F(MemoryMappedKvs, VerifyAll_FindsCorruptEntry) {
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs_.Put("a", 1));
+  ASSERT_OK(kvs_.Put("key", kValue));
+  ASSERT_OK(kvs_.Put("b", 2));
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.VerifyAll(1024));
+
+  CorruptValue(flash_.buffer(), kValue);
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.VerifyAll(1024));
+
+  // The corrupt entry is verified again the next time it is read.
+  uint32_t value = 0;
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.Get("key", &value));
+  EXPECT_OK(kvs_.Get("a", &value));
+}
+
+TEST_F(MemoryMappedKvs, VerifyAll_SpreadAcrossCalls) {
+  constexpr size_t kEntries = 8;
+  for (size_t i = 0; i < kEntries; ++i) {
+    const char key[] = {char('a' + i), '\0'};
+    ASSERT_OK(kvs_.Put(key, i));
+  }
+
+  // Each call verifies at least one entry and then stops.
+  for (size_t i = 1; i < kEntries; ++i) {
+    EXPECT_EQ(Status::OK, kvs_.VerifyAll(1));
+  }
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.VerifyAll(1));
+
+  // The next pass starts over from the first entry.
+  EXPECT_EQ(Status::OK, kvs_.VerifyAll(1));
+}
+
+TEST_F(MemoryMappedKvs, GetView_RefersToValueInFlash) {
+  constexpr auto kValue = AsBytes(uint64_t(0x0123'4567'89AB'CDEF));
+  ASSERT_OK(kvs_.Put("key", kValue));
+
+  span<const byte> view;
+  ASSERT_OK(kvs_.GetView("key", &view));
+  ASSERT_EQ(kValue.size(), view.size());
+  EXPECT_EQ(0, std::memcmp(kValue.data(), view.data(), view.size()));
+
+  const span<byte> flash = flash_.buffer();
+  EXPECT_GE(view.data(), flash.data());
+  EXPECT_LE(view.data() + view.size(), flash.data() + flash.size());
+}
+
+TEST_F(MemoryMappedKvs, GetView_CorruptValue_DataLoss) {
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs_.Put("key", kValue));
+
+  CorruptValue(flash_.buffer(), kValue);
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.VerifyAll(1024));
+
+  span<const byte> view;
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.GetView("key", &view));
+}
+
+TEST_F(MemoryMappedKvs, GetView_MissingKey_NotFound) {
+  span<const byte> view;
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.GetView("key", &view));
+}
+
+TEST_F(MemoryMappedKvs, EraseEpoch_ChangesWhenSectorIsErased) {
+  ASSERT_OK(kvs_.Put("key", 1));
+  ASSERT_OK(kvs_.Put("key", 2));
+
+  span<const byte> view;
+  ASSERT_OK(kvs_.GetView("key", &view));
+  const uint32_t epoch = kvs_.erase_epoch();
+
+  ASSERT_OK(kvs_.GarbageCollectFull());
+  EXPECT_NE(epoch, kvs_.erase_epoch());
+}
+
+TEST_F(EmptyInitializedKvs, GetView_NotMemoryMapped_Unimplemented) {
+  ASSERT_OK(kvs_.Put("key", 1));
+
+  span<const byte> view;
+  EXPECT_EQ(Status::UNIMPLEMENTED, kvs_.GetView("key", &view));
+}
+
+TEST_F(MemoryMappedKvs, VerifyAll_StreamOpen_FailedPrecondition) {
+  ASSERT_OK(kvs_.Put("key", 1));
+
+  KeyValueStore::ValueReader reader(kvs_);
+  ASSERT_OK(reader.Open("key").status());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.VerifyAll(1024));
+}
+
+namespace {
+
+class CheckpointKvs : public ::testing::Test {
+ protected:
+  CheckpointKvs() : kvs_(&flash_.partition, format) {
+    flash_.partition.Erase();
+    checkpoint_flash_.partition.Erase();
+    kvs_.set_checkpoint_partition(&checkpoint_flash_.partition);
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+
+  // Checks that the KVS matches a KVS initialized by reading every entry.
+  void ExpectMatchesFullScan() {
+    KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> scanned(
+        &flash_.partition, format);
+    ASSERT_OK(scanned.Init());
+
+    EXPECT_EQ(scanned.size(), kvs_.size());
+    EXPECT_EQ(scanned.GetStorageStats().writable_bytes,
+              kvs_.GetStorageStats().writable_bytes);
+    EXPECT_EQ(scanned.GetStorageStats().in_use_bytes,
+              kvs_.GetStorageStats().in_use_bytes);
+    EXPECT_EQ(scanned.GetStorageStats().reclaimable_bytes,
+              kvs_.GetStorageStats().reclaimable_bytes);
+  }
+
+  std::array<byte, 512 * 3> CopyCheckpoints() {
+    std::array<byte, 512 * 3> checkpoints;
+    span<byte> memory = checkpoint_flash_.memory.buffer();
+    std::copy(memory.begin(), memory.end(), checkpoints.begin());
+    return checkpoints;
+  }
+
+  Flash flash_;
+  FlashWithPartitionFake<512, 3> checkpoint_flash_;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
+};
+
+}  // namespace
+
+TEST_F(CheckpointKvs, Init_LoadsCheckpoint) {
+  ASSERT_OK(kvs_.Put("a", 1));
+  ASSERT_OK(kvs_.Put("b", 2));
+  ASSERT_OK(kvs_.Put("c", 3));
+  ASSERT_OK(kvs_.Delete("b"));
+  ASSERT_OK(kvs_.Checkpoint());
+
+  ASSERT_OK(kvs_.Init());
+  EXPECT_EQ(2u, kvs_.size());
+
+  int value = 0;
+  EXPECT_OK(kvs_.Get("a", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("b", &value));
+  EXPECT_OK(kvs_.Get("c", &value));
+  EXPECT_EQ(3, value);
+
+  ExpectMatchesFullScan();
+}
+
+TEST_F(CheckpointKvs, Init_ReplaysEntriesWrittenAfterCheckpoint) {
+  ASSERT_OK(kvs_.Put("a", 1));
+  ASSERT_OK(kvs_.Put("b", 2));
+  ASSERT_OK(kvs_.Checkpoint());
+
+  ASSERT_OK(kvs_.Put("a", 10));
+  ASSERT_OK(kvs_.Delete("b"));
+  ASSERT_OK(kvs_.Put("c", 3));
+
+  WriteBatchBuffer<2> batch;
+  ASSERT_OK(batch.Put("a", 11));
+  ASSERT_OK(batch.Put("d", 4));
+  ASSERT_OK(kvs_.Commit(batch));
+
+  ASSERT_OK(kvs_.Init());
+  EXPECT_EQ(3u, kvs_.size());
+
+  int value = 0;
+  EXPECT_OK(kvs_.Get("a", &value));
+  EXPECT_EQ(11, value);
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("b", &value));
+  EXPECT_OK(kvs_.Get("c", &value));
+  EXPECT_EQ(3, value);
+  EXPECT_OK(kvs_.Get("d", &value));
+  EXPECT_EQ(4, value);
+
+  ExpectMatchesFullScan();
+}
+
+TEST_F(CheckpointKvs, Init_DoesNotReadEntriesInCheckpoint) {
+  constexpr uint32_t kValue = 0x5EC7'10AD;
+  ASSERT_OK(kvs_.Put("key", kValue));
+  ASSERT_OK(kvs_.Checkpoint());
+
+  // Corrupt the entry's value.
+  span<byte> memory = flash_.memory.buffer();
+  const auto value_bytes = as_bytes(span(&kValue, 1));
+  auto value_in_flash = std::search(
+      memory.begin(), memory.end(), value_bytes.begin(), value_bytes.end());
+  ASSERT_NE(memory.end(), value_in_flash);
+  *value_in_flash ^= byte{0xFF};
+
+  // Init loads the entry from the checkpoint, so the corruption is only found
+  // when the entry is read.
+  ASSERT_OK(kvs_.Init());
+  uint32_t value;
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.Get("key", &value));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> scanned(&flash_.partition,
+                                                              format);
+  EXPECT_EQ(Status::DATA_LOSS, scanned.Init());
+}
+
+TEST_F(CheckpointKvs, Init_AfterGarbageCollection) {
+  ASSERT_OK(kvs_.Put("a", 1));
+  ASSERT_OK(kvs_.Put("b", 2));
+  ASSERT_OK(kvs_.Checkpoint());
+
+  // Rewrite a key enough times to garbage collect each sector several times.
+  std::array<byte, 48> value = {};
+  for (size_t i = 0; i < 100u; ++i) {
+    value[0] = byte(i);
+    ASSERT_OK(kvs_.Put("big", value));
+  }
+  ASSERT_OK(kvs_.Put("a", 5));
+
+  ASSERT_OK(kvs_.Init());
+  EXPECT_EQ(3u, kvs_.size());
+
+  int int_value = 0;
+  EXPECT_OK(kvs_.Get("a", &int_value));
+  EXPECT_EQ(5, int_value);
+  EXPECT_OK(kvs_.Get("b", &int_value));
+  EXPECT_EQ(2, int_value);
+
+  std::array<byte, 48> read_value;
+  EXPECT_OK(kvs_.Get("big", &read_value));
+  EXPECT_EQ(byte(99), read_value[0]);
+
+  ExpectMatchesFullScan();
+}
+
+TEST_F(CheckpointKvs, Init_AfterGarbageCollection_ChainedCollisions) {
+  Options options;
+  options.chain_hash_collisions = true;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &flash_.partition, format, options);
+  kvs.set_checkpoint_partition(&checkpoint_flash_.partition);
+  ASSERT_OK(kvs.Init());
+
+  // "D4" and "dFU6S" have the same hash.
+  ASSERT_OK(kvs.Put("stale", 0));
+  ASSERT_OK(kvs.Put("D4", 1));
+  ASSERT_OK(kvs.Put("dFU6S", 2));
+  ASSERT_OK(kvs.Checkpoint());
+
+  // Garbage collect the sector with the checkpointed entries. Their descriptors
+  // have no addresses until the relocated copies are loaded, and the newer
+  // entry for "D4" replaces whichever descriptor it is matched to.
+  ASSERT_OK(kvs.Put("stale", 3));
+  ASSERT_OK(kvs.GarbageCollectFull());
+  ASSERT_OK(kvs.Put("D4", 5));
+
+  // Init erases the checkpoint partition if it cannot use the checkpoint.
+  const auto checkpoints = CopyCheckpoints();
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(checkpoints, CopyCheckpoints());
+  EXPECT_EQ(3u, kvs.size());
+
+  int int_value = 0;
+  EXPECT_OK(kvs.Get("D4", &int_value));
+  EXPECT_EQ(5, int_value);
+  EXPECT_OK(kvs.Get("dFU6S", &int_value));
+  EXPECT_EQ(2, int_value);
+
+  EXPECT_OK(kvs.Get("stale", &int_value));
+  EXPECT_EQ(3, int_value);
+}
+
+TEST_F(CheckpointKvs, Init_AfterGarbageCollection_ChainedCollisionsInBatch) {
+  Options options;
+  options.chain_hash_collisions = true;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &flash_.partition, format, options);
+  kvs.set_checkpoint_partition(&checkpoint_flash_.partition);
+  ASSERT_OK(kvs.Init());
+
+  // "1U2" and "ahj9d" have the same hash, and the batch gives their entries the
+  // same transaction ID, so their relocated copies cannot be matched to their
+  // checkpointed descriptors. The checkpoint is not used.
+  ASSERT_OK(kvs.Put("stale", 0));
+  WriteBatchBuffer<2> batch;
+  ASSERT_OK(batch.Put("1U2", 3));
+  ASSERT_OK(batch.Put("ahj9d", 4));
+  ASSERT_OK(kvs.Commit(batch));
+  ASSERT_OK(kvs.Checkpoint());
+
+  ASSERT_OK(kvs.Put("stale", 1));
+  ASSERT_OK(kvs.GarbageCollectFull());
+
+  const auto checkpoints = CopyCheckpoints();
+  ASSERT_OK(kvs.Init());
+  EXPECT_NE(checkpoints, CopyCheckpoints());
+  EXPECT_EQ(3u, kvs.size());
+
+  int int_value = 0;
+  EXPECT_OK(kvs.Get("1U2", &int_value));
+  EXPECT_EQ(3, int_value);
+  EXPECT_OK(kvs.Get("ahj9d", &int_value));
+  EXPECT_EQ(4, int_value);
+}
+
+TEST_F(CheckpointKvs, Init_PartitionErased_ReadsAllEntries) {
+  ASSERT_OK(kvs_.Put("a", 1));
+  ASSERT_OK(kvs_.Checkpoint());
+
+  ASSERT_OK(flash_.partition.Erase());
+  ASSERT_OK(kvs_.Init());
+  EXPECT_EQ(0u, kvs_.size());
+
+  ASSERT_OK(kvs_.Put("a", 2));
+  ASSERT_OK(kvs_.Init());
+
+  int value = 0;
+  EXPECT_OK(kvs_.Get("a", &value));
+  EXPECT_EQ(2, value);
+}
+
+TEST_F(CheckpointKvs, Checkpoint_RotatesSectors) {
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_OK(kvs_.Put("a", i));
+    ASSERT_OK(kvs_.Put(i % 2 == 0 ? "even" : "odd", i));
+    ASSERT_OK(kvs_.Checkpoint());
+  }
+
+  ASSERT_OK(kvs_.Init());
+
+  int value = 0;
+  EXPECT_OK(kvs_.Get("a", &value));
+  EXPECT_EQ(19, value);
+  EXPECT_OK(kvs_.Get("even", &value));
+  EXPECT_EQ(18, value);
+  EXPECT_OK(kvs_.Get("odd", &value));
+  EXPECT_EQ(19, value);
+
+  ExpectMatchesFullScan();
+}
+
+TEST_F(CheckpointKvs, Checkpoint_StreamOpen_FailedPrecondition) {
+  KeyValueStore::ValueWriter writer(kvs_);
+  ASSERT_OK(writer.Open("blob", 10));
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Checkpoint());
+}
+
+TEST_F(EmptyInitializedKvs, Checkpoint_NoCheckpointPartition_FailedPrecondition) {
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs_.Checkpoint());
+}
+
+TEST(InMemoryKvs, Checkpoint_WrittenAtInterval) {
+  Flash flash;
+  FlashWithPartitionFake<512, 2> checkpoint_flash;
+  ASSERT_OK(flash.partition.Erase());
+  ASSERT_OK(checkpoint_flash.partition.Erase());
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(
+      &flash.partition, format, {.checkpoint_interval = 3});
+  kvs.set_checkpoint_partition(&checkpoint_flash.partition);
+  ASSERT_OK(kvs.Init());
+
+  const span<byte> checkpoint_memory = checkpoint_flash.memory.buffer();
+
+  ASSERT_OK(kvs.Put("a", 1));
+  ASSERT_OK(kvs.Put("b", 2));
+  EXPECT_EQ(byte{0xFF}, checkpoint_memory[0]);
+
+  ASSERT_OK(kvs.Put("c", 3));
+  EXPECT_NE(byte{0xFF}, checkpoint_memory[0]);
+}
+
+namespace {
+
+RunLengthEncodingBuffer<256> rle;
+
+constexpr EntryFormat kCompressedFormat{
+    .magic = 0x5EC0'DE3D, .checksum = &checksum, .compression = &rle};
+
+// A sparse value with long runs of zeros, which compresses well.
+constexpr auto kSparseValue = [] {
+  std::array<byte, 128> value{};
+  value[0] = byte{0x12};
+  value[64] = byte{0x34};
+  value[127] = byte{0x56};
+  return value;
+}();
+
+class CompressedKvs : public ::testing::Test {
+ protected:
+  CompressedKvs() : kvs_(&flash_.partition, kCompressedFormat) {
+    flash_.partition.Erase();
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+
+  Flash flash_;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
+};
+
+}  // namespace
+
+TEST_F(CompressedKvs, PutAndGet_CompressedValue) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+  EXPECT_LT(kvs_.GetStorageStats().in_use_bytes, kSparseValue.size());
+
+  std::array<byte, kSparseValue.size()> value;
+  StatusWithSize result = kvs_.Get("key", value);
+  ASSERT_OK(result.status());
+  ASSERT_EQ(kSparseValue.size(), result.size());
+  EXPECT_EQ(0, std::memcmp(kSparseValue.data(), value.data(), value.size()));
+}
+
+TEST_F(CompressedKvs, PutAndGet_IncompressibleValue) {
+  constexpr auto kValue = AsBytes(uint64_t(0x0123'4567'89AB'CDEF));
+  ASSERT_OK(kvs_.Put("key", kValue));
+
+  uint64_t value = 0;
+  ASSERT_OK(kvs_.Get("key", &value));
+  EXPECT_EQ(0x0123'4567'89AB'CDEFu, value);
+}
+
+TEST_F(CompressedKvs, ValueSize_IsDecompressedSize) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+
+  StatusWithSize result = kvs_.ValueSize("key");
+  ASSERT_OK(result.status());
+  EXPECT_EQ(kSparseValue.size(), result.size());
+}
+
+TEST_F(CompressedKvs, Get_WithOffset) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+
+  std::array<byte, 8> value;
+  StatusWithSize result = kvs_.Get("key", value, 60);
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED, result.status());
+  EXPECT_EQ(value.size(), result.size());
+  EXPECT_EQ(0, std::memcmp(&kSparseValue[60], value.data(), value.size()));
+
+  result = kvs_.Get("key", value, 124);
+  ASSERT_OK(result.status());
+  EXPECT_EQ(4u, result.size());
+  EXPECT_EQ(byte{0x56}, value[3]);
+
+  EXPECT_EQ(Status::OUT_OF_RANGE,
+            kvs_.Get("key", value, kSparseValue.size() + 1).status());
+}
+
+TEST_F(CompressedKvs, Init_ReadsCompressedEntries) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash_.partition,
+                                                          kCompressedFormat);
+  ASSERT_OK(kvs.Init());
+
+  std::array<byte, kSparseValue.size()> value;
+  ASSERT_OK(kvs.Get("key", value).status());
+  EXPECT_EQ(0, std::memcmp(kSparseValue.data(), value.data(), value.size()));
+}
+
+TEST_F(CompressedKvs, GarbageCollect_KeepsCompressedEntries) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+  ASSERT_OK(kvs_.Put("other", 1));
+  ASSERT_OK(kvs_.Put("other", 2));
+  ASSERT_OK(kvs_.GarbageCollectFull());
+
+  std::array<byte, kSparseValue.size()> value;
+  ASSERT_OK(kvs_.Get("key", value).status());
+  EXPECT_EQ(0, std::memcmp(kSparseValue.data(), value.data(), value.size()));
+}
+
+TEST_F(CompressedKvs, ValueReader_ReadsValueInPieces) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+
+  KeyValueStore::ValueReader reader(kvs_);
+  const StatusWithSize result = reader.Open("key");
+  ASSERT_OK(result.status());
+  EXPECT_EQ(kSparseValue.size(), result.size());
+  EXPECT_EQ(kSparseValue.size(), reader.bytes_remaining());
+
+  std::array<byte, kSparseValue.size()> value;
+  for (size_t offset = 0; offset < value.size(); offset += 30) {
+    const size_t size = std::min<size_t>(30, value.size() - offset);
+    ASSERT_OK(reader.Read(span(value).subspan(offset, size)).status());
+  }
+  EXPECT_EQ(0u, reader.bytes_remaining());
+  EXPECT_EQ(0, std::memcmp(kSparseValue.data(), value.data(), value.size()));
+}
+
+TEST_F(CompressedKvs, Get_CorruptValue_DataLoss) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+
+  // Corrupt the decompressed size stored before the compressed data.
+  CorruptValue(flash_.memory.buffer(), uint16_t(kSparseValue.size()));
+
+  std::array<byte, kSparseValue.size()> value;
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.Get("key", value).status());
+}
+
+TEST_F(CompressedKvs, Append_ToCompressedValue) {
+  ASSERT_OK(kvs_.Put("key", kSparseValue));
+  ASSERT_OK(kvs_.Append("key", ByteStr("end")));
+  EXPECT_EQ(kSparseValue.size() + 3, kvs_.ValueSize("key").size());
+
+  std::array<byte, 8> value;
+  StatusWithSize result = kvs_.Get("key", value, kSparseValue.size() - 4);
+  ASSERT_OK(result.status());
+  ASSERT_EQ(7u, result.size());
+  EXPECT_EQ(byte{0x56}, value[3]);
+  EXPECT_EQ(0, std::memcmp("end", &value[4], 3));
+
+  // Garbage collection combines the entries into one uncompressed entry.
+  ASSERT_OK(kvs_.Put("other", 1));
+  ASSERT_OK(kvs_.Put("other", 2));
+  ASSERT_OK(kvs_.GarbageCollectFull());
+
+  std::array<byte, kSparseValue.size() + 3> combined;
+  ASSERT_OK(kvs_.Get("key", combined).status());
+  EXPECT_EQ(0, std::memcmp(kSparseValue.data(), combined.data(), 128));
+  EXPECT_EQ(0, std::memcmp("end", &combined[kSparseValue.size()], 3));
+}
+
+TEST(InMemoryKvs, GetView_CompressedValue_Unimplemented) {
+  MemoryMappedFakeFlash flash;
+  FlashPartition partition(&flash);
+  ASSERT_OK(partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&partition,
+                                                          kCompressedFormat);
+  ASSERT_OK(kvs.Init());
+  ASSERT_OK(kvs.Put("key", kSparseValue));
+
+  span<const byte> view;
+  EXPECT_EQ(Status::UNIMPLEMENTED, kvs.GetView("key", &view));
+}
+
+namespace {
+
+constexpr EntryFormat kExpiringFormats[] = {
+    format,
+    {.magic = 0x7E0F'A11E, .checksum = &checksum, .expiry = true},
+};
+
+class ExpiringKvs : public ::testing::Test {
+ protected:
+  ExpiringKvs() : kvs_(&flash_.partition, kExpiringFormats) {
+    flash_.partition.Erase();
+    kvs_.SetCurrentTime(100);
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+
+  Flash flash_;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 1, 2> kvs_;
+};
+
+}  // namespace
+
+TEST_F(ExpiringKvs, Get_ExpiredKey_NotFound) {
+  ASSERT_OK(kvs_.PutWithExpiry("temp", 1, 200));
+  ASSERT_OK(kvs_.Put("kept", 2));
+
+  int value = 0;
+  ASSERT_OK(kvs_.Get("temp", &value));
+  EXPECT_EQ(1, value);
+  EXPECT_EQ(sizeof(value), kvs_.ValueSize("temp").size());
+
+  kvs_.SetCurrentTime(200);
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Get("temp", &value));
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.ValueSize("temp").status());
+  EXPECT_EQ(1u, kvs_.size());
+
+  // No tombstone is written for an expired key.
+  const size_t in_use_bytes = kvs_.GetStorageStats().in_use_bytes;
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.Delete("temp"));
+  EXPECT_EQ(in_use_bytes, kvs_.GetStorageStats().in_use_bytes);
+
+  ASSERT_OK(kvs_.Get("kept", &value));
+  EXPECT_EQ(2, value);
+}
+
+TEST_F(ExpiringKvs, Iteration_SkipsExpiredKeys) {
+  ASSERT_OK(kvs_.PutWithExpiry("temp", 1, 200));
+  ASSERT_OK(kvs_.PutWithExpiry("tea", 2, 400));
+  ASSERT_OK(kvs_.Put("kept", 3));
+
+  kvs_.SetCurrentTime(300);
+
+  size_t count = 0;
+  for (const auto& item : kvs_) {
+    EXPECT_NE("temp", std::string_view(item.key()));
+    count += 1;
+  }
+  EXPECT_EQ(2u, count);
+  EXPECT_EQ(2u, kvs_.size());
+
+  count = 0;
+  for (auto it = kvs_.begin("te"); it != kvs_.end("te"); ++it) {
+    EXPECT_STREQ("tea", it->key());
+    int value = 0;
+    ASSERT_OK(it->Get(&value));
+    EXPECT_EQ(2, value);
+    count += 1;
+  }
+  EXPECT_EQ(1u, count);
+}
+
+TEST_F(ExpiringKvs, Put_ReplacesExpiryTime) {
+  ASSERT_OK(kvs_.PutWithExpiry("key", 1, 200));
+  ASSERT_OK(kvs_.Put("key", 2));
+
+  kvs_.SetCurrentTime(300);
+  int value = 0;
+  ASSERT_OK(kvs_.Get("key", &value));
+  EXPECT_EQ(2, value);
+
+  // An expired key may be written again.
+  ASSERT_OK(kvs_.PutWithExpiry("key", 3, 400));
+  ASSERT_OK(kvs_.Get("key", &value));
+  EXPECT_EQ(3, value);
+}
+
+TEST_F(ExpiringKvs, Init_ExpiredKeysLoadedAsDeleted) {
+  ASSERT_OK(kvs_.PutWithExpiry("temp", 1, 200));
+  ASSERT_OK(kvs_.Put("kept", 2));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 1, 2> kvs(
+      &flash_.partition, kExpiringFormats);
+  kvs.SetCurrentTime(150);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(2u, kvs.size());
+
+  kvs.SetCurrentTime(200);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(1u, kvs.size());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.ValueSize("temp").status());
+}
+
+TEST_F(ExpiringKvs, GarbageCollect_ReplacesExpiredEntryWithTombstone) {
+  std::array<byte, 200> value{};
+  ASSERT_OK(kvs_.PutWithExpiry("temp", value, 200));
+
+  // Overwrite another key so that the sector has reclaimable bytes.
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_OK(kvs_.Put("kept", i));
+  }
+
+  const size_t expired_size = AlignUp(
+      sizeof(internal::EntryHeader) + 4 + value.size() + sizeof(uint32_t), 16);
+  const size_t tombstone_size = AlignUp(sizeof(internal::EntryHeader) + 4, 16);
+  const size_t in_use_bytes = kvs_.GetStorageStats().in_use_bytes;
+
+  kvs_.SetCurrentTime(200);
+  ASSERT_OK(kvs_.GarbageCollectFull());
+  EXPECT_EQ(in_use_bytes - expired_size + tombstone_size,
+            kvs_.GetStorageStats().in_use_bytes);
+  EXPECT_EQ(1u, kvs_.size());
+
+  // The tombstone keeps the key deleted, whatever the time.
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 1, 2> kvs(
+      &flash_.partition, kExpiringFormats);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.ValueSize("temp").status());
+  int kept = 0;
+  ASSERT_OK(kvs.Get("kept", &kept));
+  EXPECT_EQ(3, kept);
+}
+
+TEST_F(ExpiringKvs, Append_RemovesExpiryTime) {
+  ASSERT_OK(kvs_.PutWithExpiry("key", ByteStr("abc"), 200));
+  ASSERT_OK(kvs_.Append("key", as_bytes(span("def", 3))));
+
+  kvs_.SetCurrentTime(300);
+  EXPECT_EQ(6u, kvs_.ValueSize("key").size());
+}
+
+TEST(InMemoryKvs, PutWithExpiry_NoExpiringFormat_FailedPrecondition) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs.PutWithExpiry("key", 1, 200));
+  ASSERT_OK(kvs.PutWithExpiry("key", 1, internal::Entry::kNoExpiry));
+}
+
+TEST(InMemoryKvs, Init_ExpiringPrimaryFormat_FailedPrecondition) {
+  Flash flash;
+  constexpr EntryFormat kFormat{
+      .magic = 0x7E0F'A11E, .checksum = &checksum, .expiry = true};
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          kFormat);
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs.Init());
+}
+
+namespace {
+
+// The start of a value that is long enough that appending to it writes less
+// than rewriting it.
+constexpr auto kLogStart = ByteStr("0123456789abcdefghijklmnopqrstuv");
+const std::string kLogStartString(
+    reinterpret_cast<const char*>(kLogStart.data()), kLogStart.size());
+
+class AppendKvs : public ::testing::Test {
+ protected:
+  AppendKvs() : kvs_(&flash_.partition, format) {
+    flash_.partition.Erase();
+    ASSERT_EQ(Status::OK, kvs_.Init());
+  }
+
+  // Bytes written to flash since it was erased.
+  size_t written_bytes() const {
+    const KeyValueStore::StorageStats stats = kvs_.GetStorageStats();
+    return stats.in_use_bytes + stats.reclaimable_bytes;
+  }
+
+  std::string GetString(std::string_view key) {
+    std::array<char, 64> value;
+    StatusWithSize result = kvs_.Get(key, as_writable_bytes(span(value)));
+    EXPECT_EQ(Status::OK, result.status());
+    return std::string(value.data(), result.size());
+  }
+
+  Flash flash_;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs_;
+};
+
+}  // namespace
+
+TEST_F(AppendKvs, Append_WritesOnlyNewData) {
+  std::array<byte, 200> value;
+  for (size_t i = 0; i < value.size(); ++i) {
+    value[i] = byte(i);
+  }
+  ASSERT_OK(kvs_.Put("log", value));
+
+  const size_t before = written_bytes();
+  ASSERT_OK(kvs_.Append("log", ByteStr("0123")));
+  EXPECT_EQ(Entry::size(flash_.partition,
+                        "log",
+                        sizeof(internal::AppendHeader) + 4),
+            written_bytes() - before);
+
+  EXPECT_EQ(value.size() + 4, kvs_.ValueSize("log").size());
+
+  std::array<byte, 204> read;
+  ASSERT_OK(kvs_.Get("log", read).status());
+  EXPECT_EQ(0, std::memcmp(value.data(), read.data(), value.size()));
+  EXPECT_EQ(0, std::memcmp("0123", &read[value.size()], 4));
+}
+
+TEST_F(AppendKvs, Append_MissingKey_PutsValue) {
+  ASSERT_OK(kvs_.Append("log", ByteStr("abc")));
+  EXPECT_EQ("abc", GetString("log"));
+
+  ASSERT_OK(kvs_.Delete("log"));
+  ASSERT_OK(kvs_.Append("log", ByteStr("def")));
+  EXPECT_EQ("def", GetString("log"));
+}
+
+TEST_F(AppendKvs, Get_WithOffset) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+  ASSERT_OK(kvs_.Append("log", ByteStr("EFGH")));
+  ASSERT_OK(kvs_.Append("log", ByteStr("IJ")));
+  EXPECT_EQ(kLogStartString + "EFGHIJ", GetString("log"));
+
+  char value[4];
+  StatusWithSize result = kvs_.Get(
+      "log", as_writable_bytes(span(value)), kLogStart.size() - 1);
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED, result.status());
+  EXPECT_EQ(4u, result.size());
+  EXPECT_EQ(0, std::memcmp("vEFG", value, 4));
+
+  result =
+      kvs_.Get("log", as_writable_bytes(span(value)), kLogStart.size() + 4);
+  EXPECT_OK(result.status());
+  EXPECT_EQ(2u, result.size());
+  EXPECT_EQ(0, std::memcmp("IJ", value, 2));
+
+  EXPECT_EQ(Status::OUT_OF_RANGE,
+            kvs_.Get("log",
+                     as_writable_bytes(span(value)),
+                     kLogStart.size() + 7)
+                .status());
+}
+
+TEST_F(AppendKvs, Init_ReadsAppendedEntries) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+  ASSERT_OK(kvs_.Append("log", ByteStr("EFGH")));
+  ASSERT_OK(kvs_.Put("other", uint32_t(1)));
+  ASSERT_OK(kvs_.Append("log", ByteStr("IJ")));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash_.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(kvs_.GetStorageStats().in_use_bytes,
+            kvs.GetStorageStats().in_use_bytes);
+
+  const size_t before = kvs.GetStorageStats().in_use_bytes;
+  ASSERT_OK(kvs.Append("log", ByteStr("KL")));
+  EXPECT_EQ(
+      Entry::size(flash_.partition, "log", sizeof(internal::AppendHeader) + 2),
+      kvs.GetStorageStats().in_use_bytes - before);
+
+  char value[64];
+  StatusWithSize result = kvs.Get("log", as_writable_bytes(span(value)));
+  ASSERT_OK(result.status());
+  EXPECT_EQ(kLogStartString + "EFGHIJKL",
+            std::string_view(value, result.size()));
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(-1));
+}
+
+TEST_F(AppendKvs, GarbageCollect_CombinesAppendedEntries) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+  ASSERT_OK(kvs_.Append("log", ByteStr("EFGH")));
+  ASSERT_OK(kvs_.Append("log", ByteStr("IJ")));
+  ASSERT_OK(kvs_.Put("other", uint32_t(1)));
+  ASSERT_OK(kvs_.Put("other", uint32_t(2)));
+
+  ASSERT_OK(kvs_.GarbageCollectFull());
+  EXPECT_EQ(Entry::size(flash_.partition, "log", kLogStart.size() + 6) +
+                Entry::size(flash_.partition, "other", sizeof(uint32_t)),
+            kvs_.GetStorageStats().in_use_bytes);
+  EXPECT_EQ(kLogStartString + "EFGHIJ", GetString("log"));
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.VerifyAll(-1));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash_.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(kvs_.GetStorageStats().in_use_bytes,
+            kvs.GetStorageStats().in_use_bytes);
+}
+
+TEST_F(AppendKvs, Append_MaxAppendedEntries_CombinesValue) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+
+  for (size_t i = 0; i < KeyValueStore::kMaxAppendedEntries; ++i) {
+    ASSERT_OK(kvs_.Append("log", ByteStr("a")));
+  }
+  EXPECT_EQ(Entry::size(flash_.partition, "log", kLogStart.size()) +
+                KeyValueStore::kMaxAppendedEntries *
+                    Entry::size(flash_.partition,
+                                "log",
+                                sizeof(internal::AppendHeader) + 1),
+            kvs_.GetStorageStats().in_use_bytes);
+
+  ASSERT_OK(kvs_.Append("log", ByteStr("b")));
+  const size_t value_size =
+      kLogStart.size() + KeyValueStore::kMaxAppendedEntries + 1;
+  EXPECT_EQ(Entry::size(flash_.partition, "log", value_size),
+            kvs_.GetStorageStats().in_use_bytes);
+  EXPECT_EQ(kLogStartString + "aaaaaaaab", GetString("log"));
+}
+
+TEST_F(AppendKvs, Get_CorruptAppendedEntry_DataLoss) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+  ASSERT_OK(kvs_.Append("log", ByteStr("EFGH")));
+
+  CorruptValue(flash_.memory.buffer(), uint32_t(0x48474645));  // "EFGH"
+
+  char value[64];
+  EXPECT_EQ(Status::DATA_LOSS,
+            kvs_.Get("log", as_writable_bytes(span(value))).status());
+  EXPECT_EQ(Status::DATA_LOSS, kvs_.VerifyAll(-1));
+}
+
+TEST_F(AppendKvs, ValueReader_AppendedValue_Unimplemented) {
+  ASSERT_OK(kvs_.Put("log", kLogStart));
+  ASSERT_OK(kvs_.Append("log", ByteStr("EFGH")));
+
+  KeyValueStore::ValueReader reader(kvs_);
+  EXPECT_EQ(Status::UNIMPLEMENTED, reader.Open("log").status());
+}
+
+TEST(InMemoryKvs, Append_Redundancy_RewritesValue) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+
+  ASSERT_OK(kvs.Put("log", ByteStr("ABCD")));
+  ASSERT_OK(kvs.Append("log", ByteStr("EFGH")));
+  EXPECT_EQ(2 * Entry::size(flash.partition, "log", 8),
+            kvs.GetStorageStats().in_use_bytes);
+
+  char value[8];
+  ASSERT_OK(kvs.Get("log", as_writable_bytes(span(value))).status());
+  EXPECT_EQ(0, std::memcmp("ABCDEFGH", value, 8));
+}
+
+TEST(InMemoryKvs, Get_CorruptCopy_ReadsRedundantCopy) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", kValue));
+  CorruptValue(flash.memory.buffer(), kValue);
+
+  uint32_t value = 0;
+  ASSERT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(kValue, value);
+  EXPECT_TRUE(kvs.error_detected());
+
+  // The good copy is read first from then on.
+  value = 0;
+  ASSERT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(kValue, value);
+  EXPECT_EQ(Status::DATA_LOSS, kvs.VerifyAll(1024));
+
+  ASSERT_OK(kvs.Repair());
+  EXPECT_FALSE(kvs.error_detected());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(1024));
+  EXPECT_EQ(2 * Entry::size(flash.partition, "key", sizeof(kValue)),
+            kvs.GetStorageStats().in_use_bytes);
+
+  // The corrupt copy remains in flash until its sector is garbage collected.
+  ASSERT_OK(kvs.GarbageCollectFull());
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(1024));
+  value = 0;
+  ASSERT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(kValue, value);
+}
+
+TEST(InMemoryKvs, GarbageCollect_CorruptCopy_RelocatedAndRepaired) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+
+  // The stale entries make the keys' sectors garbage collectable.
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", uint32_t(1)));
+  ASSERT_OK(kvs.Put("key", kValue));
+  CorruptValue(flash.memory.buffer(), kValue);
+
+  // A batched entry's header is rewritten when it is relocated, but a corrupt
+  // copy keeps its checksum, so it can still be repaired.
+  constexpr uint32_t kBatchedValue = 0xBA7C'4ED0;
+  ASSERT_OK(kvs.Put("batched", uint32_t(1)));
+  WriteBatchBuffer<1> batch;
+  ASSERT_OK(batch.Put("batched", kBatchedValue));
+  ASSERT_OK(kvs.Commit(batch));
+  CorruptValue(flash.memory.buffer(), kBatchedValue);
+
+  // The corruption is found while the entries are copied and does not stop
+  // garbage collection.
+  ASSERT_OK(kvs.GarbageCollectFull());
+  EXPECT_TRUE(kvs.error_detected());
+  EXPECT_EQ(Status::DATA_LOSS, kvs.VerifyAll(1024));
+
+  ASSERT_OK(kvs.Repair());
+  EXPECT_FALSE(kvs.error_detected());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(1024));
+
+  uint32_t value = 0;
+  ASSERT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(kValue, value);
+  ASSERT_OK(kvs.Get("batched", &value));
+  EXPECT_EQ(kBatchedValue, value);
+
+  // The corrupt copies left behind by relocation are still found to be
+  // corrupt, and the repaired copies are loaded as ordinary entries.
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Init());
+  ASSERT_OK(kvs.Get("key", &value));
+  EXPECT_EQ(kValue, value);
+  ASSERT_OK(kvs.Get("batched", &value));
+  EXPECT_EQ(kBatchedValue, value);
+}
+
+TEST(InMemoryKvs, GarbageCollect_CorruptBatchedEntry_StaysCorrupt) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", uint32_t(1)));
+  WriteBatchBuffer<2> batch;
+  ASSERT_OK(batch.Put("key", kValue));
+  ASSERT_OK(batch.Put("other", uint32_t(2)));
+  ASSERT_OK(kvs.Commit(batch));
+  CorruptValue(flash.memory.buffer(), kValue);
+
+  // The batched entry's header is rewritten when it is relocated, but it keeps
+  // its checksum, so the corruption is not hidden.
+  ASSERT_OK(kvs.GarbageCollectFull());
+  EXPECT_TRUE(kvs.error_detected());
+  EXPECT_EQ(Status::DATA_LOSS, kvs.VerifyAll(1024));
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Get("key", &value));
+  ASSERT_OK(kvs.Get("other", &value));
+  EXPECT_EQ(2u, value);
+}
+
+TEST(InMemoryKvs, ScratchBuffer_UsedByInitAndGarbageCollection) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  std::array<byte, 256> scratch = {};
+  kvs.set_scratch_buffer(scratch);
+  ASSERT_OK(kvs.Init());
+
+  std::array<byte, 200> value;
+  value.fill(byte{0x11});
+  ASSERT_OK(kvs.Put("big", value));
+  value.fill(byte{0x5A});
+  ASSERT_OK(kvs.Put("big", value));
+
+  ASSERT_OK(kvs.GarbageCollectFull());
+  ASSERT_OK(kvs.Init());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(1024));
+
+  // The entries were read through the scratch buffer.
+  EXPECT_NE(scratch.end(),
+            std::find(scratch.begin(), scratch.end(), byte{0x5A}));
+
+  std::array<byte, 200> read_value = {};
+  ASSERT_OK(kvs.Get("big", read_value).status());
+  EXPECT_EQ(value, read_value);
+}
+
+TEST(InMemoryKvs, Repair_AllCopiesCorrupt_DataLoss) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", kValue));
+  ASSERT_OK(kvs.Put("other", uint32_t(1)));
+  CorruptValue(flash.memory.buffer(), kValue);
+  CorruptValue(flash.memory.buffer(), kValue);
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Get("key", &value));
+  EXPECT_EQ(Status::DATA_LOSS, kvs.VerifyAll(1024));
+
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Repair());
+  EXPECT_TRUE(kvs.error_detected());
+  EXPECT_EQ(Status::DATA_LOSS, kvs.Get("key", &value));
+  EXPECT_OK(kvs.Get("other", &value));
+}
+
+constexpr Options kImmediateRecoveryOptions = [] {
+  Options options;
+  options.recovery = ErrorRecovery::kImmediate;
+  return options;
+}();
+
+TEST(InMemoryKvs, Init_ImmediateRecovery_RepairsMissingCopy) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> single_copy_kvs(
+      &flash.partition, format);
+  ASSERT_OK(single_copy_kvs.Init());
+  ASSERT_OK(single_copy_kvs.Put("key", uint32_t(123)));
+
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(
+      &flash.partition, format, kImmediateRecoveryOptions);
+  ASSERT_OK(kvs.Init());
+  EXPECT_FALSE(kvs.error_detected());
+  EXPECT_EQ(2 * Entry::size(flash.partition, "key", sizeof(uint32_t)),
+            kvs.GetStorageStats().in_use_bytes);
+}
+
+TEST(InMemoryKvs, Init_LazyRecovery_MaintenanceStepRepairsInSteps) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> single_copy_kvs(
+      &flash.partition, format);
+  ASSERT_OK(single_copy_kvs.Init());
+  constexpr size_t kKeys = 4;
+  for (size_t i = 0; i < kKeys; ++i) {
+    const char key[] = {char('a' + i), '\0'};
+    ASSERT_OK(single_copy_kvs.Put(key, uint32_t(i)));
+  }
+
+  // Init leaves the missing copies for MaintenanceStep.
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  ASSERT_OK(kvs.Init());
+  EXPECT_TRUE(kvs.error_detected());
+  const size_t entry_size = Entry::size(flash.partition, "a", sizeof(uint32_t));
+  EXPECT_EQ(kKeys * entry_size, kvs.GetStorageStats().in_use_bytes);
+
+  // Each step repairs one entry, and the next finishes the repair.
+  for (size_t i = 1; i <= kKeys; ++i) {
+    ASSERT_OK(kvs.MaintenanceStep(1));
+    EXPECT_EQ((kKeys + i) * entry_size, kvs.GetStorageStats().in_use_bytes);
+  }
+  EXPECT_TRUE(kvs.error_detected());
+  ASSERT_OK(kvs.MaintenanceStep(1));
+  EXPECT_FALSE(kvs.error_detected());
+  EXPECT_EQ(Status::NOT_FOUND, kvs.VerifyAll(1024));
+}
+
+TEST(InMemoryKvs, MaintenanceStep_RepairFails_ReportsErrorOnce) {
+  Flash flash;
+  ASSERT_OK(flash.partition.Erase());
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors> kvs(&flash.partition,
+                                                          format);
+  ASSERT_OK(kvs.Init());
+
+  constexpr uint32_t kValue = 0xFEED'BEEF;
+  ASSERT_OK(kvs.Put("key", kValue));
+  CorruptValue(flash.memory.buffer(), kValue);
+  EXPECT_EQ(Status::DATA_LOSS, kvs.VerifyAll(1024));
+
+  ASSERT_OK(kvs.MaintenanceStep(1024));
+  EXPECT_EQ(Status::DATA_LOSS, kvs.MaintenanceStep(1024));
+  EXPECT_TRUE(kvs.error_detected());
+
+  // Maintenance continues without repairing again.
+  EXPECT_EQ(Status::NOT_FOUND, kvs.MaintenanceStep(1024));
+}
+
+TEST(InMemoryKvs, Repair_NotInitialized_FailedPrecondition) {
+  Flash flash;
+  KeyValueStoreBuffer<kMaxEntries, kMaxUsableSectors, 2> kvs(&flash.partition,
+                                                             format);
+  EXPECT_EQ(Status::FAILED_PRECONDITION, kvs.Repair());
+}
+
 TEST(InMemoryKvs, Basic) {
   const char* key1 = "Key1";
   const char* key2 = "Key2";
@@ -0,0 +1,102 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include "pw_span/span.h"
+#include "pw_status/status_with_size.h"
+
+namespace pw::kvs {
+
+// Compresses KVS values. The KVS compresses a value into the algorithm's
+// working buffer before writing it, and reads compressed values into the
+// working buffer to decompress them. Values whose compressed form does not fit
+// in the working buffer are stored uncompressed.
+//
+// The working buffer is used by whichever KeyValueStore is reading or writing,
+// so a CompressionAlgorithm must not be shared by KeyValueStores that are used
+// from different threads.
+class CompressionAlgorithm {
+ public:
+  // Compresses data into output and returns the compressed size.
+  //
+  //                    OK: the data was compressed
+  //    RESOURCE_EXHAUSTED: the compressed data does not fit in output
+  //
+  virtual StatusWithSize Compress(span<const std::byte> data,
+                                  span<std::byte> output) const = 0;
+
+  // Decompresses data into output, starting offset_bytes into the decompressed
+  // value, and returns the number of bytes written.
+  //
+  //                    OK: the rest of the value was written to output
+  //    RESOURCE_EXHAUSTED: output was filled before the end of the value
+  //             DATA_LOSS: the compressed data is invalid
+  //
+  virtual StatusWithSize Decompress(span<const std::byte> data,
+                                    span<std::byte> output,
+                                    size_t offset_bytes = 0) const = 0;
+
+  // Buffer for compressed data.
+  constexpr span<std::byte> working_buffer() const { return working_buffer_; }
+
+ protected:
+  // A derived class provides a span of its working buffer.
+  constexpr CompressionAlgorithm(span<std::byte> working_buffer)
+      : working_buffer_(working_buffer) {}
+
+  // Protected destructor prevents deleting CompressionAlgorithms from the base
+  // class, so that it is safe to have a non-virtual destructor.
+  ~CompressionAlgorithm() = default;
+
+ private:
+  span<std::byte> working_buffer_;
+};
+
+// Run-length encoding, which suits sparse structs and other values with runs of
+// repeated bytes. The data is a sequence of runs, each starting with a control
+// byte. A control byte below 0x80 is followed by that many plus one literal
+// bytes. A control byte of 0x80 or more is followed by one byte that is
+// repeated (control - 0x80 + 3) times.
+class RunLengthEncoding : public CompressionAlgorithm {
+ public:
+  StatusWithSize Compress(span<const std::byte> data,
+                          span<std::byte> output) const final;
+
+  StatusWithSize Decompress(span<const std::byte> data,
+                            span<std::byte> output,
+                            size_t offset_bytes = 0) const final;
+
+ protected:
+  constexpr RunLengthEncoding(span<std::byte> working_buffer)
+      : CompressionAlgorithm(working_buffer) {}
+
+  ~RunLengthEncoding() = default;
+};
+
+// RunLengthEncoding with a working buffer for values of up to kBufferSize bytes
+// after compression.
+template <size_t kBufferSize>
+class RunLengthEncodingBuffer final : public RunLengthEncoding {
+ public:
+  constexpr RunLengthEncodingBuffer()
+      : RunLengthEncoding(buffer_), buffer_{} {}
+
+ private:
+  std::array<std::byte, kBufferSize> buffer_;
+};
+
+}  // namespace pw::kvs
@@ -66,6 +66,35 @@ class FlashMemory {
   //
   virtual Status Erase(Address flash_address, size_t num_sectors) = 0;
 
+  // Starts erasing num_sectors at a given address and returns without waiting
+  // for the erase to complete. Only one erase may be in progress at a time. The
+  // sectors being erased must not be read or written until the erase is done.
+  // Reads and writes of other sectors either proceed during the erase or, if
+  // the hardware does not allow that, block until it completes.
+  //
+  // The default implementation erases synchronously with Erase.
+  //
+  //                OK: the erase was started
+  //  INVALID_ARGUMENT: address is not sector-aligned
+  //      OUT_OF_RANGE: erases past the end of the memory
+  //
+  virtual Status StartErase(Address flash_address, size_t num_sectors) {
+    return Erase(flash_address, num_sectors);
+  }
+
+  // Checks whether the erase started by StartErase has completed.
+  //
+  //                OK: the erase completed successfully, or none was started
+  //       UNAVAILABLE: the erase is still in progress
+  //             other: the erase failed with this status
+  //
+  virtual Status PollErase() { return Status::OK; }
+
+  // Blocks until the erase started by StartErase completes and returns its
+  // result as reported by PollErase. The default implementation calls
+  // PollErase until it is no longer UNAVAILABLE.
+  virtual Status WaitForErase();
+
   // Reads bytes from flash into buffer. Blocking call.
   //
   //                OK: success
@@ -191,6 +220,22 @@ class FlashPartition {
 
   Status Erase() { return Erase(0, this->sector_count()); }
 
+  // Starts erasing sectors without waiting for the erase to complete. See
+  // FlashMemory::StartErase. Partitions that override Erase should override
+  // StartErase as well.
+  // Returns: OK, if the erase was started.
+  //          INVALID_ARGUMENT, if address or sector count is invalid.
+  //          PERMISSION_DENIED, if partition is read only.
+  //          UNKNOWN, on HAL error
+  virtual Status StartErase(Address address, size_t num_sectors);
+
+  // Checks whether the erase started by StartErase has completed. Returns
+  // UNAVAILABLE while it is in progress, and otherwise the erase's result.
+  Status PollErase() { return flash_.PollErase(); }
+
+  // Blocks until the erase started by StartErase completes.
+  Status WaitForErase() { return flash_.WaitForErase(); }
+
   // Reads bytes from flash into buffer. Blocking call.
   // Returns: OK, on success.
   //          TIMEOUT, on timeout.
@@ -35,6 +35,12 @@ class FlashPartitionWithStats : public FlashPartition {
 
   Status Erase(Address address, size_t num_sectors) override;
 
+  Status StartErase(Address address, size_t num_sectors) override;
+
+  using FlashPartition::Read;
+
+  StatusWithSize Read(Address address, span<std::byte> output) override;
+
   span<size_t> sector_erase_counters() {
     return span(sector_counters_.data(), sector_counters_.size());
   }
@@ -47,9 +53,21 @@ class FlashPartitionWithStats : public FlashPartition {
     return total_erases;
   }
 
-  void ResetCounters() { sector_counters_.assign(sector_count(), 0); }
+  // The number of reads and bytes read since the counters were reset. Reads
+  // are always counted, regardless of PW_KVS_RECORD_PARTITION_STATS.
+  size_t read_count() const { return read_count_; }
+  size_t read_bytes() const { return read_bytes_; }
+
+  void ResetCounters() {
+    sector_counters_.assign(sector_count(), 0);
+    read_count_ = 0;
+    read_bytes_ = 0;
+  }
 
  protected:
+  // The sector_counters Vector is owned by the derived class, so it is not
+  // constructed yet. The derived class must call ResetCounters() in its
+  // constructor's body.
   FlashPartitionWithStats(
       Vector<size_t>& sector_counters,
       FlashMemory* flash,
@@ -62,12 +80,16 @@ class FlashPartitionWithStats : public FlashPartition {
                        sector_count,
                        alignment_bytes,
                        permission),
-        sector_counters_(sector_counters) {
-    sector_counters_.assign(FlashPartition::sector_count(), 0);
-  }
+        sector_counters_(sector_counters),
+        read_count_(0),
+        read_bytes_(0) {}
 
  private:
+  void CountErase(Address address, size_t num_sectors);
+
   Vector<size_t>& sector_counters_;
+  size_t read_count_;
+  size_t read_bytes_;
 };
 
 template <size_t kMaxSectors>
@@ -84,7 +106,9 @@ class FlashPartitionWithStatsBuffer : public FlashPartitionWithStats {
                                 start_sector_index,
                                 sector_count,
                                 alignment_bytes,
-                                permission) {}
+                                permission) {
+    ResetCounters();
+  }
 
   FlashPartitionWithStatsBuffer(FlashMemory* flash)
       : FlashPartitionWithStatsBuffer(
@@ -16,6 +16,7 @@
 #include <cstdint>
 
 #include "pw_kvs/checksum.h"
+#include "pw_kvs/compression.h"
 #include "pw_span/span.h"
 
 namespace pw::kvs {
@@ -37,9 +38,15 @@ struct EntryHeader {
   // number of bytes, add one to this number and multiply by 16.
   uint8_t alignment_units;
 
-  // The length of the key in bytes. The key is not null terminated.
-  //  6 bits, 0:5 - key length - maximum 64 characters
-  //  2 bits, 6:7 - reserved
+  // The length of the key in bytes and the entry's flags. The key is not null
+  // terminated.
+  //  6 bits, 0:5 - key length - maximum 63 characters
+  //  1 bit,    6 - batch flag - set for entries written in a batch, which are
+  //                followed by a commit marker
+  //  1 bit,    7 - compressed flag - set if the value is compressed
+  // If bits 6 and 7 are both set, the entry is neither batched nor compressed:
+  // it is an appended entry, whose value is an AppendHeader followed by bytes
+  // to add to the end of the value of the entry the AppendHeader refers to.
   uint8_t key_length_bytes;
 
   // Byte length of the value; maximum of 65534. The max uint16_t value (65535
@@ -68,6 +75,14 @@ class EntryFormats {
 
   const EntryFormat* Find(uint32_t magic) const;
 
+  // The first format that stores expiry times, or nullptr if there is none.
+  const EntryFormat* Expiring() const;
+
+  // True if any of the formats has a compression algorithm or stores expiry
+  // times.
+  bool HasCompression() const;
+  bool HasExpiry() const { return Expiring() != nullptr; }
+
  private:
   const span<const EntryFormat> formats_;
 };
@@ -99,6 +114,18 @@ struct EntryFormat {
   // The checksum algorithm is used to calculate checksums for KVS entries. If
   // it is null, no checksum is used.
   ChecksumAlgorithm* checksum;
+
+  // If not null, values written by Put are compressed with this algorithm when
+  // that makes their entries smaller. The compressed flag in the header marks
+  // compressed entries, so entries written without compression remain readable.
+  CompressionAlgorithm* compression = nullptr;
+
+  // If true, each entry with this magic stores a uint32_t expiry time after its
+  // value, and is treated as deleted once KeyValueStore::SetCurrentTime passes
+  // that time. KeyValueStore::PutWithExpiry writes entries in the first such
+  // format; all other entries are written in the primary format, which must
+  // not store expiry times.
+  bool expiry = false;
 };
 
 }  // namespace pw::kvs
@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <array>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 
 #include "pw_containers/vector.h"
@@ -97,7 +98,13 @@ class InMemoryFakeFlash : public FlashMemory {
       : FlashMemory(sector_size, sector_count, alignment_bytes),
         buffer_(buffer),
         read_errors_(read_errors),
-        write_errors_(write_errors) {}
+        write_errors_(write_errors),
+        timing_{},
+        elapsed_ns_(0),
+        erase_pending_(false),
+        erase_address_(0),
+        erase_sectors_(0),
+        erase_end_ns_(0) {}
 
   // The fake flash is always enabled.
   Status Enable() override { return Status::OK; }
@@ -109,6 +116,15 @@ class InMemoryFakeFlash : public FlashMemory {
   // Erase num_sectors starting at a given address.
   Status Erase(Address address, size_t num_sectors) override;
 
+  // Starts an erase that completes once the simulated erase latency has
+  // elapsed. Reading or writing the sectors before then fails.
+  Status StartErase(Address address, size_t num_sectors) override;
+
+  Status PollErase() override;
+
+  // Advances the simulated time to the end of the erase in progress.
+  Status WaitForErase() override;
+
   // Reads bytes from flash into buffer.
   StatusWithSize Read(Address address, span<std::byte> output) override;
 
@@ -137,10 +153,63 @@ class InMemoryFakeFlash : public FlashMemory {
     return true;
   }
 
+  // The simulated time that flash operations take. Reads and writes take a
+  // fixed time per call, for the command and address, plus a time per byte
+  // transferred.
+  struct Timing {
+    uint32_t erase_us_per_sector;
+    uint32_t write_us;
+    uint32_t write_ns_per_byte;
+    uint32_t read_us;
+    uint32_t read_ns_per_byte;
+  };
+
+  // Simulates the time that flash operations take, so that the time spent
+  // waiting for flash can be measured. Erase, Read, Write, and WaitForErase
+  // advance elapsed_us() by the time they would block. An erase started with
+  // StartErase runs while time is advanced by other operations or by
+  // AdvanceTime, which simulates unrelated work.
+  void SetTiming(const Timing& timing) { timing_ = timing; }
+
+  // Simulates only the time taken by erases and by each write.
+  void SetLatency(uint32_t erase_us_per_sector, uint32_t write_us) {
+    SetTiming({.erase_us_per_sector = erase_us_per_sector,
+               .write_us = write_us,
+               .write_ns_per_byte = 0,
+               .read_us = 0,
+               .read_ns_per_byte = 0});
+  }
+
+  void AdvanceTime(uint32_t us) { elapsed_ns_ += uint64_t(us) * 1000; }
+
+  uint32_t elapsed_us() const { return elapsed_ns_ / 1000; }
+
+  uint64_t elapsed_ns() const { return elapsed_ns_; }
+
+  bool erase_in_progress() const { return erase_pending_; }
+
  private:
+  Status CheckEraseArguments(Address address, size_t num_sectors) const;
+
+  // True if an erase in progress covers part of the address range.
+  bool Erasing(Address address, size_t size) const;
+
   const span<std::byte> buffer_;
   Vector<FlashError>& read_errors_;
   Vector<FlashError>& write_errors_;
+
+  uint64_t EraseNs(size_t num_sectors) const {
+    return uint64_t(timing_.erase_us_per_sector) * 1000 * num_sectors;
+  }
+
+  Timing timing_;
+  uint64_t elapsed_ns_;
+
+  // The erase started by StartErase.
+  bool erase_pending_;
+  Address erase_address_;
+  size_t erase_sectors_;
+  uint64_t erase_end_ns_;
 };
 
 // Creates an InMemoryFakeFlash backed by a std::array. The array is initialized
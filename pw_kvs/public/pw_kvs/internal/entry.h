@@ -27,16 +27,54 @@
 #include "pw_kvs/format.h"
 #include "pw_kvs/internal/hash.h"
 #include "pw_kvs/internal/key_descriptor.h"
+#include "pw_kvs/io.h"
 #include "pw_span/span.h"
 
 namespace pw::kvs::internal {
 
+// Starts the value of an appended entry. The entries for a key's value form a
+// chain in one sector: an entry with the start of the value, followed by up to
+// KeyValueStore::kMaxAppendedEntries appended entries that each refer to the
+// entry before them.
+struct AppendHeader {
+  uint32_t previous_address;
+  uint32_t previous_transaction_id;
+
+  // The size of the complete value, including this entry's bytes.
+  uint16_t value_size;
+
+  // The number of appended entries in the chain, including this one.
+  uint16_t chain_length;
+};
+
+static_assert(sizeof(AppendHeader) == 12);
+
 // Entry represents a key-value entry in a flash partition.
 class Entry {
  public:
   static constexpr size_t kMinAlignmentBytes = sizeof(EntryHeader);
   static constexpr size_t kMaxKeyLength = 0b111111;
 
+  // Set in the key length byte of entries written by KeyValueStore::Commit. A
+  // batched entry is only valid if it is followed in the same sector by a
+  // commit marker with the same transaction ID.
+  static constexpr uint8_t kBatchFlag = 0b1000000;
+
+  // Set in the key length byte of entries whose value is compressed. A
+  // compressed value starts with its decompressed size as a uint16_t.
+  static constexpr uint8_t kCompressedFlag = 0b10000000;
+
+  // Both flags are set in the key length byte of appended entries, which are
+  // never batched or compressed. An appended entry's value is an AppendHeader
+  // followed by bytes to add to the end of the value of the entry it refers
+  // to.
+  static constexpr uint8_t kAppendedFlags = kBatchFlag | kCompressedFlag;
+
+  // Entries in a format that stores expiry times end with a uint32_t expiry
+  // time after the value. An expiry time of kNoExpiry never expires.
+  static constexpr size_t kExpirySize = sizeof(uint32_t);
+  static constexpr uint32_t kNoExpiry = 0xFFFFFFFF;
+
   using Address = FlashPartition::Address;
 
   // Buffer capable of holding any valid key (without a null terminator);
@@ -65,9 +103,39 @@ class Entry {
                      const EntryFormat& format,
                      std::string_view key,
                      span<const std::byte> value,
-                     uint32_t transaction_id) {
-    return Entry(
-        partition, address, format, key, value, value.size(), transaction_id);
+                     uint32_t transaction_id,
+                     bool batched = false,
+                     bool compressed = false) {
+    return Entry(partition,
+                 address,
+                 format,
+                 key,
+                 value,
+                 value.size(),
+                 transaction_id,
+                 batched,
+                 compressed);
+  }
+
+  // Creates a new Entry for a valid entry that expires at expiry_time. The
+  // format must store expiry times.
+  static Entry Expiring(FlashPartition& partition,
+                        Address address,
+                        const EntryFormat& format,
+                        std::string_view key,
+                        span<const std::byte> value,
+                        uint32_t transaction_id,
+                        uint32_t expiry_time) {
+    return Entry(partition,
+                 address,
+                 format,
+                 key,
+                 value,
+                 value.size(),
+                 transaction_id,
+                 false,
+                 false,
+                 expiry_time);
   }
 
   // Creates a new Entry for a tombstone entry, which marks a deleted key.
@@ -75,14 +143,71 @@ class Entry {
                          Address address,
                          const EntryFormat& format,
                          std::string_view key,
-                         uint32_t transaction_id) {
+                         uint32_t transaction_id,
+                         bool batched = false) {
     return Entry(partition,
                  address,
                  format,
                  key,
                  {},
                  kDeletedValueLength,
-                 transaction_id);
+                 transaction_id,
+                 batched,
+                 false);
+  }
+
+  // Creates a new Entry for a valid entry whose key and value are provided in
+  // pieces. The checksum is calculated with StartChecksum, UpdateChecksum, and
+  // FinishChecksum as the value is written.
+  static Entry Streamed(FlashPartition& partition,
+                        Address address,
+                        const EntryFormat& format,
+                        std::string_view key,
+                        uint16_t value_size,
+                        uint32_t transaction_id) {
+    return Entry(&partition,
+                 address,
+                 format,
+                 {.magic = format.magic,
+                  .checksum = 0,
+                  .alignment_units =
+                      alignment_bytes_to_units(partition.alignment_bytes()),
+                  .key_length_bytes = static_cast<uint8_t>(key.size()),
+                  .value_size_bytes = value_size,
+                  .transaction_id = transaction_id});
+  }
+
+  // Creates a new Entry for an appended entry whose key and value are written
+  // in pieces with an EntryWriter, like a streamed entry. The value_size
+  // includes the AppendHeader.
+  static Entry Appended(FlashPartition& partition,
+                        Address address,
+                        const EntryFormat& format,
+                        std::string_view key,
+                        uint16_t value_size,
+                        uint32_t transaction_id) {
+    Entry entry =
+        Streamed(partition, address, format, key, value_size, transaction_id);
+    entry.header_.key_length_bytes |= kAppendedFlags;
+    return entry;
+  }
+
+  // Creates the commit marker that ends a batch. The marker has no key; its
+  // value is the number of entries in the batch.
+  static Entry BatchCommit(FlashPartition& partition,
+                           Address address,
+                           const EntryFormat& format,
+                           span<const std::byte> entry_count,
+                           uint32_t transaction_id) {
+    return Entry(partition,
+                 address,
+                 format,
+                 {},
+                 entry_count,
+                 entry_count.size(),
+                 transaction_id,
+                 true,
+                 false);
   }
 
   Entry() = default;
@@ -94,11 +219,18 @@ class Entry {
   KeyDescriptor descriptor(uint32_t key_hash) const {
     return KeyDescriptor{key_hash,
                          transaction_id(),
-                         deleted() ? EntryState::kDeleted : EntryState::kValid};
+                         deleted() ? EntryState::kDeleted : EntryState::kValid,
+                         false,
+                         static_cast<uint16_t>(size())};
   }
 
   StatusWithSize Write(std::string_view key, span<const std::byte> value) const;
 
+  // Writes the header followed by the first bytes of the key and value, padded
+  // to the entry's alignment. Used to write a streamed entry's header after the
+  // rest of the entry, once the checksum is known.
+  StatusWithSize WriteHeader(span<const std::byte> first_bytes) const;
+
   // Changes the format and transcation ID for this entry. In order to calculate
   // the new checksum, the entire entry is read into a small stack-allocated
   // buffer. The updated entry may be written to flash using the Copy function.
@@ -107,7 +239,23 @@ class Entry {
   // Writes this entry at a new address. The key and value are read from the
   // entry's current address. The Entry object's header, which may be newer than
   // what is in flash, is used.
-  StatusWithSize Copy(Address new_address) const;
+  //
+  // The key and value are read only once and are checked against the header's
+  // checksum as they are copied. If they do not match, the copy is still
+  // written, and DATA_LOSS is returned with the size of the copy.
+  //
+  // The entry is copied through the buffer if it is larger than the built-in
+  // buffer and at least the entry's alignment, so that large entries are
+  // copied in fewer, larger reads and writes.
+  StatusWithSize Copy(Address new_address,
+                      span<std::byte> buffer = span<std::byte>()) const;
+
+  // Clears the batch flag and recalculates the checksum, reading the key and
+  // value from flash. Used when an entry is moved away from its commit marker.
+  // The buffer, if larger than the built-in buffer, is used for the reads.
+  // Returns DATA_LOSS, with the flag cleared but the checksum unchanged, if the
+  // entry does not match its checksum.
+  Status ClearBatchFlag(span<std::byte> buffer = span<std::byte>());
 
   // Reads a key into a buffer, which must be large enough for a max-length key.
   // If successful, the size is returned in the StatusWithSize. The key is not
@@ -125,14 +273,47 @@ class Entry {
   Status VerifyChecksum(std::string_view key,
                         span<const std::byte> value) const;
 
-  Status VerifyChecksumInFlash() const;
+  // Reads the entry from flash and verifies its checksum. The entry is read
+  // through the buffer if it is larger than the built-in buffer, so that large
+  // entries take fewer reads.
+  Status VerifyChecksumInFlash(
+      span<std::byte> buffer = span<std::byte>()) const;
+
+  // Calculates the checksum of an entry's key and value in pieces. After
+  // StartChecksum, pass the key and then the value to UpdateChecksum, in order.
+  // Other entries' checksums must not be calculated until the checksum is
+  // finished, since the checksum algorithm holds the state.
+  void StartChecksum() const;
+
+  void UpdateChecksum(span<const std::byte> data) const {
+    if (checksum_algo_ != nullptr) {
+      checksum_algo_->Update(data);
+    }
+  }
+
+  // Finishes the checksum and stores it in the header.
+  void FinishChecksum();
+
+  // Finishes the checksum and compares it to the checksum in the header.
+  Status FinishAndVerifyChecksum() const;
 
   // Calculates the total size of an entry, including padding.
   static size_t size(const FlashPartition& partition,
                      std::string_view key,
                      span<const std::byte> value) {
-    return AlignUp(sizeof(EntryHeader) + key.size() + value.size(),
-                   std::max(partition.alignment_bytes(), kMinAlignmentBytes));
+    return size(partition, key, value.size());
+  }
+
+  static size_t size(const FlashPartition& partition,
+                     std::string_view key,
+                     size_t value_size) {
+    return AlignUp(sizeof(EntryHeader) + key.size() + value_size,
+                   alignment_bytes(partition));
+  }
+
+  // The alignment of entries written to the partition.
+  static size_t alignment_bytes(const FlashPartition& partition) {
+    return AlignUp(partition.alignment_bytes(), kMinAlignmentBytes);
   }
 
   Address address() const { return address_; }
@@ -142,11 +323,16 @@ class Entry {
   // The address at which the next possible entry could be located.
   Address next_address() const { return address() + size(); }
 
+  // Address of the first byte of the value, which follows the key.
+  Address value_address() const {
+    return address() + sizeof(EntryHeader) + key_length();
+  }
+
   // Total size of this entry, including padding.
   size_t size() const { return AlignUp(content_size(), alignment_bytes()); }
 
   // The length of the key in bytes. Keys are not null terminated.
-  size_t key_length() const { return header_.key_length_bytes; }
+  size_t key_length() const { return header_.key_length_bytes & kMaxKeyLength; }
 
   // The size of the value, without padding. The size is 0 if this is a
   // tombstone entry.
@@ -163,6 +349,41 @@ class Entry {
     return header_.value_size_bytes == kDeletedValueLength;
   }
 
+  // True if this entry was written as part of a batch.
+  bool batched() const {
+    return (header_.key_length_bytes & kAppendedFlags) == kBatchFlag;
+  }
+
+  // True if the value is compressed with the entry format's compression.
+  bool compressed() const {
+    return (header_.key_length_bytes & kAppendedFlags) == kCompressedFlag;
+  }
+
+  // True if this entry adds bytes to the value of an earlier entry.
+  bool appended() const {
+    return (header_.key_length_bytes & kAppendedFlags) == kAppendedFlags;
+  }
+
+  // Reads the AppendHeader at the start of an appended entry's value.
+  Status ReadAppendHeader(AppendHeader* header) const;
+
+  // The entry format's compression algorithm, which may be null.
+  CompressionAlgorithm* compression() const { return compression_; }
+
+  // True if this entry's format stores an expiry time.
+  bool has_expiry() const { return has_expiry_; }
+
+  // The time at which this entry expires, or kNoExpiry.
+  uint32_t expiry_time() const { return has_expiry_ ? expiry_ : kNoExpiry; }
+
+  // True if this entry has expired at the given time.
+  bool expired(uint32_t current_time) const {
+    return expiry_time() != kNoExpiry && current_time >= expiry_time();
+  }
+
+  // True if this entry is the commit marker at the end of a batch.
+  bool batch_commit() const { return batched() && key_length() == 0u; }
+
   void DebugLog() const;
 
  private:
@@ -174,16 +395,23 @@ class Entry {
         std::string_view key,
         span<const std::byte> value,
         uint16_t value_size_bytes,
-        uint32_t transaction_id);
+        uint32_t transaction_id,
+        bool batched,
+        bool compressed,
+        uint32_t expiry_time = kNoExpiry);
 
   constexpr Entry(FlashPartition* partition,
                   Address address,
                   const EntryFormat& format,
-                  EntryHeader header)
+                  EntryHeader header,
+                  uint32_t expiry_time = kNoExpiry)
       : partition_(partition),
         address_(address),
         checksum_algo_(format.checksum),
-        header_(header) {}
+        compression_(format.compression),
+        header_(header),
+        expiry_(expiry_time),
+        has_expiry_(format.expiry) {}
 
   FlashPartition& partition() const { return *partition_; }
 
@@ -191,7 +419,14 @@ class Entry {
 
   // The total size of the entry, excluding padding.
   size_t content_size() const {
-    return sizeof(EntryHeader) + key_length() + value_size();
+    return sizeof(EntryHeader) + key_length() + value_size() + expiry_size();
+  }
+
+  size_t expiry_size() const { return has_expiry_ ? kExpirySize : 0u; }
+
+  // The expiry time stored after the value, if the format stores one.
+  span<const std::byte> expiry_bytes() const {
+    return as_bytes(span(&expiry_, 1)).first(expiry_size());
   }
 
   span<const std::byte> checksum_bytes() const {
@@ -201,7 +436,9 @@ class Entry {
   span<const std::byte> CalculateChecksum(std::string_view key,
                                           span<const std::byte> value) const;
 
-  Status CalculateChecksumFromFlash();
+  Status CalculateChecksumFromFlash(span<std::byte> buffer);
+
+  void AddPaddingBytesToChecksum() const;
 
   static constexpr uint8_t alignment_bytes_to_units(size_t alignment_bytes) {
     return (alignment_bytes + 15) / 16 - 1;  // An alignment of 0 is invalid.
@@ -210,7 +447,58 @@ class Entry {
   FlashPartition* partition_;
   Address address_;
   ChecksumAlgorithm* checksum_algo_;
+  CompressionAlgorithm* compression_;
   EntryHeader header_;
+
+  // Stored in flash after the value only if has_expiry_ is set.
+  uint32_t expiry_;
+  bool has_expiry_;
+};
+
+// Writes an Entry created with Entry::Streamed in pieces. The key and then the
+// value are passed to Write, which also updates the checksum. The header is
+// written last by Finish, once the checksum is known, so an entry that is not
+// finished has an erased header and is skipped when reading.
+//
+// The start of the entry shares an alignment unit with the header, so it is
+// held in RAM until Finish. The rest of the entry is written as it is received.
+class EntryWriter {
+ public:
+  // The largest entry alignment supported by the EntryWriter's buffers.
+  static constexpr size_t kMaxAlignmentBytes = 64;
+
+  EntryWriter(FlashPartition& partition);
+
+  EntryWriter(const EntryWriter&) = delete;
+  EntryWriter& operator=(const EntryWriter&) = delete;
+
+  // Starts writing an entry. The entry must remain valid until Finish or
+  // Abandon is called.
+  void Start(Entry& entry);
+
+  // Writes key or value bytes and adds them to the entry's checksum.
+  Status Write(span<const std::byte> data);
+
+  // Writes any buffered data, then the entry's header.
+  Status Finish();
+
+  // Writes any buffered data, but not the header, so that another entry can be
+  // started. The abandoned entry's space must not be reused until it is erased.
+  void Abandon();
+
+ private:
+  StatusWithSize WriteToFlash(span<const std::byte> data);
+
+  FlashPartition& partition_;
+  Entry* entry_;
+
+  // The part of the entry that shares an alignment unit with the header.
+  std::array<std::byte, kMaxAlignmentBytes> first_unit_;
+  size_t first_unit_size_;
+
+  Entry::Address flash_address_;
+  OutputToMethod<&EntryWriter::WriteToFlash> flash_;
+  AlignedWriterBuffer<kMaxAlignmentBytes> writer_;
 };
 
 }  // namespace pw::kvs::internal
@@ -13,12 +13,14 @@
 // the License.
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <string_view>
 
 #include "pw_containers/vector.h"
 #include "pw_kvs/flash_memory.h"
+#include "pw_kvs/internal/key_cache.h"
 #include "pw_kvs/internal/key_descriptor.h"
 #include "pw_span/span.h"
 
@@ -36,8 +38,26 @@ class EntryMetadata {
 
   uint32_t transaction_id() const { return descriptor_->transaction_id; }
 
+  size_t entry_size() const { return descriptor_->entry_size; }
+
   EntryState state() const { return descriptor_->state; }
 
+  bool verified() const { return descriptor_->verified; }
+
+  // Like the addresses, the KeyDescriptor is updated in place, so this may be
+  // called through a const EntryMetadata.
+  void set_verified(bool verified) const { descriptor_->verified = verified; }
+
+  // Marks the key deleted, such as when its entry expires. Updated in place
+  // like set_verified.
+  void set_state(EntryState state) const { descriptor_->state = state; }
+
+  // Sets the size of the entry, or of all entries in an append chain. Updated
+  // in place like set_verified.
+  void set_entry_size(size_t entry_size) const {
+    descriptor_->entry_size = entry_size;
+  }
+
   // The first known address of this entry.
   uint32_t first_address() const { return addresses_[0]; }
 
@@ -57,6 +77,10 @@ class EntryMetadata {
     addresses_ = span(addresses_.begin(), addresses_.size() + 1);
   }
 
+  // Removes an address from the entry metadata. The remaining addresses keep
+  // their order.
+  void RemoveAddress(Address address);
+
   // Resets the KeyDescrtiptor and addresses to refer to the provided
   // KeyDescriptor and address.
   void Reset(const KeyDescriptor& descriptor, Address address);
@@ -83,15 +107,55 @@ class EntryCache {
   template <size_t kMaxEntries, size_t kRedundancy>
   using AddressList = Address[kMaxEntries * kRedundancy + kRedundancy];
 
+  // A slot in the optional hash index. Each slot holds the index of a
+  // KeyDescriptor in the descriptor list, or kEmptySlot if it is unused.
+  using IndexSlot = uint16_t;
+
+  static constexpr IndexSlot kEmptySlot = IndexSlot(-1);
+
+  // The type to use for a hash index with the specified number of slots. The
+  // index is an open-addressing hash table keyed on the key hash. It must have
+  // more slots than the maximum number of entries; about twice as many slots as
+  // entries keeps probe sequences short.
+  template <size_t kSlots>
+  using HashIndex = std::array<IndexSlot, kSlots>;
+
+  // The first bytes of a key, kept for each descriptor in the optional key
+  // prefix table so that keys can be matched against a prefix without reading
+  // them from flash. Bytes past the end of the key are '\0'. The prefix is
+  // unknown if its first byte is '\0'.
+  using KeyPrefix = std::array<char, 4>;
+
+  // Whether a key starts with a prefix, as far as the key prefix table shows.
+  enum class PrefixMatch { kNo, kYes, kMaybe };
+
+  // Creates an EntryCache. If hash_index is empty, entries are found by
+  // scanning the descriptor list. Otherwise, the hash index is used to find
+  // entries in constant time. If key_cache_slots is not empty, recently used
+  // keys are kept in RAM so they do not have to be read from flash. If
+  // key_prefixes is not empty, it must have a KeyPrefix for each descriptor.
+  //
+  // If chain_collisions is true, keys whose hashes collide get separate
+  // descriptors, which are told apart by reading their keys. Otherwise, a key
+  // whose hash matches another key's cannot be added.
   constexpr EntryCache(Vector<KeyDescriptor>& descriptors,
                        Address* addresses,
-                       size_t redundancy)
+                       size_t redundancy,
+                       span<IndexSlot> hash_index = {},
+                       span<KeyCache::Slot> key_cache_slots = {},
+                       span<KeyPrefix> key_prefixes = {},
+                       bool chain_collisions = false)
       : descriptors_(descriptors),
         addresses_(addresses),
-        redundancy_(redundancy) {}
+        redundancy_(redundancy),
+        hash_index_(hash_index),
+        key_cache_(key_cache_slots),
+        key_prefixes_(key_prefixes),
+        chain_collisions_(chain_collisions) {}
 
-  // Clears all KeyDescriptors.
-  void Reset() { descriptors_.clear(); }
+  // Clears all KeyDescriptors and cached keys. Must be called before using the
+  // EntryCache.
+  void Reset();
 
   // Finds the metadata for an entry matching a particular key. Searches for a
   // KeyDescriptor that matches this key and sets *metadata to point to it if
@@ -100,10 +164,10 @@ class EntryCache {
   //             OK: there is a matching descriptor and *metadata is set
   //      NOT_FOUND: there is no descriptor that matches this key, but this key
   //                 has a unique hash (and could potentially be added to the
-  //                 KVS)
+  //                 KVS), or collisions are chained
   // ALREADY_EXISTS: there is no descriptor that matches this key, but the
   //                 key's hash collides with the hash for an existing
-  //                 descriptor
+  //                 descriptor and collisions are not chained
   //
   Status Find(FlashPartition& partition,
               std::string_view key,
@@ -119,16 +183,72 @@ class EntryCache {
                       std::string_view key,
                       EntryMetadata* metadata) const;
 
+  // Finds the metadata for the descriptor with the key hash. Unlike Find, the
+  // key is not read from flash to confirm that it matches. If collisions are
+  // chained, the first descriptor with the hash is found.
+  //
+  //          OK: there is a descriptor with the hash and *metadata is set
+  //   NOT_FOUND: no descriptor has the hash
+  //
+  Status FindByHash(uint32_t key_hash, EntryMetadata* metadata) const;
+
+  // Returns the key for an entry if it is in the key cache, or an empty
+  // string_view if it is not.
+  std::string_view CachedKey(const EntryMetadata& metadata) const {
+    return key_cache_.Find(index_of(metadata));
+  }
+
+  // Adds an entry's key to the key cache, if there is one.
+  void CacheKey(const EntryMetadata& metadata, std::string_view key) const {
+    key_cache_.Add(index_of(metadata), key);
+  }
+
+  // True if there is a key cache, which lookups update.
+  bool key_cache_enabled() const { return key_cache_.enabled(); }
+
+  // True if there is a key prefix table, which iteration updates.
+  bool key_prefixes_enabled() const { return !key_prefixes_.empty(); }
+
+  // Key cache hit and miss counts.
+  const KeyCacheStats& key_cache_stats() const { return key_cache_.stats(); }
+
+  // Records the first bytes of an entry's key, if there is a key prefix table.
+  void SetKeyPrefix(const EntryMetadata& metadata, std::string_view key) const;
+
+  // Checks whether an entry's key starts with the prefix using the key prefix
+  // table. Returns kMaybe if the key must be read from flash to tell.
+  PrefixMatch MatchPrefix(const EntryMetadata& metadata,
+                          std::string_view prefix) const;
+
+  // Returns the metadata for the descriptor at the specified position in the
+  // descriptor list, which must be less than total_entries(). Descriptors keep
+  // their positions until the EntryCache is reset.
+  EntryMetadata at(size_t descriptor_index) const {
+    return EntryMetadata(descriptors_[descriptor_index],
+                         addresses(descriptor_index));
+  }
+
   // Adds a new descriptor to the descriptor list. The entry MUST be unique and
   // the EntryCache must NOT be full!
   EntryMetadata AddNew(const KeyDescriptor& entry, Address address);
 
   // Adds a new descriptor, overwrites an existing one, or adds an additional
   // redundant address to one. The sector size is included for checking that
-  // redundant entries are in different sectors.
+  // redundant entries are in different sectors. If provided, the key is
+  // recorded in the key prefix table.
+  //
+  // If collisions are chained, the key and the partition must be provided.
+  // The key is compared with the keys of descriptors with the same hash, which
+  // are read from flash unless they are in the key cache.
   Status AddNewOrUpdateExisting(const KeyDescriptor& descriptor,
                                 Address address,
-                                size_t sector_size_bytes);
+                                size_t sector_size_bytes,
+                                std::string_view key = {},
+                                FlashPartition* partition = nullptr);
+
+  // Removes the addresses in a sector from every descriptor, such as when the
+  // sector is erased. Descriptors may be left with no addresses.
+  void RemoveAddressesInSector(Address sector_address, size_t sector_size_bytes);
 
   // Returns a pointer to an array of redundancy() addresses for temporary use.
   // This is used by the KeyValueStore to track reserved addresses when finding
@@ -152,6 +272,9 @@ class EntryCache {
   // The maximum number of entries supported by this EntryCache.
   size_t max_entries() const { return descriptors_.max_size(); }
 
+  // True if keys with colliding hashes are kept in separate descriptors.
+  bool chain_collisions() const { return chain_collisions_; }
+
   // Iterates over the EntryCache as EntryMetadata objects.
   class iterator {
    public:
@@ -195,7 +318,63 @@ class EntryCache {
   iterator end() const { return iterator(this, descriptors_.end()); }
 
  private:
-  int FindIndex(uint32_t key_hash) const;
+  // Returns the index of the first descriptor with the key hash for which
+  // matches(index) returns true, or -1 if there is none.
+  template <typename Predicate>
+  int FindIndex(uint32_t key_hash, Predicate&& matches) const {
+    if (hash_index_.empty()) {
+      for (size_t i = 0; i < descriptors_.size(); ++i) {
+        if (descriptors_[i].key_hash == key_hash && matches(i)) {
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    // Probe linearly from the hash's home slot. The index always has more
+    // slots than descriptors, so an empty slot terminates the search.
+    for (size_t slot = key_hash % hash_index_.size();
+         hash_index_[slot] != kEmptySlot;
+         slot = (slot + 1) % hash_index_.size()) {
+      const size_t index = hash_index_[slot];
+      if (descriptors_[index].key_hash == key_hash && matches(index)) {
+        return index;
+      }
+    }
+    return -1;
+  }
+
+  int FindIndex(uint32_t key_hash) const {
+    return FindIndex(key_hash, [](size_t) { return true; });
+  }
+
+  // Finds the descriptor for the key, comparing the key with the key of each
+  // descriptor with its hash until one matches. Returns the index, or -1 if no
+  // descriptor matches or a key could not be read, in which case *status is
+  // set to the error.
+  //
+  // A descriptor whose entries were all in erased sectors has no address from
+  // which to read its key. When an entry is being loaded, which is described
+  // by loading, such a descriptor matches if no other descriptor does and
+  // either it is the only such descriptor with the entry's transaction ID, or
+  // none has that ID and the entry is newer, so that it replaces the whole
+  // descriptor. Keys with the same hash written by one batch share an ID, so
+  // if several such descriptors have the entry's ID, DATA_LOSS is returned.
+  int FindKeyIndex(FlashPartition& partition,
+                   uint32_t key_hash,
+                   std::string_view key,
+                   Status* status,
+                   const KeyDescriptor* loading = nullptr) const;
+
+  // Checks whether the descriptor's key is the key, using the key cache or
+  // reading the key from flash. Returns OK if it is, NOT_FOUND if it is not.
+  Status CompareKey(FlashPartition& partition,
+                    size_t descriptor_index,
+                    std::string_view key) const;
+
+  // Adds the descriptor at the specified index to the hash index, if there is
+  // one.
+  void AddToHashIndex(size_t descriptor_index);
 
   // Adds the address to the descriptor at the specified index if there is an
   // address slot available.
@@ -204,6 +383,10 @@ class EntryCache {
   // Returns a span of the valid addresses for the descriptor.
   span<Address> addresses(size_t descriptor_index) const;
 
+  size_t index_of(const EntryMetadata& metadata) const {
+    return metadata.descriptor_ - descriptors_.begin();
+  }
+
   Address* first_address(size_t descriptor_index) const {
     return &addresses_[descriptor_index * redundancy_];
   }
@@ -213,6 +396,18 @@ class EntryCache {
   Vector<KeyDescriptor>& descriptors_;
   FlashPartition::Address* const addresses_;
   const size_t redundancy_;
+
+  // Optional open-addressing hash table of descriptor indices. Descriptors are
+  // never removed individually, so the table never needs tombstones.
+  const span<IndexSlot> hash_index_;
+
+  // Mutable so that lookups in const methods can update the cache.
+  mutable KeyCache key_cache_;
+
+  // Optional table of key prefixes, parallel to the descriptor list.
+  const span<KeyPrefix> key_prefixes_;
+
+  const bool chain_collisions_;
 };
 
 }  // namespace pw::kvs::internal
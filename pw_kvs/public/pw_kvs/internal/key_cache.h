@@ -0,0 +1,74 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "pw_kvs/internal/entry.h"
+#include "pw_span/span.h"
+
+namespace pw::kvs::internal {
+
+// Hit and miss counts for a KeyCache.
+struct KeyCacheStats {
+  size_t hits;
+  size_t misses;
+};
+
+// Fixed-size, least-recently-used cache of keys, indexed by the position of
+// their KeyDescriptor in the EntryCache. Keys are immutable for the lifetime of
+// a descriptor, so cached keys only need to be discarded when the EntryCache is
+// reset.
+//
+// With no slots, the cache is disabled. Lookups always fail and are not counted
+// in the statistics.
+class KeyCache {
+ public:
+  struct Slot {
+    uint16_t descriptor_index;
+    uint8_t key_length;
+    uint32_t last_used;
+    char key[Entry::kMaxKeyLength];
+  };
+
+  static constexpr uint16_t kEmpty = uint16_t(-1);
+
+  constexpr KeyCache(span<Slot> slots)
+      : slots_(slots), clock_(0), stats_{0, 0} {}
+
+  // Discards all cached keys. Does not clear the statistics.
+  void Reset();
+
+  // Returns the cached key for the descriptor, or an empty string_view if the
+  // key is not cached. Counts a hit or a miss.
+  std::string_view Find(size_t descriptor_index);
+
+  // Caches a key, replacing the least recently used key if the cache is full.
+  void Add(size_t descriptor_index, std::string_view key);
+
+  bool enabled() const { return !slots_.empty(); }
+
+  const KeyCacheStats& stats() const { return stats_; }
+
+  void ResetStats() { stats_ = {0, 0}; }
+
+ private:
+  const span<Slot> slots_;
+  uint32_t clock_;  // Incremented on every use to order slots by recency.
+  KeyCacheStats stats_;
+};
+
+}  // namespace pw::kvs::internal
@@ -26,6 +26,17 @@ struct KeyDescriptor {
   uint32_t transaction_id;
 
   EntryState state;  // TODO: Pack into transaction ID? or something?
+
+  // True if the checksum of the entry at the first address was verified since
+  // Init, either when it was loaded, written, or read.
+  bool verified;
+
+  // Size of the entry in flash, including padding. Kept so that valid bytes
+  // can be counted without reading the entry's header again. Fits in the
+  // padding after verified.
+  uint16_t entry_size;
 };
 
+static_assert(sizeof(KeyDescriptor) == 3 * sizeof(uint32_t));
+
 }  // namespace pw::kvs::internal
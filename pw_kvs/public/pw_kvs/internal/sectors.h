@@ -13,6 +13,7 @@
 // the License.
 #pragma once
 
+#include <algorithm>
 #include <climits>
 #include <cstddef>
 #include <cstdint>
@@ -21,7 +22,12 @@
 #include "pw_kvs/flash_memory.h"
 #include "pw_span/span.h"
 
-namespace pw::kvs::internal {
+namespace pw::kvs {
+
+// Declared in key_value_store.h with the other KeyValueStore options.
+enum class GarbageCollectPolicy;
+
+namespace internal {
 
 // Tracks the available and used space in each sector used by the KVS.
 class SectorDescriptor {
@@ -79,6 +85,17 @@ class SectorDescriptor {
     return sector_size_bytes - valid_bytes_ - writable_bytes();
   }
 
+  // The newest transaction ID of the entries written to this sector since it
+  // was erased. Relocated entries keep their transaction IDs, so this tracks
+  // how long the sector's data has gone unmodified.
+  uint32_t newest_transaction_id() const { return newest_transaction_id_; }
+
+  void UpdateNewestTransactionId(uint32_t transaction_id) {
+    newest_transaction_id_ = std::max(newest_transaction_id_, transaction_id);
+  }
+
+  void ResetNewestTransactionId() { newest_transaction_id_ = 0; }
+
   static constexpr size_t max_sector_size() { return kMaxSectorSize; }
 
  private:
@@ -88,10 +105,13 @@ class SectorDescriptor {
   static constexpr size_t kMaxSectorSize = UINT16_MAX - 1;
 
   explicit constexpr SectorDescriptor(uint16_t sector_size_bytes)
-      : tail_free_bytes_(sector_size_bytes), valid_bytes_(0) {}
+      : tail_free_bytes_(sector_size_bytes),
+        valid_bytes_(0),
+        newest_transaction_id_(0) {}
 
   uint16_t tail_free_bytes_;  // writable bytes at the end of the sector
   uint16_t valid_bytes_;      // sum of sizes of valid entries
+  uint32_t newest_transaction_id_;
 };
 
 // Represents a list of sectors usable by the KVS.
@@ -99,13 +119,17 @@ class Sectors {
  public:
   using Address = FlashPartition::Address;
 
-  constexpr Sectors(Vector<SectorDescriptor>& sectors,
-                    FlashPartition& partition,
-                    const SectorDescriptor** temp_sectors_to_skip)
+  constexpr Sectors(
+      Vector<SectorDescriptor>& sectors,
+      FlashPartition& partition,
+      const SectorDescriptor** temp_sectors_to_skip,
+      GarbageCollectPolicy gc_policy)
       : descriptors_(sectors),
         partition_(partition),
         last_new_(nullptr),
-        temp_sectors_to_skip_(temp_sectors_to_skip) {}
+        temp_sectors_to_skip_(temp_sectors_to_skip),
+        gc_policy_(gc_policy),
+        erase_counts_{} {}
 
   // Resets the Sectors list. Must be called before using the object.
   void Reset() {
@@ -184,9 +208,20 @@ class Sectors {
   }
 
   // Finds a sector that is ready to be garbage collected. Returns nullptr if no
-  // sectors can / need to be garbage collected.
+  // sectors can / need to be garbage collected. The current transaction ID is
+  // used to find the age of sectors for GarbageCollectPolicy::kCostBenefit.
   SectorDescriptor* FindSectorToGarbageCollect(
-      span<const Address> addresses_to_avoid);
+      span<const Address> addresses_to_avoid,
+      uint32_t current_transaction_id = 0);
+
+  // The number of sectors that are erased and ready to be written.
+  size_t EmptySectorCount() const;
+
+  // Sets the number of times each sector has been erased, indexed by sector,
+  // for GarbageCollectPolicy::kWearLeveling. The counts are not copied.
+  void set_erase_counts(span<const size_t> erase_counts) {
+    erase_counts_ = erase_counts;
+  }
 
   // The number of sectors in use.
   size_t size() const { return descriptors_.size(); }
@@ -219,6 +254,11 @@ class Sectors {
               span<const Address> addresses_to_skip,
               span<const Address> reserved_addresses);
 
+  // Scores a sector with valid and reclaimable bytes according to the garbage
+  // collection policy. The sector with the highest score is collected.
+  uint64_t GarbageCollectScore(const SectorDescriptor& sector,
+                               uint32_t current_transaction_id) const;
+
   Vector<SectorDescriptor>& descriptors_;
   FlashPartition& partition_;
 
@@ -227,6 +267,10 @@ class Sectors {
   // Temp buffer with space for redundancy * 2 - 1 sector pointers. This list is
   // used to track sectors that should be excluded from Find functions.
   const SectorDescriptor** const temp_sectors_to_skip_;
+
+  const GarbageCollectPolicy gc_policy_;
+  span<const size_t> erase_counts_;
 };
 
-}  // namespace pw::kvs::internal
+}  // namespace internal
+}  // namespace pw::kvs
@@ -14,6 +14,9 @@
 #pragma once
 
 #include <type_traits>
+#include <utility>
+
+#include "pw_span/span.h"
 
 namespace pw::kvs {
 
@@ -28,6 +28,7 @@
 #include "pw_kvs/internal/key_descriptor.h"
 #include "pw_kvs/internal/sectors.h"
 #include "pw_kvs/internal/span_traits.h"
+#include "pw_kvs/io.h"
 #include "pw_span/span.h"
 #include "pw_status/status.h"
 #include "pw_status/status_with_size.h"
@@ -46,15 +47,36 @@ enum class GargbageCollectOnWrite {
 };
 
 enum class ErrorRecovery {
-  // Immediately do full recovery of any errors that are detected.
+  // Immediately do full recovery of any errors that are detected. Init repairs
+  // corruption before it returns.
   kImmediate,
 
-  // Recover from errors, but do some time consuming steps at a later time. Such
-  // as waiting to garbage collect sectors with corrupt entries until the next
-  // garbage collection.
+  // Recover from errors, but do some time consuming steps at a later time. Init
+  // leaves corruption that it finds for MaintenanceStep to repair in budgeted
+  // steps, so that startup is not delayed by verifying and rewriting entries.
   kLazy,
 };
 
+// How to choose the sector to garbage collect when every sector with
+// reclaimable bytes also has valid entries that must be relocated. Sectors with
+// no valid entries are always collected first, since they cost nothing to
+// relocate.
+enum class GarbageCollectPolicy {
+  // Collect the sector with the most reclaimable bytes.
+  kGreedy,
+
+  // Collect the sector with the highest age * reclaimable / valid bytes, where
+  // age is the number of transactions since an entry was last written to the
+  // sector. Cold sectors are collected before they are mostly stale, which
+  // reduces how often hot data is copied.
+  kCostBenefit,
+
+  // Collect the sector that has been erased the fewest times, breaking ties by
+  // reclaimable bytes. Requires per-sector erase counts; without them, this is
+  // the same as kGreedy.
+  kWearLeveling,
+};
+
 struct Options {
   // Perform garbage collection if necessary when writing. If not kDisabled,
   // garbage collection is attempted if space for an entry cannot be found. This
@@ -62,6 +84,10 @@ struct Options {
   // require garbage collection fail with RESOURCE_EXHAUSTED.
   GargbageCollectOnWrite gc_on_write = GargbageCollectOnWrite::kOneSector;
 
+  // How to choose which sector to garbage collect. kWearLeveling requires
+  // per-sector erase counts, which are provided with set_sector_erase_counts.
+  GarbageCollectPolicy gc_policy = GarbageCollectPolicy::kGreedy;
+
   // When the KVS handles errors that are discovered, such as corrupt entries,
   // not enough redundant copys of an entry, etc.
   ErrorRecovery recovery = ErrorRecovery::kLazy;
@@ -69,10 +95,41 @@ struct Options {
   // Verify an entry's checksum after reading it from flash.
   bool verify_on_read = true;
 
+  // With verify_on_read, only verify entries in memory-mapped flash the first
+  // time they are read after Init, rather than on every read. Entries loaded by
+  // Init or written with verify_on_write count as read. Use VerifyAll to check
+  // entries for corruption that happens after they are verified.
+  bool verify_once_on_read = false;
+
   // Verify an in-flash entry's checksum after writing it.
   bool verify_on_write = true;
+
+  // If not 0 and the KVS has a checkpoint partition, a checkpoint is written
+  // after a write once this many transactions have occurred since the last
+  // checkpoint.
+  uint32_t checkpoint_interval = 0;
+
+  // The number of erased sectors MaintenanceStep keeps ready for writes, in
+  // addition to the one that is always kept empty for garbage collection.
+  // Writes that find an erased sector do not wait for garbage collection.
+  size_t spare_sectors = 0;
+
+  // Keys are found by a 32-bit hash. By default, a key whose hash matches
+  // another key's cannot be written; Put returns ALREADY_EXISTS. If this is
+  // set, such keys are kept in separate KeyDescriptors and told apart by their
+  // keys, so that any keys can be stored. The cost is an extra read of a key
+  // from flash when Init loads an entry whose hash is already known, including
+  // older versions and redundant copies of the same key, unless the key is in
+  // the key cache.
+  //
+  // This must be set the same way for every KVS that uses a partition. A KVS
+  // without it loads keys with colliding hashes as versions of one key.
+  bool chain_hash_collisions = false;
 };
 
+class ThreadSafeKeyValueStore;
+class WriteBackKeyValueStore;
+
 class KeyValueStore {
  public:
   // KeyValueStores are declared as instances of
@@ -84,9 +141,11 @@ class KeyValueStore {
   //
   // Return values:
   //
-  //          OK: KVS successfully initialized.
-  //   DATA_LOSS: KVS initialized and is usable, but contains corrupt data.
-  //     UNKNOWN: Unknown error. KVS is not initialized.
+  //                    OK: KVS successfully initialized.
+  //             DATA_LOSS: KVS initialized and is usable, but contains corrupt
+  //                        data.
+  //   FAILED_PRECONDITION: a ValueWriter or ValueReader is open.
+  //               UNKNOWN: Unknown error. KVS is not initialized.
   //
   Status Init();
 
@@ -100,9 +159,12 @@ class KeyValueStore {
   // RESOURCE_EXHAUSTED with the number of bytes read. The remainder of the
   // value can be read by calling get with an offset.
   //
+  // With redundancy, the copies of the entry are read in turn until one can be
+  // read and verified.
+  //
   //                    OK: the entry was successfully read
   //             NOT_FOUND: the key is not present in the KVS
-  //             DATA_LOSS: found the entry, but the data was corrupted
+  //             DATA_LOSS: found the entry, but every copy was corrupted
   //    RESOURCE_EXHAUSTED: the buffer could not fit the entire value, but as
   //                        many bytes as possible were written to it
   //   FAILED_PRECONDITION: the KVS is not initialized
@@ -123,20 +185,43 @@ class KeyValueStore {
     return FixedSizeGet(key, pointer, sizeof(T));
   }
 
+  // Finds the value of an entry in memory-mapped flash without copying it. On
+  // success, value refers to the value in flash and its checksum has been
+  // checked as for Get.
+  //
+  // The view remains valid until the sector that holds the entry is erased.
+  // Writes and garbage collection may erase sectors, so the view must not be
+  // used after erase_epoch() changes.
+  //
+  //                    OK: value refers to the entry's value in flash
+  //             NOT_FOUND: the key is not present in the KVS
+  //             DATA_LOSS: found the entry, but the data was corrupted
+  //         UNIMPLEMENTED: the partition is not memory-mapped or the value is
+  //                        compressed or has appended entries
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //      INVALID_ARGUMENT: key is empty or too long
+  //
+  Status GetView(std::string_view key, span<const std::byte>* value) const;
+
+  // Incremented each time the KVS erases a sector. Views from GetView are valid
+  // while this value is unchanged.
+  uint32_t erase_epoch() const { return erase_epoch_; }
+
   // Adds a key-value entry to the KVS. If the key was already present, its
   // value is overwritten.
   //
   // The value may be a span of bytes or a trivially copyable object.
   //
-  // In the current implementation, all keys in the KVS must have a unique hash.
-  // If Put is called with a key whose hash matches an existing key, nothing
-  // is added and ALREADY_EXISTS is returned.
+  // Unless Options::chain_hash_collisions is set, all keys in the KVS must have
+  // a unique hash. If Put is called with a key whose hash matches an existing
+  // key, nothing is added and ALREADY_EXISTS is returned.
   //
   //                    OK: the entry was successfully added or updated
   //             DATA_LOSS: checksum validation failed after writing the data
   //    RESOURCE_EXHAUSTED: there is not enough space to add the entry
   //        ALREADY_EXISTS: the entry could not be added because a different key
-  //                        with the same hash is already in the KVS
+  //                        with the same hash is already in the KVS, unless
+  //                        Options::chain_hash_collisions is set
   //   FAILED_PRECONDITION: the KVS is not initialized
   //      INVALID_ARGUMENT: key is empty or too long or value is too large
   //
@@ -150,6 +235,41 @@ class KeyValueStore {
     }
   }
 
+  // Adds a key-value entry that expires at expiry_time, in the units passed to
+  // SetCurrentTime. Once the current time reaches expiry_time, the key is
+  // treated as deleted without writing a tombstone, and garbage collection
+  // writes a tombstone in place of the entry instead of copying its value.
+  //
+  // Expiry times are stored in the first of the KVS's entry formats that has
+  // EntryFormat::expiry set. They are not kept in RAM, so when such a format is
+  // present, finding a key reads its entry's header to check whether it has
+  // expired. Expired keys are counted by size() and visited by iterators until
+  // they are found to have expired. Appending to a key removes its expiry time,
+  // and values with an expiry time are not compressed.
+  //
+  // Same return values as Put, and:
+  //
+  //   FAILED_PRECONDITION: no entry format stores expiry times
+  //
+  template <typename T>
+  Status PutWithExpiry(const std::string_view& key,
+                       const T& value,
+                       uint32_t expiry_time) {
+    if constexpr (ConvertsToSpan<T>::value) {
+      return PutBytes(key, as_bytes(span(value)), expiry_time);
+    } else {
+      CheckThatObjectCanBePutOrGet<T>();
+      return PutBytes(key, as_bytes(span(&value, 1)), expiry_time);
+    }
+  }
+
+  // Sets the time against which expiry times are compared. The KVS has no
+  // clock, so the application sets the time, in any units, as it advances.
+  // Entries that have expired when Init runs are loaded as deleted.
+  void SetCurrentTime(uint32_t time) { current_time_ = time; }
+
+  uint32_t current_time() const { return current_time_; }
+
   // Removes a key-value entry from the KVS.
   //
   //                    OK: the entry was successfully added or updated
@@ -161,6 +281,67 @@ class KeyValueStore {
   //
   Status Delete(std::string_view key);
 
+  // The most appended entries that extend one entry before Append rewrites the
+  // value as a single entry.
+  static constexpr size_t kMaxAppendedEntries = 8;
+
+  // Adds data to the end of a key's value. If the key is not present, Append is
+  // the same as Put.
+  //
+  // Only the new data is written if it fits after the key's entry in its
+  // sector: it is stored in an appended entry that refers to the key's previous
+  // entry, so the bytes written per update do not grow with the value. This
+  // suits values that grow, such as logs. The value is rewritten as a single
+  // entry when its sector is full, after kMaxAppendedEntries appended entries,
+  // and when garbage collection relocates it. Appended entries are not used if
+  // the redundancy is greater than 1.
+  //
+  // GetView and ValueReader return UNIMPLEMENTED for values with appended
+  // entries.
+  //
+  //                    OK: the data was appended
+  //             DATA_LOSS: checksum validation failed for the existing value or
+  //                        after writing the data
+  //    RESOURCE_EXHAUSTED: there is not enough space to add the entry
+  //        ALREADY_EXISTS: the entry could not be added because a different key
+  //                        with the same hash is already in the KVS, unless
+  //                        Options::chain_hash_collisions is set
+  //   FAILED_PRECONDITION: the KVS is not initialized
+  //      INVALID_ARGUMENT: key is empty or too long or value is too large
+  //         UNIMPLEMENTED: the partition's alignment is too large to write
+  //                        entries in pieces
+  //
+  Status Append(std::string_view key, span<const std::byte> data);
+
+  // A group of Put and Delete operations that are applied together by Commit.
+  class WriteBatch;
+
+  // Writes the operations in a WriteBatch to flash. The batch's entries share
+  // one transaction ID and are written to a single sector, followed by a commit
+  // marker. If the commit marker is not written (for example, due to power
+  // loss), none of the batch's operations are applied when the KVS is next
+  // initialized. The batch is not cleared.
+  //
+  //                    OK: all operations in the batch were applied
+  //             NOT_FOUND: a key to delete is not present in the KVS
+  //             DATA_LOSS: checksum validation failed after writing the data
+  //    RESOURCE_EXHAUSTED: there is not enough space or there are not enough
+  //                        KeyDescriptors for the batch
+  //        ALREADY_EXISTS: a key has the same hash as a different key, unless
+  //                        Options::chain_hash_collisions is set
+  //   FAILED_PRECONDITION: the KVS is not initialized
+  //      INVALID_ARGUMENT: a key appears twice or the batch is too large to fit
+  //                        in one sector
+  //
+  Status Commit(WriteBatch& batch);
+
+  // Writes or reads a value in pieces through the pw::Output and pw::Input
+  // interfaces, for values that are too large to buffer in RAM. Only one
+  // ValueWriter or ValueReader may be open at a time. While one is open, other
+  // operations return FAILED_PRECONDITION.
+  class ValueWriter;
+  class ValueReader;
+
   // Returns the size of the value corresponding to the key.
   //
   //                    OK: the size was returned successfully
@@ -177,9 +358,95 @@ class KeyValueStore {
   // Perform garbage collection of part of the KVS, typically a single sector or
   // similar unit that makes sense for the KVS implementation.
   Status GarbageCollectPartial() {
+    if (stream_open_) {
+      return Status::FAILED_PRECONDITION;
+    }
     return GarbageCollectPartial(span<const Address>());
   }
 
+  // Performs part of a garbage collection, so that garbage collection can be
+  // spread across many calls (such as idle ticks) that each take a bounded
+  // amount of time. Each call either relocates entries out of the sector being
+  // collected until at least max_bytes have been moved, or erases the sector
+  // once it holds no valid entries. Progress is kept in RAM between calls and
+  // is discarded by Init. New entries are not written to a sector while it is
+  // being collected.
+  //
+  // The erase is started with FlashPartition::StartErase and is not waited
+  // for, so it may overlap with other work, reads, and writes to other
+  // sectors. The next step checks whether it has completed. Writes that need
+  // the sector's space, checkpoints, and other garbage collection wait for it.
+  //
+  //                    OK: garbage collection work was done
+  //             NOT_FOUND: there is no reclaimable space to garbage collect
+  //           UNAVAILABLE: the erase started by the previous step is still in
+  //                        progress
+  //   FAILED_PRECONDITION: a ValueWriter or ValueReader is open
+  //
+  Status GarbageCollectStep(size_t max_bytes);
+
+  // Prepares erased sectors ahead of demand, for calling from an idle loop.
+  // While fewer than Options::spare_sectors + 1 sectors are erased, each call
+  // performs a GarbageCollectStep(max_bytes), preferring sectors that hold no
+  // valid entries and only need an erase. A garbage collection in progress is
+  // always continued.
+  //
+  // If corruption was detected, MaintenanceStep first repairs it like Repair,
+  // in steps: each call repairs entries until at least max_bytes of copies have
+  // been checked, and then sectors with corrupt data are garbage collected a
+  // step at a time. A repair that fails returns its error once and is not
+  // retried until Repair or Init is called.
+  //
+  //                    OK: work was done; call again to continue
+  //             NOT_FOUND: enough sectors are erased, or there is no
+  //                        reclaimable space to garbage collect
+  //             DATA_LOSS: the repair finished, but an entry has no valid copy
+  //           UNAVAILABLE: an erase is still in progress
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //
+  Status MaintenanceStep(size_t max_bytes);
+
+  // True if GarbageCollectStep has started collecting a sector that it has not
+  // yet erased.
+  bool garbage_collection_in_progress() const {
+    return gc_sector_ != nullptr || erasing_sector_ != nullptr;
+  }
+
+  // Verifies the checksums of the entries in flash, so that corruption is found
+  // in the background instead of when a value is read. Each call verifies
+  // entries until at least max_bytes have been read, continuing from where the
+  // previous call stopped. Corrupt entries are reported as errors to handle
+  // according to the ErrorRecovery option. Like GarbageCollectStep and
+  // MaintenanceStep, VerifyAll may be called until it returns NOT_FOUND.
+  //
+  //                    OK: the entries checked were valid; call again to
+  //                        continue
+  //             NOT_FOUND: every entry was verified; the next call starts over
+  //             DATA_LOSS: an entry checked by this call is corrupt
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //
+  Status VerifyAll(size_t max_bytes);
+
+  // Repairs the corruption found by Init, VerifyAll, or reads since the last
+  // repair. Copies of entries that fail verification are dropped, entries with
+  // fewer copies than the redundancy are copied from a good copy to other
+  // sectors, sectors that hold corrupt data are garbage collected, and a
+  // sector is garbage collected if none is empty. Repair does all of this
+  // before it returns, regardless of Options::recovery; MaintenanceStep does
+  // the same work in steps.
+  //
+  //                    OK: no errors remain
+  //             DATA_LOSS: an entry has no valid copy
+  //    RESOURCE_EXHAUSTED: there is not enough space for the new copies
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //
+  Status Repair();
+
+  // True if corruption was found that Repair has not fixed. With redundancy,
+  // reads of a key whose first copy is corrupt return another copy and set
+  // this, so that the corrupt copy can be repaired.
+  bool error_detected() const { return error_detected_; }
+
   void LogDebugInfo() const;
 
   // Classes and functions to support STL-style iteration.
@@ -214,15 +481,19 @@ class KeyValueStore {
 
     constexpr Item(const KeyValueStore& kvs,
                    const internal::EntryCache::iterator& iterator)
-        : kvs_(kvs), iterator_(iterator), key_buffer_{} {}
+        : kvs_(kvs), iterator_(iterator), key_buffer_{}, key_length_(0) {}
 
-    void ReadKey();
+    // Reads the key into the key buffer, unless it was already read.
+    std::string_view ReadKey();
 
     const KeyValueStore& kvs_;
     internal::EntryCache::iterator iterator_;
 
     // Buffer large enough for a null-terminated version of any valid key.
     std::array<char, internal::Entry::kMaxKeyLength + 1> key_buffer_;
+
+    // Length of the key in key_buffer_, or 0 if it has not been read.
+    size_t key_length_;
   };
 
   class iterator {
@@ -231,7 +502,7 @@ class KeyValueStore {
 
     iterator& operator++(int) { return operator++(); }
 
-    // Reads the entry's key from flash.
+    // Reads the entry's key from flash, if it was not already read.
     const Item& operator*() {
       item_.ReadKey();
       return item_;
@@ -253,17 +524,29 @@ class KeyValueStore {
     friend class KeyValueStore;
 
     constexpr iterator(const KeyValueStore& kvs,
-                       const internal::EntryCache::iterator& iterator)
-        : item_(kvs, iterator) {}
+                       const internal::EntryCache::iterator& iterator,
+                       std::string_view prefix = {})
+        : item_(kvs, iterator), prefix_(prefix) {}
+
+    void SkipNonMatching();
 
     Item item_;
+    std::string_view prefix_;
   };
 
   using const_iterator = iterator;  // Standard alias for iterable types.
 
-  iterator begin() const;
+  iterator begin() const { return begin(std::string_view()); }
   iterator end() const { return iterator(*this, entry_cache_.end()); }
 
+  // Iterates over only the keys that start with the prefix, from begin(prefix)
+  // to end(prefix). The prefix is not copied, so it must remain valid while the
+  // iterator is used. Keys are read from flash to compare them with the prefix
+  // unless the KeyValueStoreBuffer indexes key prefixes, in which case prefixes
+  // of up to four characters are matched without reading flash.
+  iterator begin(std::string_view prefix) const;
+  iterator end(std::string_view) const { return end(); }
+
   // Returns the number of valid entries in the KeyValueStore.
   size_t size() const { return entry_cache_.present_entries(); }
 
@@ -276,6 +559,52 @@ class KeyValueStore {
   // the underlying flash is erased.
   uint32_t transaction_count() const { return last_transaction_id_; }
 
+  // Provides the number of times each sector in the partition has been erased,
+  // such as FlashPartitionWithStats::sector_erase_counters(), for the
+  // GarbageCollectPolicy::kWearLeveling policy. The counts are not copied, so
+  // they must remain valid while the KVS is in use. Set them again if the
+  // counts are reset to a different size.
+  void set_sector_erase_counts(span<const size_t> erase_counts) {
+    sectors_.set_erase_counts(erase_counts);
+  }
+
+  // Provides a buffer through which entries are read when they are verified or
+  // copied, such as by Init and garbage collection. Without one, entries are
+  // read in pieces of 32-64 B, so a large entry takes many reads; on flash with
+  // a high per-read cost, such as SPI flash, a buffer about the size of the
+  // largest entry is much faster. The buffer is not copied, so it must remain
+  // valid while the KVS is in use, and it must not be used for anything else
+  // during KVS operations. An empty buffer restores the built-in buffers.
+  void set_scratch_buffer(span<std::byte> buffer) { scratch_buffer_ = buffer; }
+
+  // Sets a partition in which to keep checkpoints of the KVS's in-RAM state:
+  // the KeyDescriptors and the written bytes in each sector. If there is a
+  // checkpoint, Init loads it and reads only the entries written after it, so
+  // Init's time does not grow with the amount of data in the KVS. Must be
+  // called before Init.
+  //
+  // The partition must have at least two sectors and an alignment of at most
+  // 64 B. A checkpoint must fit in one sector; it takes about 12 B per sector
+  // plus 12 B + 4 B * redundancy per KeyDescriptor. If the KVS's partition is
+  // modified other than by the KVS, such as by erasing it, the checkpoint
+  // partition must be erased as well.
+  void set_checkpoint_partition(FlashPartition* partition) {
+    checkpoint_partition_ = partition;
+  }
+
+  // Writes a checkpoint of the KVS's in-RAM state to the checkpoint partition.
+  // Checkpoints are also written automatically if
+  // Options::checkpoint_interval is set.
+  //
+  //                    OK: the checkpoint was written
+  //    RESOURCE_EXHAUSTED: the checkpoint does not fit in a sector of the
+  //                        checkpoint partition
+  //   FAILED_PRECONDITION: the KVS is not initialized, has no checkpoint
+  //                        partition, has a stream open, or detected corrupt
+  //                        data during Init
+  //
+  Status Checkpoint();
+
   struct StorageStats {
     size_t writable_bytes;
     size_t in_use_bytes;
@@ -284,6 +613,14 @@ class KeyValueStore {
 
   StorageStats GetStorageStats() const;
 
+  using KeyCacheStats = internal::KeyCacheStats;
+
+  // Returns the number of key lookups that were served from the in-RAM key
+  // cache (hits) or had to read the key from flash (misses).
+  KeyCacheStats GetKeyCacheStats() const {
+    return entry_cache_.key_cache_stats();
+  }
+
   // Level of redundancy to use for writing entries.
   size_t redundancy() const { return entry_cache_.redundancy(); }
 
@@ -302,9 +639,15 @@ class KeyValueStore {
                 Vector<SectorDescriptor>& sector_descriptor_list,
                 const SectorDescriptor** temp_sectors_to_skip,
                 Vector<KeyDescriptor>& key_descriptor_list,
-                Address* addresses);
+                Address* addresses,
+                span<internal::EntryCache::IndexSlot> hash_index,
+                span<internal::KeyCache::Slot> key_cache_slots,
+                span<internal::EntryCache::KeyPrefix> key_prefixes);
 
  private:
+  friend class ThreadSafeKeyValueStore;
+  friend class WriteBackKeyValueStore;
+
   using EntryMetadata = internal::EntryMetadata;
   using EntryState = internal::EntryState;
 
@@ -317,20 +660,89 @@ class KeyValueStore {
         "as_bytes(span(&value, 1)) or as_writable_bytes(span(&value, 1)).");
   }
 
+  void ResetInMemoryState();
+
+  Status LoadEntries(size_t* total_corrupt_bytes, int* corrupt_entries);
   Status LoadEntry(Address entry_address, Address* next_entry_address);
+  Status LoadBatch(const Entry& first_entry, Address* next_entry_address);
+  Status AddEntryToCache(const Entry& entry, Address* next_entry_address);
   Status ScanForEntry(const SectorDescriptor& sector,
                       Address start_address,
                       Address* next_entry_address);
 
-  Status PutBytes(std::string_view key, span<const std::byte> value);
+  Status PutBytes(std::string_view key,
+                  span<const std::byte> value,
+                  uint32_t expiry_time = Entry::kNoExpiry);
 
   StatusWithSize ValueSize(const EntryMetadata& metadata) const;
 
+  // Reads the header of the first copy of the entry that can be read.
+  Status ReadEntry(const EntryMetadata& metadata, Entry& entry) const;
+
+  // Finds a key that is present and has not expired. Returns NOT_FOUND for an
+  // expired key, which is marked deleted.
+  Status FindExisting(std::string_view key, EntryMetadata* metadata) const;
+
+  // True if the entry has an expiry time that has passed, in which case its key
+  // is marked deleted.
+  bool MarkDeletedIfExpired(const EntryMetadata& metadata) const;
+
+  // Moves a redundant copy that was read after the copies before it failed to
+  // the front of the entry's addresses, so that it is read first from then on.
+  void PreferCopy(const EntryMetadata& metadata, size_t index) const;
+
+  // True if the entry's checksum must be verified when it is read.
+  bool VerifyOnRead(const EntryMetadata& metadata) const;
+
+  // True if reads update in-memory state, such as the key cache, so that they
+  // must not run concurrently with each other.
+  bool ReadsModifyState() const;
+
+  span<const std::byte> CompressValue(std::string_view key,
+                                      span<const std::byte> value,
+                                      bool* compressed) const;
+
+  StatusWithSize ReadCompressedValue(std::string_view key,
+                                     const EntryMetadata& metadata,
+                                     const Entry& entry,
+                                     span<const std::byte>* data,
+                                     bool verify = true) const;
+
+  // Addresses of the entries in an append chain.
+  using AppendChain = std::array<Address, kMaxAppendedEntries + 1>;
+
+  StatusWithSize FindAppendChain(const Entry& newest,
+                                 AppendChain& chain,
+                                 bool verify) const;
+
+  Status ReadAppendChain(std::string_view key,
+                         const EntryMetadata& metadata,
+                         span<const Address> chain,
+                         size_t offset_bytes,
+                         Output& output) const;
+
+  StatusWithSize GetAppended(std::string_view key,
+                             const EntryMetadata& metadata,
+                             const Entry& newest,
+                             span<std::byte> value_buffer,
+                             size_t offset_bytes) const;
+
   StatusWithSize Get(std::string_view key,
                      const EntryMetadata& metadata,
                      span<std::byte> value_buffer,
                      size_t offset_bytes) const;
 
+  StatusWithSize GetCopy(std::string_view key,
+                         const EntryMetadata& metadata,
+                         Address address,
+                         span<std::byte> value_buffer,
+                         size_t offset_bytes) const;
+
+  Status GetViewOfCopy(std::string_view key,
+                       const EntryMetadata& metadata,
+                       Address address,
+                       span<const std::byte>* value) const;
+
   Status FixedSizeGet(std::string_view key,
                       void* value,
                       size_t size_bytes) const;
@@ -345,20 +757,44 @@ class KeyValueStore {
   Status WriteEntryForExistingKey(EntryMetadata& metadata,
                                   EntryState new_state,
                                   std::string_view key,
-                                  span<const std::byte> value);
+                                  span<const std::byte> value,
+                                  uint32_t expiry_time = Entry::kNoExpiry);
 
-  Status WriteEntryForNewKey(std::string_view key, span<const std::byte> value);
+  Status WriteEntryForNewKey(std::string_view key,
+                             span<const std::byte> value,
+                             uint32_t expiry_time = Entry::kNoExpiry);
 
   Status WriteEntry(std::string_view key,
                     span<const std::byte> value,
                     EntryState new_state,
                     EntryMetadata* prior_metadata = nullptr,
-                    size_t prior_size = 0);
+                    uint32_t expiry_time = Entry::kNoExpiry);
 
-  EntryMetadata UpdateKeyDescriptor(const Entry& new_entry,
+  EntryMetadata UpdateKeyDescriptor(const KeyDescriptor& descriptor,
                                     std::string_view key,
-                                    EntryMetadata* prior_metadata,
-                                    size_t prior_size);
+                                    Address address,
+                                    EntryMetadata* prior_metadata);
+
+  Status WriteAppendedEntry(EntryMetadata& metadata,
+                            std::string_view key,
+                            span<const std::byte> data,
+                            size_t value_size,
+                            uint16_t chain_length);
+
+  Status WriteCombinedEntry(EntryMetadata& metadata,
+                            std::string_view key,
+                            span<const std::byte> data,
+                            size_t value_size);
+
+  Status WriteChainedValue(Entry& entry,
+                           std::string_view key,
+                           const EntryMetadata& metadata,
+                           span<const Address> chain,
+                           span<const std::byte> data);
+
+  Status PrepareBatch(WriteBatch& batch, size_t* batch_size);
+
+  Status AppendBatch(WriteBatch& batch, Address address);
 
   Status GetSectorForWrite(SectorDescriptor** sector,
                            size_t entry_size,
@@ -372,6 +808,16 @@ class KeyValueStore {
                        KeyValueStore::Address& address,
                        span<const Address> addresses_to_skip);
 
+  Status RelocateExpiredEntry(const EntryMetadata& metadata,
+                              const Entry& entry,
+                              KeyValueStore::Address& address,
+                              span<const Address> addresses_to_skip);
+
+  Status RelocateAppendChain(const EntryMetadata& metadata,
+                             const Entry& newest,
+                             KeyValueStore::Address& address,
+                             span<const Address> addresses_to_skip);
+
   Status GarbageCollectPartial(span<const Address> addresses_to_skip);
 
   Status RelocateKeyAddressesInSector(SectorDescriptor& sector_to_gc,
@@ -381,12 +827,69 @@ class KeyValueStore {
   Status GarbageCollectSector(SectorDescriptor& sector_to_gc,
                               span<const Address> addresses_to_skip);
 
-  Status Repair() { return Status::UNIMPLEMENTED; }
+  Status ReinitializeSector(SectorDescriptor& sector);
+
+  Status StartReinitializeSector(SectorDescriptor& sector);
+
+  Status FinishErase(bool wait = true);
+
+  Status AppendCopy(const Entry& entry, Address new_address);
+
+  Status LoadCheckpoint(size_t* total_corrupt_bytes, int* corrupt_entries);
+
+  Status FindCheckpoint(Entry* checkpoint, Address* records_end);
+
+  Status ReadCheckpointRecord(Address address,
+                              Entry* entry,
+                              bool* is_checkpoint) const;
+
+  Status ReadCheckpoint(const Entry& checkpoint, uint32_t* transaction_id);
+
+  Status ApplySectorErasures(Address address, Address records_end);
+
+  Status VerifyCheckpointSectors(const Entry& checkpoint) const;
+
+  uint32_t FirstTransactionId(const SectorDescriptor& sector) const;
+
+  void CheckpointIfDue();
+
+  Status WriteCheckpoint();
+
+  Status WriteCheckpointContents(internal::EntryWriter& writer) const;
+
+  Status WriteSectorErasure(const SectorDescriptor& sector);
+
+  Status FinishCheckpointRecord(internal::EntryWriter& writer,
+                                const Entry& record,
+                                Status status);
+
+  size_t CheckpointSectorSpace() const;
+
+  Status StartCheckpointSector();
+
+  Status InvalidateCheckpoints();
+
+  Status RepairCorruption();
+
+  Status RepairEntry(EntryMetadata& metadata);
+
+  Status RepairStep(size_t max_bytes);
+
+  Status FinishRepair();
+
+  void StartGarbageCollectStep(SectorDescriptor& sector);
 
   internal::Entry CreateEntry(Address address,
                               std::string_view key,
                               span<const std::byte> value,
-                              EntryState state);
+                              EntryState state,
+                              bool compressed,
+                              uint32_t expiry_time = Entry::kNoExpiry);
+
+  internal::Entry CreateBatchEntry(Address address,
+                                   std::string_view key,
+                                   span<const std::byte> value,
+                                   EntryState state);
 
   void LogSectors() const;
   void LogKeyDescriptor() const;
@@ -397,23 +900,277 @@ class KeyValueStore {
   // List of sectors used by this KVS.
   internal::Sectors sectors_;
 
-  // Unordered list of KeyDescriptors. Finding a key requires scanning and
-  // verifying a match by reading the actual entry.
+  // Unordered list of KeyDescriptors. Finding a key requires scanning (or a
+  // hash index lookup) and verifying a match by reading the actual entry.
   internal::EntryCache entry_cache_;
 
   Options options_;
 
   bool initialized_;
 
-  bool error_detected_;
+  // Set by reads that fall back to a redundant copy, so it may change through
+  // a const KeyValueStore.
+  mutable bool error_detected_;
 
   uint32_t last_transaction_id_;
+
+  // Sector being collected by GarbageCollectStep, or nullptr if there is none,
+  // and the position of the next KeyDescriptor whose entries to relocate. The
+  // sector's writable bytes are restored if the collection is abandoned.
+  SectorDescriptor* gc_sector_;
+  size_t gc_next_entry_;
+  uint16_t gc_writable_bytes_;
+
+  // Sector whose erase was started but has not been completed, or nullptr.
+  SectorDescriptor* erasing_sector_;
+
+  // Position of the next KeyDescriptor whose entries VerifyAll checks.
+  size_t verify_next_entry_;
+
+  // Progress of a repair done by MaintenanceStep: the position of the next
+  // KeyDescriptor to repair, and the first error found so far. After a repair
+  // fails, MaintenanceStep does not repair again until Repair or Init.
+  size_t repair_next_entry_;
+  Status repair_status_;
+  bool repair_failed_;
+
+  // Number of sectors erased by this KVS, which invalidates views of entries
+  // in flash. Not reset by Init.
+  uint32_t erase_epoch_;
+
+  // True while a ValueWriter or ValueReader is open. Streams keep the state of
+  // the entry format's checksum between calls, so no other operations may run.
+  mutable bool stream_open_;
+
+  // Optional buffer for reading entries when they are verified or copied.
+  span<std::byte> scratch_buffer_;
+
+  // The time set by SetCurrentTime, against which expiry times are compared.
+  uint32_t current_time_;
+
+  // Optional partition for checkpoints, and the address at which to write the
+  // next checkpoint record. Records are ordered by their sequence numbers.
+  FlashPartition* checkpoint_partition_;
+  Address checkpoint_address_;
+  uint32_t checkpoint_sequence_;
+
+  // last_transaction_id_ when the newest checkpoint was written.
+  uint32_t checkpoint_transaction_id_;
+
+  // True if the checkpoint partition holds a checkpoint, in which case sector
+  // erasures must be recorded after it.
+  bool has_checkpoint_;
 };
 
+// A group of Put and Delete operations that are applied together by
+// KeyValueStore::Commit. WriteBatches are declared as instances of
+// WriteBatchBuffer<MAX_OPERATIONS>.
+//
+// The batch refers to the keys and values passed to it; they are not copied
+// and must remain valid until the batch is committed or cleared.
+class KeyValueStore::WriteBatch {
+ public:
+  // Adds a Put operation to the batch. The value may be a span of bytes or a
+  // trivially copyable object.
+  //
+  //                    OK: the operation was added
+  //    RESOURCE_EXHAUSTED: the batch is full
+  //      INVALID_ARGUMENT: key is empty or too long
+  //
+  template <typename T>
+  Status Put(const std::string_view& key, const T& value) {
+    if constexpr (ConvertsToSpan<T>::value) {
+      return Add(key, as_bytes(span(value)), EntryState::kValid);
+    } else {
+      CheckThatObjectCanBePutOrGet<T>();
+      return Add(key, as_bytes(span(&value, 1)), EntryState::kValid);
+    }
+  }
+
+  // Adds a Delete operation to the batch. Same return values as Put.
+  Status Delete(std::string_view key) {
+    return Add(key, {}, EntryState::kDeleted);
+  }
+
+  // Removes all operations from the batch.
+  void clear() { operations_.clear(); }
+
+  size_t size() const { return operations_.size(); }
+
+  size_t max_size() const { return operations_.max_size(); }
+
+  bool empty() const { return operations_.empty(); }
+
+ protected:
+  struct Operation {
+    std::string_view key;
+    span<const std::byte> value;
+    EntryState state;
+
+    // Set by Commit.
+    bool new_key;
+    EntryMetadata metadata;
+    Address address;
+  };
+
+  constexpr WriteBatch(Vector<Operation>& operations)
+      : operations_(operations) {}
+
+ private:
+  friend class KeyValueStore;
+
+  Status Add(std::string_view key,
+             span<const std::byte> value,
+             EntryState state);
+
+  Vector<Operation>& operations_;
+};
+
+// Writes a value in pieces. After Open, exactly value_size bytes must be
+// written with Write before calling Finish. The checksum is calculated as the
+// value is written, and the entry's header is written to flash last, once the
+// checksum is known. The value is not visible in the KVS until Finish succeeds.
+//
+// If the ValueWriter is destroyed without calling Finish, the partially written
+// entry is abandoned; its space is reclaimed by garbage collection.
+class KeyValueStore::ValueWriter final : public Output {
+ public:
+  ValueWriter(KeyValueStore& kvs);
+
+  ~ValueWriter() { Close(); }
+
+  ValueWriter(const ValueWriter&) = delete;
+  ValueWriter& operator=(const ValueWriter&) = delete;
+
+  // Starts writing a value of value_size bytes for the key. Space for the entry
+  // is found, garbage collecting if necessary, before any data is written.
+  //
+  //                    OK: the ValueWriter is ready for the value
+  //    RESOURCE_EXHAUSTED: there is not enough space to add the entry
+  //        ALREADY_EXISTS: a different key with the same hash is in the KVS,
+  //                        unless Options::chain_hash_collisions is set
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //      INVALID_ARGUMENT: key is empty or too long or value is too large
+  //              INTERNAL: the partition's alignment is too large for the
+  //                        ValueWriter's buffers
+  //
+  Status Open(std::string_view key, size_t value_size);
+
+  // Writes the entry's header and any buffered data, then adds the entry to the
+  // KVS. The ValueWriter is closed, even if Finish fails, unless it returns
+  // FAILED_PRECONDITION.
+  //
+  //                    OK: the value was written and added to the KVS
+  //             DATA_LOSS: checksum validation failed after writing the data
+  //   FAILED_PRECONDITION: the ValueWriter is not open or the value is
+  //                        incomplete
+  //
+  Status Finish();
+
+  // Number of bytes of the value that have not been written yet.
+  size_t bytes_remaining() const { return bytes_remaining_; }
+
+  bool is_open() const { return open_; }
+
+ private:
+  // Writes value bytes. Returns OUT_OF_RANGE if more bytes than were reserved
+  // in Open are written, and FAILED_PRECONDITION if the ValueWriter is not
+  // open. Flash write errors are returned, after which Finish fails.
+  StatusWithSize DoWrite(span<const std::byte> data) override;
+
+  void Close();
+
+  KeyValueStore& kvs_;
+  Entry entry_;
+  Entry::KeyBuffer key_buffer_;
+  size_t bytes_remaining_;
+  Status status_;
+  bool open_;
+
+  internal::EntryWriter writer_;
+};
+
+// Reads a value in pieces. Each Read fills as much of the buffer as it can and
+// returns the number of bytes read. The checksum is verified when the last byte
+// of the value is read, so the value must not be used until the last Read
+// returns OK. Reading the whole value closes the ValueReader.
+class KeyValueStore::ValueReader final : public Input {
+ public:
+  ValueReader(const KeyValueStore& kvs)
+      : kvs_(kvs),
+        entry_(),
+        compressed_value_(),
+        value_size_(0),
+        offset_(0),
+        verify_(false),
+        open_(false) {}
+
+  ~ValueReader() { Close(); }
+
+  ValueReader(const ValueReader&) = delete;
+  ValueReader& operator=(const ValueReader&) = delete;
+
+  // Starts reading the value for the key. Returns the size of the value.
+  //
+  //                    OK: the ValueReader is ready to read the value
+  //             NOT_FOUND: the key is not present in the KVS
+  //   FAILED_PRECONDITION: the KVS is not initialized or a stream is open
+  //      INVALID_ARGUMENT: key is empty or too long
+  //         UNIMPLEMENTED: the value has appended entries
+  //
+  StatusWithSize Open(std::string_view key);
+
+  // Stops reading the value before the end, without verifying the checksum.
+  void Close();
+
+  // Number of bytes of the value that have not been read yet.
+  size_t bytes_remaining() const { return value_size_ - offset_; }
+
+  bool is_open() const { return open_; }
+
+ private:
+  //                    OK: bytes were read; if bytes_remaining() is 0, the
+  //                        value's checksum was verified
+  //             DATA_LOSS: the value's checksum did not match
+  //   FAILED_PRECONDITION: the ValueReader is not open
+  //
+  StatusWithSize DoRead(span<std::byte> data) override;
+
+  const KeyValueStore& kvs_;
+  Entry entry_;
+
+  // A compressed value is read into the compression working buffer by Open and
+  // decompressed in pieces.
+  span<const std::byte> compressed_value_;
+
+  size_t value_size_;
+  size_t offset_;
+  bool verify_;
+  bool open_;
+};
+
+// KeyValueStoreBuffer allocates the buffers used by a KeyValueStore.
+//
+// Each of the kMaxEntries keys costs sizeof(internal::KeyDescriptor) (12 B)
+// plus sizeof(internal::EntryCache::Address) (4 B) per copy in kRedundancy.
+// Keys are identified by a 32-bit hash; with chain_hash_collisions set,
+// colliding keys each get their own KeyDescriptor, so no extra RAM is used.
+//
+// If kHashIndexSlots is non-zero, a hash index with that many slots is used to
+// find keys in constant time instead of scanning every KeyDescriptor. Each slot
+// costs sizeof(internal::EntryCache::IndexSlot) bytes. kHashIndexSlots must be
+// greater than kMaxEntries; about twice kMaxEntries is recommended.
+//
+// If kKeyCacheEntries is non-zero, up to that many recently used keys are kept
+// in RAM. Cached keys are compared and iterated without reading flash. Each
+// entry costs sizeof(internal::KeyCache::Slot) bytes.
 template <size_t kMaxEntries,
           size_t kMaxUsableSectors,
           size_t kRedundancy = 1,
-          size_t kEntryFormats = 1>
+          size_t kEntryFormats = 1,
+          size_t kHashIndexSlots = 0,
+          size_t kKeyCacheEntries = 0,
+          bool kIndexKeyPrefixes = false>
 class KeyValueStoreBuffer : public KeyValueStore {
  public:
   // Constructs a KeyValueStore on the partition, with support for one
@@ -441,7 +1198,10 @@ class KeyValueStoreBuffer : public KeyValueStore {
                       sectors_,
                       temp_sectors_to_skip_,
                       key_descriptors_,
-                      addresses_) {
+                      addresses_,
+                      hash_index_,
+                      key_cache_slots_,
+                      key_prefixes_) {
     std::copy(formats.begin(), formats.end(), formats_.begin());
   }
 
@@ -450,6 +1210,14 @@ class KeyValueStoreBuffer : public KeyValueStore {
   static_assert(kMaxUsableSectors > 0u);
   static_assert(kRedundancy > 0u);
   static_assert(kEntryFormats > 0u);
+  static_assert(kHashIndexSlots == 0u || kHashIndexSlots > kMaxEntries,
+                "The hash index must have more slots than kMaxEntries");
+  static_assert(kHashIndexSlots == 0u ||
+                    kMaxEntries < internal::EntryCache::kEmptySlot,
+                "kMaxEntries is too large to use a hash index");
+  static_assert(kKeyCacheEntries == 0u ||
+                    kMaxEntries < internal::KeyCache::kEmpty,
+                "kMaxEntries is too large to use a key cache");
 
   Vector<SectorDescriptor, kMaxUsableSectors> sectors_;
 
@@ -470,8 +1238,32 @@ class KeyValueStoreBuffer : public KeyValueStore {
   // KeyDescriptors.
   internal::EntryCache::AddressList<kRedundancy, kMaxEntries> addresses_;
 
+  // Optional hash index of KeyDescriptors, keyed on the key hash.
+  internal::EntryCache::HashIndex<kHashIndexSlots> hash_index_;
+
+  // Optional cache of recently used keys.
+  std::array<internal::KeyCache::Slot, kKeyCacheEntries> key_cache_slots_;
+
+  // Optional table of the first bytes of each key, for prefix iteration.
+  std::array<internal::EntryCache::KeyPrefix,
+             kIndexKeyPrefixes ? kMaxEntries : 0>
+      key_prefixes_;
+
   // EntryFormats that can be read by this KeyValueStore.
   std::array<EntryFormat, kEntryFormats> formats_;
 };
 
+// WriteBatchBuffer allocates space for up to kMaxOperations operations in a
+// KeyValueStore::WriteBatch.
+template <size_t kMaxOperations>
+class WriteBatchBuffer : public KeyValueStore::WriteBatch {
+ public:
+  constexpr WriteBatchBuffer() : WriteBatch(operations_) {}
+
+ private:
+  static_assert(kMaxOperations > 0u);
+
+  Vector<Operation, kMaxOperations> operations_;
+};
+
 }  // namespace pw::kvs
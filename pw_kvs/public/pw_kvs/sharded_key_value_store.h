@@ -0,0 +1,142 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+#include "pw_kvs/key_value_store.h"
+#include "pw_span/span.h"
+#include "pw_status/status.h"
+#include "pw_status/status_with_size.h"
+
+namespace pw::kvs {
+
+// Spreads keys over several KeyValueStores, such as KVSs on separate flash
+// chips. Each key is stored in exactly one shard, chosen by the key's hash, so
+// writes to different shards use different flash, and each shard garbage
+// collects only its own sectors.
+//
+// The shards are ordinary KeyValueStores, constructed by the caller with their
+// own partitions, formats, and options. The number and order of the shards
+// determine where keys are stored, so they must not change once the shards
+// hold data. Every shard should be able to hold every key, since keys are not
+// spread perfectly evenly.
+//
+// At least one shard is required. Without shards, Init and the functions that
+// access keys return FAILED_PRECONDITION.
+//
+// The ShardedKeyValueStore is not thread safe. Since the shards are
+// independent, shard() may be used to maintain each shard from its own thread,
+// provided the shard is not used through the ShardedKeyValueStore meanwhile.
+class ShardedKeyValueStore {
+ public:
+  // The shards must remain valid while the ShardedKeyValueStore is in use.
+  constexpr ShardedKeyValueStore(span<KeyValueStore* const> shards)
+      : shards_(shards) {}
+
+  ShardedKeyValueStore(const ShardedKeyValueStore&) = delete;
+  ShardedKeyValueStore& operator=(const ShardedKeyValueStore&) = delete;
+
+  // Initializes every shard. Returns OK if all shards initialized; otherwise,
+  // the first error. All shards are initialized even if one fails. Returns
+  // FAILED_PRECONDITION if there are no shards.
+  Status Init();
+
+  // True if there are shards and every shard is initialized.
+  bool initialized() const;
+
+  // Reads, writes, and deletes the key in its shard. Same return values as the
+  // KeyValueStore functions.
+  StatusWithSize Get(std::string_view key,
+                     span<std::byte> value,
+                     size_t offset_bytes = 0) const {
+    if (shards_.empty()) {
+      return StatusWithSize::FAILED_PRECONDITION;
+    }
+    return Shard(key).Get(key, value, offset_bytes);
+  }
+
+  template <typename Pointer,
+            typename = std::enable_if_t<std::is_pointer_v<Pointer>>>
+  Status Get(const std::string_view& key, const Pointer& pointer) const {
+    if (shards_.empty()) {
+      return Status::FAILED_PRECONDITION;
+    }
+    return Shard(key).Get(key, pointer);
+  }
+
+  template <typename T>
+  Status Put(const std::string_view& key, const T& value) {
+    if (shards_.empty()) {
+      return Status::FAILED_PRECONDITION;
+    }
+    return Shard(key).Put(key, value);
+  }
+
+  Status Delete(std::string_view key) {
+    if (shards_.empty()) {
+      return Status::FAILED_PRECONDITION;
+    }
+    return Shard(key).Delete(key);
+  }
+
+  StatusWithSize ValueSize(std::string_view key) const {
+    if (shards_.empty()) {
+      return StatusWithSize::FAILED_PRECONDITION;
+    }
+    return Shard(key).ValueSize(key);
+  }
+
+  // Garbage collects every shard. Returns the first error, after collecting
+  // the other shards.
+  Status GarbageCollectFull();
+
+  // Runs a KeyValueStore::MaintenanceStep of up to max_bytes on every shard.
+  // Erases are started without waiting for them, so the shards' erases run in
+  // parallel when the shards are on separate flash devices.
+  //
+  //           OK: work was done in at least one shard; call again to continue
+  //    NOT_FOUND: no shard has maintenance to do
+  //  UNAVAILABLE: no work was done, but an erase is still in progress
+  //        other: the first error from a shard, after stepping the others
+  //
+  Status MaintenanceStep(size_t max_bytes);
+
+  // The sum of the shards' storage stats.
+  KeyValueStore::StorageStats GetStorageStats() const;
+
+  // The number of keys in all shards.
+  size_t size() const;
+
+  bool empty() const { return size() == 0u; }
+
+  // The index of the shard that stores the key, or 0 if there are no shards.
+  size_t ShardIndex(std::string_view key) const;
+
+  size_t shard_count() const { return shards_.size(); }
+
+  KeyValueStore& shard(size_t index) { return *shards_[index]; }
+  const KeyValueStore& shard(size_t index) const { return *shards_[index]; }
+
+ private:
+  KeyValueStore& Shard(std::string_view key) const {
+    return *shards_[ShardIndex(key)];
+  }
+
+  const span<KeyValueStore* const> shards_;
+};
+
+}  // namespace pw::kvs
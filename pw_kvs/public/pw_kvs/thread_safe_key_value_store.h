@@ -0,0 +1,213 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+#include "pw_kvs/key_value_store.h"
+#include "pw_span/span.h"
+#include "pw_status/status.h"
+#include "pw_status/status_with_size.h"
+
+namespace pw::kvs {
+
+// A lock that is held either exclusively by one writer or shared by any number
+// of readers. Implement this with the platform's synchronization primitives.
+class ReaderWriterLock {
+ public:
+  // Acquires and releases the lock exclusively.
+  virtual void Lock() = 0;
+  virtual void Unlock() = 0;
+
+  // Acquires and releases the lock shared with other readers.
+  virtual void LockShared() = 0;
+  virtual void UnlockShared() = 0;
+
+ protected:
+  constexpr ReaderWriterLock() = default;
+
+  // Protected destructor prevents deleting ReaderWriterLocks from the base
+  // class, so that it is safe to have a non-virtual destructor.
+  ~ReaderWriterLock() = default;
+};
+
+// Wraps a KeyValueStore so that it may be used from multiple threads. Writes,
+// garbage collection, and Init hold the lock exclusively. Get, ValueSize, and
+// iteration share the lock, so they run concurrently with each other, but not
+// with a writer.
+//
+// Reads share the lock only if they do not update any state, so they hold the
+// lock exclusively if any of these apply:
+//
+//   - verify_on_read is set, since reads mark entries as verified and checksum
+//     algorithms keep their state in the algorithm object
+//   - there is a key cache or key prefix table, which reads fill in
+//   - the redundancy is greater than 1, since reads reorder an entry's copies
+//   - a format compresses values, which are decompressed in the compression
+//     algorithm's working buffer
+//   - a format stores expiry times, since reads mark expired keys deleted
+//
+// All access to the KVS must go through the wrapper. ValueWriter, ValueReader,
+// and GetView are not available, since they hold on to the KVS between calls.
+class ThreadSafeKeyValueStore {
+ public:
+  constexpr ThreadSafeKeyValueStore(KeyValueStore& kvs, ReaderWriterLock& lock)
+      : kvs_(kvs), lock_(lock) {}
+
+  ThreadSafeKeyValueStore(const ThreadSafeKeyValueStore&) = delete;
+  ThreadSafeKeyValueStore& operator=(const ThreadSafeKeyValueStore&) = delete;
+
+  // Holds the lock for reading and provides read-only access to the KVS, for
+  // iterating over entries or making several reads that must be consistent
+  // with each other. Writers wait until the ReadAccess is destroyed.
+  class ReadAccess {
+   public:
+    ReadAccess(const ReadAccess&) = delete;
+    ReadAccess& operator=(const ReadAccess&) = delete;
+
+    ~ReadAccess() { store_.UnlockForRead(); }
+
+    const KeyValueStore& operator*() const { return store_.kvs_; }
+    const KeyValueStore* operator->() const { return &store_.kvs_; }
+
+   private:
+    friend class ThreadSafeKeyValueStore;
+
+    explicit ReadAccess(const ThreadSafeKeyValueStore& store) : store_(store) {
+      store_.LockForRead();
+    }
+
+    const ThreadSafeKeyValueStore& store_;
+  };
+
+  ReadAccess Read() const { return ReadAccess(*this); }
+
+  // The following functions hold the lock and call the KeyValueStore function
+  // of the same name.
+
+  Status Init() {
+    WriteLock lock(lock_);
+    return kvs_.Init();
+  }
+
+  StatusWithSize Get(std::string_view key,
+                     span<std::byte> value,
+                     size_t offset_bytes = 0) const {
+    return Read()->Get(key, value, offset_bytes);
+  }
+
+  template <typename Pointer,
+            typename = std::enable_if_t<std::is_pointer_v<Pointer>>>
+  Status Get(const std::string_view& key, const Pointer& pointer) const {
+    return Read()->Get(key, pointer);
+  }
+
+  StatusWithSize ValueSize(std::string_view key) const {
+    return Read()->ValueSize(key);
+  }
+
+  template <typename T>
+  Status Put(const std::string_view& key, const T& value) {
+    WriteLock lock(lock_);
+    return kvs_.Put(key, value);
+  }
+
+  template <typename T>
+  Status PutWithExpiry(const std::string_view& key,
+                       const T& value,
+                       uint32_t expiry_time) {
+    WriteLock lock(lock_);
+    return kvs_.PutWithExpiry(key, value, expiry_time);
+  }
+
+  void SetCurrentTime(uint32_t time) {
+    WriteLock lock(lock_);
+    kvs_.SetCurrentTime(time);
+  }
+
+  Status Delete(std::string_view key) {
+    WriteLock lock(lock_);
+    return kvs_.Delete(key);
+  }
+
+  Status Append(std::string_view key, span<const std::byte> data) {
+    WriteLock lock(lock_);
+    return kvs_.Append(key, data);
+  }
+
+  Status Commit(KeyValueStore::WriteBatch& batch) {
+    WriteLock lock(lock_);
+    return kvs_.Commit(batch);
+  }
+
+  Status GarbageCollectFull() {
+    WriteLock lock(lock_);
+    return kvs_.GarbageCollectFull();
+  }
+
+  Status GarbageCollectPartial() {
+    WriteLock lock(lock_);
+    return kvs_.GarbageCollectPartial();
+  }
+
+  Status GarbageCollectStep(size_t max_bytes) {
+    WriteLock lock(lock_);
+    return kvs_.GarbageCollectStep(max_bytes);
+  }
+
+  Status MaintenanceStep(size_t max_bytes) {
+    WriteLock lock(lock_);
+    return kvs_.MaintenanceStep(max_bytes);
+  }
+
+  // VerifyAll marks entries as verified, so it holds the lock exclusively.
+  Status VerifyAll(size_t max_bytes) {
+    WriteLock lock(lock_);
+    return kvs_.VerifyAll(max_bytes);
+  }
+
+  Status Repair() {
+    WriteLock lock(lock_);
+    return kvs_.Repair();
+  }
+
+  bool error_detected() const { return Read()->error_detected(); }
+
+  size_t size() const { return Read()->size(); }
+
+  KeyValueStore::StorageStats GetStorageStats() const {
+    return Read()->GetStorageStats();
+  }
+
+ private:
+  class WriteLock {
+   public:
+    explicit WriteLock(ReaderWriterLock& lock) : lock_(lock) { lock_.Lock(); }
+    ~WriteLock() { lock_.Unlock(); }
+
+   private:
+    ReaderWriterLock& lock_;
+  };
+
+  void LockForRead() const;
+  void UnlockForRead() const;
+
+  KeyValueStore& kvs_;
+  ReaderWriterLock& lock_;
+};
+
+}  // namespace pw::kvs
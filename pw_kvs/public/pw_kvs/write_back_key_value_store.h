@@ -0,0 +1,191 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "pw_kvs/internal/span_traits.h"
+#include "pw_kvs/key_value_store.h"
+#include "pw_span/span.h"
+#include "pw_status/status.h"
+#include "pw_status/status_with_size.h"
+
+namespace pw::kvs {
+
+// Buffers Puts in RAM and writes them to a KeyValueStore later, so that a key
+// that is updated many times (such as a counter) is written to flash once per
+// flush instead of once per update. This reduces flash wear and the number of
+// sector erases.
+//
+// Buffered writes are written to flash when:
+//
+//   - Flush is called.
+//   - Tick is called and the oldest buffered write has waited max_delay_ms.
+//   - A Put for a new key does not fit in the buffer. The buffer is flushed to
+//     make room for it.
+//
+// DURABILITY: Buffered writes are lost if the device resets or loses power
+// before they are flushed. A Put may be lost if it happened up to
+// max_delay_ms, plus the time between Tick calls, before the reset. Call Flush
+// before shutting down, and write values that must not be lost directly to the
+// KeyValueStore.
+//
+// Get and ValueSize return buffered values. Delete removes the buffered value
+// and deletes the key from the KeyValueStore immediately. Flush before
+// iterating over or otherwise using the KeyValueStore directly.
+class WriteBackKeyValueStore {
+ public:
+  WriteBackKeyValueStore(const WriteBackKeyValueStore&) = delete;
+  WriteBackKeyValueStore& operator=(const WriteBackKeyValueStore&) = delete;
+
+  // Buffers a key-value entry. Values that do not fit in a buffer slot are
+  // written to the KVS immediately, as are all values if the buffer has no
+  // slots.
+  //
+  //                    OK: the entry was buffered or written
+  //   FAILED_PRECONDITION: the KVS is not initialized
+  //      INVALID_ARGUMENT: key is empty or too long
+  //                 other: making room for the entry failed with a status
+  //                        from KeyValueStore::Put
+  //
+  template <typename T>
+  Status Put(const std::string_view& key, const T& value) {
+    if constexpr (ConvertsToSpan<T>::value) {
+      return PutBytes(key, as_bytes(span(value)));
+    } else {
+      KeyValueStore::CheckThatObjectCanBePutOrGet<T>();
+      return PutBytes(key, as_bytes(span(&value, 1)));
+    }
+  }
+
+  // Removes the key from the buffer and from the KVS. Returns NOT_FOUND only if
+  // the key was neither buffered nor in the KVS; otherwise, the same values as
+  // KeyValueStore::Delete.
+  Status Delete(std::string_view key);
+
+  // Reads the buffered value for the key, or the value from the KVS if the key
+  // is not buffered. Same return values as KeyValueStore::Get.
+  StatusWithSize Get(std::string_view key,
+                     span<std::byte> value,
+                     size_t offset_bytes = 0) const;
+
+  template <typename Pointer,
+            typename = std::enable_if_t<std::is_pointer_v<Pointer>>>
+  Status Get(const std::string_view& key, const Pointer& pointer) const {
+    using T = std::remove_reference_t<std::remove_pointer_t<Pointer>>;
+    KeyValueStore::CheckThatObjectCanBePutOrGet<T>();
+    return FixedSizeGet(key, pointer, sizeof(T));
+  }
+
+  StatusWithSize ValueSize(std::string_view key) const;
+
+  // Writes all buffered values to the KVS. Values that fail to write remain
+  // buffered, and the first error is returned.
+  Status Flush();
+
+  // Advances the time that buffered writes have waited by elapsed_ms, and
+  // flushes them once the oldest has waited at least max_delay_ms. Call this
+  // periodically, such as from the application's idle loop.
+  Status Tick(uint32_t elapsed_ms);
+
+  // The number of keys with buffered values.
+  size_t buffered_keys() const;
+
+  // The KVS that values are written to.
+  KeyValueStore& kvs() { return kvs_; }
+  const KeyValueStore& kvs() const { return kvs_; }
+
+ protected:
+  // A buffered entry. The key is followed by the value in the slot's bytes. An
+  // empty key marks a free slot.
+  struct Slot {
+    uint8_t key_size;
+    uint16_t value_size;
+  };
+
+  // A derived class provides the slots and slot_bytes bytes of storage for
+  // each of them.
+  WriteBackKeyValueStore(KeyValueStore& kvs,
+                         span<Slot> slots,
+                         span<std::byte> buffer,
+                         size_t slot_bytes,
+                         uint32_t max_delay_ms)
+      : kvs_(kvs),
+        slots_(slots),
+        buffer_(buffer),
+        slot_bytes_(slot_bytes),
+        max_delay_ms_(max_delay_ms),
+        oldest_write_age_ms_(0) {}
+
+ private:
+  Status PutBytes(std::string_view key, span<const std::byte> value);
+
+  Status FixedSizeGet(std::string_view key,
+                      void* value,
+                      size_t size_bytes) const;
+
+  // Returns the slot that buffers the key, or nullptr.
+  const Slot* FindSlot(std::string_view key) const;
+  Slot* FindSlot(std::string_view key) {
+    return const_cast<Slot*>(std::as_const(*this).FindSlot(key));
+  }
+
+  span<std::byte> SlotData(const Slot& slot) const {
+    return buffer_.subspan((&slot - slots_.data()) * slot_bytes_, slot_bytes_);
+  }
+
+  std::string_view SlotKey(const Slot& slot) const {
+    return std::string_view(
+        reinterpret_cast<const char*>(SlotData(slot).data()), slot.key_size);
+  }
+
+  span<const std::byte> SlotValue(const Slot& slot) const {
+    return SlotData(slot).subspan(slot.key_size, slot.value_size);
+  }
+
+  KeyValueStore& kvs_;
+  span<Slot> slots_;
+  span<std::byte> buffer_;
+  const size_t slot_bytes_;
+
+  const uint32_t max_delay_ms_;
+
+  // How long the oldest buffered write has waited, as counted by Tick.
+  uint32_t oldest_write_age_ms_;
+};
+
+// A WriteBackKeyValueStore that buffers up to kMaxBufferedKeys keys at once,
+// each with a key and value of up to kMaxEntryBytes combined.
+template <size_t kMaxBufferedKeys, size_t kMaxEntryBytes>
+class WriteBackKeyValueStoreBuffer final : public WriteBackKeyValueStore {
+ public:
+  WriteBackKeyValueStoreBuffer(KeyValueStore& kvs, uint32_t max_delay_ms)
+      : WriteBackKeyValueStore(
+            kvs, slots_, buffer_, kMaxEntryBytes, max_delay_ms),
+        slots_{},
+        buffer_{} {}
+
+ private:
+  static_assert(kMaxEntryBytes <= UINT16_MAX);
+
+  std::array<Slot, kMaxBufferedKeys> slots_;
+  std::array<std::byte, kMaxBufferedKeys * kMaxEntryBytes> buffer_;
+};
+
+}  // namespace pw::kvs
@@ -14,7 +14,10 @@
 
 #include "pw_kvs/internal/sectors.h"
 
+#include <algorithm>
+
 #define PW_LOG_USE_ULTRA_SHORT_NAMES 1
+#include "pw_kvs/key_value_store.h"
 #include "pw_log/log.h"
 
 namespace pw::kvs::internal {
@@ -157,7 +160,7 @@ Status Sectors::Find(FindMode find_mode,
 
 // TODO: Consider breaking this function into smaller sub-chunks.
 SectorDescriptor* Sectors::FindSectorToGarbageCollect(
-    span<const Address> reserved_addresses) {
+    span<const Address> reserved_addresses, uint32_t current_transaction_id) {
   const size_t sector_size_bytes = partition_.sector_size_bytes();
   SectorDescriptor* sector_candidate = nullptr;
   size_t candidate_bytes = 0;
@@ -181,14 +184,22 @@ SectorDescriptor* Sectors::FindSectorToGarbageCollect(
     }
   }
 
-  // Step 2: If step 1 yields no sectors, just find the sector with the most
-  // reclaimable bytes but no addresses to avoid.
+  // Step 2: If step 1 yields no sectors, find the sector with reclaimable bytes
+  // that scores highest for the garbage collection policy. For kGreedy, this is
+  // the sector with the most reclaimable bytes.
   if (sector_candidate == nullptr) {
+    uint64_t candidate_score = 0;
+
     for (auto& sector : descriptors_) {
-      if ((sector.RecoverableBytes(sector_size_bytes) > candidate_bytes) &&
-          !Contains(sectors_to_skip, &sector)) {
+      if (sector.RecoverableBytes(sector_size_bytes) == 0u ||
+          Contains(sectors_to_skip, &sector)) {
+        continue;
+      }
+      const uint64_t score =
+          GarbageCollectScore(sector, current_transaction_id);
+      if (sector_candidate == nullptr || score > candidate_score) {
         sector_candidate = &sector;
-        candidate_bytes = sector.RecoverableBytes(sector_size_bytes);
+        candidate_score = score;
       }
     }
   }
@@ -218,4 +229,40 @@ SectorDescriptor* Sectors::FindSectorToGarbageCollect(
   return sector_candidate;
 }
 
+size_t Sectors::EmptySectorCount() const {
+  const size_t sector_size_bytes = partition_.sector_size_bytes();
+  return std::count_if(
+      descriptors_.begin(),
+      descriptors_.end(),
+      [sector_size_bytes](const SectorDescriptor& sector) {
+        return sector.Empty(sector_size_bytes);
+      });
+}
+
+uint64_t Sectors::GarbageCollectScore(const SectorDescriptor& sector,
+                                      uint32_t current_transaction_id) const {
+  const uint64_t reclaimable_bytes =
+      sector.RecoverableBytes(partition_.sector_size_bytes());
+
+  switch (gc_policy_) {
+    case GarbageCollectPolicy::kGreedy:
+      break;
+    case GarbageCollectPolicy::kCostBenefit: {
+      const uint64_t age =
+          current_transaction_id - sector.newest_transaction_id() + 1;
+      return age * reclaimable_bytes / std::max<size_t>(sector.valid_bytes(), 1);
+    }
+    case GarbageCollectPolicy::kWearLeveling:
+      if (erase_counts_.size() >= descriptors_.size()) {
+        // Fewer erases always scores higher. Reclaimable bytes fit in the low
+        // 16 bits, since sectors are smaller than 64 KiB.
+        const uint64_t erase_count =
+            std::min<uint64_t>(erase_counts_[Index(sector)], UINT32_MAX);
+        return ((UINT32_MAX - erase_count) << 16) | reclaimable_bytes;
+      }
+      break;
+  }
+  return reclaimable_bytes;
+}
+
 }  // namespace pw::kvs::internal
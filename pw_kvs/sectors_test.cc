@@ -14,8 +14,12 @@
 
 #include "pw_kvs/internal/sectors.h"
 
+#include <algorithm>
+#include <iterator>
+
 #include "gtest/gtest.h"
 #include "pw_kvs/in_memory_fake_flash.h"
+#include "pw_kvs/key_value_store.h"
 
 namespace pw::kvs::internal {
 namespace {
@@ -24,7 +28,10 @@ class SectorsTest : public ::testing::Test {
  protected:
   SectorsTest()
       : partition_(&flash_),
-        sectors_(sector_descriptors_, partition_, nullptr) {}
+        sectors_(sector_descriptors_,
+                 partition_,
+                 nullptr,
+                 GarbageCollectPolicy::kGreedy) {}
 
   FakeFlashBuffer<128, 16> flash_;
   FlashPartition partition_;
@@ -79,8 +86,102 @@ TEST_F(SectorsTest, NextWritableAddress_PartiallyWrittenSector) {
   EXPECT_EQ(123u, sectors_.NextWritableAddress(*sectors_.begin()));
 }
 
-// TODO: Add tests for FindSpace, FindSpaceDuringGarbageCollection, and
-// FindSectorToGarbageCollect.
+// Marks bytes in a sector as written, of which valid_bytes are still valid.
+void WriteToSector(SectorDescriptor& sector,
+                   uint16_t written_bytes,
+                   uint16_t valid_bytes,
+                   uint32_t transaction_id) {
+  sector.RemoveWritableBytes(written_bytes);
+  sector.AddValidBytes(valid_bytes);
+  sector.UpdateNewestTransactionId(transaction_id);
+}
+
+TEST_F(SectorsTest, EmptySectorCount) {
+  sectors_.Reset();
+  EXPECT_EQ(16u, sectors_.EmptySectorCount());
+
+  WriteToSector(sectors_.begin()[0], 128, 0, 1);
+  WriteToSector(sectors_.begin()[5], 1, 1, 2);
+  EXPECT_EQ(14u, sectors_.EmptySectorCount());
+}
+
+TEST_F(SectorsTest, FindSectorToGarbageCollect_NothingWritten) {
+  sectors_.Reset();
+  EXPECT_EQ(nullptr, sectors_.FindSectorToGarbageCollect({}));
+}
+
+TEST_F(SectorsTest, FindSectorToGarbageCollect_PrefersNoValidBytes) {
+  sectors_.Reset();
+  WriteToSector(sectors_.begin()[1], 128, 0, 1);
+  WriteToSector(sectors_.begin()[2], 128, 8, 2);
+  WriteToSector(sectors_.begin()[3], 16, 0, 3);
+
+  EXPECT_EQ(&sectors_.begin()[1], sectors_.FindSectorToGarbageCollect({}));
+}
+
+TEST_F(SectorsTest, FindSectorToGarbageCollect_SkipsReservedSectors) {
+  sectors_.Reset();
+  WriteToSector(sectors_.begin()[1], 128, 0, 1);
+  WriteToSector(sectors_.begin()[3], 16, 0, 2);
+
+  const SectorDescriptor* skip[1];
+  Sectors sectors(
+      sector_descriptors_, partition_, skip, GarbageCollectPolicy::kGreedy);
+  const Sectors::Address reserved[] = {sectors.BaseAddress(sectors.begin()[1])};
+
+  EXPECT_EQ(&sectors.begin()[3], sectors.FindSectorToGarbageCollect(reserved));
+}
+
+class SectorsGarbageCollectPolicyTest : public SectorsTest {
+ protected:
+  SectorsGarbageCollectPolicyTest() {
+    sectors_.Reset();
+
+    // Sector 1 is cold, with few reclaimable bytes.
+    WriteToSector(sectors_.begin()[1], 128, 96, 10);
+    // Sector 2 is hot, with the most reclaimable bytes.
+    WriteToSector(sectors_.begin()[2], 128, 64, 99);
+    // Sector 3 has the fewest reclaimable bytes.
+    WriteToSector(sectors_.begin()[3], 128, 112, 98);
+  }
+
+  SectorDescriptor* Find(GarbageCollectPolicy policy,
+                         span<const size_t> erase_counts = {}) {
+    Sectors sectors(sector_descriptors_, partition_, nullptr, policy);
+    sectors.set_erase_counts(erase_counts);
+    return sectors.FindSectorToGarbageCollect({}, 100);
+  }
+};
+
+TEST_F(SectorsGarbageCollectPolicyTest, Greedy_MostReclaimableBytes) {
+  EXPECT_EQ(&sectors_.begin()[2], Find(GarbageCollectPolicy::kGreedy));
+}
+
+TEST_F(SectorsGarbageCollectPolicyTest, CostBenefit_OldAndCheapToCollect) {
+  EXPECT_EQ(&sectors_.begin()[1], Find(GarbageCollectPolicy::kCostBenefit));
+}
+
+TEST_F(SectorsGarbageCollectPolicyTest, WearLeveling_FewestErases) {
+  size_t erase_counts[16] = {};
+  std::fill(std::begin(erase_counts), std::end(erase_counts), 5);
+  erase_counts[3] = 4;
+
+  EXPECT_EQ(&sectors_.begin()[3],
+            Find(GarbageCollectPolicy::kWearLeveling, erase_counts));
+}
+
+TEST_F(SectorsGarbageCollectPolicyTest, WearLeveling_TiesUseReclaimableBytes) {
+  size_t erase_counts[16] = {};
+
+  EXPECT_EQ(&sectors_.begin()[2],
+            Find(GarbageCollectPolicy::kWearLeveling, erase_counts));
+}
+
+TEST_F(SectorsGarbageCollectPolicyTest, WearLeveling_NoEraseCounts_IsGreedy) {
+  EXPECT_EQ(&sectors_.begin()[2], Find(GarbageCollectPolicy::kWearLeveling));
+}
+
+// TODO: Add tests for FindSpace and FindSpaceDuringGarbageCollection.
 
 }  // namespace
 }  // namespace pw::kvs::internal
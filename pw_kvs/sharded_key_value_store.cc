@@ -0,0 +1,114 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/sharded_key_value_store.h"
+
+#include <cstdint>
+
+#include "pw_kvs/internal/hash.h"
+
+namespace pw::kvs {
+
+using std::string_view;
+
+Status ShardedKeyValueStore::Init() {
+  if (shards_.empty()) {
+    return Status::FAILED_PRECONDITION;
+  }
+
+  Status result = Status::OK;
+  for (KeyValueStore* shard : shards_) {
+    const Status status = shard->Init();
+    if (result.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+bool ShardedKeyValueStore::initialized() const {
+  if (shards_.empty()) {
+    return false;
+  }
+  for (const KeyValueStore* shard : shards_) {
+    if (!shard->initialized()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Status ShardedKeyValueStore::GarbageCollectFull() {
+  Status result = Status::OK;
+  for (KeyValueStore* shard : shards_) {
+    const Status status = shard->GarbageCollectFull();
+    if (result.ok()) {
+      result = status;
+    }
+  }
+  return result;
+}
+
+Status ShardedKeyValueStore::MaintenanceStep(size_t max_bytes) {
+  Status error = Status::OK;
+  bool did_work = false;
+  bool erasing = false;
+
+  for (KeyValueStore* shard : shards_) {
+    const Status status = shard->MaintenanceStep(max_bytes);
+    if (status.ok()) {
+      did_work = true;
+    } else if (status == Status::UNAVAILABLE) {
+      erasing = true;
+    } else if (status != Status::NOT_FOUND && error.ok()) {
+      error = status;
+    }
+  }
+
+  if (!error.ok()) {
+    return error;
+  }
+  if (did_work) {
+    return Status::OK;
+  }
+  return erasing ? Status::UNAVAILABLE : Status::NOT_FOUND;
+}
+
+KeyValueStore::StorageStats ShardedKeyValueStore::GetStorageStats() const {
+  KeyValueStore::StorageStats stats = {};
+  for (const KeyValueStore* shard : shards_) {
+    const KeyValueStore::StorageStats shard_stats = shard->GetStorageStats();
+    stats.writable_bytes += shard_stats.writable_bytes;
+    stats.in_use_bytes += shard_stats.in_use_bytes;
+    stats.reclaimable_bytes += shard_stats.reclaimable_bytes;
+  }
+  return stats;
+}
+
+size_t ShardedKeyValueStore::size() const {
+  size_t total = 0;
+  for (const KeyValueStore* shard : shards_) {
+    total += shard->size();
+  }
+  return total;
+}
+
+size_t ShardedKeyValueStore::ShardIndex(string_view key) const {
+  // The shards' hash indexes use the low bits of the hash, so the shard is
+  // chosen from the high bits. Otherwise, each shard's keys would fall in only
+  // some of its index's slots.
+  return (uint64_t(internal::Hash(key)) * shards_.size()) >> 32;
+}
+
+}  // namespace pw::kvs
@@ -0,0 +1,183 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/sharded_key_value_store.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+
+#include "gtest/gtest.h"
+#include "pw_kvs/crc16_checksum.h"
+#include "pw_kvs/flash_memory.h"
+#include "pw_kvs/in_memory_fake_flash.h"
+
+namespace pw::kvs {
+namespace {
+
+ChecksumCrc16 checksum;
+constexpr EntryFormat kFormat{.magic = 0x5A4D'0B1E, .checksum = &checksum};
+
+constexpr size_t kKeys = 40;
+
+// Two shards, each on its own flash device.
+class ShardedKvs : public ::testing::Test {
+ protected:
+  ShardedKvs()
+      : flash_0_(16),
+        flash_1_(16),
+        partition_0_(&flash_0_),
+        partition_1_(&flash_1_),
+        shard_0_(&partition_0_, kFormat),
+        shard_1_(&partition_1_, kFormat),
+        shards_{&shard_0_, &shard_1_},
+        store_(shards_) {
+    partition_0_.Erase();
+    partition_1_.Erase();
+  }
+
+  static const char* Key(size_t index) {
+    static std::array<std::array<char, 8>, kKeys> keys;
+    std::snprintf(keys[index].data(), keys[index].size(), "key%zu", index);
+    return keys[index].data();
+  }
+
+  FakeFlashBuffer<512, 4> flash_0_;
+  FakeFlashBuffer<512, 4> flash_1_;
+  FlashPartition partition_0_;
+  FlashPartition partition_1_;
+  KeyValueStoreBuffer<kKeys, 4> shard_0_;
+  KeyValueStoreBuffer<kKeys, 4> shard_1_;
+  std::array<KeyValueStore*, 2> shards_;
+  ShardedKeyValueStore store_;
+};
+
+TEST_F(ShardedKvs, PutAndGet_KeysAreStoredInTheirShard) {
+  ASSERT_EQ(Status::OK, store_.Init());
+  EXPECT_TRUE(store_.initialized());
+
+  for (size_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(Status::OK, store_.Put(Key(i), uint32_t(i)));
+  }
+  EXPECT_EQ(kKeys, store_.size());
+
+  for (size_t i = 0; i < kKeys; ++i) {
+    uint32_t value = 0;
+    ASSERT_EQ(Status::OK, store_.Get(Key(i), &value));
+    EXPECT_EQ(i, value);
+
+    const size_t shard = store_.ShardIndex(Key(i));
+    ASSERT_LT(shard, store_.shard_count());
+    EXPECT_EQ(sizeof(value), store_.shard(shard).ValueSize(Key(i)).size());
+    EXPECT_EQ(Status::NOT_FOUND,
+              store_.shard(1 - shard).ValueSize(Key(i)).status());
+  }
+
+  // Both shards are used.
+  EXPECT_NE(0u, shard_0_.size());
+  EXPECT_NE(0u, shard_1_.size());
+  EXPECT_EQ(kKeys, shard_0_.size() + shard_1_.size());
+}
+
+TEST_F(ShardedKvs, Delete) {
+  ASSERT_EQ(Status::OK, store_.Init());
+  ASSERT_EQ(Status::OK, store_.Put("key", uint32_t(1)));
+
+  EXPECT_EQ(Status::OK, store_.Delete("key"));
+  EXPECT_EQ(Status::NOT_FOUND, store_.ValueSize("key").status());
+  EXPECT_EQ(Status::NOT_FOUND, store_.Delete("key"));
+  EXPECT_TRUE(store_.empty());
+}
+
+TEST_F(ShardedKvs, GetStorageStats_SumsShards) {
+  ASSERT_EQ(Status::OK, store_.Init());
+  for (size_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(Status::OK, store_.Put(Key(i), uint32_t(i)));
+  }
+
+  const KeyValueStore::StorageStats stats = store_.GetStorageStats();
+  const KeyValueStore::StorageStats stats_0 = shard_0_.GetStorageStats();
+  const KeyValueStore::StorageStats stats_1 = shard_1_.GetStorageStats();
+  EXPECT_EQ(stats_0.writable_bytes + stats_1.writable_bytes,
+            stats.writable_bytes);
+  EXPECT_EQ(stats_0.in_use_bytes + stats_1.in_use_bytes, stats.in_use_bytes);
+  EXPECT_EQ(stats_0.reclaimable_bytes + stats_1.reclaimable_bytes,
+            stats.reclaimable_bytes);
+}
+
+TEST_F(ShardedKvs, MaintenanceStep_CollectsEveryShard) {
+  ASSERT_EQ(Status::OK, store_.Init());
+  EXPECT_EQ(Status::NOT_FOUND, store_.MaintenanceStep(1024));
+
+  // Fill both shards with stale entries.
+  for (uint32_t i = 0; i < 40; ++i) {
+    for (size_t key = 0; key < 4; ++key) {
+      ASSERT_EQ(Status::OK, store_.Put(Key(key), i));
+    }
+  }
+  ASSERT_NE(0u, shard_0_.GetStorageStats().reclaimable_bytes);
+  ASSERT_NE(0u, shard_1_.GetStorageStats().reclaimable_bytes);
+
+  Status status;
+  for (int steps = 0; steps < 100; ++steps) {
+    status = store_.MaintenanceStep(1024);
+    if (!status.ok() && status != Status::UNAVAILABLE) {
+      break;
+    }
+  }
+  EXPECT_EQ(Status::NOT_FOUND, status);
+
+  ASSERT_EQ(Status::OK, store_.GarbageCollectFull());
+  EXPECT_EQ(0u, store_.GetStorageStats().reclaimable_bytes);
+
+  for (size_t key = 0; key < 4; ++key) {
+    uint32_t value = 0;
+    ASSERT_EQ(Status::OK, store_.Get(Key(key), &value));
+    EXPECT_EQ(39u, value);
+  }
+}
+
+TEST_F(ShardedKvs, Init_ReopensShards) {
+  ASSERT_EQ(Status::OK, store_.Init());
+  for (size_t i = 0; i < kKeys; ++i) {
+    ASSERT_EQ(Status::OK, store_.Put(Key(i), uint32_t(i)));
+  }
+
+  KeyValueStoreBuffer<kKeys, 4> shard_0(&partition_0_, kFormat);
+  KeyValueStoreBuffer<kKeys, 4> shard_1(&partition_1_, kFormat);
+  std::array<KeyValueStore*, 2> shards = {&shard_0, &shard_1};
+  ShardedKeyValueStore store(shards);
+  ASSERT_EQ(Status::OK, store.Init());
+
+  EXPECT_EQ(kKeys, store.size());
+  uint32_t value = 0;
+  ASSERT_EQ(Status::OK, store.Get(Key(7), &value));
+  EXPECT_EQ(7u, value);
+}
+
+TEST(ShardedKvsWithoutShards, FailedPrecondition) {
+  ShardedKeyValueStore store(span<KeyValueStore* const>{});
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.Init());
+  EXPECT_FALSE(store.initialized());
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.Put("key", value));
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.Get("key", &value));
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.ValueSize("key").status());
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.Delete("key"));
+  EXPECT_EQ(0u, store.size());
+}
+
+}  // namespace
+}  // namespace pw::kvs
@@ -0,0 +1,37 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/thread_safe_key_value_store.h"
+
+namespace pw::kvs {
+
+// Whether reads modify the KVS depends only on its configuration, so a reader
+// releases the lock in the same mode that it acquired it.
+void ThreadSafeKeyValueStore::LockForRead() const {
+  if (kvs_.ReadsModifyState()) {
+    lock_.Lock();
+  } else {
+    lock_.LockShared();
+  }
+}
+
+void ThreadSafeKeyValueStore::UnlockForRead() const {
+  if (kvs_.ReadsModifyState()) {
+    lock_.Unlock();
+  } else {
+    lock_.UnlockShared();
+  }
+}
+
+}  // namespace pw::kvs
@@ -0,0 +1,378 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/thread_safe_key_value_store.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "pw_kvs/crc16_checksum.h"
+#include "pw_kvs/flash_memory.h"
+#include "pw_kvs/in_memory_fake_flash.h"
+
+namespace pw::kvs {
+namespace {
+
+ChecksumCrc16 checksum;
+constexpr EntryFormat kFormat{.magic = 0x7E5A'FE01, .checksum = &checksum};
+
+// Checksums are verified when entries are written and by VerifyAll. The
+// checksum algorithm is not used by reads, so they may share the lock.
+constexpr Options kNoVerifyOnReadOptions = [] {
+  Options options;
+  options.verify_on_read = false;
+  return options;
+}();
+
+class SharedMutexLock final : public ReaderWriterLock {
+ public:
+  void Lock() override { mutex_.lock(); }
+  void Unlock() override { mutex_.unlock(); }
+  void LockShared() override { mutex_.lock_shared(); }
+  void UnlockShared() override { mutex_.unlock_shared(); }
+
+ private:
+  std::shared_mutex mutex_;
+};
+
+// Counts how often the lock is held in each mode.
+class RecordingLock final : public ReaderWriterLock {
+ public:
+  void Lock() override {
+    EXPECT_FALSE(held_);
+    held_ = true;
+    exclusive_ += 1;
+  }
+  void Unlock() override {
+    EXPECT_TRUE(held_);
+    held_ = false;
+  }
+  void LockShared() override {
+    EXPECT_FALSE(held_);
+    held_ = true;
+    shared_ += 1;
+  }
+  void UnlockShared() override {
+    EXPECT_TRUE(held_);
+    held_ = false;
+  }
+
+  bool held() const { return held_; }
+  int exclusive() const { return exclusive_; }
+  int shared() const { return shared_; }
+
+ private:
+  bool held_ = false;
+  int exclusive_ = 0;
+  int shared_ = 0;
+};
+
+// Counts the keys that start with the prefix.
+int CountKeys(const KeyValueStore& kvs, std::string_view prefix) {
+  int count = 0;
+  for (auto it = kvs.begin(prefix); it != kvs.end(prefix); ++it) {
+    count += 1;
+  }
+  return count;
+}
+
+class ThreadSafeKvs : public ::testing::Test {
+ protected:
+  ThreadSafeKvs()
+      : flash_(16),
+        partition_(&flash_),
+        kvs_(&partition_, kFormat, kNoVerifyOnReadOptions) {
+    partition_.Erase();
+  }
+
+  FakeFlashBuffer<512, 8> flash_;
+  FlashPartition partition_;
+  KeyValueStoreBuffer<32, 8> kvs_;
+};
+
+TEST_F(ThreadSafeKvs, Get_SharesLock) {
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs_, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+  EXPECT_EQ(2, lock.exclusive());
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store.Get("key", &value));
+  EXPECT_EQ(123u, value);
+  EXPECT_EQ(4u, store.ValueSize("key").size());
+  EXPECT_EQ(1u, store.size());
+
+  EXPECT_EQ(2, lock.exclusive());
+  EXPECT_EQ(3, lock.shared());
+  EXPECT_FALSE(lock.held());
+}
+
+TEST_F(ThreadSafeKvs, WritesHoldLockExclusively) {
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs_, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+  ASSERT_EQ(Status::OK, store.Delete("key"));
+  ASSERT_EQ(Status::OK, store.GarbageCollectFull());
+  ASSERT_EQ(Status::NOT_FOUND, store.VerifyAll(1024));
+
+  EXPECT_EQ(5, lock.exclusive());
+  EXPECT_EQ(0, lock.shared());
+  EXPECT_FALSE(lock.held());
+}
+
+TEST_F(ThreadSafeKvs, Get_ReadsModifyState_HoldsLockExclusively) {
+  KeyValueStoreBuffer<32, 8, 1, 1, 0, 4> kvs(
+      &partition_, kFormat, kNoVerifyOnReadOptions);
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+
+  // Lookups update the key cache, so reads may not run concurrently.
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store.Get("key", &value));
+  EXPECT_EQ(3, lock.exclusive());
+  EXPECT_EQ(0, lock.shared());
+}
+
+TEST_F(ThreadSafeKvs, Get_VerifyOnRead_HoldsLockExclusively) {
+  KeyValueStoreBuffer<32, 8> kvs(&partition_, kFormat);
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+
+  // Verifying the checksum updates the checksum algorithm's state.
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store.Get("key", &value));
+  EXPECT_EQ(3, lock.exclusive());
+  EXPECT_EQ(0, lock.shared());
+}
+
+TEST_F(ThreadSafeKvs, Get_VerifyOnReadWithoutChecksum_HoldsLockExclusively) {
+  constexpr EntryFormat kNoChecksumFormat{.magic = 0x7E5A'FE02,
+                                          .checksum = nullptr};
+  KeyValueStoreBuffer<32, 8> kvs(&partition_, kNoChecksumFormat);
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+
+  // There is no checksum to verify, but reads still mark entries as verified.
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store.Get("key", &value));
+  EXPECT_EQ(3, lock.exclusive());
+  EXPECT_EQ(0, lock.shared());
+}
+
+TEST_F(ThreadSafeKvs, ReadAccess_KeyPrefixes_HoldsLockExclusively) {
+  KeyValueStoreBuffer<32, 8, 1, 1, 0, 0, true> kvs(
+      &partition_, kFormat, kNoVerifyOnReadOptions);
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("key", uint32_t(123)));
+
+  // Iterating records the prefixes of the keys it reads.
+  {
+    ThreadSafeKeyValueStore::ReadAccess access = store.Read();
+    EXPECT_EQ(1, CountKeys(*access, "k"));
+  }
+  EXPECT_EQ(3, lock.exclusive());
+  EXPECT_EQ(0, lock.shared());
+}
+
+TEST_F(ThreadSafeKvs, ReadAccess_HoldsLockWhileIterating) {
+  RecordingLock lock;
+  ThreadSafeKeyValueStore store(kvs_, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+  ASSERT_EQ(Status::OK, store.Put("a", uint32_t(1)));
+  ASSERT_EQ(Status::OK, store.Put("b", uint32_t(2)));
+
+  {
+    ThreadSafeKeyValueStore::ReadAccess kvs = store.Read();
+    EXPECT_TRUE(lock.held());
+
+    uint32_t sum = 0;
+    for (const auto& item : *kvs) {
+      uint32_t value = 0;
+      ASSERT_EQ(Status::OK, item.Get(&value));
+      sum += value;
+    }
+    EXPECT_EQ(3u, sum);
+  }
+
+  EXPECT_FALSE(lock.held());
+  EXPECT_EQ(1, lock.shared());
+}
+
+// Values are written with a sequence number and its complement, so that a torn
+// or misplaced read is detected.
+struct Value {
+  uint32_t sequence;
+  uint32_t complement;
+};
+
+constexpr std::array<const char*, 6> kKeys = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot"};
+
+TEST_F(ThreadSafeKvs, Stress_ConcurrentReadersAndWriter) {
+  constexpr uint32_t kWrites = 3000;
+  constexpr size_t kReaders = 3;
+  constexpr size_t kReads = 500;
+
+  SharedMutexLock lock;
+  ThreadSafeKeyValueStore store(kvs_, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+
+  std::atomic<int> errors = 0;
+
+  std::thread writer([&] {
+    for (uint32_t i = 1; i <= kWrites; ++i) {
+      const char* key = kKeys[i % kKeys.size()];
+      Status status = (i % 17 == 0)
+                          ? store.Delete(key)
+                          : store.Put(key, Value{i, ~i});
+      if (!status.ok() && status != Status::NOT_FOUND) {
+        errors += 1;
+      }
+      if (i % 250 == 0 && !store.GarbageCollectFull().ok()) {
+        errors += 1;
+      }
+    }
+  });
+
+  // Each reader checks that values are intact and never go backwards. Readers
+  // make a fixed number of passes, so that the test finishes even if the lock
+  // favors readers over the writer.
+  std::array<std::thread, kReaders> readers;
+  for (std::thread& reader : readers) {
+    reader = std::thread([&] {
+      std::array<uint32_t, kKeys.size()> last_sequence = {};
+      for (size_t i = 0; i < kReads; ++i) {
+        for (size_t k = 0; k < kKeys.size(); ++k) {
+          Value value;
+          Status status = store.Get(kKeys[k], &value);
+          if (status == Status::NOT_FOUND) {
+            continue;
+          }
+          if (!status.ok() || value.complement != ~value.sequence ||
+              value.sequence < last_sequence[k]) {
+            errors += 1;
+          }
+          last_sequence[k] = value.sequence;
+        }
+      }
+    });
+  }
+
+  // Iterates over the entries while holding the lock, so that every entry
+  // found by the iterator can be read.
+  std::thread iterating_reader([&] {
+    for (size_t i = 0; i < kReads / 10; ++i) {
+      ThreadSafeKeyValueStore::ReadAccess kvs = store.Read();
+      for (const auto& item : *kvs) {
+        Value value;
+        if (!item.Get(&value).ok() || value.complement != ~value.sequence) {
+          errors += 1;
+        }
+      }
+    }
+  });
+
+  writer.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  iterating_reader.join();
+
+  EXPECT_EQ(0, errors.load());
+
+  Value value;
+  ASSERT_EQ(Status::OK, store.Get(kKeys[kWrites % kKeys.size()], &value));
+  EXPECT_EQ(kWrites, value.sequence);
+}
+
+TEST_F(ThreadSafeKvs, Stress_ConcurrentPrefixIterators) {
+  constexpr uint32_t kWrites = 1000;
+  constexpr size_t kReaders = 4;
+  constexpr size_t kReads = 100;
+
+  KeyValueStoreBuffer<32, 8, 1, 1, 0, 0, true> kvs(
+      &partition_, kFormat, kNoVerifyOnReadOptions);
+  SharedMutexLock lock;
+  ThreadSafeKeyValueStore store(kvs, lock);
+  ASSERT_EQ(Status::OK, store.Init());
+
+  std::atomic<int> errors = 0;
+
+  std::thread writer([&] {
+    for (uint32_t i = 1; i <= kWrites; ++i) {
+      if (!store.Put(kKeys[i % kKeys.size()], Value{i, ~i}).ok()) {
+        errors += 1;
+      }
+      if (i % 250 == 0 && !store.GarbageCollectFull().ok()) {
+        errors += 1;
+      }
+    }
+  });
+
+  // Each reader iterates over the keys with a different prefix, which records
+  // key prefixes in the shared prefix table as it goes.
+  constexpr std::array<std::string_view, kReaders> kPrefixes = {
+      "a", "b", "ch", "foxtrot"};
+  std::array<std::thread, kReaders> readers;
+  for (size_t r = 0; r < kReaders; ++r) {
+    readers[r] = std::thread([&, prefix = kPrefixes[r]] {
+      for (size_t i = 0; i < kReads; ++i) {
+        ThreadSafeKeyValueStore::ReadAccess access = store.Read();
+        int found = 0;
+        for (auto it = access->begin(prefix); it != access->end(prefix); ++it) {
+          Value value;
+          if (std::string_view(it->key()).substr(0, prefix.size()) != prefix ||
+              !it->Get(&value).ok() || value.complement != ~value.sequence) {
+            errors += 1;
+          }
+          found += 1;
+        }
+        if (found > 1) {
+          errors += 1;
+        }
+      }
+    });
+  }
+
+  writer.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(0, errors.load());
+
+  ThreadSafeKeyValueStore::ReadAccess access = store.Read();
+  for (std::string_view prefix : kPrefixes) {
+    EXPECT_EQ(1, CountKeys(*access, prefix));
+  }
+}
+
+}  // namespace
+}  // namespace pw::kvs
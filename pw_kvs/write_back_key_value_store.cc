@@ -0,0 +1,177 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/write_back_key_value_store.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "pw_kvs/internal/entry.h"
+#include "pw_kvs_private/macros.h"
+
+namespace pw::kvs {
+
+using std::byte;
+using std::string_view;
+
+Status WriteBackKeyValueStore::PutBytes(string_view key,
+                                        span<const byte> value) {
+  if (!kvs_.initialized()) {
+    return Status::FAILED_PRECONDITION;
+  }
+  if (key.empty() || key.size() > internal::Entry::kMaxKeyLength) {
+    return Status::INVALID_ARGUMENT;
+  }
+
+  Slot* slot = FindSlot(key);
+
+  // Entries that are too large for a slot are written through.
+  if (slots_.empty() || key.size() + value.size() > slot_bytes_) {
+    if (slot != nullptr) {
+      slot->key_size = 0;
+    }
+    return kvs_.Put(key, value);
+  }
+
+  if (slot == nullptr) {
+    for (Slot& free_slot : slots_) {
+      if (free_slot.key_size == 0u) {
+        slot = &free_slot;
+        break;
+      }
+    }
+  }
+
+  // Make room for the entry by writing the buffered values to flash.
+  if (slot == nullptr) {
+    TRY(Flush());
+    slot = slots_.data();
+  }
+
+  if (buffered_keys() == 0u) {
+    oldest_write_age_ms_ = 0;
+  }
+
+  span<byte> data = SlotData(*slot);
+  std::memcpy(data.data(), key.data(), key.size());
+  std::memcpy(data.data() + key.size(), value.data(), value.size());
+  slot->key_size = key.size();
+  slot->value_size = value.size();
+  return Status::OK;
+}
+
+Status WriteBackKeyValueStore::Delete(string_view key) {
+  Slot* slot = FindSlot(key);
+  if (slot == nullptr) {
+    return kvs_.Delete(key);
+  }
+
+  slot->key_size = 0;
+  const Status status = kvs_.Delete(key);
+  return status == Status::NOT_FOUND ? Status(Status::OK) : status;
+}
+
+StatusWithSize WriteBackKeyValueStore::Get(string_view key,
+                                           span<byte> value,
+                                           size_t offset_bytes) const {
+  const Slot* slot = FindSlot(key);
+  if (slot == nullptr) {
+    return kvs_.Get(key, value, offset_bytes);
+  }
+
+  const span<const byte> buffered = SlotValue(*slot);
+  if (offset_bytes > buffered.size()) {
+    return StatusWithSize::OUT_OF_RANGE;
+  }
+
+  const size_t remaining = buffered.size() - offset_bytes;
+  const size_t read_size = std::min(remaining, value.size());
+  std::memcpy(value.data(), buffered.data() + offset_bytes, read_size);
+  return StatusWithSize(
+      read_size == remaining ? Status::OK : Status::RESOURCE_EXHAUSTED,
+      read_size);
+}
+
+Status WriteBackKeyValueStore::FixedSizeGet(string_view key,
+                                            void* value,
+                                            size_t size_bytes) const {
+  const Slot* slot = FindSlot(key);
+  if (slot == nullptr) {
+    return kvs_.FixedSizeGet(key, value, size_bytes);
+  }
+
+  if (slot->value_size != size_bytes) {
+    return Status::INVALID_ARGUMENT;
+  }
+  std::memcpy(value, SlotValue(*slot).data(), size_bytes);
+  return Status::OK;
+}
+
+StatusWithSize WriteBackKeyValueStore::ValueSize(string_view key) const {
+  const Slot* slot = FindSlot(key);
+  if (slot == nullptr) {
+    return kvs_.ValueSize(key);
+  }
+  return StatusWithSize(slot->value_size);
+}
+
+Status WriteBackKeyValueStore::Flush() {
+  Status result = Status::OK;
+
+  for (Slot& slot : slots_) {
+    if (slot.key_size == 0u) {
+      continue;
+    }
+
+    const Status status = kvs_.Put(SlotKey(slot), SlotValue(slot));
+    if (status.ok()) {
+      slot.key_size = 0;
+    } else if (result.ok()) {
+      result = status;
+    }
+  }
+
+  oldest_write_age_ms_ = 0;
+  return result;
+}
+
+Status WriteBackKeyValueStore::Tick(uint32_t elapsed_ms) {
+  if (buffered_keys() == 0u) {
+    return Status::OK;
+  }
+
+  oldest_write_age_ms_ += elapsed_ms;
+  if (oldest_write_age_ms_ < max_delay_ms_) {
+    return Status::OK;
+  }
+  return Flush();
+}
+
+size_t WriteBackKeyValueStore::buffered_keys() const {
+  return std::count_if(slots_.begin(), slots_.end(), [](const Slot& slot) {
+    return slot.key_size != 0u;
+  });
+}
+
+const WriteBackKeyValueStore::Slot* WriteBackKeyValueStore::FindSlot(
+    string_view key) const {
+  for (const Slot& slot : slots_) {
+    if (slot.key_size != 0u && SlotKey(slot) == key) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace pw::kvs
@@ -0,0 +1,182 @@
+// Copyright 2020 The Pigweed Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you may not
+// use this file except in compliance with the License. You may obtain a copy of
+// the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "pw_kvs/write_back_key_value_store.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "pw_kvs/crc16_checksum.h"
+#include "pw_kvs/flash_memory.h"
+#include "pw_kvs/in_memory_fake_flash.h"
+
+namespace pw::kvs {
+namespace {
+
+using std::byte;
+
+ChecksumCrc16 checksum;
+constexpr EntryFormat kFormat{.magic = 0x3A7E'0B0F, .checksum = &checksum};
+
+constexpr uint32_t kMaxDelayMs = 100;
+
+class WriteBackKvs : public ::testing::Test {
+ protected:
+  WriteBackKvs()
+      : flash_(16),
+        partition_(&flash_),
+        kvs_(&partition_, kFormat),
+        store_(kvs_, kMaxDelayMs) {
+    partition_.Erase();
+    kvs_.Init();
+  }
+
+  // The number of entries written to flash, counted by initializing a second
+  // KVS on the same partition.
+  size_t entries_in_flash() {
+    KeyValueStoreBuffer<16, 4> kvs(&partition_, kFormat);
+    kvs.Init();
+    return kvs.size();
+  }
+
+  FakeFlashBuffer<512, 4> flash_;
+  FlashPartition partition_;
+  KeyValueStoreBuffer<16, 4> kvs_;
+  WriteBackKeyValueStoreBuffer<2, 32> store_;
+};
+
+TEST_F(WriteBackKvs, Put_IsBufferedUntilFlush) {
+  for (uint32_t i = 1; i <= 100; ++i) {
+    ASSERT_EQ(Status::OK, store_.Put("counter", i));
+  }
+  EXPECT_EQ(1u, store_.buffered_keys());
+  EXPECT_EQ(0u, entries_in_flash());
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store_.Get("counter", &value));
+  EXPECT_EQ(100u, value);
+  EXPECT_EQ(sizeof(uint32_t), store_.ValueSize("counter").size());
+
+  ASSERT_EQ(Status::OK, store_.Flush());
+  EXPECT_EQ(0u, store_.buffered_keys());
+  EXPECT_EQ(1u, entries_in_flash());
+
+  value = 0;
+  EXPECT_EQ(Status::OK, kvs_.Get("counter", &value));
+  EXPECT_EQ(100u, value);
+}
+
+TEST_F(WriteBackKvs, Get_UnbufferedKey_ReadsKvs) {
+  ASSERT_EQ(Status::OK, kvs_.Put("stored", uint32_t(7)));
+
+  uint32_t value = 0;
+  EXPECT_EQ(Status::OK, store_.Get("stored", &value));
+  EXPECT_EQ(7u, value);
+  EXPECT_EQ(Status::NOT_FOUND, store_.Get("missing", &value));
+}
+
+TEST_F(WriteBackKvs, Get_WithOffset) {
+  ASSERT_EQ(Status::OK, store_.Put("name", as_bytes(span("Mingus"))));
+
+  char value[4] = {};
+  StatusWithSize result =
+      store_.Get("name", as_writable_bytes(span(value)), 1);
+  EXPECT_EQ(Status::RESOURCE_EXHAUSTED, result.status());
+  EXPECT_EQ(4u, result.size());
+  EXPECT_EQ(0, std::memcmp("ingu", value, 4));
+
+  result = store_.Get("name", as_writable_bytes(span(value)), 5);
+  EXPECT_EQ(Status::OK, result.status());
+  EXPECT_EQ(2u, result.size());
+
+  EXPECT_EQ(Status::OUT_OF_RANGE,
+            store_.Get("name", as_writable_bytes(span(value)), 8).status());
+}
+
+TEST_F(WriteBackKvs, Get_WrongSize_InvalidArgument) {
+  ASSERT_EQ(Status::OK, store_.Put("counter", uint32_t(1)));
+
+  uint16_t value;
+  EXPECT_EQ(Status::INVALID_ARGUMENT, store_.Get("counter", &value));
+}
+
+TEST_F(WriteBackKvs, Tick_FlushesAfterMaxDelay) {
+  ASSERT_EQ(Status::OK, store_.Tick(kMaxDelayMs));
+  ASSERT_EQ(Status::OK, store_.Put("counter", uint32_t(1)));
+
+  ASSERT_EQ(Status::OK, store_.Tick(kMaxDelayMs / 2));
+  ASSERT_EQ(Status::OK, store_.Put("counter", uint32_t(2)));
+  EXPECT_EQ(0u, entries_in_flash());
+
+  ASSERT_EQ(Status::OK, store_.Tick(kMaxDelayMs / 2));
+  EXPECT_EQ(0u, store_.buffered_keys());
+  EXPECT_EQ(1u, entries_in_flash());
+
+  // The delay starts over with the next buffered write.
+  ASSERT_EQ(Status::OK, store_.Put("counter", uint32_t(3)));
+  ASSERT_EQ(Status::OK, store_.Tick(kMaxDelayMs - 1));
+  EXPECT_EQ(1u, store_.buffered_keys());
+}
+
+TEST_F(WriteBackKvs, Put_BufferFull_FlushesToMakeRoom) {
+  ASSERT_EQ(Status::OK, store_.Put("a", uint32_t(1)));
+  ASSERT_EQ(Status::OK, store_.Put("b", uint32_t(2)));
+  EXPECT_EQ(0u, entries_in_flash());
+
+  ASSERT_EQ(Status::OK, store_.Put("c", uint32_t(3)));
+  EXPECT_EQ(1u, store_.buffered_keys());
+  EXPECT_EQ(2u, entries_in_flash());
+}
+
+TEST_F(WriteBackKvs, Put_LargeValue_IsWrittenThrough) {
+  ASSERT_EQ(Status::OK, store_.Put("value", uint32_t(1)));
+
+  const std::array<byte, 40> large = {};
+  ASSERT_EQ(Status::OK, store_.Put("value", large));
+  EXPECT_EQ(0u, store_.buffered_keys());
+  EXPECT_EQ(large.size(), kvs_.ValueSize("value").size());
+}
+
+TEST_F(WriteBackKvs, Put_InvalidKey) {
+  EXPECT_EQ(Status::INVALID_ARGUMENT, store_.Put("", uint32_t(1)));
+}
+
+TEST_F(WriteBackKvs, Delete_BufferedKey) {
+  ASSERT_EQ(Status::OK, store_.Put("new", uint32_t(1)));
+  EXPECT_EQ(Status::OK, store_.Delete("new"));
+  EXPECT_EQ(Status::NOT_FOUND, store_.ValueSize("new").status());
+
+  ASSERT_EQ(Status::OK, kvs_.Put("old", uint32_t(1)));
+  ASSERT_EQ(Status::OK, store_.Put("old", uint32_t(2)));
+  EXPECT_EQ(Status::OK, store_.Delete("old"));
+  EXPECT_EQ(Status::NOT_FOUND, kvs_.ValueSize("old").status());
+
+  EXPECT_EQ(Status::NOT_FOUND, store_.Delete("missing"));
+  ASSERT_EQ(Status::OK, store_.Flush());
+  EXPECT_EQ(0u, entries_in_flash());
+}
+
+TEST(WriteBackKvsUninitialized, Put_FailedPrecondition) {
+  FakeFlashBuffer<512, 4> flash(16);
+  FlashPartition partition(&flash);
+  KeyValueStoreBuffer<16, 4> kvs(&partition, kFormat);
+  WriteBackKeyValueStoreBuffer<2, 32> store(kvs, kMaxDelayMs);
+
+  EXPECT_EQ(Status::FAILED_PRECONDITION, store.Put("key", uint32_t(1)));
+}
+
+}  // namespace
+}  // namespace pw::kvs